@@ -1409,7 +1409,7 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
         [](common_params & params, const std::string & value) {
             params.lookup_cache_static = value;
         }
-    ).set_examples({LLAMA_EXAMPLE_LOOKUP}));
+    ).set_examples({LLAMA_EXAMPLE_LOOKUP, LLAMA_EXAMPLE_SERVER}));
     add_opt(common_arg(
         {"-lcd", "--lookup-cache-dynamic"}, "FNAME",
         "path to dynamic lookup cache to use for lookup decoding (updated by generation)",
@@ -1464,6 +1464,13 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.swa_full = true;
         }
     ).set_env("LLAMA_ARG_SWA_FULL"));
+    add_opt(common_arg(
+        {"--swap-output"},
+        string_format("double-buffer the logits and embeddings output, so that the outputs of a batch can be sampled while the next batch is computed (default: %s)", params.swap_output ? "true" : "false"),
+        [](common_params & params) {
+            params.swap_output = true;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_SWAP_OUTPUT"));
     add_opt(common_arg(
         {"--no-context-shift"},
         string_format("disables context shift on infinite text generation (default: %s)", params.ctx_shift ? "disabled" : "enabled"),
@@ -2186,6 +2193,16 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.defrag_thold = std::stof(value);
         }
     ).set_env("LLAMA_ARG_DEFRAG_THOLD"));
+    add_opt(common_arg(
+        {"--kv-paged"}, "N",
+        string_format("when a batch does not fit in contiguous KV cells, place it in runs of at least N free cells instead of failing (default: %d, 0 = disabled)", params.n_kv_block),
+        [](common_params & params, int value) {
+            if (value < 0) {
+                throw std::invalid_argument("invalid value");
+            }
+            params.n_kv_block = value;
+        }
+    ).set_env("LLAMA_ARG_KV_PAGED"));
     add_opt(common_arg(
         {"-np", "--parallel"}, "N",
         string_format("number of parallel sequences to decode (default: %d)", params.n_parallel),
@@ -2274,6 +2291,29 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.use_mmap = false;
         }
     ).set_env("LLAMA_ARG_NO_MMAP"));
+    add_opt(common_arg(
+        {"--load-threads"}, "N",
+        string_format("number of threads reading the model in parallel when not using mmap, 0 = sequential reads (default: %d)", params.n_load_threads),
+        [](common_params & params, int value) {
+            params.n_load_threads = value;
+        }
+    ).set_env("LLAMA_ARG_LOAD_THREADS"));
+    add_opt(common_arg(
+        {"--direct-io"},
+        "read the model with direct I/O (O_DIRECT), bypassing the page cache, implies --no-mmap",
+        [](common_params & params) {
+            params.use_direct_io = true;
+            params.use_mmap = false;
+        }
+    ).set_env("LLAMA_ARG_DIRECT_IO"));
+    add_opt(common_arg(
+        {"--repack-cache"}, "DIR",
+        "directory where the weights repacked for the CPU are saved on the first load and mapped from on the next loads,\n"
+        "so that the processes using the same model share them (default: disabled)",
+        [](common_params & params, const std::string & value) {
+            params.repack_cache_dir = value;
+        }
+    ).set_env("LLAMA_ARG_REPACK_CACHE"));
     add_opt(common_arg(
         {"--numa"}, "TYPE",
         "attempt optimizations that help on some NUMA systems\n"
@@ -2809,6 +2849,13 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.n_threads_http = value;
         }
     ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_THREADS_HTTP"));
+    add_opt(common_arg(
+        {"--threads-sampling"}, "N",
+        string_format("number of threads used to sample the slots of a decoded batch in parallel (default: %d, -1 = same as --threads)", params.n_threads_sampling),
+        [](common_params & params, int value) {
+            params.n_threads_sampling = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_THREADS_SAMPLING"));
     add_opt(common_arg(
         {"--cache-reuse"}, "N",
         string_format(
@@ -2819,6 +2866,61 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.n_cache_reuse = value;
         }
     ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_CACHE_REUSE"));
+    add_opt(common_arg(
+        {"--cache-radix"}, "N",
+        string_format(
+            "max number of KV cells kept by the prompt cache shared across all slots (default: %d, 0 = disabled)\n"
+            "the cells are taken from the total context, so each slot gets (ctx-size - N) / parallel\n"
+            "context shift and cache reuse are disabled while it is enabled", params.n_cache_radix
+        ),
+        [](common_params & params, int value) {
+            params.n_cache_radix = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_CACHE_RADIX"));
+    add_opt(common_arg(
+        {"--cache-radix-seqs"}, "N",
+        string_format("max number of prompts kept by the shared prompt cache, each uses one extra sequence (default: %d)", params.n_cache_radix_seqs),
+        [](common_params & params, int value) {
+            params.n_cache_radix_seqs = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_CACHE_RADIX_SEQS"));
+    add_opt(common_arg(
+        {"--cache-mtmd"}, "N",
+        string_format(
+            "max size in MiB of the cache of image and audio embeddings shared across all slots (default: %d, 0 = disabled)\n"
+            "a repeated image or audio file skips the encoder", params.n_cache_mtmd
+        ),
+        [](common_params & params, int value) {
+            params.n_cache_mtmd = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_CACHE_MTMD"));
+    add_opt(common_arg(
+        {"--prefill-budget"}, "N",
+        string_format(
+            "max number of prompt tokens processed per iteration, on top of the tokens of the generating slots (default: %d, 0 = batch-size)\n"
+            "lower values keep the generation latency low while long prompts are being processed", params.n_prefill_budget
+        ),
+        [](common_params & params, int value) {
+            params.n_prefill_budget = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_PREFILL_BUDGET"));
+    add_opt(common_arg(
+        {"--prefill-chunk"}, "N",
+        string_format(
+            "max number of prompt tokens of a single slot processed per iteration (default: %d, 0 = unlimited)\n"
+            "lets the prompts of several slots progress together instead of the first one taking the whole budget", params.n_prefill_chunk
+        ),
+        [](common_params & params, int value) {
+            params.n_prefill_chunk = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_PREFILL_CHUNK"));
+    add_opt(common_arg(
+        {"--max-queue-time"}, "N",
+        string_format("max time in milliseconds a request may wait for a free slot before it is rejected (default: %d, 0 = disabled)", params.t_queue_max_ms),
+        [](common_params & params, int value) {
+            params.t_queue_max_ms = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_MAX_QUEUE_TIME"));
     add_opt(common_arg(
         {"--metrics"},
         string_format("enable prometheus compatible metrics endpoint (default: %s)", params.endpoint_metrics ? "enabled" : "disabled"),
@@ -3175,7 +3277,25 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
         [](common_params & params, const std::string & value) {
             params.speculative.p_split = std::stof(value);
         }
-    ).set_examples({LLAMA_EXAMPLE_SPECULATIVE}).set_env("LLAMA_ARG_DRAFT_P_SPLIT"));
+    ).set_examples({LLAMA_EXAMPLE_SPECULATIVE, LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_DRAFT_P_SPLIT"));
+    add_opt(common_arg(
+        {"--draft-branches"}, "N",
+        string_format("max number of branches of the draft tree verified in a single batch, with a draft model each slot reserves N extra sequences (default: %d, 1 = linear draft)\n"
+            "the slots, the sequences of the shared prompt cache and of the draft trees cannot exceed 64 in total", params.speculative.n_branch),
+        [](common_params & params, int value) {
+            if (value < 1 || value > 64) {
+                throw std::invalid_argument("invalid value");
+            }
+            params.speculative.n_branch = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_DRAFT_BRANCHES"));
+    add_opt(common_arg(
+        {"--draft-lookup"},
+        string_format("use prompt lookup decoding: draft from the n-grams of the context (and of --lookup-cache-static) instead of a draft model (default: %s)", params.speculative.lookup ? "enabled" : "disabled"),
+        [](common_params & params) {
+            params.speculative.lookup = true;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_DRAFT_LOOKUP"));
     add_opt(common_arg(
         {"--draft-p-min"}, "P",
         string_format("minimum speculative decoding probability (greedy) (default: %.1f)", (double)params.speculative.p_min),
@@ -3265,6 +3385,16 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.vocoder.speaker_file = value;
         }
     ).set_examples({LLAMA_EXAMPLE_TTS}));
+    add_opt(common_arg(
+        {"--tts-chunk"}, "N",
+        string_format("vocode the audio in chunks of N codes while they are being generated, 0 = after generation (default: %d)", params.vocoder.n_chunk),
+        [](common_params & params, int value) {
+            if (value < 0) {
+                throw std::invalid_argument("invalid value");
+            }
+            params.vocoder.n_chunk = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_TTS}));
 
     // model-specific
     add_opt(common_arg(
@@ -1107,6 +1107,12 @@ struct llama_model_params common_model_params_to_llama(common_params & params) {
     mparams.use_mmap        = params.use_mmap;
     mparams.use_mlock       = params.use_mlock;
     mparams.check_tensors   = params.check_tensors;
+    mparams.use_direct_io   = params.use_direct_io;
+    mparams.n_load_threads  = params.n_load_threads;
+
+    if (!params.repack_cache_dir.empty()) {
+        mparams.repack_cache_dir = params.repack_cache_dir.c_str();
+    }
 
     if (params.kv_overrides.empty()) {
         mparams.kv_overrides = NULL;
@@ -1131,8 +1137,12 @@ struct llama_model_params common_model_params_to_llama(common_params & params) {
 struct llama_context_params common_context_params_to_llama(const common_params & params) {
     auto cparams = llama_context_default_params();
 
+    // the draft trees are only verified with a draft model
+    const bool has_draft = !params.speculative.model.path.empty() || !params.speculative.model.hf_repo.empty();
+
     cparams.n_ctx             = params.n_ctx;
-    cparams.n_seq_max         = params.n_parallel;
+    cparams.n_seq_max         = params.n_parallel + (params.n_cache_radix > 0 ? params.n_cache_radix_seqs : 0) +
+                                (has_draft && params.speculative.n_branch > 1 ? params.n_parallel*params.speculative.n_branch : 0);
     cparams.n_batch           = params.n_batch;
     cparams.n_ubatch          = params.n_ubatch;
     cparams.n_threads         = params.cpuparams.n_threads;
@@ -1150,6 +1160,7 @@ struct llama_context_params common_context_params_to_llama(const common_params &
     cparams.pooling_type      = params.pooling_type;
     cparams.attention_type    = params.attention_type;
     cparams.defrag_thold      = params.defrag_thold;
+    cparams.n_kv_block        = params.n_kv_block;
     cparams.cb_eval           = params.cb_eval;
     cparams.cb_eval_user_data = params.cb_eval_user_data;
     cparams.offload_kqv       = !params.no_kv_offload;
@@ -1157,6 +1168,7 @@ struct llama_context_params common_context_params_to_llama(const common_params &
     cparams.no_perf           = params.no_perf;
     cparams.op_offload        = !params.no_op_offload;
     cparams.swa_full          = params.swa_full;
+    cparams.swap_output       = params.swap_output;
 
     cparams.type_k = params.cache_type_k;
     cparams.type_v = params.cache_type_v;
@@ -196,8 +196,10 @@ struct common_params_speculative {
     int32_t n_max        =    16; // maximum number of tokens to draft during speculative decoding
     int32_t n_min        =     0; // minimum number of draft tokens to use for speculative decoding
     int32_t n_gpu_layers =    -1; // number of layers to store in VRAM for the draft model (-1 - use default)
+    int32_t n_branch     =     1; // max number of branches of a draft tree (1 - linear draft)
     float   p_split      =  0.1f; // speculative decoding split probability
     float   p_min        = 0.75f; // minimum speculative decoding probability (greedy)
+    bool    lookup       = false; // draft from the n-grams of the context instead of a draft model (prompt lookup decoding)
 
     ggml_type cache_type_k = GGML_TYPE_F16; // KV cache data type for the K
     ggml_type cache_type_v = GGML_TYPE_F16; // KV cache data type for the V
@@ -214,6 +216,8 @@ struct common_params_vocoder {
     std::string speaker_file = ""; // speaker file path                                      // NOLINT
 
     bool use_guide_tokens = false; // enable guide tokens to improve TTS accuracy            // NOLINT
+
+    int32_t n_chunk = 0; // stream the audio in chunks of this many codes (0 = disabled)     // NOLINT
 };
 
 enum common_reasoning_format {
@@ -242,6 +246,7 @@ struct common_params {
     float   yarn_beta_slow        =  1.0f; // YaRN high correction dim
     int32_t yarn_orig_ctx         =     0; // YaRN original context length
     float   defrag_thold          =  0.1f; // KV cache defragmentation threshold
+    int32_t n_kv_block            =     0; // paged KV placement: min number of cells in a run (0 = disabled)
 
     // offload params
     std::vector<ggml_backend_dev_t> devices; // devices to use for offloading
@@ -249,6 +254,7 @@ struct common_params {
     int32_t n_gpu_layers      = -1;  // number of layers to store in VRAM (-1 - use default)
     int32_t main_gpu          = 0;   // the GPU that is used for scratch and small tensors
     float   tensor_split[128] = {0}; // how split tensors should be distributed across GPUs
+    int32_t n_load_threads    = 0;   // number of threads reading the model in parallel without mmap (0 = sequential reads)
 
     enum llama_split_mode split_mode = LLAMA_SPLIT_MODE_LAYER; // how to split the model across GPUs
 
@@ -281,6 +287,7 @@ struct common_params {
     std::string lookup_cache_static  = ""; // path of static ngram cache file for lookup decoding           // NOLINT
     std::string lookup_cache_dynamic = ""; // path of dynamic ngram cache file for lookup decoding          // NOLINT
     std::string logits_file          = ""; // file for saving *all* logits                                  // NOLINT
+    std::string repack_cache_dir     = ""; // directory of the cache of the weights repacked for the CPU    // NOLINT
 
     std::vector<std::string> in_files;   // all input files
     std::vector<std::string> antiprompt; // strings upon which more user input is prompted (a.k.a. reverse prompts)
@@ -329,10 +336,12 @@ struct common_params {
     bool no_perf           = false; // disable performance metrics
     bool ctx_shift         = true;  // context shift on inifinite text generation
     bool swa_full          = false; // use full-size SWA cache (https://github.com/ggml-org/llama.cpp/pull/13194#issuecomment-2868343055)
+    bool swap_output       = false; // double-buffer the logits/embeddings output to sample while the next batch is computed
 
     bool input_prefix_bos  = false; // prefix BOS to user inputs, preceding input_prefix
     bool use_mmap          = true;  // use mmap for faster loads
     bool use_mlock         = false; // use mlock to keep model in memory
+    bool use_direct_io     = false; // read the model bypassing the page cache, implies no mmap
     bool verbose_prompt    = false; // print prompt tokens before generation
     bool display_prompt    = true;  // print prompt before generation
     bool no_kv_offload     = false; // disable KV offloading
@@ -365,7 +374,14 @@ struct common_params {
     int32_t timeout_read   = 600;          // http read timeout in seconds
     int32_t timeout_write  = timeout_read; // http write timeout in seconds
     int32_t n_threads_http = -1;           // number of threads to process HTTP requests (TODO: support threadpool)
+    int32_t n_threads_sampling = -1;       // number of threads to sample the slots of a decoded batch (-1 = --threads)
     int32_t n_cache_reuse  = 0;            // min chunk size to reuse from the cache via KV shifting
+    int32_t n_cache_radix  = 0;            // max number of KV cells kept by the server-wide prompt cache (0 = disabled)
+    int32_t n_cache_radix_seqs = 8;        // number of extra sequences reserved for the server-wide prompt cache
+    int32_t n_cache_mtmd   = 256;          // max size in MiB of the server-wide cache of image and audio embeddings (0 = disabled)
+    int32_t n_prefill_budget = 0;          // max number of prompt tokens added to a batch per iteration (0 = n_batch)
+    int32_t n_prefill_chunk  = 0;          // max number of prompt tokens of a single slot per iteration (0 = unlimited)
+    int32_t t_queue_max_ms   = 0;          // reject requests that wait for a free slot longer than this (0 = disabled)
 
     std::string hostname      = "127.0.0.1";
     std::string public_path   = "";                                                                         // NOLINT
@@ -3,7 +3,13 @@
 #include "common.h"
 #include "log.h"
 
+#include <atomic>
 #include <cmath>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
 #include <unordered_map>
 #include <algorithm>
 
@@ -112,9 +118,7 @@ struct common_sampler {
 
     llama_token_data_array cur_p;
 
-    void set_logits(struct llama_context * ctx, int idx) {
-        const auto * logits = llama_get_logits_ith(ctx, idx);
-
+    void set_logits(struct llama_context * ctx, const float * logits) {
         const llama_model * model = llama_get_model(ctx);
         const llama_vocab * vocab = llama_model_get_vocab(model);
 
@@ -146,6 +150,65 @@ std::string common_params_sampling::print() const {
     return std::string(result);
 }
 
+// check if the sampler chain reduces to top-k -> top-p -> min-p -> temp -> dist, optionally preceded by logit modifiers
+// (penalties, DRY), so that llama_sampler_init_fused can replace the individual samplers
+static bool common_sampler_can_fuse(const struct common_params_sampling & params) {
+    if (params.mirostat != 0 || params.dynatemp_range > 0.0f) {
+        return false;
+    }
+
+    // index of the last fused sampler seen so far, in the order top-k, top-p, min-p, temp
+    int i_fused = -1;
+
+    for (const auto & cnstr : params.samplers) {
+        int i = -1;
+
+        switch (cnstr) {
+            case COMMON_SAMPLER_TYPE_PENALTIES:
+            case COMMON_SAMPLER_TYPE_DRY:
+                {
+                    const bool active = cnstr == COMMON_SAMPLER_TYPE_PENALTIES
+                        ? params.penalty_last_n != 0 && (params.penalty_repeat != 1.0f || params.penalty_freq != 0.0f || params.penalty_present != 0.0f)
+                        : params.dry_multiplier != 0.0f && params.dry_base >= 1.0f && params.dry_penalty_last_n != 0;
+
+                    // the logit modifiers must run before the fused sampler
+                    if (active && i_fused >= 0) {
+                        return false;
+                    }
+                } continue;
+            case COMMON_SAMPLER_TYPE_TOP_N_SIGMA:
+                if (params.top_n_sigma > 0.0f) {
+                    return false;
+                }
+                continue;
+            case COMMON_SAMPLER_TYPE_TYPICAL_P:
+                if (params.typ_p < 1.0f) {
+                    return false;
+                }
+                continue;
+            case COMMON_SAMPLER_TYPE_XTC:
+                if (params.xtc_probability > 0.0f && params.xtc_threshold <= 0.5f) {
+                    return false;
+                }
+                continue;
+            case COMMON_SAMPLER_TYPE_TOP_K:       i = 0; break;
+            case COMMON_SAMPLER_TYPE_TOP_P:       i = 1; break;
+            case COMMON_SAMPLER_TYPE_MIN_P:       i = 2; break;
+            case COMMON_SAMPLER_TYPE_TEMPERATURE: i = 3; break;
+            default:
+                return false;
+        }
+
+        if (i <= i_fused) {
+            return false;
+        }
+
+        i_fused = i;
+    }
+
+    return true;
+}
+
 struct common_sampler * common_sampler_init(const struct llama_model * model, const struct common_params_sampling & params) {
     const llama_vocab * vocab = llama_model_get_vocab(model);
 
@@ -228,7 +291,38 @@ struct common_sampler * common_sampler_init(const struct llama_model * model, co
                 params.logit_bias.size(),
                 params.logit_bias.data()));
 
-    if (params.mirostat == 0) {
+    if (common_sampler_can_fuse(params)) {
+        int32_t top_k = 0;
+        float   top_p = 1.0f;
+        float   min_p = 0.0f;
+        float   temp  = 1.0f;
+
+        for (const auto & cnstr : params.samplers) {
+            switch (cnstr) {
+                case COMMON_SAMPLER_TYPE_PENALTIES:
+                    llama_sampler_chain_add(result->chain, llama_sampler_init_penalties(params.penalty_last_n, params.penalty_repeat, params.penalty_freq, params.penalty_present));
+                    break;
+                case COMMON_SAMPLER_TYPE_DRY:
+                    {
+                        std::vector<const char *> c_breakers;
+                        c_breakers.reserve(params.dry_sequence_breakers.size());
+                        for (const auto & str : params.dry_sequence_breakers) {
+                            c_breakers.push_back(str.c_str());
+                        }
+
+                        llama_sampler_chain_add(result->chain, llama_sampler_init_dry(vocab, llama_model_n_ctx_train(model), params.dry_multiplier, params.dry_base, params.dry_allowed_length, params.dry_penalty_last_n, c_breakers.data(), c_breakers.size()));
+                    }
+                    break;
+                case COMMON_SAMPLER_TYPE_TOP_K:       top_k = params.top_k; break;
+                case COMMON_SAMPLER_TYPE_TOP_P:       top_p = params.top_p; break;
+                case COMMON_SAMPLER_TYPE_MIN_P:       min_p = params.min_p; break;
+                case COMMON_SAMPLER_TYPE_TEMPERATURE: temp  = params.temp;  break;
+                default:
+                    break;
+            }
+        }
+        llama_sampler_chain_add(result->chain, llama_sampler_init_fused(top_k, top_p, min_p, params.min_keep, temp, params.seed));
+    } else if (params.mirostat == 0) {
         for (const auto & cnstr : params.samplers) {
             switch (cnstr) {
                 case COMMON_SAMPLER_TYPE_DRY:
@@ -336,7 +430,13 @@ void common_perf_print(const struct llama_context * ctx, const struct common_sam
 }
 
 llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_context * ctx, int idx, bool grammar_first) {
-    gsmpl->set_logits(ctx, idx);
+    return common_sampler_sample_logits(gsmpl, ctx, llama_get_logits_ith(ctx, idx), grammar_first);
+}
+
+llama_token common_sampler_sample_logits(struct common_sampler * gsmpl, struct llama_context * ctx, const float * logits, bool grammar_first) {
+    GGML_ASSERT(logits != nullptr);
+
+    gsmpl->set_logits(ctx, logits);
 
     auto & grmr  = gsmpl->grmr;
     auto & chain = gsmpl->chain;
@@ -371,7 +471,7 @@ llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_co
 
     // resampling:
     // if the token is not valid, sample again, but first apply the grammar sampler and then the sampling chain
-    gsmpl->set_logits(ctx, idx);
+    gsmpl->set_logits(ctx, logits);
 
     llama_sampler_apply(grmr,  &cur_p);
     llama_sampler_apply(chain, &cur_p);
@@ -420,6 +520,156 @@ std::vector<llama_token> common_sampler_sample_and_accept_n(struct common_sample
     return common_sampler_sample_and_accept_n(gsmpl, ctx, idxs, draft, grammar_first);
 }
 
+// the calling thread takes part in the work, so the pool has n_threads - 1 workers
+struct common_sampler_pool {
+    std::vector<std::thread> workers;
+
+    std::mutex              mutex;
+    std::condition_variable cv_work;
+    std::condition_variable cv_done;
+
+    // current job, items [0, n_items) are taken with i_next
+    std::function<void(int)> job;
+
+    int              n_items = 0;
+    std::atomic<int> i_next  = 0;
+
+    int      n_running = 0; // workers still processing the current job
+    uint64_t n_jobs    = 0; // incremented for each new job
+    bool     stop      = false;
+
+    // first exception thrown by the current job, rethrown by run() on the calling thread
+    std::exception_ptr error;
+
+    void work() {
+        for (int i = i_next++; i < n_items; i = i_next++) {
+            try {
+                job(i);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!error) {
+                    error = std::current_exception();
+                }
+                // skip the remaining items
+                i_next = n_items;
+            }
+        }
+    }
+
+    void run(int n, std::function<void(int)> fn) {
+        if (workers.empty() || n <= 1) {
+            for (int i = 0; i < n; ++i) {
+                fn(i);
+            }
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            job       = std::move(fn);
+            n_items   = n;
+            i_next    = 0;
+            n_running = workers.size();
+            n_jobs++;
+            error     = nullptr;
+        }
+        cv_work.notify_all();
+
+        work();
+
+        std::exception_ptr err;
+        {
+            // the workers must be done with the job before it goes out of scope, even if it failed
+            std::unique_lock<std::mutex> lock(mutex);
+            cv_done.wait(lock, [&] { return n_running == 0; });
+
+            std::swap(err, error);
+        }
+
+        if (err) {
+            std::rethrow_exception(err);
+        }
+    }
+};
+
+struct common_sampler_pool * common_sampler_pool_init(int n_threads) {
+    auto * pool = new common_sampler_pool;
+
+    for (int i = 1; i < n_threads; ++i) {
+        pool->workers.emplace_back([pool]() {
+            uint64_t n_jobs = 0;
+
+            while (true) {
+                {
+                    std::unique_lock<std::mutex> lock(pool->mutex);
+                    pool->cv_work.wait(lock, [&] { return pool->stop || pool->n_jobs != n_jobs; });
+
+                    if (pool->stop) {
+                        return;
+                    }
+
+                    n_jobs = pool->n_jobs;
+                }
+
+                pool->work();
+
+                {
+                    std::lock_guard<std::mutex> lock(pool->mutex);
+                    if (--pool->n_running == 0) {
+                        pool->cv_done.notify_one();
+                    }
+                }
+            }
+        });
+    }
+
+    return pool;
+}
+
+void common_sampler_pool_free(struct common_sampler_pool * pool) {
+    if (pool) {
+        {
+            std::lock_guard<std::mutex> lock(pool->mutex);
+            pool->stop = true;
+        }
+        pool->cv_work.notify_all();
+
+        for (auto & worker : pool->workers) {
+            worker.join();
+        }
+
+        delete pool;
+    }
+}
+
+std::vector<llama_token> common_sampler_sample_and_accept_batch(
+        struct common_sampler_pool * pool,
+        const std::vector<struct common_sampler *> & gsmpls,
+        struct llama_context * ctx,
+        const std::vector<const float *> & logits,
+        bool grammar_first) {
+    GGML_ASSERT(gsmpls.size() == logits.size());
+
+    std::vector<llama_token> result(gsmpls.size());
+
+    const auto job = [&](int i) {
+        result[i] = common_sampler_sample_logits(gsmpls[i], ctx, logits[i], grammar_first);
+
+        common_sampler_accept(gsmpls[i], result[i], true);
+    };
+
+    if (pool) {
+        pool->run(gsmpls.size(), job);
+    } else {
+        for (size_t i = 0; i < gsmpls.size(); ++i) {
+            job(i);
+        }
+    }
+
+    return result;
+}
+
 uint32_t common_sampler_get_seed(const struct common_sampler * gsmpl) {
     return llama_sampler_get_seed(gsmpl->chain);
 }
@@ -60,6 +60,10 @@ void common_perf_print(const struct llama_context * ctx, const struct common_sam
 //
 llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_context * ctx, int idx, bool grammar_first = false);
 
+// same as common_sampler_sample, but samples from the given row of logits
+// e.g. the outputs of the previous decode with llama_get_logits_prev_ith()
+llama_token common_sampler_sample_logits(struct common_sampler * gsmpl, struct llama_context * ctx, const float * logits, bool grammar_first = false);
+
 // generalized version of common_sampler_sample
 //
 // will cross-reference the sampled tokens with a batch of draft tokens and accept those that match
@@ -81,6 +85,29 @@ std::vector<llama_token> common_sampler_sample_and_accept_n(struct common_sample
 // assume idxs == [ 0, 1, 2, ..., draft.size() ]
 std::vector<llama_token> common_sampler_sample_and_accept_n(struct common_sampler * gsmpl, struct llama_context * ctx, const llama_tokens & draft, bool grammar_first = false);
 
+// batched sampling
+//
+// samples the next token of several sequences in parallel, e.g. all the generating slots of a server step
+// gsmpls[i] samples from the row of logits logits[i] (see llama_get_logits_ith) and accepts the sampled token
+// each sampler is used by a single thread at a time, so the per-sequence state (grammar, penalties, RNG) is respected
+// and the result does not depend on the number of threads
+// if sampling a sequence throws, the first exception is rethrown on the calling thread once all the threads are done
+//
+// the pool can be nullptr to sample on the calling thread
+//
+struct common_sampler_pool;
+
+struct common_sampler_pool * common_sampler_pool_init(int n_threads);
+
+void common_sampler_pool_free(struct common_sampler_pool * pool);
+
+std::vector<llama_token> common_sampler_sample_and_accept_batch(
+        struct common_sampler_pool * pool,
+        const std::vector<struct common_sampler *> & gsmpls,
+        struct llama_context * ctx,
+        const std::vector<const float *> & logits,
+        bool grammar_first = false);
+
 uint32_t common_sampler_get_seed(const struct common_sampler * gsmpl);
 
 // helpers
@@ -16,15 +16,19 @@ struct common_speculative {
 
     llama_batch batch;
     llama_tokens prompt;
+
+    // prompt[0] was prompt_tgt[i_start] in the last call
+    int i_start;
 };
 
 struct common_speculative * common_speculative_init(
         struct llama_context * ctx_dft) {
     auto * result = new common_speculative {
-        /* .ctx    = */ ctx_dft,
-        /* .smpl   = */ nullptr,
-        /* .batch  = */ llama_batch_init(llama_n_batch(ctx_dft), 0, 1),
-        /* .prompt = */ {},
+        /* .ctx     = */ ctx_dft,
+        /* .smpl    = */ nullptr,
+        /* .batch   = */ llama_batch_init(llama_n_batch(ctx_dft), 0, 1),
+        /* .prompt  = */ {},
+        /* .i_start = */ 0,
     };
 
     // TODO: optimize or pass from outside?
@@ -62,6 +66,58 @@ struct common_speculative * common_speculative_init(
     return result;
 }
 
+int32_t common_speculative_find_prefix(const llama_tokens & prompt, const llama_token * tgt, int32_t n_tgt, int32_t & pos) {
+    const int32_t n_prompt = prompt.size();
+
+    pos = 0;
+
+    if (n_tgt == 0) {
+        return 0;
+    }
+
+    // z[i] - length of the longest common prefix of tgt and tgt[i, n_tgt)
+    std::vector<int32_t> z(n_tgt, 0);
+    z[0] = n_tgt;
+
+    for (int32_t i = 1, l = 0, r = 0; i < n_tgt; ++i) {
+        if (i < r) {
+            z[i] = std::min(r - i, z[i - l]);
+        }
+        while (i + z[i] < n_tgt && tgt[z[i]] == tgt[i + z[i]]) {
+            z[i]++;
+        }
+        if (i + z[i] > r) {
+            l = i;
+            r = i + z[i];
+        }
+    }
+
+    // the same for the suffixes of the prompt, prompt[l, r) is the match that reaches the furthest
+    // each token of the prompt is compared at most once after a match, so this is linear even for repetitive prompts
+    int32_t best = 0;
+
+    for (int32_t i = 0, l = 0, r = 0; i < n_prompt && best < n_tgt; ++i) {
+        int32_t cur = 0;
+        if (i < r) {
+            cur = std::min(r - i, z[i - l]);
+        }
+        while (cur < n_tgt && i + cur < n_prompt && tgt[cur] == prompt[i + cur]) {
+            cur++;
+        }
+        if (i + cur > r) {
+            l = i;
+            r = i + cur;
+        }
+
+        if (cur > best) {
+            best = cur;
+            pos  = i;
+        }
+    }
+
+    return best;
+}
+
 void common_speculative_free(struct common_speculative * spec) {
     if (spec == nullptr) {
         return;
@@ -134,14 +190,52 @@ bool common_speculative_are_compatible(
     return true;
 }
 
-llama_tokens common_speculative_gen_draft(
+// find the longest prefix of tgt[0, n_tgt) that is contained in the draft prompt - reuse_n tokens starting at reuse_i
+// i_hint is the position in the draft prompt where tgt is expected to start
+static void common_speculative_find_reuse(
         struct common_speculative * spec,
-        struct common_speculative_params params,
+        const llama_token * tgt,
+        int n_tgt,
+        int i_hint,
+        int & reuse_i,
+        int & reuse_n) {
+    const auto & prompt = spec->prompt;
+
+    reuse_i = 0;
+    reuse_n = 0;
+
+    if (n_tgt == 0 || prompt.empty()) {
+        return;
+    }
+
+    // during generation, the target prompt continues the previous draft prompt, so it is found entirely at i_hint
+    // in that case no longer match exists and the search can be skipped
+    if (i_hint >= 0 && i_hint < (int) prompt.size()) {
+        int cur = 0;
+        while (cur < n_tgt && i_hint + cur < (int) prompt.size() && tgt[cur] == prompt[i_hint + cur]) {
+            cur++;
+        }
+
+        if (cur == n_tgt) {
+            reuse_i = i_hint;
+            reuse_n = cur;
+            return;
+        }
+    }
+
+    reuse_n = common_speculative_find_prefix(prompt, tgt, n_tgt, reuse_i);
+}
+
+// bring the draft context in sync with the target prompt and evaluate id_last in sequence 0
+// returns false if the previous draft can be reused as it is - in that case it is returned in `reused`
+static bool common_speculative_prepare(
+        struct common_speculative * spec,
+        const struct common_speculative_params & params,
         const llama_tokens & prompt_tgt,
-        llama_token id_last) {
+        llama_token id_last,
+        llama_tokens & reused) {
     auto & batch  = spec->batch;
     auto & ctx    = spec->ctx;
-    auto & smpl   = spec->smpl;
     auto & prompt = spec->prompt;
 
     auto * mem = llama_get_memory(ctx);
@@ -155,25 +249,15 @@ llama_tokens common_speculative_gen_draft(
 
     // reuse as much as possible from the old draft context
     // ideally, the draft context should be as big as the target context and we will always reuse the entire prompt
-    for (int i = 0; i < (int) prompt.size(); ++i) {
-        int cur = 0;
-        while (i_start + cur < (int) prompt_tgt.size() &&
-               i       + cur < (int) prompt.size() &&
-               prompt_tgt[i_start + cur] == prompt[i + cur]) {
-            cur++;
-        }
+    common_speculative_find_reuse(spec, prompt_tgt.data() + i_start, prompt_tgt.size() - i_start, i_start - spec->i_start, reuse_i, reuse_n);
 
-        if ((cur >= params.n_reuse || n_ctx >= (int) prompt_tgt.size()) && cur > reuse_n) {
-            reuse_i = i;
-            reuse_n = cur;
-        }
+    if (reuse_n < params.n_reuse && n_ctx < (int) prompt_tgt.size()) {
+        reuse_i = 0;
+        reuse_n = 0;
     }
 
     LOG_DBG("%s: reuse_i = %d, reuse_n = %d, prompt = %d\n", __func__, reuse_i, reuse_n, (int) prompt.size());
 
-    llama_tokens result;
-    result.reserve(params.n_draft);
-
     if (reuse_n == 0) {
         llama_memory_clear(mem, false);
 
@@ -183,14 +267,16 @@ llama_tokens common_speculative_gen_draft(
         // target model agreed with it. in this case, we simply pass back the previous results to save compute
         if (reuse_i + reuse_n < (int) prompt.size() && prompt[reuse_i + reuse_n] == id_last) {
             for (int i = reuse_i + reuse_n + 1; i < (int) prompt.size(); ++i) {
-                result.push_back(prompt[i]);
+                reused.push_back(prompt[i]);
 
-                if (params.n_draft <= (int) result.size()) {
+                if (params.n_draft <= (int) reused.size()) {
                     break;
                 }
             }
 
-            return result;
+            spec->i_start = i_start - reuse_i;
+
+            return false;
         }
 
         if (reuse_i > 0) {
@@ -207,6 +293,8 @@ llama_tokens common_speculative_gen_draft(
         }
     }
 
+    spec->i_start = i_start;
+
     // prepare a batch to evaluate any new tokens in the prompt
     common_batch_clear(batch);
 
@@ -237,6 +325,28 @@ llama_tokens common_speculative_gen_draft(
 
     llama_decode(ctx, batch);
 
+    return true;
+}
+
+llama_tokens common_speculative_gen_draft(
+        struct common_speculative * spec,
+        struct common_speculative_params params,
+        const llama_tokens & prompt_tgt,
+        llama_token id_last) {
+    auto & batch  = spec->batch;
+    auto & ctx    = spec->ctx;
+    auto & smpl   = spec->smpl;
+    auto & prompt = spec->prompt;
+
+    llama_tokens result;
+    result.reserve(params.n_draft);
+
+    if (!common_speculative_prepare(spec, params, prompt_tgt, id_last, result)) {
+        return result;
+    }
+
+    const llama_pos n_past = prompt.size() - 1;
+
     common_sampler_reset(smpl);
 
     // sample n_draft tokens from the draft model
@@ -278,3 +388,199 @@ llama_tokens common_speculative_gen_draft(
 
     return result;
 }
+
+common_speculative_tree common_speculative_gen_draft_tree(
+        struct common_speculative * spec,
+        struct common_speculative_params params,
+        const llama_tokens & prompt_tgt,
+        llama_token id_last) {
+    auto & batch  = spec->batch;
+    auto & ctx    = spec->ctx;
+    auto & smpl   = spec->smpl;
+    auto & prompt = spec->prompt;
+
+    auto * mem = llama_get_memory(ctx);
+
+    common_speculative_tree tree;
+
+    {
+        llama_tokens reused;
+        if (!common_speculative_prepare(spec, params, prompt_tgt, id_last, reused)) {
+            for (size_t i = 0; i < reused.size(); ++i) {
+                tree.add(reused[i], (int) i - 1);
+                tree.seqs[i] = 1;
+            }
+            tree.n_branch = reused.empty() ? 0 : 1;
+
+            return tree;
+        }
+    }
+
+    const llama_pos n_past = prompt.size() - 1;
+
+    const int n_branch_max = std::max(1, std::min(params.n_branch, (int) llama_n_seq_max(ctx)));
+
+    // the state of each branch - branch b is drafted in sequence b of the draft context
+    struct branch_state {
+        int  node;    // the last node of the branch
+        int  i_batch; // the output of the last node in the draft batch
+        bool active;
+    };
+
+    // branch 0 starts at the root, the output of id_last
+    std::vector<branch_state> branches = { { -1, 0, true } };
+
+    common_sampler_reset(smpl);
+
+    for (int i = 0; (int) tree.size() < params.n_draft; ++i) {
+        common_batch_clear(batch);
+
+        const int n_branch_cur = branches.size();
+
+        for (int b = 0; b < n_branch_cur && (int) tree.size() < params.n_draft; ++b) {
+            if (!branches[b].active) {
+                continue;
+            }
+
+            common_sampler_sample(smpl, ctx, branches[b].i_batch, true);
+
+            const auto * cur_p = common_sampler_get_candidates(smpl);
+
+            for (int k = 0; k < std::min(3, (int) cur_p->size); ++k) {
+                LOG_DBG(" - draft candidate %3d, branch %2d, pos %3d: %6d (%8.3f) '%s'\n",
+                        k, b, i, cur_p->data[k].id, cur_p->data[k].p, common_token_to_piece(ctx, cur_p->data[k].id).c_str());
+            }
+
+            const int parent = branches[b].node;
+
+            // the best candidate continues the branch, the next ones start new branches if they are likely enough
+            int n_child = 1;
+            while (n_child < (int) cur_p->size &&
+                   (int) branches.size() + n_child - 1 < n_branch_max &&
+                   (int) tree.size() + n_child < params.n_draft &&
+                   cur_p->data[n_child].p > params.p_split) {
+                n_child++;
+            }
+
+            for (int f = 0; f < n_child; ++f) {
+                int bf = b;
+
+                if (f > 0) {
+                    bf = branches.size();
+
+                    LOG_DBG("%s: splitting branch %d into %d at pos %d\n", __func__, b, bf, i);
+
+                    llama_memory_seq_rm(mem,    bf, -1, -1);
+                    llama_memory_seq_cp(mem, b, bf, -1, -1);
+
+                    branches.push_back({ parent, -1, true });
+                }
+
+                const llama_token id = cur_p->data[f].id;
+
+                branches[bf].node = tree.add(id, parent);
+
+                // without a split, only continue with very high-confidence draft tokens
+                if ((int) tree.size() >= params.n_draft || (n_child == 1 && cur_p->data[f].p < params.p_min)) {
+                    branches[bf].active = false;
+                    continue;
+                }
+
+                branches[bf].i_batch = batch.n_tokens;
+
+                common_batch_add(batch, id, n_past + i + 1, { bf }, true);
+
+                if (bf == 0) {
+                    prompt.push_back(id);
+                }
+            }
+        }
+
+        if (batch.n_tokens == 0) {
+            break;
+        }
+
+        // evaluate the drafted tokens of all branches on the draft model
+        llama_decode(ctx, batch);
+    }
+
+    // the drafts of the side branches are not needed anymore - branch 0 stays in sequence 0 and can be reused
+    for (int b = 1; b < (int) branches.size(); ++b) {
+        llama_memory_seq_rm(mem, b, -1, -1);
+    }
+
+    tree.n_branch = branches.size();
+
+    for (int b = 0; b < tree.n_branch; ++b) {
+        for (int k = branches[b].node; k >= 0; k = tree.parent[k]) {
+            tree.seqs[k] |= 1ull << b;
+        }
+    }
+
+    return tree;
+}
+
+void common_speculative_tree_add_to_batch(
+        const common_speculative_tree & tree,
+                          llama_batch & batch,
+                          llama_token   id_last,
+                            llama_pos   n_past,
+                         llama_seq_id   seq_id_base) {
+    std::vector<llama_seq_id> seq_ids;
+
+    for (int b = 0; b < tree.n_branch; ++b) {
+        seq_ids.push_back(seq_id_base + b);
+    }
+
+    // the root is shared by all branches
+    common_batch_add(batch, id_last, n_past, seq_ids, true);
+
+    for (int k = 0; k < tree.size(); ++k) {
+        seq_ids.clear();
+        for (int b = 0; b < tree.n_branch; ++b) {
+            if (tree.seqs[k] & (1ull << b)) {
+                seq_ids.push_back(seq_id_base + b);
+            }
+        }
+
+        common_batch_add(batch, tree.tokens[k], n_past + 1 + tree.depth(k), seq_ids, true);
+    }
+}
+
+llama_tokens common_speculative_tree_sample_and_accept(
+        struct common_sampler * smpl,
+        struct llama_context * ctx,
+        const common_speculative_tree & tree,
+        int i_batch_root,
+        int & node_last) {
+    llama_tokens result;
+
+    node_last = -1;
+
+    while (true) {
+        const int i_batch = node_last < 0 ? i_batch_root : i_batch_root + 1 + node_last;
+
+        const llama_token id = common_sampler_sample(smpl, ctx, i_batch);
+
+        common_sampler_accept(smpl, id, true);
+
+        result.push_back(id);
+
+        // follow the child that matches the sampled token
+        int next = -1;
+        for (int k = node_last + 1; k < tree.size(); ++k) {
+            if (tree.parent[k] == node_last && tree.tokens[k] == id) {
+                next = k;
+                break;
+            }
+        }
+
+        if (next < 0) {
+            break;
+        }
+
+        node_last = next;
+    }
+
+    return result;
+}
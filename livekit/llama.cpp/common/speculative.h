@@ -10,8 +10,46 @@ struct common_speculative_params {
     int n_reuse = 256;
 
     float p_min = 0.75f; // min probability required to accept a token in the draft
+
+    int   n_branch = 1;    // max number of branches of a draft tree
+    float p_split  = 0.1f; // min probability of a candidate to start a new branch
+};
+
+// a tree of drafted tokens - the root is the last sampled token and is not part of the tree
+// the nodes are in the order in which they were drafted, so each parent comes before its children
+struct common_speculative_tree {
+    llama_tokens          tokens;
+    std::vector<int>      parent; // parent node, -1 if the parent is the root
+    std::vector<uint64_t> seqs;   // mask of the branches that go through the node
+
+    int n_branch = 0;
+
+    int size() const {
+        return tokens.size();
+    }
+
+    int add(llama_token id, int p) {
+        tokens.push_back(id);
+        parent.push_back(p);
+        seqs.push_back(0);
+
+        return tokens.size() - 1;
+    }
+
+    // distance from the root - 0 for the children of the root
+    int depth(int k) const {
+        int d = 0;
+        for (k = parent[k]; k >= 0; k = parent[k]) {
+            d++;
+        }
+        return d;
+    }
 };
 
+// length of the longest prefix of tgt[0, n_tgt) that is contained in prompt, pos is set to the start of its first occurrence
+// used to find the part of the draft context that can be reused for a new target prompt, in O(prompt.size() + n_tgt)
+int32_t common_speculative_find_prefix(const llama_tokens & prompt, const llama_token * tgt, int32_t n_tgt, int32_t & pos);
+
 struct common_speculative * common_speculative_init(struct llama_context * ctx_dft);
 
 void common_speculative_free(struct common_speculative * spec);
@@ -26,3 +64,29 @@ llama_tokens common_speculative_gen_draft(
         struct common_speculative_params   params,
                       const llama_tokens & prompt,
                              llama_token   id_last);
+
+// draft a tree of up to n_draft tokens: the best candidate continues a branch, and the next candidates with
+// probability above p_split start new branches, up to n_branch branches (branch b uses sequence b of the draft context)
+common_speculative_tree common_speculative_gen_draft_tree(
+               struct common_speculative * spec,
+        struct common_speculative_params   params,
+                      const llama_tokens & prompt,
+                             llama_token   id_last);
+
+// add id_last at n_past followed by the tree nodes to the batch, branch b uses sequence seq_id_base + b
+// the sequences of the branches must contain the prompt before the batch is decoded
+void common_speculative_tree_add_to_batch(
+        const common_speculative_tree & tree,
+                          llama_batch & batch,
+                          llama_token   id_last,
+                            llama_pos   n_past,
+                         llama_seq_id   seq_id_base);
+
+// sample the target model along the tree decoded with common_speculative_tree_add_to_batch, starting at the root
+// returns the accepted tokens - the drafted ones followed by one sampled token - and the last accepted node (-1 = root)
+llama_tokens common_speculative_tree_sample_and_accept(
+        struct common_sampler * smpl,
+         struct llama_context * ctx,
+  const common_speculative_tree & tree,
+                            int   i_batch_root,
+                            int & node_last);
@@ -89,7 +89,8 @@ static bool gguf_ex_read_0(const std::string & fname) {
         /*.ctx      = */ NULL,
     };
 
-    struct gguf_context * ctx = gguf_init_from_file(fname.c_str(), params);
+    // only the meta data is needed, so map the file instead of reading it
+    struct gguf_context * ctx = gguf_init_from_file_mmap(fname.c_str(), params);
 
     if (!ctx) {
         fprintf(stderr, "%s: failed to load '%s'\n", __func__, fname.c_str());
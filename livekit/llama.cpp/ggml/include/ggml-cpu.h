@@ -19,6 +19,24 @@ extern "C" {
         // abort ggml_graph_compute when true
         ggml_abort_callback abort_callback;
         void *              abort_callback_data;
+
+        // synchronize the threads after every node
+        // by default, nodes that do not depend on the nodes computed since the last barrier run without one
+        bool sync_all;
+
+        // compute every node on its own (also with the GGML_CPU_NO_FUSION environment variable)
+        // by default, common sequences such as rms_norm + mul and silu + mul are computed by fused kernels
+        bool no_fusion;
+
+        // number of barriers between the nodes, set by `ggml_graph_compute()`
+        int n_barriers;
+
+        // number of nodes computed as part of a fused kernel of a later node, set by `ggml_graph_compute()`
+        int n_fused;
+
+        // number of matrix multiplication chunks taken from the queue of another NUMA node, set by `ggml_graph_compute()`
+        // the GGML_CPU_CHUNK_QUEUES=N environment variable splits the threads between N queues without NUMA, for testing
+        int n_chunk_steals;
     };
 
     // numa strategies
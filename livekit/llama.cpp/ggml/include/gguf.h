@@ -78,6 +78,10 @@ extern "C" {
 
     GGML_API struct gguf_context * gguf_init_empty(void);
     GGML_API struct gguf_context * gguf_init_from_file(const char * fname, struct gguf_init_params params);
+
+    // same as gguf_init_from_file, but the file is mapped and strings and arrays point into the mapping instead of being copied
+    // the mapping is kept until gguf_free, falls back to reading the file if it cannot be mapped
+    GGML_API struct gguf_context * gguf_init_from_file_mmap(const char * fname, struct gguf_init_params params);
     //GGML_API struct gguf_context * gguf_init_from_buffer(..);
 
     GGML_API void gguf_free(struct gguf_context * ctx);
@@ -118,6 +122,11 @@ extern "C" {
     // get ith C string from array with given key_id
     GGML_API const char * gguf_get_arr_str (const struct gguf_context * ctx, int64_t key_id, size_t i);
 
+    // get a string without copying it, the length is written to len and the string is NOT null-terminated
+    // prefer these over gguf_get_val_str/gguf_get_arr_str for contexts from gguf_init_from_file_mmap
+    GGML_API const char * gguf_get_val_str_view(const struct gguf_context * ctx, int64_t key_id, size_t * len);
+    GGML_API const char * gguf_get_arr_str_view(const struct gguf_context * ctx, int64_t key_id, size_t i, size_t * len);
+
     GGML_API int64_t        gguf_get_n_tensors    (const struct gguf_context * ctx);
     GGML_API int64_t        gguf_find_tensor      (const struct gguf_context * ctx, const char * name); // returns -1 if the tensor is not found
     GGML_API size_t         gguf_get_tensor_offset(const struct gguf_context * ctx, int64_t tensor_id);
@@ -116,6 +116,19 @@ static ggml_backend_buffer_i ggml_backend_amx_buffer_interface = {
     /* .reset           = */ nullptr,
 };
 
+// buffer over memory that already holds converted tensors, the memory is not owned by the buffer
+static ggml_backend_buffer_i ggml_backend_amx_buffer_from_ptr_interface = {
+    /* .free_buffer     = */ nullptr,
+    /* .get_base        = */ ggml_backend_amx_buffer_get_base,
+    /* .init_tensor     = */ ggml_backend_amx_buffer_init_tensor,
+    /* .memset_tensor   = */ ggml_backend_amx_buffer_memset_tensor,
+    /* .set_tensor      = */ ggml_backend_amx_buffer_set_tensor,
+    /* .get_tensor      = */ nullptr,
+    /* .cpy_tensor      = */ nullptr,
+    /* .clear           = */ ggml_backend_amx_buffer_clear,
+    /* .reset           = */ nullptr,
+};
+
 static const char * ggml_backend_amx_buffer_type_get_name(ggml_backend_buffer_type_t buft) {
     return "AMX";
 
@@ -171,6 +184,13 @@ class extra_buffer_type : ggml::cpu::extra_buffer_type {
 
         return nullptr;
     }
+
+    ggml_backend_buffer_t buffer_from_ptr(ggml_backend_buffer_type_t buft, void * ptr, size_t size) override {
+        if ((uintptr_t) ptr % TENSOR_ALIGNMENT != 0) {
+            return nullptr;
+        }
+        return ggml_backend_buffer_init(buft, ggml_backend_amx_buffer_from_ptr_interface, ptr, size);
+    }
 };
 }  // namespace ggml::cpu::amx
 
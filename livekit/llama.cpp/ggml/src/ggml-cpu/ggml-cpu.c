@@ -427,6 +427,14 @@ typedef pthread_mutex_t    ggml_mutex_t;
 
 #endif
 
+#define GGML_NUMA_MAX_NODES 8
+#define GGML_NUMA_MAX_CPUS 512
+
+// chunk counters of a parallel op, one per NUMA node of the threads, see ggml_chunk_next
+struct ggml_chunk_queues {
+    char counters[GGML_NUMA_MAX_NODES][CACHE_LINE_SIZE]; // atomic_int, chunks taken from the node after the first chunk of each thread
+};
+
 // Threadpool def
 struct ggml_threadpool {
     ggml_mutex_t mutex;       // mutex for cond.var
@@ -441,6 +449,12 @@ struct ggml_threadpool {
     atomic_int GGML_CACHE_ALIGN n_barrier_passed;
     atomic_int GGML_CACHE_ALIGN current_chunk; // currently processing chunk during Mat_Mul, shared between all the threads.
 
+    // chunks of the matrix multiplications, split between the NUMA nodes of the threads, see ggml_threadpool_chunk_layout
+    struct ggml_chunk_queues chunk_queues;
+    int         n_chunk_nodes;                             // number of NUMA nodes of the current threads
+    int         chunk_node_first[GGML_NUMA_MAX_NODES + 1]; // the threads of node i are counted in [first[i], first[i + 1])
+    atomic_int  n_chunk_steals;                            // chunks taken from the queue of another node
+
     // these are atomic as an annotation for thread-sanitizer
     atomic_bool stop;         // Used for stopping the threadpool altogether
     atomic_bool pause;        // Used for pausing the threadpool or individual threads
@@ -453,6 +467,11 @@ struct ggml_threadpool {
     int32_t      prio;        // Scheduling priority
     uint32_t     poll;        // Polling level (0 - no polling)
 
+    // barriers and fused nodes of the current graph, see ggml_graph_compute_sync and ggml_graph_compute_fusion
+    uint8_t    * node_sync;   // [n_node_sync], != 0 if the threads synchronize before the node
+    uint8_t    * node_fusion; // [n_node_sync], enum ggml_cpu_fusion
+    int          n_node_sync;
+
     enum ggml_status ec;
 };
 
@@ -466,6 +485,10 @@ struct ggml_compute_state {
 #endif
     struct ggml_threadpool * threadpool;
     int ith;
+
+    int numa_node;  // NUMA node of the CPUs of the thread, 0 if unknown
+    int chunk_node; // index of the chunk queue of the thread, set by ggml_threadpool_chunk_layout
+    int chunk_rank; // index of the thread among the threads of the same queue
 };
 
 // Helpers for polling loops
@@ -485,9 +508,6 @@ static inline void ggml_thread_cpu_relax(void) {;}
 // NUMA support
 //
 
-#define GGML_NUMA_MAX_NODES 8
-#define GGML_NUMA_MAX_CPUS 512
-
 struct ggml_numa_node {
     uint32_t cpus[GGML_NUMA_MAX_CPUS]; // hardware threads on this node
     uint32_t n_cpus;
@@ -512,6 +532,8 @@ struct ggml_numa_nodes {
 
 struct ggml_state {
     struct ggml_numa_nodes numa;
+    bool no_fusion;      // GGML_CPU_NO_FUSION is set, see ggml_graph_compute_fusion
+    int  n_chunk_queues; // GGML_CPU_CHUNK_QUEUES, see ggml_threadpool_chunk_layout
 };
 
 static struct ggml_state g_state = {0};
@@ -669,6 +691,146 @@ bool ggml_is_numa(void) {
     return g_state.numa.n_nodes > 1;
 }
 
+static int ggml_numa_node_of_cpu(int cpu) {
+    for (uint32_t n = 0; n < g_state.numa.n_nodes; ++n) {
+        for (uint32_t i = 0; i < g_state.numa.nodes[n].n_cpus; ++i) {
+            if (g_state.numa.nodes[n].cpus[i] == (uint32_t) cpu) {
+                return n;
+            }
+        }
+    }
+    return 0;
+}
+
+// NUMA node the thread ith of a threadpool runs on, from the NUMA strategy or its cpumask
+// 0 if it is not known or if the thread can run on multiple nodes
+static int ggml_thread_numa_node(int ith, const bool * cpumask) {
+    if (!ggml_is_numa()) {
+        return 0;
+    }
+
+    switch (g_state.numa.numa_strategy) {
+        case GGML_NUMA_STRATEGY_DISTRIBUTE:
+            // same as set_numa_thread_affinity
+            return ith % g_state.numa.n_nodes;
+        case GGML_NUMA_STRATEGY_ISOLATE:
+            return g_state.numa.current_node;
+        default:
+            break;
+    }
+
+    int node = -1;
+    for (int c = 0; cpumask && c < GGML_MAX_N_THREADS; c++) {
+        if (!cpumask[c]) {
+            continue;
+        }
+        const int n = ggml_numa_node_of_cpu(c);
+        if (node >= 0 && n != node) {
+            return 0;
+        }
+        node = n;
+    }
+
+    return node < 0 ? 0 : node;
+}
+
+// NUMA node of the chunk queue of the thread j
+// GGML_CPU_CHUNK_QUEUES=N distributes the threads between N queues as if they ran on N nodes, for testing the stealing
+// of chunks without a NUMA system
+static int ggml_thread_chunk_node(const struct ggml_threadpool * tp, int j) {
+    return g_state.n_chunk_queues > 0 ? j % g_state.n_chunk_queues : tp->workers[j].numa_node;
+}
+
+// assigns the threads [0, n_threads) to the chunk queues, one queue per NUMA node with threads
+// called before the threads start computing the graph
+static void ggml_threadpool_chunk_layout(struct ggml_threadpool * tp, int n_threads) {
+    int n_node_threads[GGML_NUMA_MAX_NODES] = { 0 };
+    for (int j = 0; j < n_threads; j++) {
+        n_node_threads[ggml_thread_chunk_node(tp, j)]++;
+    }
+
+    int queue_of_node[GGML_NUMA_MAX_NODES];
+
+    tp->n_chunk_nodes       = 0;
+    tp->chunk_node_first[0] = 0;
+    for (int n = 0; n < GGML_NUMA_MAX_NODES; n++) {
+        if (n_node_threads[n] > 0) {
+            const int q = tp->n_chunk_nodes++;
+            queue_of_node[n] = q;
+            tp->chunk_node_first[q + 1] = tp->chunk_node_first[q] + n_node_threads[n];
+        }
+    }
+
+    int n_queue_threads[GGML_NUMA_MAX_NODES] = { 0 };
+    for (int j = 0; j < n_threads; j++) {
+        const int q = queue_of_node[ggml_thread_chunk_node(tp, j)];
+        tp->workers[j].chunk_node = q;
+        tp->workers[j].chunk_rank = n_queue_threads[q]++;
+    }
+}
+
+// called by one thread, followed by a barrier before the chunks are taken
+static void ggml_chunk_queues_reset(struct ggml_chunk_queues * queues) {
+    for (int q = 0; q < GGML_NUMA_MAX_NODES; q++) {
+        atomic_store_explicit((atomic_int *) queues->counters[q], 0, memory_order_relaxed);
+    }
+}
+
+// the chunks [0, n_chunks) of an op are split between the chunk queues in proportion to their number of threads,
+// so that the threads of a NUMA node work on contiguous chunks and only contend on the counter of their node
+// each thread starts with the chunk at its rank in its queue, then takes the next chunks of its queue,
+// and steals the chunks of the other queues when its queue is empty
+// returns -1 when all the chunks have been taken
+static int ggml_chunk_next(struct ggml_chunk_queues * queues, const struct ggml_compute_params * params, int n_chunks) {
+    struct ggml_threadpool * tp = params->threadpool;
+
+    const int n_queues  = tp->n_chunk_nodes;
+    const int n_threads = tp->chunk_node_first[n_queues];
+    const int q0        = tp->workers[params->ith].chunk_node;
+
+    if (n_queues == 1 && n_chunks <= n_threads) {
+        // every chunk is the first chunk of a thread
+        return -1;
+    }
+
+    for (int i = 0; i < n_queues; i++) {
+        const int q = (q0 + i) % n_queues;
+
+        const int64_t first = tp->chunk_node_first[q];
+        const int64_t last  = tp->chunk_node_first[q + 1];
+        const int     begin = (int) (n_chunks*first/n_threads);
+        const int     end   = (int) (n_chunks*last/n_threads);
+
+        if (begin + (last - first) >= end) {
+            continue;
+        }
+
+        const int chunk = begin + (int) (last - first) +
+            atomic_fetch_add_explicit((atomic_int *) queues->counters[q], 1, memory_order_relaxed);
+
+        if (chunk < end) {
+            if (i > 0) {
+                atomic_fetch_add_explicit(&tp->n_chunk_steals, 1, memory_order_relaxed);
+            }
+            return chunk;
+        }
+    }
+
+    return -1;
+}
+
+static int ggml_chunk_first(struct ggml_chunk_queues * queues, const struct ggml_compute_params * params, int n_chunks) {
+    const struct ggml_threadpool    * tp    = params->threadpool;
+    const struct ggml_compute_state * state = &tp->workers[params->ith];
+
+    const int n_threads = tp->chunk_node_first[tp->n_chunk_nodes];
+
+    const int chunk = (int) ((int64_t) n_chunks*tp->chunk_node_first[state->chunk_node]/n_threads) + state->chunk_rank;
+    const int end   = (int) ((int64_t) n_chunks*tp->chunk_node_first[state->chunk_node + 1]/n_threads);
+
+    return chunk < end ? chunk : ggml_chunk_next(queues, params, n_chunks);
+}
+
 #if defined(__ARM_ARCH)
 
 #if defined(__linux__) && defined(__aarch64__)
@@ -1189,9 +1351,39 @@ static void ggml_compute_forward_mul_mat_one_chunk(
     }
 }
 
+// adds the bias of a fused GGML_OP_ADD to a chunk of the result, see ggml_graph_compute_fusion
+static void ggml_compute_forward_mul_mat_add_chunk(
+    const struct ggml_tensor * dst,
+          struct ggml_tensor * add,
+    const int64_t ir0_start,
+    const int64_t ir0_end,
+    const int64_t ir1_start,
+    const int64_t ir1_end) {
+
+    const struct ggml_tensor * bias = add->src[1];
+
+    const int64_t ne1 = dst->ne[1];
+    const int64_t ne2 = dst->ne[2];
+
+    for (int64_t ir1 = ir1_start; ir1 < ir1_end; ++ir1) {
+        const int64_t i3 = ir1/(ne2*ne1);
+        const int64_t i2 = (ir1 - i3*ne2*ne1)/ne1;
+        const int64_t i1 = (ir1 - i3*ne2*ne1 - i2*ne1);
+
+        const float * x = (const float *) ((const char *) dst->data + i1*dst->nb[1] + i2*dst->nb[2] + i3*dst->nb[3]);
+        const float * b = (const float *) ((const char *) bias->data +
+                (i1 % bias->ne[1])*bias->nb[1] + (i2 % bias->ne[2])*bias->nb[2] + (i3 % bias->ne[3])*bias->nb[3]);
+        float       * y = (float *)       ((char *)       add->data + i1*add->nb[1] + i2*add->nb[2] + i3*add->nb[3]);
+
+        ggml_vec_add_f32(ir0_end - ir0_start, y + ir0_start, x + ir0_start, b + ir0_start);
+    }
+}
+
+// add is the GGML_OP_ADD of a bias fused with the matrix multiplication, or NULL
 static void ggml_compute_forward_mul_mat(
         const struct ggml_compute_params * params,
-              struct ggml_tensor * dst) {
+              struct ggml_tensor * dst,
+              struct ggml_tensor * add) {
 
     const struct ggml_tensor * src0 = dst->src[0];
     const struct ggml_tensor * src1 = dst->src[1];
@@ -1246,6 +1438,10 @@ static void ggml_compute_forward_mul_mat(
                                      src1->type,
                                      dst->type))
                     goto UseGgmlGemm1;
+        if (add) {
+            ggml_barrier(params->threadpool);
+            ggml_compute_forward_add(params, add);
+        }
         return;
     }
 UseGgmlGemm1:;
@@ -1289,8 +1485,8 @@ UseGgmlGemm1:;
     }
 
     if (ith == 0) {
-        // Every thread starts at ith, so the first unprocessed chunk is nth.  This save a bit of coordination right at the start.
-        atomic_store_explicit(&params->threadpool->current_chunk, nth, memory_order_relaxed);
+        // Every thread starts at its first chunk, the counters only count the chunks taken after them.
+        ggml_chunk_queues_reset(&params->threadpool->chunk_queues);
     }
 
     ggml_barrier(params->threadpool);
@@ -1314,6 +1510,10 @@ UseGgmlGemm1:;
                                      vec_dot_type,
                                      dst->type))
                     goto UseGgmlGemm2;
+        if (add) {
+            ggml_barrier(params->threadpool);
+            ggml_compute_forward_add(params, add);
+        }
         return;
     }
 UseGgmlGemm2:;
@@ -1340,9 +1540,10 @@ UseGgmlGemm2:;
     int64_t nchunk1 = (nr1 + chunk_size - 1) / chunk_size;
 
     // If the chunking is poor for the number of threads on this setup, scrap the whole plan.  Re-chunk it by thread.
-    //   Also, chunking by thread was measured to have perform better on NUMA systems.  See https://github.com/ggml-org/llama.cpp/pull/6915
-    //   In theory, chunking should be just as useful on NUMA and non NUMA systems, but testing disagreed with that.
-    if (nchunk0 * nchunk1 < nth * 4 || ggml_is_numa()) {
+    //   On NUMA systems, chunking by thread used to perform better, since the chunks were taken by the threads of any node.
+    //   See https://github.com/ggml-org/llama.cpp/pull/6915
+    //   Now the threads take the chunks of their node first, see ggml_chunk_next.
+    if (nchunk0 * nchunk1 < nth * 4) {
         // distribute the thread work across the inner or outer loop based on which one is larger
         nchunk0 = nr0 > nr1 ? nth : 1; // parallelize by src0 rows
         nchunk1 = nr0 > nr1 ? 1 : nth; // parallelize by src1 rows
@@ -1353,9 +1554,9 @@ UseGgmlGemm2:;
     const int64_t dr1 = (nr1 + nchunk1 - 1) / nchunk1;
 
     // The first chunk comes from our thread_id, the rest will get auto-assigned.
-    int current_chunk = ith;
+    int current_chunk = ggml_chunk_first(&params->threadpool->chunk_queues, params, nchunk0 * nchunk1);
 
-    while (current_chunk < nchunk0 * nchunk1) {
+    while (current_chunk >= 0) {
         const int64_t ith0 = current_chunk % nchunk0;
         const int64_t ith1 = current_chunk / nchunk0;
 
@@ -1375,11 +1576,11 @@ UseGgmlGemm2:;
         }
         ggml_compute_forward_mul_mat_one_chunk(params, dst, src0->type, num_rows_per_vec_dot, ir0_start, ir0_end, ir1_start, ir1_end);
 
-        if (nth >= nchunk0 * nchunk1) {
-            break;
+        if (add) {
+            ggml_compute_forward_mul_mat_add_chunk(dst, add, ir0_start, ir0_end, ir1_start, ir1_end);
         }
 
-        current_chunk = atomic_fetch_add_explicit(&params->threadpool->current_chunk, 1, memory_order_relaxed);
+        current_chunk = ggml_chunk_next(&params->threadpool->chunk_queues, params, nchunk0 * nchunk1);
     }
 }
 
@@ -1509,8 +1710,8 @@ static void ggml_compute_forward_mul_mat_id(
     struct mmid_row_mapping * matrix_rows = // [n_as][ids->ne[0]*ids->ne[1]]
         incr_ptr_aligned(&wdata_cur, n_as*ids->ne[0]*ids->ne[1]*sizeof(struct mmid_row_mapping), sizeof(int64_t));
 
-    char (*atomic_current_chunk)[CACHE_LINE_SIZE] = // [n_as]
-        incr_ptr_aligned(&wdata_cur, CACHE_LINE_SIZE * n_as, CACHE_LINE_SIZE);
+    struct ggml_chunk_queues * chunk_queues = // [n_as]
+        incr_ptr_aligned(&wdata_cur, sizeof(struct ggml_chunk_queues) * n_as, CACHE_LINE_SIZE);
 
     GGML_ASSERT(params->wsize >= (size_t)((char *) wdata_cur - (char *) params->wdata));
 
@@ -1568,10 +1769,9 @@ static void ggml_compute_forward_mul_mat_id(
         }
     }
 
-    // reset current_chunk
+    // reset the chunk counters
     for (int cur_a = ith; cur_a < n_as; cur_a += nth) {
-        atomic_int * current_chunk_ctr = (atomic_int *)(atomic_current_chunk + cur_a);
-        *current_chunk_ctr = nth;
+        ggml_chunk_queues_reset(&chunk_queues[cur_a]);
     }
 
     ggml_barrier(params->threadpool);
@@ -1599,8 +1799,8 @@ static void ggml_compute_forward_mul_mat_id(
         // disable for ARM
         const bool disable_chunking = true;
 #else
-        // disable for NUMA
-        const bool disable_chunking = ggml_is_numa();
+        // on NUMA the threads take the chunks of their node first, see ggml_chunk_next
+        const bool disable_chunking = false;
 #endif // defined(__aarch64__)
 
         int64_t nchunk0 = (nr0 + chunk_size - 1) / chunk_size;
@@ -1614,11 +1814,9 @@ static void ggml_compute_forward_mul_mat_id(
         const int64_t dr0 = (nr0 + nchunk0 - 1) / nchunk0;
         const int64_t dr1 = (nr1 + nchunk1 - 1) / nchunk1;
 
-        int current_chunk = ith;
-
-        atomic_int * current_chunk_ctr = (atomic_int *)(atomic_current_chunk + cur_a);
+        int current_chunk = ggml_chunk_first(&chunk_queues[cur_a], params, nchunk0 * nchunk1);
 
-        while (current_chunk < nchunk0 * nchunk1) {
+        while (current_chunk >= 0) {
             const int64_t ith0 = current_chunk % nchunk0;
             const int64_t ith1 = current_chunk / nchunk0;
 
@@ -1634,11 +1832,7 @@ static void ggml_compute_forward_mul_mat_id(
                 src0_cur, matrix_rows, row_size, src1_cont, wdata
             );
 
-            if (nth >= nchunk0 * nchunk1) {
-                break;
-            }
-
-            current_chunk = atomic_fetch_add_explicit(current_chunk_ctr, 1, memory_order_relaxed);
+            current_chunk = ggml_chunk_next(&chunk_queues[cur_a], params, nchunk0 * nchunk1);
         }
     }
 }
@@ -1764,7 +1958,7 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
             } break;
         case GGML_OP_MUL_MAT:
             {
-                ggml_compute_forward_mul_mat(params, tensor);
+                ggml_compute_forward_mul_mat(params, tensor, NULL);
             } break;
         case GGML_OP_MUL_MAT_ID:
             {
@@ -2556,6 +2750,8 @@ void ggml_threadpool_free(struct ggml_threadpool* threadpool) {
 #endif // GGML_USE_OPENMP
 
     const size_t workers_size = sizeof(struct ggml_compute_state) * n_threads;
+    free(threadpool->node_sync);
+    free(threadpool->node_fusion);
     ggml_aligned_free(threadpool->workers, workers_size);
     ggml_aligned_free(threadpool, sizeof(struct ggml_threadpool));
 }
@@ -2599,6 +2795,167 @@ void ggml_threadpool_resume(struct ggml_threadpool * threadpool) {
 #endif
 }
 
+// size of the work buffer needed to compute node with n_threads
+static size_t ggml_graph_node_work_size(struct ggml_tensor * node, int n_threads) {
+    const int n_tasks = ggml_get_n_tasks(node, n_threads);
+
+    size_t cur = 0;
+
+    if (!ggml_cpu_extra_work_size(n_threads, node, &cur)) {
+        switch (node->op) {
+            case GGML_OP_CPY:
+            case GGML_OP_DUP:
+                {
+                    if (ggml_is_quantized(node->type) ||
+                        // F16 -> BF16 and BF16 -> F16 copies go through intermediate F32
+                        (node->src[0]->type == GGML_TYPE_F16  && node->src[1] && node->src[1]->type == GGML_TYPE_BF16) ||
+                        (node->src[0]->type == GGML_TYPE_BF16 && node->src[1] && node->src[1]->type == GGML_TYPE_F16)) {
+                        cur = ggml_type_size(GGML_TYPE_F32) * node->ne[0] * n_tasks;
+                    }
+                } break;
+            case GGML_OP_ADD:
+            case GGML_OP_ADD1:
+                {
+                    if (ggml_is_quantized(node->src[0]->type)) {
+                        cur = ggml_type_size(GGML_TYPE_F32) * node->src[0]->ne[0] * n_tasks;
+                    }
+                } break;
+            case GGML_OP_ACC:
+                {
+                    if (ggml_is_quantized(node->src[0]->type)) {
+                        cur = ggml_type_size(GGML_TYPE_F32) * node->src[1]->ne[0] * n_tasks;
+                    }
+                } break;
+            case GGML_OP_COUNT_EQUAL:
+                {
+                    cur = ggml_type_size(node->type)*n_tasks;
+                } break;
+            case GGML_OP_MUL_MAT:
+                {
+                    const enum ggml_type vec_dot_type = type_traits_cpu[node->src[0]->type].vec_dot_type;
+
+                    if (node->src[1]->type != vec_dot_type) {
+                        cur = ggml_row_size(vec_dot_type, ggml_nelements(node->src[1]));
+                    }
+                } break;
+            case GGML_OP_MUL_MAT_ID:
+                {
+                    cur = 0;
+                    const struct ggml_tensor * src0 = node->src[0];
+                    const struct ggml_tensor * src1 = node->src[1];
+                    const struct ggml_tensor * ids = node->src[2];
+                    const enum ggml_type vec_dot_type = type_traits_cpu[src0->type].vec_dot_type;
+                    const int n_as = src0->ne[2];
+                    // src1
+                    if (src1->type != vec_dot_type) {
+                        cur += ggml_row_size(vec_dot_type, ggml_nelements(src1)) + sizeof(int64_t);
+                    }
+                    // matrix_row_counts
+                    cur += n_as * sizeof(int64_t) + sizeof(int64_t);
+                    // matrix_rows
+                    cur += n_as*ids->ne[0]*ids->ne[1]*sizeof(struct mmid_row_mapping) + sizeof(int64_t);
+                    // chunk_queues
+                    cur += sizeof(struct ggml_chunk_queues)*n_as + CACHE_LINE_SIZE;
+                } break;
+            case GGML_OP_OUT_PROD:
+                {
+                    if (ggml_is_quantized(node->src[0]->type)) {
+                        cur = ggml_type_size(GGML_TYPE_F32) * node->src[0]->ne[0] * n_tasks;
+                    }
+                } break;
+            case GGML_OP_SOFT_MAX:
+            case GGML_OP_ROPE:
+            case GGML_OP_ROPE_BACK:
+                {
+                    cur = ggml_type_size(GGML_TYPE_F32) * node->ne[0] * n_tasks;
+                } break;
+            case GGML_OP_CONV_TRANSPOSE_1D:
+                {
+                    GGML_ASSERT(node->src[0]->ne[3] == 1);
+                    GGML_ASSERT(node->src[1]->ne[2] == 1);
+                    GGML_ASSERT(node->src[1]->ne[3] == 1);
+
+                    const int64_t ne00 = node->src[0]->ne[0];  // K
+                    const int64_t ne01 = node->src[0]->ne[1];  // Cout
+                    const int64_t ne02 = node->src[0]->ne[2];  // Cin
+                    const int64_t ne10 = node->src[1]->ne[0];  // L
+                    const int64_t ne11 = node->src[1]->ne[1];  // Cin
+
+                    if ((node->src[0]->type == GGML_TYPE_F16 ||
+                         node->src[0]->type == GGML_TYPE_BF16) &&
+                        node->src[1]->type == GGML_TYPE_F32) {
+                        cur += sizeof(ggml_fp16_t)*ne00*ne01*ne02;
+                        cur += sizeof(ggml_fp16_t)*ne10*ne11;
+                    } else if (node->src[0]->type == GGML_TYPE_F32 &&
+                               node->src[1]->type == GGML_TYPE_F32) {
+                        cur += sizeof(float)*ne00*ne01*ne02;
+                        cur += sizeof(float)*ne10*ne11;
+                    } else {
+                        GGML_ABORT("fatal error");
+                    }
+                } break;
+            case GGML_OP_CONV_TRANSPOSE_2D:
+                {
+                    const int64_t ne00 = node->src[0]->ne[0]; // W
+                    const int64_t ne01 = node->src[0]->ne[1]; // H
+                    const int64_t ne02 = node->src[0]->ne[2]; // Channels Out
+                    const int64_t ne03 = node->src[0]->ne[3]; // Channels In
+
+                    const int64_t ne10 = node->src[1]->ne[0]; // W
+                    const int64_t ne11 = node->src[1]->ne[1]; // H
+                    const int64_t ne12 = node->src[1]->ne[2]; // Channels In
+
+                    cur += sizeof(ggml_fp16_t)*ne00*ne01*ne02*ne03;
+                    cur += sizeof(ggml_fp16_t)*ne10*ne11*ne12;
+                } break;
+            case GGML_OP_FLASH_ATTN_EXT:
+                {
+                    const int64_t ne10 = node->src[1]->ne[0]; // DK
+                    const int64_t ne20 = node->src[2]->ne[0]; // DV
+
+                    cur = sizeof(float)*(1*ne10 + 2*ne20)*n_tasks; // 1x head size K + 2x head size V (per thread)
+
+                    // partial results of the KV chunks, when the KV sequence is split between threads
+                    const int64_t n_chunks = ggml_flash_attn_ext_n_kv_chunks(node, n_tasks);
+                    if (n_chunks > 1) {
+                        const int64_t nr = ggml_nrows(node->src[0]);
+
+                        cur += sizeof(float)*(2 + ne20)*nr*n_chunks; // M, S and VKQ per chunk
+                    }
+                } break;
+            case GGML_OP_FLASH_ATTN_BACK:
+                {
+                    const int64_t    D = node->src[0]->ne[0];
+                    const int64_t ne11 = ggml_up(node->src[1]->ne[1], GGML_SOFT_MAX_UNROLL);
+                    const int64_t mxDn = MAX(D, ne11) * 2; // *2 because of S and SM in ggml_compute_forward_flash_attn_back
+                    if (node->src[1]->type == GGML_TYPE_F32) {
+                        cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
+                        cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
+                    } else if (node->src[1]->type == GGML_TYPE_F16) {
+                        cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
+                        cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
+                    } else if (node->src[1]->type == GGML_TYPE_BF16) {
+                        cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
+                        cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
+                    }
+                } break;
+
+            case GGML_OP_CROSS_ENTROPY_LOSS:
+                {
+                    cur = ggml_type_size(node->type)*(n_tasks + node->src[0]->ne[0]*n_tasks);
+                } break;
+            case GGML_OP_COUNT:
+                {
+                    GGML_ABORT("fatal error");
+                }
+            default:
+                break;
+        }
+    }
+
+    return cur;
+}
+
 struct ggml_cplan ggml_graph_plan(
           const struct ggml_cgraph * cgraph,
                                int   n_threads,
@@ -2626,165 +2983,431 @@ struct ggml_cplan ggml_graph_plan(
 
         max_tasks = MAX(max_tasks, n_tasks);
 
-        size_t cur = 0;
+        work_size = MAX(work_size, ggml_graph_node_work_size(node, n_threads));
+    }
 
-        if (!ggml_cpu_extra_work_size(n_threads, node, &cur)) {
-            switch (node->op) {
-                case GGML_OP_CPY:
-                case GGML_OP_DUP:
-                    {
-                        if (ggml_is_quantized(node->type) ||
-                            // F16 -> BF16 and BF16 -> F16 copies go through intermediate F32
-                            (node->src[0]->type == GGML_TYPE_F16  && node->src[1] && node->src[1]->type == GGML_TYPE_BF16) ||
-                            (node->src[0]->type == GGML_TYPE_BF16 && node->src[1] && node->src[1]->type == GGML_TYPE_F16)) {
-                            cur = ggml_type_size(GGML_TYPE_F32) * node->ne[0] * n_tasks;
-                        }
-                    } break;
-                case GGML_OP_ADD:
-                case GGML_OP_ADD1:
-                    {
-                        if (ggml_is_quantized(node->src[0]->type)) {
-                            cur = ggml_type_size(GGML_TYPE_F32) * node->src[0]->ne[0] * n_tasks;
-                        }
-                    } break;
-                case GGML_OP_ACC:
-                    {
-                        if (ggml_is_quantized(node->src[0]->type)) {
-                            cur = ggml_type_size(GGML_TYPE_F32) * node->src[1]->ne[0] * n_tasks;
-                        }
-                    } break;
-                case GGML_OP_COUNT_EQUAL:
-                    {
-                        cur = ggml_type_size(node->type)*n_tasks;
-                    } break;
-                case GGML_OP_MUL_MAT:
-                    {
-                        const enum ggml_type vec_dot_type = type_traits_cpu[node->src[0]->type].vec_dot_type;
+    if (work_size > 0) {
+        work_size += CACHE_LINE_SIZE*(n_threads);
+    }
 
-                        if (node->src[1]->type != vec_dot_type) {
-                            cur = ggml_row_size(vec_dot_type, ggml_nelements(node->src[1]));
-                        }
-                    } break;
-                case GGML_OP_MUL_MAT_ID:
-                    {
-                        cur = 0;
-                        const struct ggml_tensor * src0 = node->src[0];
-                        const struct ggml_tensor * src1 = node->src[1];
-                        const struct ggml_tensor * ids = node->src[2];
-                        const enum ggml_type vec_dot_type = type_traits_cpu[src0->type].vec_dot_type;
-                        const int n_as = src0->ne[2];
-                        // src1
-                        if (src1->type != vec_dot_type) {
-                            cur += ggml_row_size(vec_dot_type, ggml_nelements(src1)) + sizeof(int64_t);
-                        }
-                        // matrix_row_counts
-                        cur += n_as * sizeof(int64_t) + sizeof(int64_t);
-                        // matrix_rows
-                        cur += n_as*ids->ne[0]*ids->ne[1]*sizeof(struct mmid_row_mapping) + sizeof(int64_t);
-                        // atomic_current_chunk
-                        cur += CACHE_LINE_SIZE*n_as + CACHE_LINE_SIZE;
-                    } break;
-                case GGML_OP_OUT_PROD:
-                    {
-                        if (ggml_is_quantized(node->src[0]->type)) {
-                            cur = ggml_type_size(GGML_TYPE_F32) * node->src[0]->ne[0] * n_tasks;
-                        }
-                    } break;
-                case GGML_OP_SOFT_MAX:
-                case GGML_OP_ROPE:
-                case GGML_OP_ROPE_BACK:
-                    {
-                        cur = ggml_type_size(GGML_TYPE_F32) * node->ne[0] * n_tasks;
-                    } break;
-                case GGML_OP_CONV_TRANSPOSE_1D:
-                    {
-                        GGML_ASSERT(node->src[0]->ne[3] == 1);
-                        GGML_ASSERT(node->src[1]->ne[2] == 1);
-                        GGML_ASSERT(node->src[1]->ne[3] == 1);
-
-                        const int64_t ne00 = node->src[0]->ne[0];  // K
-                        const int64_t ne01 = node->src[0]->ne[1];  // Cout
-                        const int64_t ne02 = node->src[0]->ne[2];  // Cin
-                        const int64_t ne10 = node->src[1]->ne[0];  // L
-                        const int64_t ne11 = node->src[1]->ne[1];  // Cin
-
-                        if ((node->src[0]->type == GGML_TYPE_F16 ||
-                             node->src[0]->type == GGML_TYPE_BF16) &&
-                            node->src[1]->type == GGML_TYPE_F32) {
-                            cur += sizeof(ggml_fp16_t)*ne00*ne01*ne02;
-                            cur += sizeof(ggml_fp16_t)*ne10*ne11;
-                        } else if (node->src[0]->type == GGML_TYPE_F32 &&
-                                   node->src[1]->type == GGML_TYPE_F32) {
-                            cur += sizeof(float)*ne00*ne01*ne02;
-                            cur += sizeof(float)*ne10*ne11;
-                        } else {
-                            GGML_ABORT("fatal error");
-                        }
-                    } break;
-                case GGML_OP_CONV_TRANSPOSE_2D:
-                    {
-                        const int64_t ne00 = node->src[0]->ne[0]; // W
-                        const int64_t ne01 = node->src[0]->ne[1]; // H
-                        const int64_t ne02 = node->src[0]->ne[2]; // Channels Out
-                        const int64_t ne03 = node->src[0]->ne[3]; // Channels In
+    cplan.threadpool = threadpool;
+    cplan.n_threads  = MIN(max_tasks, n_threads);
+    cplan.work_size  = work_size;
+    cplan.work_data  = NULL;
 
-                        const int64_t ne10 = node->src[1]->ne[0]; // W
-                        const int64_t ne11 = node->src[1]->ne[1]; // H
-                        const int64_t ne12 = node->src[1]->ne[2]; // Channels In
+    return cplan;
+}
 
-                        cur += sizeof(ggml_fp16_t)*ne00*ne01*ne02*ne03;
-                        cur += sizeof(ggml_fp16_t)*ne10*ne11*ne12;
-                    } break;
-                case GGML_OP_FLASH_ATTN_EXT:
-                    {
-                        const int64_t ne10 = node->src[1]->ne[0]; // DK
-                        const int64_t ne20 = node->src[2]->ne[0]; // DV
+// ops that can overlap with the preceding nodes since the last barrier, as long as they do not depend on them
+// they do not use barriers or shared state of the threadpool, and use at most a per-thread slice of the work buffer
+static bool ggml_graph_node_can_overlap(const struct ggml_tensor * node) {
+    switch (node->op) {
+        case GGML_OP_DUP:
+        case GGML_OP_CPY:
+        case GGML_OP_CONT:
+        case GGML_OP_ADD:
+        case GGML_OP_ADD1:
+        case GGML_OP_SUB:
+        case GGML_OP_MUL:
+        case GGML_OP_DIV:
+        case GGML_OP_SQR:
+        case GGML_OP_SQRT:
+        case GGML_OP_LOG:
+        case GGML_OP_SIN:
+        case GGML_OP_COS:
+        case GGML_OP_SCALE:
+        case GGML_OP_CLAMP:
+        case GGML_OP_CONCAT:
+        case GGML_OP_NORM:
+        case GGML_OP_RMS_NORM:
+        case GGML_OP_L2_NORM:
+        case GGML_OP_GET_ROWS:
+        case GGML_OP_SOFT_MAX:
+        case GGML_OP_ROPE:
+        case GGML_OP_UNARY:
+            return true;
+        default:
+            return false;
+    }
+}
 
-                        cur = sizeof(float)*(1*ne10 + 2*ne20)*n_tasks; // 1x head size K + 2x head size V (per thread)
-                    } break;
-                case GGML_OP_FLASH_ATTN_BACK:
-                    {
-                        const int64_t    D = node->src[0]->ne[0];
-                        const int64_t ne11 = ggml_up(node->src[1]->ne[1], GGML_SOFT_MAX_UNROLL);
-                        const int64_t mxDn = MAX(D, ne11) * 2; // *2 because of S and SM in ggml_compute_forward_flash_attn_back
-                        if (node->src[1]->type == GGML_TYPE_F32) {
-                            cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
-                        } else if (node->src[1]->type == GGML_TYPE_F16) {
-                            cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
-                        } else if (node->src[1]->type == GGML_TYPE_BF16) {
-                            cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
-                            cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
-                        }
-                    } break;
+// nodes that do not compute anything
+static bool ggml_graph_node_is_nop(const struct ggml_tensor * node) {
+    switch (node->op) {
+        case GGML_OP_NONE:
+        case GGML_OP_RESHAPE:
+        case GGML_OP_VIEW:
+        case GGML_OP_PERMUTE:
+        case GGML_OP_TRANSPOSE:
+            return true;
+        default:
+            return ggml_is_empty(node);
+    }
+}
 
-                case GGML_OP_CROSS_ENTROPY_LOSS:
-                    {
-                        cur = ggml_type_size(node->type)*(n_tasks + node->src[0]->ne[0]*n_tasks);
-                    } break;
-                case GGML_OP_COUNT:
-                    {
-                        GGML_ABORT("fatal error");
-                    }
-                default:
-                    break;
+// short sequences of nodes computed by a single kernel, without a barrier or a pass over memory between them
+// a group is computed at the position of its last node, the other nodes of the group are deferred until then
+// the results of all the nodes are still written, since they may be read by later nodes, other graph splits or callbacks
+enum ggml_cpu_fusion {
+    GGML_CPU_FUSION_NONE = 0,
+    GGML_CPU_FUSION_DEFERRED,         // computed with a later node
+    GGML_CPU_FUSION_RMS_NORM_MUL,     // mul(rms_norm(x), w)
+    GGML_CPU_FUSION_ADD_RMS_NORM,     // rms_norm(add(a, b))
+    GGML_CPU_FUSION_ADD_RMS_NORM_MUL, // mul(rms_norm(add(a, b)), w)
+    GGML_CPU_FUSION_SILU_MUL,         // mul(silu(x), y), mul(y, silu(x))
+    GGML_CPU_FUSION_MUL_MAT_ADD,      // add(mul_mat(a, b), bias)
+};
+
+#define GGML_CPU_FUSION_MAX_NODES 3
+
+// max distance between a deferred node and the last node of its group
+#define GGML_CPU_FUSION_MAX_DEFER 4
+
+static bool ggml_cpu_fusion_is_f32_rows(const struct ggml_tensor * t) {
+    return t->type == GGML_TYPE_F32 && t->nb[0] == sizeof(float);
+}
+
+// b is broadcast to the rows of a
+static bool ggml_cpu_fusion_can_broadcast(const struct ggml_tensor * b, const struct ggml_tensor * a) {
+    return ggml_cpu_fusion_is_f32_rows(b) && b->ne[0] == a->ne[0] && ggml_can_repeat(b, a);
+}
+
+static bool ggml_cpu_fusion_is_add(const struct ggml_tensor * t) {
+    return t->op == GGML_OP_ADD &&
+        ggml_cpu_fusion_is_f32_rows(t) && ggml_cpu_fusion_is_f32_rows(t->src[0]) && ggml_are_same_shape(t, t->src[0]) &&
+        ggml_cpu_fusion_can_broadcast(t->src[1], t);
+}
+
+static bool ggml_cpu_fusion_is_rms_norm(const struct ggml_tensor * t) {
+    return t->op == GGML_OP_RMS_NORM && ggml_cpu_fusion_is_f32_rows(t) && ggml_cpu_fusion_is_f32_rows(t->src[0]);
+}
+
+// mul(x, w) with w broadcast to the rows of x
+static bool ggml_cpu_fusion_is_mul_of(const struct ggml_tensor * t, const struct ggml_tensor * x) {
+    return t->op == GGML_OP_MUL && t->src[0] == x &&
+        ggml_cpu_fusion_is_f32_rows(t) && ggml_are_same_shape(t, x) && ggml_cpu_fusion_can_broadcast(t->src[1], t);
+}
+
+static bool ggml_cpu_fusion_is_silu(const struct ggml_tensor * t) {
+    return t->op == GGML_OP_UNARY && ggml_get_unary_op(t) == GGML_UNARY_OP_SILU &&
+        t->type == GGML_TYPE_F32 && t->src[0]->type == GGML_TYPE_F32 &&
+        ggml_is_contiguous_1(t) && ggml_is_contiguous_1(t->src[0]);
+}
+
+static struct ggml_tensor * ggml_cpu_fusion_silu_of(const struct ggml_tensor * mul) {
+    return ggml_cpu_fusion_is_silu(mul->src[0]) ? mul->src[0] : mul->src[1];
+}
+
+static bool ggml_cpu_fusion_match(enum ggml_cpu_fusion fusion, const struct ggml_tensor * node) {
+    switch (fusion) {
+        case GGML_CPU_FUSION_RMS_NORM_MUL:
+            return node->op == GGML_OP_MUL && ggml_cpu_fusion_is_rms_norm(node->src[0]) &&
+                ggml_cpu_fusion_is_mul_of(node, node->src[0]);
+        case GGML_CPU_FUSION_ADD_RMS_NORM:
+            return ggml_cpu_fusion_is_rms_norm(node) && ggml_cpu_fusion_is_add(node->src[0]);
+        case GGML_CPU_FUSION_ADD_RMS_NORM_MUL:
+            return ggml_cpu_fusion_match(GGML_CPU_FUSION_RMS_NORM_MUL, node) &&
+                ggml_cpu_fusion_match(GGML_CPU_FUSION_ADD_RMS_NORM, node->src[0]);
+        case GGML_CPU_FUSION_SILU_MUL:
+            {
+                if (node->op != GGML_OP_MUL || node->type != GGML_TYPE_F32 || !ggml_is_contiguous_1(node)) {
+                    return false;
+                }
+                const struct ggml_tensor * silu = ggml_cpu_fusion_silu_of(node);
+                const struct ggml_tensor * y    = node->src[0] == silu ? node->src[1] : node->src[0];
+                return ggml_cpu_fusion_is_silu(silu) && y->type == GGML_TYPE_F32 && ggml_is_contiguous_1(y) &&
+                    ggml_are_same_shape(node, silu) && ggml_are_same_shape(node, y);
             }
+        case GGML_CPU_FUSION_MUL_MAT_ADD:
+            return node->op == GGML_OP_ADD && node->src[0]->op == GGML_OP_MUL_MAT && ggml_cpu_fusion_is_add(node);
+        default:
+            return false;
+    }
+}
+
+// the nodes of the group computed at node, node being the last one
+static int ggml_cpu_fusion_nodes(enum ggml_cpu_fusion fusion, struct ggml_tensor * node, struct ggml_tensor ** nodes) {
+    switch (fusion) {
+        case GGML_CPU_FUSION_RMS_NORM_MUL:
+        case GGML_CPU_FUSION_ADD_RMS_NORM:
+        case GGML_CPU_FUSION_MUL_MAT_ADD:
+            nodes[0] = node->src[0];
+            nodes[1] = node;
+            return 2;
+        case GGML_CPU_FUSION_ADD_RMS_NORM_MUL:
+            nodes[0] = node->src[0]->src[0];
+            nodes[1] = node->src[0];
+            nodes[2] = node;
+            return 3;
+        case GGML_CPU_FUSION_SILU_MUL:
+            nodes[0] = ggml_cpu_fusion_silu_of(node);
+            nodes[1] = node;
+            return 2;
+        default:
+            nodes[0] = node;
+            return 1;
+    }
+}
+
+static void ggml_compute_forward_fused(struct ggml_compute_params * params, enum ggml_cpu_fusion fusion, struct ggml_tensor * node) {
+    switch (fusion) {
+        case GGML_CPU_FUSION_RMS_NORM_MUL:
+            {
+                ggml_compute_forward_rms_norm_fused(params, NULL, node->src[0], node);
+            } break;
+        case GGML_CPU_FUSION_ADD_RMS_NORM:
+            {
+                ggml_compute_forward_rms_norm_fused(params, node->src[0], node, NULL);
+            } break;
+        case GGML_CPU_FUSION_ADD_RMS_NORM_MUL:
+            {
+                ggml_compute_forward_rms_norm_fused(params, node->src[0]->src[0], node->src[0], node);
+            } break;
+        case GGML_CPU_FUSION_SILU_MUL:
+            {
+                ggml_compute_forward_silu_mul(params, ggml_cpu_fusion_silu_of(node), node);
+            } break;
+        case GGML_CPU_FUSION_MUL_MAT_ADD:
+            {
+                struct ggml_tensor * mm = node->src[0];
+                if (ggml_cpu_extra_compute_forward(params, mm)) {
+                    ggml_barrier(params->threadpool);
+                    ggml_compute_forward_add(params, node);
+                } else {
+                    ggml_compute_forward_mul_mat(params, mm, node);
+                }
+            } break;
+        default:
+            GGML_ABORT("fatal error");
+    }
+}
+
+static void ggml_threadpool_reserve_nodes(struct ggml_threadpool * tp, int n_nodes) {
+    if (tp->n_node_sync < n_nodes) {
+        free(tp->node_sync);
+        free(tp->node_fusion);
+        tp->node_sync   = malloc(n_nodes);
+        tp->node_fusion = malloc(n_nodes);
+        tp->n_node_sync = n_nodes;
+        GGML_ASSERT(tp->node_sync && tp->node_fusion);
+    }
+}
+
+// max number of memory ranges tracked between two barriers
+#define GGML_SYNC_MAX_RANGES 64
+
+struct ggml_sync_range {
+    const char * begin;
+    const char * end;
+};
+
+static bool ggml_sync_range_overlaps(const struct ggml_sync_range * ranges, int n, struct ggml_sync_range r) {
+    for (int i = 0; i < n; i++) {
+        if (r.begin < ranges[i].end && ranges[i].begin < r.end) {
+            return true;
         }
+    }
+    return false;
+}
+
+static struct ggml_sync_range ggml_sync_range_of(const struct ggml_tensor * t) {
+    struct ggml_sync_range r = { (const char *) t->data, (const char *) t->data + ggml_nbytes(t) };
+    return r;
+}
+
+// the nodes between a deferred node and the last node of its group are computed before the deferred node,
+// so they must not read or write memory written by it, or write memory read by it
+static bool ggml_graph_fusion_can_defer(const struct ggml_cgraph * cgraph, const uint8_t * fusion,
+        struct ggml_tensor ** group, const int * idx, int n_group) {
+    for (int g = 0; g < n_group - 1; g++) {
+        const struct ggml_tensor * node = group[g];
+
+        const struct ggml_sync_range w = ggml_sync_range_of(node);
+
+        for (int k = idx[g] + 1; k < idx[n_group - 1]; k++) {
+            const struct ggml_tensor * other = cgraph->nodes[k];
+
+            bool member = false;
+            for (int h = g + 1; h < n_group - 1; h++) {
+                member = member || other == group[h];
+            }
+
+            if (member || fusion[k] == GGML_CPU_FUSION_DEFERRED || ggml_graph_node_is_nop(other)) {
+                continue;
+            }
+
+            const struct ggml_sync_range wo = ggml_sync_range_of(other);
 
-        work_size = MAX(work_size, cur);
+            if (ggml_sync_range_overlaps(&w, 1, wo)) {
+                return false;
+            }
+
+            for (int j = 0; j < GGML_MAX_SRC; j++) {
+                if (other->src[j] && ggml_sync_range_overlaps(&w, 1, ggml_sync_range_of(other->src[j]))) {
+                    return false;
+                }
+                if (node->src[j] && ggml_sync_range_overlaps(&wo, 1, ggml_sync_range_of(node->src[j]))) {
+                    return false;
+                }
+            }
+        }
     }
 
-    if (work_size > 0) {
-        work_size += CACHE_LINE_SIZE*(n_threads);
+    return true;
+}
+
+// finds the groups of nodes computed by a fused kernel, returns the number of deferred nodes
+static int ggml_graph_compute_fusion(struct ggml_threadpool * tp, struct ggml_cgraph * cgraph, bool no_fusion) {
+    static const enum ggml_cpu_fusion candidates[] = {
+        GGML_CPU_FUSION_ADD_RMS_NORM_MUL,
+        GGML_CPU_FUSION_RMS_NORM_MUL,
+        GGML_CPU_FUSION_ADD_RMS_NORM,
+        GGML_CPU_FUSION_SILU_MUL,
+        GGML_CPU_FUSION_MUL_MAT_ADD,
+    };
+
+    uint8_t * fusion = tp->node_fusion;
+
+    memset(fusion, GGML_CPU_FUSION_NONE, cgraph->n_nodes);
+
+    if (no_fusion) {
+        return 0;
     }
 
-    cplan.threadpool = threadpool;
-    cplan.n_threads  = MIN(max_tasks, n_threads);
-    cplan.work_size  = work_size;
-    cplan.work_data  = NULL;
+    int n_fused = 0;
 
-    return cplan;
+    // backwards, so that the longest group ending at a node is found first
+    for (int i = cgraph->n_nodes - 1; i > 0; i--) {
+        struct ggml_tensor * node = cgraph->nodes[i];
+
+        if (fusion[i] != GGML_CPU_FUSION_NONE || ggml_graph_node_is_nop(node)) {
+            continue;
+        }
+
+        for (size_t c = 0; c < sizeof(candidates)/sizeof(candidates[0]); c++) {
+            if (!ggml_cpu_fusion_match(candidates[c], node)) {
+                continue;
+            }
+
+            struct ggml_tensor * group[GGML_CPU_FUSION_MAX_NODES];
+            int idx[GGML_CPU_FUSION_MAX_NODES];
+
+            const int n_group = ggml_cpu_fusion_nodes(candidates[c], node, group);
+
+            idx[n_group - 1] = i;
+
+            bool found = true;
+            for (int g = n_group - 2; g >= 0 && found; g--) {
+                found = false;
+                for (int k = idx[g + 1] - 1; k >= 0 && k >= i - GGML_CPU_FUSION_MAX_DEFER; k--) {
+                    if (cgraph->nodes[k] == group[g]) {
+                        found = fusion[k] == GGML_CPU_FUSION_NONE;
+                        idx[g] = k;
+                        break;
+                    }
+                }
+            }
+
+            if (!found || !ggml_graph_fusion_can_defer(cgraph, fusion, group, idx, n_group)) {
+                continue;
+            }
+
+            for (int g = 0; g < n_group - 1; g++) {
+                fusion[idx[g]] = GGML_CPU_FUSION_DEFERRED;
+            }
+            fusion[i] = candidates[c];
+
+            n_fused += n_group - 1;
+            break;
+        }
+    }
+
+    return n_fused;
+}
+
+// decides before which nodes the threads have to synchronize, returns the number of barriers
+//
+// a node is computed without a barrier after the preceding nodes if it does not read memory they write,
+// does not write memory they read or write, and does not need the work buffer while another of them uses it
+// this mostly removes the barriers around view ops and between independent element-wise ops
+// the nodes of a fused group are handled as a single node at the position of the last one
+static int ggml_graph_compute_sync(struct ggml_threadpool * tp, struct ggml_cgraph * cgraph, int n_threads, bool sync_all) {
+    // memory written and read by the nodes since the last barrier
+    struct ggml_sync_range writes[GGML_SYNC_MAX_RANGES];
+    struct ggml_sync_range reads [GGML_SYNC_MAX_RANGES];
+    int  n_writes = 0;
+    int  n_reads  = 0;
+    bool wdata    = false; // the work buffer is in use
+
+    int n_barriers = 0;
+
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        struct ggml_tensor * node = cgraph->nodes[i];
+
+        const enum ggml_cpu_fusion fusion = (enum ggml_cpu_fusion) tp->node_fusion[i];
+
+        const bool empty = fusion == GGML_CPU_FUSION_DEFERRED || ggml_graph_node_is_nop(node);
+
+        struct ggml_tensor * group[GGML_CPU_FUSION_MAX_NODES];
+        const int n_group = ggml_cpu_fusion_nodes(fusion, node, group);
+
+        bool overlap    = true;
+        bool node_wdata = false;
+
+        for (int g = 0; g < n_group && !empty; g++) {
+            size_t cur = 0;
+            overlap    = overlap && ggml_graph_node_can_overlap(group[g]) && !ggml_cpu_extra_work_size(n_threads, group[g], &cur);
+            node_wdata = node_wdata || ggml_graph_node_work_size(group[g], n_threads) > 0;
+        }
+
+        bool sync = i > 0 && (sync_all || (!empty && !overlap));
+
+        if (!sync && !empty && i > 0) {
+            sync = (node_wdata && wdata) ||
+                n_writes + n_group > GGML_SYNC_MAX_RANGES || n_reads + n_group*GGML_MAX_SRC > GGML_SYNC_MAX_RANGES;
+
+            for (int g = 0; g < n_group && !sync; g++) {
+                const struct ggml_sync_range w = ggml_sync_range_of(group[g]);
+
+                sync = ggml_sync_range_overlaps(writes, n_writes, w) || ggml_sync_range_overlaps(reads, n_reads, w);
+
+                for (int j = 0; j < GGML_MAX_SRC && !sync; j++) {
+                    if (group[g]->src[j]) {
+                        sync = ggml_sync_range_overlaps(writes, n_writes, ggml_sync_range_of(group[g]->src[j]));
+                    }
+                }
+            }
+        }
+
+        if (sync) {
+            n_barriers++;
+            n_writes = 0;
+            n_reads  = 0;
+            wdata    = false;
+        }
+
+        tp->node_sync[i] = sync;
+
+        if (empty) {
+            continue;
+        }
+
+        // nodes that cannot overlap may use the whole work buffer
+        wdata = wdata || !overlap || node_wdata;
+
+        for (int g = 0; g < n_group; g++) {
+            if (n_writes < GGML_SYNC_MAX_RANGES) {
+                writes[n_writes++] = ggml_sync_range_of(group[g]);
+            }
+            for (int j = 0; j < GGML_MAX_SRC; j++) {
+                if (group[g]->src[j] && n_reads < GGML_SYNC_MAX_RANGES) {
+                    reads[n_reads++] = ggml_sync_range_of(group[g]->src[j]);
+                }
+            }
+        }
+    }
+
+    return n_barriers;
 }
 
 static thread_ret_t ggml_graph_compute_thread(void * data) {
@@ -2804,20 +3427,33 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
         /*.threadpool=*/ tp,
     };
 
-    for (int node_n = 0; node_n < cgraph->n_nodes && atomic_load_explicit(&tp->abort, memory_order_relaxed) != node_n; node_n++) {
+    for (int node_n = 0; node_n < cgraph->n_nodes; node_n++) {
         struct ggml_tensor * node = cgraph->nodes[node_n];
 
-        ggml_compute_forward(&params, node);
+        if (tp->node_sync[node_n]) {
+            ggml_barrier(state->threadpool);
+
+            if (atomic_load_explicit(&tp->abort, memory_order_relaxed) == node_n) {
+                break;
+            }
+        }
+
+        const enum ggml_cpu_fusion fusion = (enum ggml_cpu_fusion) tp->node_fusion[node_n];
+
+        if (fusion == GGML_CPU_FUSION_NONE) {
+            ggml_compute_forward(&params, node);
+        } else if (fusion != GGML_CPU_FUSION_DEFERRED) {
+            ggml_compute_forward_fused(&params, fusion, node);
+        }
+
+        // only abort before a barrier, so that all the threads stop at the same node
+        const bool sync_next = node_n + 1 == cgraph->n_nodes || tp->node_sync[node_n + 1];
 
-        if (state->ith == 0 && cplan->abort_callback &&
+        if (state->ith == 0 && sync_next && cplan->abort_callback &&
                 cplan->abort_callback(cplan->abort_callback_data)) {
             atomic_store_explicit(&tp->abort, node_n + 1, memory_order_relaxed);
             tp->ec    = GGML_STATUS_ABORTED;
         }
-
-        if (node_n + 1 < cgraph->n_nodes) {
-            ggml_barrier(state->threadpool);
-        }
     }
 
     ggml_barrier(state->threadpool);
@@ -2994,6 +3630,11 @@ static struct ggml_threadpool * ggml_threadpool_new_impl(
         threadpool->n_threads_cur    = tpp->n_threads;
         threadpool->poll             = tpp->poll;
         threadpool->prio             = tpp->prio;
+        threadpool->node_sync        = NULL;
+        threadpool->node_fusion      = NULL;
+        threadpool->n_node_sync      = 0;
+        threadpool->n_chunk_nodes    = 0;
+        threadpool->n_chunk_steals   = 0;
         threadpool->ec               = GGML_STATUS_SUCCESS;
     }
 
@@ -3005,6 +3646,7 @@ static struct ggml_threadpool * ggml_threadpool_new_impl(
     for (int j = 0; j < tpp->n_threads; j++) {
         workers[j].threadpool = threadpool;
         workers[j].ith        = j;
+        workers[j].numa_node  = ggml_thread_numa_node(j, NULL);
     }
 
     threadpool->workers = workers;
@@ -3020,12 +3662,14 @@ static struct ggml_threadpool * ggml_threadpool_new_impl(
 
     for (int j = 1; j < tpp->n_threads; j++) {
         ggml_thread_cpumask_next(tpp->cpumask, workers[j].cpumask, tpp->strict_cpu, &cpumask_iter);
+        workers[j].numa_node = ggml_thread_numa_node(j, workers[j].cpumask);
 
         int32_t rc = ggml_thread_create(&workers[j].thrd, NULL, ggml_graph_compute_secondary_thread, &workers[j]);
         GGML_ASSERT(rc == 0);
     }
 
     ggml_thread_cpumask_next(tpp->cpumask, workers[0].cpumask, tpp->strict_cpu, &cpumask_iter);
+    workers[0].numa_node = ggml_thread_numa_node(0, workers[0].cpumask);
 
     if (!threadpool->pause) {
         // Update main thread prio and affinity at the start, otherwise we'll do it in resume
@@ -3067,10 +3711,16 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
         threadpool->cgraph           = cgraph;
         threadpool->cplan            = cplan;
         threadpool->current_chunk    = 0;
+        threadpool->n_chunk_steals   = 0;
         threadpool->abort            = -1;
         threadpool->ec               = GGML_STATUS_SUCCESS;
     }
 
+    ggml_threadpool_reserve_nodes(threadpool, cgraph->n_nodes);
+
+    cplan->n_fused    = ggml_graph_compute_fusion(threadpool, cgraph, cplan->no_fusion || g_state.no_fusion);
+    cplan->n_barriers = ggml_graph_compute_sync(threadpool, cgraph, n_threads, cplan->sync_all);
+
 #ifdef GGML_USE_OPENMP
     if (n_threads > 1) {
         #pragma omp parallel num_threads(n_threads)
@@ -3080,12 +3730,14 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
                 // update the number of threads from the actual number of threads that we got from OpenMP
                 n_threads = omp_get_num_threads();
                 atomic_store_explicit(&threadpool->n_threads_cur, n_threads, memory_order_relaxed);
+                ggml_threadpool_chunk_layout(threadpool, n_threads);
             }
 
             ggml_graph_compute_thread(&threadpool->workers[omp_get_thread_num()]);
         }
     } else {
         atomic_store_explicit(&threadpool->n_threads_cur, 1, memory_order_relaxed);
+        ggml_threadpool_chunk_layout(threadpool, 1);
         ggml_graph_compute_thread(&threadpool->workers[0]);
     }
 #else
@@ -3094,6 +3746,8 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
         n_threads = threadpool->n_threads_max;
     }
 
+    ggml_threadpool_chunk_layout(threadpool, n_threads);
+
     // Kick all threads to start the new graph
     ggml_graph_compute_kickoff(threadpool, n_threads);
 
@@ -3106,6 +3760,8 @@ enum ggml_status ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cpl
 
     enum ggml_status ret = threadpool->ec;
 
+    cplan->n_chunk_steals = atomic_load_explicit(&threadpool->n_chunk_steals, memory_order_relaxed);
+
     if (disposable_threadpool) {
         ggml_threadpool_free(threadpool);
     }
@@ -3466,6 +4122,13 @@ void ggml_cpu_init(void) {
         ggml_init_arm_arch_features();
 #endif
 
+        g_state.no_fusion = getenv("GGML_CPU_NO_FUSION") != NULL;
+
+        const char * n_chunk_queues = getenv("GGML_CPU_CHUNK_QUEUES");
+        if (n_chunk_queues) {
+            g_state.n_chunk_queues = MIN(MAX(atoi(n_chunk_queues), 0), GGML_NUMA_MAX_NODES);
+        }
+
         is_first_call = false;
     }
 
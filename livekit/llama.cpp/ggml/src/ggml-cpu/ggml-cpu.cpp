@@ -80,6 +80,18 @@ static bool ggml_backend_cpu_is_extra_buffer_type(ggml_backend_buffer_type_t buf
     return false;
 }
 
+static ggml_backend_buffer_t ggml_backend_cpu_extra_buffer_from_ptr(ggml_backend_buffer_type_t buft, void * ptr, size_t size) {
+    if (!ggml_backend_cpu_is_extra_buffer_type(buft)) {
+        return nullptr;
+    }
+
+    auto * buf_extra = (ggml::cpu::extra_buffer_type *) buft->context;
+    if (!buf_extra) {
+        return nullptr;
+    }
+    return buf_extra->buffer_from_ptr(buft, ptr, size);
+}
+
 // CPU backend - backend (stream)
 
 struct ggml_backend_cpu_context {
@@ -619,6 +631,10 @@ static void * ggml_backend_cpu_get_proc_address(ggml_backend_reg_t reg, const ch
         ggml_backend_dev_get_extra_bufts_t fct = ggml_backend_cpu_device_get_extra_buffers_type;
         return (void *)fct;
     }
+    if (strcmp(name, "ggml_backend_extra_buffer_from_ptr") == 0) {
+        ggml_backend_extra_buffer_from_ptr_t fct = ggml_backend_cpu_extra_buffer_from_ptr;
+        return (void *)fct;
+    }
     if (strcmp(name, "ggml_backend_get_features") == 0) {
         return (void *)ggml_backend_cpu_get_features;
     }
@@ -2938,6 +2938,45 @@ static void ggml_compute_forward_silu_f32(
     }
 }
 
+// silu fused with the mul of its result, see ggml_graph_compute_fusion
+// the result of the silu is written too
+void ggml_compute_forward_silu_mul(
+        const ggml_compute_params * params,
+        ggml_tensor * silu,
+        ggml_tensor * dst) {
+
+    const ggml_tensor * src0 = silu->src[0];
+    const ggml_tensor * src1 = dst->src[0] == silu ? dst->src[1] : dst->src[0];
+
+    GGML_ASSERT(dst->src[0] == silu || dst->src[1] == silu);
+    GGML_ASSERT(ggml_is_contiguous_1(src0) && ggml_is_contiguous_1(src1));
+    GGML_ASSERT(ggml_is_contiguous_1(silu) && ggml_is_contiguous_1(dst));
+    GGML_ASSERT(ggml_are_same_shape(src0, dst) && ggml_are_same_shape(src1, dst));
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int nc = src0->ne[0];
+    const int nr = ggml_nrows(src0);
+
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
+
+    for (int i1 = ir0; i1 < ir1; i1++) {
+        float * s = (float *) ((char *) silu->data + i1*(silu->nb[1]));
+
+        ggml_vec_silu_f32(nc, s, (float *) ((char *) src0->data + i1*(src0->nb[1])));
+
+        ggml_vec_mul_f32(nc,
+                (float *) ((char *) dst->data  + i1*( dst->nb[1])), s,
+                (float *) ((char *) src1->data + i1*(src1->nb[1])));
+    }
+}
+
 static void ggml_compute_forward_silu_f16(
     const ggml_compute_params * params,
     ggml_tensor * dst) {
@@ -3333,6 +3372,77 @@ void ggml_compute_forward_rms_norm(
     }
 }
 
+// rms_norm fused with the add computing its input and the mul of its result, see ggml_graph_compute_fusion
+// add and mul are optional, the results of all the nodes are written
+void ggml_compute_forward_rms_norm_fused(
+        const ggml_compute_params * params,
+        ggml_tensor * add,
+        ggml_tensor * dst,
+        ggml_tensor * mul) {
+
+    const ggml_tensor * src0 = dst->src[0];
+
+    GGML_ASSERT(!add || add == src0);
+    GGML_ASSERT(!mul || mul->src[0] == dst);
+    GGML_ASSERT(src0->type == GGML_TYPE_F32 && dst->type == GGML_TYPE_F32);
+    GGML_ASSERT(src0->nb[0] == sizeof(float));
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    GGML_TENSOR_UNARY_OP_LOCALS
+
+    float eps;
+    memcpy(&eps, dst->op_params, sizeof(float));
+
+    GGML_ASSERT(eps >= 0.0f);
+
+    for (int64_t i03 = 0; i03 < ne03; i03++) {
+        for (int64_t i02 = 0; i02 < ne02; i02++) {
+            for (int64_t i01 = ith; i01 < ne01; i01 += nth) {
+                float * x = (float *) ((char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03);
+
+                if (add) {
+                    const ggml_tensor * a = add->src[0];
+                    const ggml_tensor * b = add->src[1];
+
+                    const float * xa = (const float *) ((const char *) a->data + i01*a->nb[1] + i02*a->nb[2] + i03*a->nb[3]);
+                    const float * xb = (const float *) ((const char *) b->data +
+                            (i01 % b->ne[1])*b->nb[1] + (i02 % b->ne[2])*b->nb[2] + (i03 % b->ne[3])*b->nb[3]);
+
+                    ggml_vec_add_f32(ne00, x, xa, xb);
+                }
+
+                ggml_float sum = 0.0;
+                for (int64_t i00 = 0; i00 < ne00; i00++) {
+                    sum += (ggml_float)(x[i00] * x[i00]);
+                }
+
+                const float mean = sum/ne00;
+
+                float * y = (float *) ((char *) dst->data + i01*nb1 + i02*nb2 + i03*nb3);
+
+                memcpy(y, x, ne00 * sizeof(float));
+
+                const float scale = 1.0f/sqrtf(mean + eps);
+
+                ggml_vec_scale_f32(ne00, y, scale);
+
+                if (mul) {
+                    const ggml_tensor * w = mul->src[1];
+
+                    const float * xw = (const float *) ((const char *) w->data +
+                            (i01 % w->ne[1])*w->nb[1] + (i02 % w->ne[2])*w->nb[2] + (i03 % w->ne[3])*w->nb[3]);
+
+                    float * z = (float *) ((char *) mul->data + i01*mul->nb[1] + i02*mul->nb[2] + i03*mul->nb[3]);
+
+                    ggml_vec_mul_f32(ne00, z, y, xw);
+                }
+            }
+        }
+    }
+}
+
 static void ggml_compute_forward_rms_norm_back_f32(
         const ggml_compute_params * params,
         ggml_tensor * dst) {
@@ -7012,13 +7122,21 @@ void ggml_compute_forward_argsort(
 
 // ggml_compute_forward_flash_attn_ext
 
-static void ggml_compute_forward_flash_attn_ext_f16(
-        const ggml_compute_params * params,
+// online softmax over the KV range [ic0, ic1) of q row ir
+// on return VKQ32 holds the unnormalized FP32 output, M the maximum KQ value and S the sum of expf(KQ - M)
+// wdata is the thread's scratch buffer of (1*DK + 2*DV) floats, VKQ32 points to its beginning
+static void ggml_compute_forward_flash_attn_ext_f16_one_chunk(
         const ggml_tensor * q,
         const ggml_tensor * k,
         const ggml_tensor * v,
         const ggml_tensor * mask,
-        ggml_tensor * dst) {
+        const ggml_tensor * dst,
+        float * wdata,
+        int64_t ir,
+        int64_t ic0,
+        int64_t ic1,
+        float * M_out,
+        float * S_out) {
 
     GGML_TENSOR_LOCALS(int64_t, neq, q,   ne)
     GGML_TENSOR_LOCALS(size_t,  nbq, q,   nb)
@@ -7026,35 +7144,9 @@ static void ggml_compute_forward_flash_attn_ext_f16(
     GGML_TENSOR_LOCALS(size_t,  nbk, k,   nb)
     GGML_TENSOR_LOCALS(int64_t, nev, v,   ne)
     GGML_TENSOR_LOCALS(size_t,  nbv, v,   nb)
-    GGML_TENSOR_LOCALS(int64_t, ne,  dst, ne)
-    GGML_TENSOR_LOCALS(size_t,  nb,  dst, nb)
-
-    const int ith = params->ith;
-    const int nth = params->nth;
 
     const int64_t DK = nek0;
     const int64_t DV = nev0;
-    const int64_t N  = neq1;
-
-    GGML_ASSERT(ne0 == DV);
-    GGML_ASSERT(ne2 == N);
-
-    // input tensor rows must be contiguous
-    GGML_ASSERT(nbq0 == ggml_type_size(q->type));
-    GGML_ASSERT(nbk0 == ggml_type_size(k->type));
-    GGML_ASSERT(nbv0 == ggml_type_size(v->type));
-
-    GGML_ASSERT(neq0 == DK);
-    GGML_ASSERT(nek0 == DK);
-    GGML_ASSERT(nev0 == DV);
-
-    GGML_ASSERT(neq1 == N);
-
-    // dst cannot be transposed or permuted
-    GGML_ASSERT(nb0 == sizeof(float));
-    GGML_ASSERT(nb0 <= nb1);
-    GGML_ASSERT(nb1 <= nb2);
-    GGML_ASSERT(nb2 <= nb3);
 
     // broadcast factors
     const int64_t rk2 = neq2/nek2;
@@ -7063,25 +7155,13 @@ static void ggml_compute_forward_flash_attn_ext_f16(
     const int64_t rv2 = neq2/nev2;
     const int64_t rv3 = neq3/nev3;
 
-    // parallelize by q rows using ggml_vec_dot_f32
-
-    // total rows in q
-    const int nr = neq1*neq2*neq3;
-
-    // rows per thread
-    const int dr = (nr + nth - 1)/nth;
-
-    // row range for this thread
-    const int ir0 = dr*ith;
-    const int ir1 = MIN(ir0 + dr, nr);
-
     float scale         = 1.0f;
     float max_bias      = 0.0f;
     float logit_softcap = 0.0f;
 
-    memcpy(&scale,         (float *) dst->op_params + 0, sizeof(float));
-    memcpy(&max_bias,      (float *) dst->op_params + 1, sizeof(float));
-    memcpy(&logit_softcap, (float *) dst->op_params + 2, sizeof(float));
+    memcpy(&scale,         (const float *) dst->op_params + 0, sizeof(float));
+    memcpy(&max_bias,      (const float *) dst->op_params + 1, sizeof(float));
+    memcpy(&logit_softcap, (const float *) dst->op_params + 2, sizeof(float));
 
     if (logit_softcap != 0) {
         scale /= logit_softcap;
@@ -7101,133 +7181,289 @@ static void ggml_compute_forward_flash_attn_ext_f16(
     GGML_ASSERT((                            q_to_vec_dot) && "fattn: unsupported K-type");
     GGML_ASSERT((v->type == GGML_TYPE_F32 || v_to_float  ) && "fattn: unsupported V-type");
 
-    // loop over n_batch and n_head
-    for (int ir = ir0; ir < ir1; ++ir) {
-        // q indices
-        const int iq3 = ir/(neq2*neq1);
-        const int iq2 = (ir - iq3*neq2*neq1)/neq1;
-        const int iq1 = (ir - iq3*neq2*neq1 - iq2*neq1);
+    // q indices
+    const int iq3 = ir/(neq2*neq1);
+    const int iq2 = (ir - iq3*neq2*neq1)/neq1;
+    const int iq1 = (ir - iq3*neq2*neq1 - iq2*neq1);
 
-        const uint32_t h = iq2; // head index
-        const float slope = (max_bias > 0.0f) ? h < n_head_log2 ? powf(m0, h + 1) : powf(m1, 2*(h - n_head_log2) + 1) : 1.0f;
+    const uint32_t h = iq2; // head index
+    const float slope = (max_bias > 0.0f) ? h < n_head_log2 ? powf(m0, h + 1) : powf(m1, 2*(h - n_head_log2) + 1) : 1.0f;
+
+    float S = 0.0f;      // sum
+    float M = -INFINITY; // maximum KQ value
+
+    float       * VKQ32 = wdata;                          // FP32 VKQ accumulator
+    float       * V32   =                 (VKQ32 + 1*DV); // (temporary) FP32 V buffer
+    ggml_fp16_t * VKQ16 = (ggml_fp16_t *) (VKQ32 + 1*DV); // (temporary) FP16 VKQ accumulator
+    ggml_fp16_t * Q_q   = (ggml_fp16_t *) (VKQ32 + 2*DV); // (temporary) buffer for Q converted to quantized/FP16
 
-        float S = 0.0f;      // sum
-        float M = -INFINITY; // maximum KQ value
+    if (v->type == GGML_TYPE_F16) {
+        memset(VKQ16, 0, DV*sizeof(ggml_fp16_t));
+    } else {
+        memset(VKQ32, 0, DV*sizeof(float));
+    }
+
+    const ggml_fp16_t * mp = mask ? (ggml_fp16_t *)((char *) mask->data + iq1*mask->nb[1]) : NULL;
+
+    // k indices
+    const int ik3 = iq3 / rk3;
+    const int ik2 = iq2 / rk2;
+
+    // v indices
+    const int iv3 = iq3 / rv3;
+    const int iv2 = iq2 / rv2;
+
+    const float * pq = (const float *) ((char *) q->data + (iq1*nbq1 + iq2*nbq2 + iq3*nbq3));
+    q_to_vec_dot(pq, Q_q, DK);
+
+    // online softmax / attention
+    // loop over n_kv and n_head_kv
+    // ref: https://arxiv.org/pdf/2112.05682.pdf
+    for (int64_t ic = ic0; ic < ic1; ++ic) {
+        const float mv = mp ? slope*GGML_FP16_TO_FP32(mp[ic]) : 0.0f;
+        if (mv == -INFINITY) {
+            continue;
+        }
+
+        float s; // KQ value
+
+        const char * k_data = (const char *) k->data + ( ic*nbk1 + ik2*nbk2 + ik3*nbk3);
+        kq_vec_dot(DK, &s, 0, k_data, 0, Q_q, 0, 1);
+
+        s = s*scale; // scale KQ value
+
+        if (logit_softcap != 0.0f) {
+            s = logit_softcap*tanhf(s);
+        }
+
+        s += mv; // apply mask
+
+        const float Mold = M;
 
-        float       * VKQ32 = (float       *) params->wdata + ith*(1*DK + 2*DV + CACHE_LINE_SIZE_F32); // FP32 VKQ accumulator
-        float       * V32   =                 (VKQ32 + 1*DV); // (temporary) FP32 V buffer
-        ggml_fp16_t * VKQ16 = (ggml_fp16_t *) (VKQ32 + 1*DV); // (temporary) FP16 VKQ accumulator
-        ggml_fp16_t * Q_q   = (ggml_fp16_t *) (VKQ32 + 2*DV); // (temporary) buffer for Q converted to quantized/FP16
+        float ms = 1.0f; // upon new higher max val, scale VKQ and KQ sum with this value
+        float vs = 1.0f; // post-softmax KQ value, expf(s - M)
+
+        const char * v_data = ((const char *) v->data + (ic*nbv1 + iv2*nbv2 + iv3*nbv3));
 
         if (v->type == GGML_TYPE_F16) {
-            memset(VKQ16, 0, DV*sizeof(ggml_fp16_t));
+            if (s > M) {
+                // s is new maximum, ms < 1.0f, vs == expf(s - s) == 1.0f
+                M = s;
+                ms = expf(Mold - M);
+
+                // V = V*expf(Mold - M)
+                ggml_vec_scale_f16(DV, VKQ16, ms);
+            } else {
+                // no new maximum, ms == 1.0f, vs != 1.0f
+                vs = expf(s - M);
+            }
+
+            // V += v*expf(s - M)
+            ggml_vec_mad_f16(DV, VKQ16, (const ggml_fp16_t *) v_data, vs);
         } else {
-            memset(VKQ32, 0, DV*sizeof(float));
+            if (s > M) {
+                // s is new maximum, ms < 1.0f, vs == expf(s - s) == 1.0f
+                M = s;
+                ms = expf(Mold - M);
+
+                // V = V*expf(Mold - M)
+                ggml_vec_scale_f32(DV, VKQ32, ms);
+            } else {
+                // no new maximum, ms == 1.0f, vs != 1.0f
+                vs = expf(s - M);
+            }
+
+            // V += v*expf(s - M)
+            if (v_to_float) {
+                v_to_float(v_data, V32, DV);
+                ggml_vec_mad_f32(DV, VKQ32, V32, vs);
+            } else {
+                // V is F32
+                ggml_vec_mad_f32(DV, VKQ32, (const float *) v_data, vs);
+            }
         }
 
-        const ggml_fp16_t * mp = mask ? (ggml_fp16_t *)((char *) mask->data + iq1*mask->nb[1]) : NULL;
+        S = S*ms + vs; // scale and increment sum with partial sum
+    }
 
-        // k indices
-        const int ik3 = iq3 / rk3;
-        const int ik2 = iq2 / rk2;
+    if (v->type == GGML_TYPE_F16) {
+        for (int64_t d = 0; d < DV; ++d) {
+            VKQ32[d] = GGML_FP16_TO_FP32(VKQ16[d]);
+        }
+    }
 
-        // v indices
-        const int iv3 = iq3 / rv3;
-        const int iv2 = iq2 / rv2;
+    *M_out = M;
+    *S_out = S;
+}
 
-        const float * pq = (const float *) ((char *) q->data + (iq1*nbq1 + iq2*nbq2 + iq3*nbq3));
-        q_to_vec_dot(pq, Q_q, DK);
+// writes the normalized output of q row ir
+static void ggml_compute_forward_flash_attn_ext_f16_write_row(
+        const ggml_tensor * q,
+        ggml_tensor * dst,
+        int64_t ir,
+        float * VKQ32,
+        float S) {
+    const int64_t neq1 = q->ne[1];
+    const int64_t neq2 = q->ne[2];
 
-        // online softmax / attention
-        // loop over n_kv and n_head_kv
-        // ref: https://arxiv.org/pdf/2112.05682.pdf
-        for (int64_t ic = 0; ic < nek1; ++ic) {
-            const float mv = mp ? slope*GGML_FP16_TO_FP32(mp[ic]) : 0.0f;
-            if (mv == -INFINITY) {
-                continue;
-            }
+    const int64_t DV = dst->ne[0];
 
-            float s; // KQ value
+    // V /= S
+    const float S_inv = 1.0f/S;
+    ggml_vec_scale_f32(DV, VKQ32, S_inv);
 
-            const char * k_data = (const char *) k->data + ( ic*nbk1 + ik2*nbk2 + ik3*nbk3);
-            kq_vec_dot(DK, &s, 0, k_data, 0, Q_q, 0, 1);
+    // dst indices
+    const int i3 = ir/(neq2*neq1);
+    const int i2 = (ir - i3*neq2*neq1)/neq1;
+    const int i1 = (ir - i3*neq2*neq1 - i2*neq1);
 
-            s = s*scale; // scale KQ value
+    // original
+    //memcpy((char *) dst->data + (i1*nb1 + i2*nb2 + i3*nb3), V, nev0*sizeof(float));
 
-            if (logit_softcap != 0.0f) {
-                s = logit_softcap*tanhf(s);
-            }
+    // permute(0, 2, 1, 3)
+    memcpy((char *) dst->data + (i3*dst->ne[2]*dst->ne[1] + i2 + i1*dst->ne[1])*dst->nb[1], VKQ32, dst->nb[1]);
+}
 
-            s += mv; // apply mask
+int64_t ggml_flash_attn_ext_n_kv_chunks(const ggml_tensor * dst, int n_threads) {
+    const ggml_tensor * q = dst->src[0];
+    const ggml_tensor * k = dst->src[1];
 
-            const float Mold = M;
+    // total rows in q
+    const int64_t nr = q->ne[1]*q->ne[2]*q->ne[3];
 
-            float ms = 1.0f; // upon new higher max val, scale VKQ and KQ sum with this value
-            float vs = 1.0f; // post-softmax KQ value, expf(s - M)
+    if (nr >= n_threads) {
+        return 1;
+    }
 
-            const char * v_data = ((const char *) v->data + (ic*nbv1 + iv2*nbv2 + iv3*nbv3));
+    // each thread processes one chunk of every row, unless the chunks would be too small
+    return MAX(1, MIN(n_threads, k->ne[1]/GGML_FA_MIN_KV_CHUNK));
+}
 
-            if (v->type == GGML_TYPE_F16) {
-                if (s > M) {
-                    // s is new maximum, ms < 1.0f, vs == expf(s - s) == 1.0f
-                    M = s;
-                    ms = expf(Mold - M);
+static void ggml_compute_forward_flash_attn_ext_f16(
+        const ggml_compute_params * params,
+        const ggml_tensor * q,
+        const ggml_tensor * k,
+        const ggml_tensor * v,
+        const ggml_tensor * mask,
+        ggml_tensor * dst) {
 
-                    // V = V*expf(Mold - M)
-                    ggml_vec_scale_f16(DV, VKQ16, ms);
-                } else {
-                    // no new maximum, ms == 1.0f, vs != 1.0f
-                    vs = expf(s - M);
-                }
+    GGML_TENSOR_LOCALS(int64_t, neq, q,   ne)
+    GGML_TENSOR_LOCALS(size_t,  nbq, q,   nb)
+    GGML_TENSOR_LOCALS(int64_t, nek, k,   ne)
+    GGML_TENSOR_LOCALS(size_t,  nbk, k,   nb)
+    GGML_TENSOR_LOCALS(int64_t, nev, v,   ne)
+    GGML_TENSOR_LOCALS(size_t,  nbv, v,   nb)
+    GGML_TENSOR_LOCALS(int64_t, ne,  dst, ne)
+    GGML_TENSOR_LOCALS(size_t,  nb,  dst, nb)
 
-                // V += v*expf(s - M)
-                ggml_vec_mad_f16(DV, VKQ16, (const ggml_fp16_t *) v_data, vs);
-            } else {
-                if (s > M) {
-                    // s is new maximum, ms < 1.0f, vs == expf(s - s) == 1.0f
-                    M = s;
-                    ms = expf(Mold - M);
+    const int ith = params->ith;
+    const int nth = params->nth;
 
-                    // V = V*expf(Mold - M)
-                    ggml_vec_scale_f32(DV, VKQ32, ms);
-                } else {
-                    // no new maximum, ms == 1.0f, vs != 1.0f
-                    vs = expf(s - M);
-                }
+    const int64_t DK = nek0;
+    const int64_t DV = nev0;
+    const int64_t N  = neq1;
 
-                // V += v*expf(s - M)
-                if (v_to_float) {
-                    v_to_float(v_data, V32, DV);
-                    ggml_vec_mad_f32(DV, VKQ32, V32, vs);
-                } else {
-                    // V is F32
-                    ggml_vec_mad_f32(DV, VKQ32, (const float *) v_data, vs);
-                }
-            }
+    GGML_ASSERT(ne0 == DV);
+    GGML_ASSERT(ne2 == N);
+
+    // input tensor rows must be contiguous
+    GGML_ASSERT(nbq0 == ggml_type_size(q->type));
+    GGML_ASSERT(nbk0 == ggml_type_size(k->type));
+    GGML_ASSERT(nbv0 == ggml_type_size(v->type));
+
+    GGML_ASSERT(neq0 == DK);
+    GGML_ASSERT(nek0 == DK);
+    GGML_ASSERT(nev0 == DV);
+
+    GGML_ASSERT(neq1 == N);
+
+    // dst cannot be transposed or permuted
+    GGML_ASSERT(nb0 == sizeof(float));
+    GGML_ASSERT(nb0 <= nb1);
+    GGML_ASSERT(nb1 <= nb2);
+    GGML_ASSERT(nb2 <= nb3);
 
-            S = S*ms + vs; // scale and increment sum with partial sum
+    // total rows in q
+    const int64_t nr = neq1*neq2*neq3;
+
+    float * wdata = (float *) params->wdata + ith*(1*DK + 2*DV + CACHE_LINE_SIZE_F32);
+
+    const int64_t n_chunks = ggml_flash_attn_ext_n_kv_chunks(dst, nth);
+
+    if (n_chunks == 1) {
+        // parallelize by q rows using ggml_vec_dot_f32
+
+        // rows per thread
+        const int64_t dr = (nr + nth - 1)/nth;
+
+        // row range for this thread
+        const int64_t ir0 = dr*ith;
+        const int64_t ir1 = MIN(ir0 + dr, nr);
+
+        // loop over n_batch and n_head
+        for (int64_t ir = ir0; ir < ir1; ++ir) {
+            float M;
+            float S;
+            ggml_compute_forward_flash_attn_ext_f16_one_chunk(q, k, v, mask, dst, wdata, ir, 0, nek1, &M, &S);
+            ggml_compute_forward_flash_attn_ext_f16_write_row(q, dst, ir, wdata, S);
         }
 
-        if (v->type == GGML_TYPE_F16) {
-            for (int64_t d = 0; d < DV; ++d) {
-                VKQ32[d] = GGML_FP16_TO_FP32(VKQ16[d]);
-            }
+        return;
+    }
+
+    // split-KV: fewer rows than threads (e.g. single token decode), so each thread processes a chunk of the KV
+    // sequence of every row, and the partial results are combined after a barrier
+    // ref: https://crfm.stanford.edu/2023/10/12/flashdecoding.html
+
+    // partial results after the per-thread buffers, [M, S, VKQ32] for each chunk of each row
+    float * partials = (float *) params->wdata + nth*(1*DK + 2*DV + CACHE_LINE_SIZE_F32);
+
+    const int64_t n_partial = 2 + DV;
+
+    // KV elements per chunk
+    const int64_t dc = (nek1 + n_chunks - 1)/n_chunks;
+
+    for (int64_t i = ith; i < nr*n_chunks; i += nth) {
+        const int64_t ir = i/n_chunks;
+        const int64_t ic = i%n_chunks;
+
+        const int64_t ic0 = dc*ic;
+        const int64_t ic1 = MIN(ic0 + dc, nek1);
+
+        float * partial = partials + i*n_partial;
+
+        ggml_compute_forward_flash_attn_ext_f16_one_chunk(q, k, v, mask, dst, wdata, ir, ic0, ic1, &partial[0], &partial[1]);
+        memcpy(partial + 2, wdata, DV*sizeof(float));
+    }
+
+    ggml_barrier(params->threadpool);
+
+    // log-sum-exp reduction of the chunks of each row
+    for (int64_t ir = ith; ir < nr; ir += nth) {
+        const float * partial = partials + ir*n_chunks*n_partial;
+
+        float M = -INFINITY;
+        for (int64_t ic = 0; ic < n_chunks; ++ic) {
+            M = MAX(M, partial[ic*n_partial]);
         }
 
-        // V /= S
-        const float S_inv = 1.0f/S;
-        ggml_vec_scale_f32(DV, VKQ32, S_inv);
+        float S = 0.0f;
+        memset(wdata, 0, DV*sizeof(float));
 
-        // dst indices
-        const int i1 = iq1;
-        const int i2 = iq2;
-        const int i3 = iq3;
+        for (int64_t ic = 0; ic < n_chunks; ++ic) {
+            const float * p = partial + ic*n_partial;
+            if (p[0] == -INFINITY) {
+                // fully masked chunk
+                continue;
+            }
+
+            const float ms = expf(p[0] - M);
 
-        // original
-        //memcpy((char *) dst->data + (i1*nb1 + i2*nb2 + i3*nb3), V, nev0*sizeof(float));
+            S += p[1]*ms;
+            ggml_vec_mad_f32(DV, wdata, p + 2, ms);
+        }
 
-        // permute(0, 2, 1, 3)
-        memcpy((char *) dst->data + (i3*ne2*ne1 + i2 + i1*ne1)*nb1, VKQ32, nb1);
+        ggml_compute_forward_flash_attn_ext_f16_write_row(q, dst, ir, wdata, S);
     }
 }
 
@@ -40,6 +40,8 @@ void ggml_compute_forward_silu_back(const struct ggml_compute_params * params, s
 void ggml_compute_forward_norm(const struct ggml_compute_params * params, struct ggml_tensor * dst);
 void ggml_compute_forward_rms_norm(const struct ggml_compute_params * params, struct ggml_tensor * dst);
 void ggml_compute_forward_rms_norm_back(const struct ggml_compute_params * params, struct ggml_tensor * dst);
+void ggml_compute_forward_rms_norm_fused(const struct ggml_compute_params * params, struct ggml_tensor * add, struct ggml_tensor * dst, struct ggml_tensor * mul);
+void ggml_compute_forward_silu_mul(const struct ggml_compute_params * params, struct ggml_tensor * silu, struct ggml_tensor * dst);
 void ggml_compute_forward_group_norm(const struct ggml_compute_params * params, struct ggml_tensor * dst);
 void ggml_compute_forward_l2_norm(const struct ggml_compute_params * params, struct ggml_tensor * dst);
 void ggml_compute_forward_out_prod(const struct ggml_compute_params * params, struct ggml_tensor * dst);
@@ -84,6 +86,13 @@ void ggml_compute_forward_flash_attn_ext(
     const struct ggml_tensor * v,
     const struct ggml_tensor * mask,
     struct ggml_tensor * dst);
+
+// minimum number of KV elements per chunk when the KV sequence is split between threads
+#define GGML_FA_MIN_KV_CHUNK 256
+
+// number of chunks the KV sequence of a GGML_OP_FLASH_ATTN_EXT node is split into with n_threads
+int64_t ggml_flash_attn_ext_n_kv_chunks(const struct ggml_tensor * dst, int n_threads);
+
 void ggml_compute_forward_flash_attn_back(
         const struct ggml_compute_params * params,
         const bool masked,
@@ -1549,6 +1549,22 @@ class extra_buffer_type : ggml::cpu::extra_buffer_type {
         }
         return nullptr;
     }
+
+    ggml_backend_buffer_t buffer_from_ptr(ggml_backend_buffer_type_t buft, void * ptr, size_t size) override {
+        ggml_backend_buffer_t buffer = ggml_backend_cpu_buffer_from_ptr(ptr, size);
+
+        if (buffer == nullptr) {
+            return nullptr;
+        }
+
+        // the tensors are already repacked, init_tensor only selects the kernels matching their layout
+        buffer->buft              = buft;
+        buffer->iface.init_tensor = ggml_backend_cpu_repack_buffer_init_tensor;
+        buffer->iface.set_tensor  = ggml_backend_cpu_repack_buffer_set_tensor;
+        buffer->iface.get_tensor  = nullptr;
+        buffer->iface.cpy_tensor  = nullptr;
+        return buffer;
+    }
 };
 }  // namespace ggml::cpu::repack
 
@@ -29,6 +29,14 @@ class extra_buffer_type {
     virtual ~extra_buffer_type();
     virtual bool            supports_op(ggml_backend_dev_t dev, const struct ggml_tensor * op) = 0;
     virtual tensor_traits * get_tensor_traits(const struct ggml_tensor * op)                   = 0;
+
+    // buffer over memory that already holds tensors in the layout of this buffer type, nullptr if not supported
+    virtual ggml_backend_buffer_t buffer_from_ptr(ggml_backend_buffer_type_t buft, void * ptr, size_t size) {
+        GGML_UNUSED(buft);
+        GGML_UNUSED(ptr);
+        GGML_UNUSED(size);
+        return nullptr;
+    }
 };
 }  // namespace ggml::cpu
 
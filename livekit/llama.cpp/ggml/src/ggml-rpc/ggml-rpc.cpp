@@ -3,7 +3,9 @@
 #include "ggml-backend-impl.h"
 #include "ggml-cpp.h"
 
+#include <algorithm>
 #include <cinttypes>
+#include <deque>
 #include <string>
 #include <vector>
 #include <memory>
@@ -29,6 +31,9 @@
 #include <cstring>
 #include <fstream>
 #include <filesystem>
+#ifdef GGML_RPC_LZ4
+#  include <lz4.h>
+#endif
 
 namespace fs = std::filesystem;
 
@@ -39,9 +44,32 @@ using ssize_t = __int64;
 typedef int sockfd_t;
 #endif
 
+// request sent by the client whose response has not been received yet
+struct rpc_pending_rsp {
+    uint32_t id;
+    uint8_t  cmd;
+    void *   output;
+    size_t   output_size;
+};
+
+// graph that the server keeps, see RPC_CMD_GRAPH_RECOMPUTE
+struct rpc_cached_graph {
+    uint64_t             hash;
+    std::vector<uint8_t> data; // serialized graph
+};
+
 // cross-platform socket
 struct socket_t {
     sockfd_t fd;
+
+    // client-side state of the connection
+    std::mutex                    mutex;
+    uint32_t                      next_id      = 0;
+    uint32_t                      features     = 0;
+    std::deque<rpc_pending_rsp>   pending;
+    std::vector<rpc_cached_graph> graphs;                           // most recently used first
+    int                           graph_status = GGML_STATUS_SUCCESS; // first error of the pending graph computations
+
     socket_t(sockfd_t fd) : fd(fd) {}
     ~socket_t() {
         GGML_PRINT_DEBUG("[%s] closing socket %d\n", __func__, this->fd);
@@ -96,18 +124,39 @@ enum rpc_cmd {
     RPC_CMD_INIT_TENSOR,
     RPC_CMD_GET_ALLOC_SIZE,
     RPC_CMD_HELLO,
+    RPC_CMD_GET_FEATURES,
+    RPC_CMD_SET_TENSOR_LZ4,
+    RPC_CMD_GRAPH_RECOMPUTE,
     RPC_CMD_COUNT,
 };
 
+// features of the server, returned by RPC_CMD_GET_FEATURES
+enum rpc_feature {
+    RPC_FEATURE_LZ4 = 1 << 0, // RPC_CMD_SET_TENSOR_LZ4
+};
+
 // Try RPC_CMD_SET_TENSOR_HASH first when data size is larger than this threshold
 const size_t HASH_THRESHOLD = 10 * 1024 * 1024;
 
+// Compress RPC_CMD_SET_TENSOR data larger than this threshold when GGML_RPC_LZ4 is set
+const size_t LZ4_THRESHOLD = 64 * 1024;
+
+// Max number of requests sent by the client before it waits for their responses
+const size_t MAX_PENDING = 64;
+
+// Number of graphs cached by the server, the client tracks the same graphs
+const size_t GRAPH_CACHE_SIZE = 8;
+
 struct rpc_msg_hello_rsp {
     uint8_t major;
     uint8_t minor;
     uint8_t patch;
 };
 
+struct rpc_msg_get_features_rsp {
+    uint32_t features;
+};
+
 struct rpc_msg_get_alloc_size_req {
     rpc_tensor tensor;
 };
@@ -228,6 +277,22 @@ static uint64_t fnv_hash(const uint8_t * data, size_t len) {
     return hash;
 }
 
+// Hash of a serialized graph, processes 8 bytes at a time since it runs for every graph computation
+static uint64_t graph_hash(const uint8_t * data, size_t len) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+        uint64_t w;
+        memcpy(&w, data + i, sizeof(w));
+        hash = (hash ^ w) * 0x100000001b3ULL;
+        hash ^= hash >> 29;
+    }
+    for (; i < len; ++i) {
+        hash = (hash ^ data[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
 static std::shared_ptr<socket_t> make_socket(sockfd_t fd) {
 #ifdef _WIN32
     if (fd == INVALID_SOCKET) {
@@ -351,6 +416,31 @@ static bool send_msg(sockfd_t sockfd, const void * msg, size_t msg_size) {
     return send_data(sockfd, msg, msg_size);
 }
 
+// small messages are sent together with their header, so that they go out in a single packet with TCP_NODELAY
+static bool send_msg(sockfd_t sockfd, const void * header, size_t header_size, const void * msg, size_t msg_size) {
+    uint8_t buf[256];
+    if (header_size + msg_size <= sizeof(buf)) {
+        memcpy(buf, header, header_size);
+        if (msg_size > 0) {
+            memcpy(buf + header_size, msg, msg_size);
+        }
+        return send_data(sockfd, buf, header_size + msg_size);
+    }
+    if (!send_data(sockfd, header, header_size)) {
+        return false;
+    }
+    return send_data(sockfd, msg, msg_size);
+}
+
+// response to a request with request_id
+static bool send_rsp(sockfd_t sockfd, uint32_t id, const void * msg, size_t msg_size) {
+    uint8_t header[sizeof(uint32_t) + sizeof(uint64_t)];
+    const uint64_t size = msg_size;
+    memcpy(header, &id, sizeof(id));
+    memcpy(header + sizeof(id), &size, sizeof(size));
+    return send_msg(sockfd, header, sizeof(header), msg, msg_size);
+}
+
 static bool recv_msg(sockfd_t sockfd, void * msg, size_t msg_size) {
     uint64_t size;
     if (!recv_data(sockfd, &size, sizeof(size))) {
@@ -386,48 +476,109 @@ static bool parse_endpoint(const std::string & endpoint, std::string & host, int
     return true;
 }
 
-// RPC request : | rpc_cmd (1 byte) | request_size (8 bytes) | request_data (request_size bytes) |
-// No response
-static bool send_rpc_cmd(const std::shared_ptr<socket_t> & sock, enum rpc_cmd cmd, const void * input, size_t input_size) {
-    uint8_t cmd_byte = cmd;
-    if (!send_data(sock->fd, &cmd_byte, sizeof(cmd_byte))) {
+// RPC request : | rpc_cmd (1 byte) | request_id (4 bytes) | request_size (8 bytes) | request_data (request_size bytes) |
+// RPC response: | request_id (4 bytes) | response_size (8 bytes) | response_data (response_size bytes) |
+//
+// The server handles the requests in order, so the client sends the requests that do not return any data without
+// waiting for their responses, and checks them when it receives the response of a later request.
+// HELLO is sent before any other request without request_id, and its response has no request_id either, so that
+// the version check works with any version of the protocol.
+// The functions below require sock->mutex to be held.
+
+static bool send_rpc_req(socket_t & sock, enum rpc_cmd cmd, uint32_t id, const void * input, size_t input_size) {
+    uint8_t header[1 + sizeof(uint32_t) + sizeof(uint64_t)];
+    const uint64_t size = input_size;
+    header[0] = cmd;
+    memcpy(header + 1, &id, sizeof(id));
+    memcpy(header + 1 + sizeof(id), &size, sizeof(size));
+    return send_msg(sock.fd, header, sizeof(header), input, input_size);
+}
+
+// receives the response of the oldest pending request
+static bool recv_rpc_rsp(socket_t & sock) {
+    GGML_ASSERT(!sock.pending.empty());
+    const rpc_pending_rsp req = sock.pending.front();
+    sock.pending.pop_front();
+
+    uint32_t id;
+    uint64_t size;
+    if (!recv_data(sock.fd, &id, sizeof(id)) || id != req.id) {
         return false;
     }
-    if (!send_data(sock->fd, &input_size, sizeof(input_size))) {
+    if (!recv_data(sock.fd, &size, sizeof(size))) {
         return false;
     }
-    if (!send_data(sock->fd, input, input_size)) {
+    if (req.cmd == RPC_CMD_GRAPH_COMPUTE || req.cmd == RPC_CMD_GRAPH_RECOMPUTE) {
+        // the status is returned by the next graph_compute
+        rpc_msg_graph_compute_rsp response;
+        if (size != sizeof(response) || !recv_data(sock.fd, &response, sizeof(response))) {
+            return false;
+        }
+        if (response.result != GGML_STATUS_SUCCESS && sock.graph_status == GGML_STATUS_SUCCESS) {
+            GGML_LOG_ERROR("%s: RPC graph compute failed with status %d\n", __func__, (int) response.result);
+            sock.graph_status = response.result;
+        }
+        return true;
+    }
+    if (size != req.output_size) {
         return false;
     }
-    return true;
+    return recv_data(sock.fd, req.output, req.output_size);
 }
 
-// RPC request : | rpc_cmd (1 byte) | request_size (8 bytes) | request_data (request_size bytes) |
-// RPC response: | response_size (8 bytes) | response_data (response_size bytes) |
-static bool send_rpc_cmd(const std::shared_ptr<socket_t> & sock, enum rpc_cmd cmd, const void * input, size_t input_size, void * output, size_t output_size) {
-    if (!send_rpc_cmd(sock, cmd, input, input_size)) {
-        return false;
+// receives responses until at most n_pending requests are pending
+static bool recv_rpc_rsps(socket_t & sock, size_t n_pending) {
+    while (sock.pending.size() > n_pending) {
+        if (!recv_rpc_rsp(sock)) {
+            return false;
+        }
     }
-    // TODO: currently the output_size is always known, do we need support for commands with variable output size?
-    // even if we do, we can skip sending output_size from the server for commands with known output size
-    uint64_t out_size;
-    if (!recv_data(sock->fd, &out_size, sizeof(out_size))) {
+    return true;
+}
+
+// output must remain valid until the response is received
+static bool send_rpc_req_async(socket_t & sock, enum rpc_cmd cmd, const void * input, size_t input_size, void * output, size_t output_size) {
+    // bound the number of responses in flight, so that the server never blocks on a full socket
+    if (!recv_rpc_rsps(sock, MAX_PENDING - 1)) {
         return false;
     }
-    if (out_size != output_size) {
+    const uint32_t id = sock.next_id++;
+    if (!send_rpc_req(sock, cmd, id, input, input_size)) {
         return false;
     }
-    if (!recv_data(sock->fd, output, output_size)) {
+    sock.pending.push_back({id, (uint8_t) cmd, output, output_size});
+    return true;
+}
+
+// No response
+static bool send_rpc_cmd(const std::shared_ptr<socket_t> & sock, enum rpc_cmd cmd, const void * input, size_t input_size) {
+    std::lock_guard<std::mutex> lock(sock->mutex);
+    return send_rpc_req(*sock, cmd, sock->next_id++, input, input_size);
+}
+
+// Empty response, checked later
+static bool send_rpc_cmd_async(const std::shared_ptr<socket_t> & sock, enum rpc_cmd cmd, const void * input, size_t input_size) {
+    std::lock_guard<std::mutex> lock(sock->mutex);
+    return send_rpc_req_async(*sock, cmd, input, input_size, nullptr, 0);
+}
+
+// Waits for the response
+static bool send_rpc_cmd(const std::shared_ptr<socket_t> & sock, enum rpc_cmd cmd, const void * input, size_t input_size, void * output, size_t output_size) {
+    std::lock_guard<std::mutex> lock(sock->mutex);
+    if (!send_rpc_req_async(*sock, cmd, input, input_size, output, output_size)) {
         return false;
     }
-    return true;
+    return recv_rpc_rsps(*sock, 0);
 }
 
 // RPC client-side implementation
 
 static bool check_server_version(const std::shared_ptr<socket_t> & sock) {
+    // RPC request : | rpc_cmd (1 byte) | request_size (8 bytes) |
+    // RPC response: | response_size (8 bytes) | response_data (response_size bytes) |
     rpc_msg_hello_rsp response;
-    bool status = send_rpc_cmd(sock, RPC_CMD_HELLO, nullptr, 0, &response, sizeof(response));
+    uint8_t cmd = RPC_CMD_HELLO;
+    bool status = send_data(sock->fd, &cmd, sizeof(cmd)) && send_msg(sock->fd, nullptr, 0) && recv_msg(sock->fd, &response, sizeof(response));
     RPC_STATUS_ASSERT(status);
     if (response.major != RPC_PROTO_MAJOR_VERSION || response.minor > RPC_PROTO_MINOR_VERSION) {
         fprintf(stderr, "RPC server version mismatch: %d.%d.%d\n", response.major, response.minor, response.patch);
@@ -439,6 +590,26 @@ static bool check_server_version(const std::shared_ptr<socket_t> & sock) {
     return true;
 }
 
+static uint32_t get_features(const std::shared_ptr<socket_t> & sock) {
+    rpc_msg_get_features_rsp response;
+    bool status = send_rpc_cmd(sock, RPC_CMD_GET_FEATURES, nullptr, 0, &response, sizeof(response));
+    RPC_STATUS_ASSERT(status);
+    return response.features;
+}
+
+static bool use_lz4(const std::shared_ptr<socket_t> & sock) {
+#ifdef GGML_RPC_LZ4
+    static const bool enabled = [] {
+        const char * env = getenv("GGML_RPC_LZ4");
+        return env != nullptr && atoi(env) != 0;
+    }();
+    return enabled && (sock->features & RPC_FEATURE_LZ4);
+#else
+    GGML_UNUSED(sock);
+    return false;
+#endif
+}
+
 static std::shared_ptr<socket_t> get_socket(const std::string & endpoint) {
     static std::mutex mutex;
     std::lock_guard<std::mutex> lock(mutex);
@@ -475,6 +646,7 @@ static std::shared_ptr<socket_t> get_socket(const std::string & endpoint) {
     if (!check_server_version(sock)) {
         return nullptr;
     }
+    sock->features = get_features(sock);
     GGML_PRINT_DEBUG("[%s] connected to %s, sockfd=%d\n", __func__, endpoint.c_str(), sock->fd);
     sockets[endpoint] = sock;
     return sock;
@@ -483,8 +655,13 @@ static std::shared_ptr<socket_t> get_socket(const std::string & endpoint) {
 static void ggml_backend_rpc_buffer_free_buffer(ggml_backend_buffer_t buffer) {
     ggml_backend_rpc_buffer_context * ctx = (ggml_backend_rpc_buffer_context *)buffer->context;
     rpc_msg_free_buffer_req request = {ctx->remote_ptr};
-    bool status = send_rpc_cmd(ctx->sock, RPC_CMD_FREE_BUFFER, &request, sizeof(request), nullptr, 0);
-    RPC_STATUS_ASSERT(status);
+    {
+        std::lock_guard<std::mutex> lock(ctx->sock->mutex);
+        // the server drops its cached graphs when a buffer is freed, as they may reference the buffer
+        ctx->sock->graphs.clear();
+        bool status = send_rpc_req_async(*ctx->sock, RPC_CMD_FREE_BUFFER, &request, sizeof(request), nullptr, 0);
+        RPC_STATUS_ASSERT(status);
+    }
     delete ctx;
 }
 
@@ -547,7 +724,7 @@ static enum ggml_status ggml_backend_rpc_buffer_init_tensor(ggml_backend_buffer_
 
         request.tensor = serialize_tensor(tensor);
 
-        bool status = send_rpc_cmd(ctx->sock, RPC_CMD_INIT_TENSOR, &request, sizeof(request), nullptr, 0);
+        bool status = send_rpc_cmd_async(ctx->sock, RPC_CMD_INIT_TENSOR, &request, sizeof(request));
         RPC_STATUS_ASSERT(status);
     }
     return GGML_STATUS_SUCCESS;
@@ -569,6 +746,24 @@ static void ggml_backend_rpc_buffer_set_tensor(ggml_backend_buffer_t buffer, ggm
             return;
         }
     }
+#ifdef GGML_RPC_LZ4
+    if (size > LZ4_THRESHOLD && use_lz4(ctx->sock)) {
+        // input serialization format: | rpc_tensor | offset (8 bytes) | size (8 bytes) | compressed data |
+        const size_t header_size = sizeof(rpc_tensor) + 2*sizeof(uint64_t);
+        const uint64_t data_size = size;
+        std::vector<uint8_t> input(header_size + LZ4_compressBound(size));
+        memcpy(input.data(), &rpc_tensor, sizeof(rpc_tensor));
+        memcpy(input.data() + sizeof(rpc_tensor), &offset, sizeof(offset));
+        memcpy(input.data() + sizeof(rpc_tensor) + sizeof(offset), &data_size, sizeof(data_size));
+        const int n = LZ4_compress_default((const char *) data, (char *) input.data() + header_size, size, input.size() - header_size);
+        // quantized weights barely compress, send them as they are
+        if (n > 0 && (size_t) n < size - size/16) {
+            bool status = send_rpc_cmd(ctx->sock, RPC_CMD_SET_TENSOR_LZ4, input.data(), header_size + n);
+            RPC_STATUS_ASSERT(status);
+            return;
+        }
+    }
+#endif
     // input serialization format: | rpc_tensor | offset (8 bytes) | data (size bytes)
     size_t input_size = sizeof(rpc_tensor) + sizeof(uint64_t) + size;
     std::vector<uint8_t> input(input_size, 0);
@@ -611,7 +806,7 @@ static bool ggml_backend_rpc_buffer_cpy_tensor(ggml_backend_buffer_t buffer, con
 static void ggml_backend_rpc_buffer_clear(ggml_backend_buffer_t buffer, uint8_t value) {
     ggml_backend_rpc_buffer_context * ctx = (ggml_backend_rpc_buffer_context *)buffer->context;
     rpc_msg_buffer_clear_req request = {ctx->remote_ptr, value};
-    bool status = send_rpc_cmd(ctx->sock, RPC_CMD_BUFFER_CLEAR, &request, sizeof(request), nullptr, 0);
+    bool status = send_rpc_cmd_async(ctx->sock, RPC_CMD_BUFFER_CLEAR, &request, sizeof(request));
     RPC_STATUS_ASSERT(status);
 }
 
@@ -716,8 +911,12 @@ static void ggml_backend_rpc_free(ggml_backend_t backend) {
 }
 
 static void ggml_backend_rpc_synchronize(ggml_backend_t backend) {
-    GGML_UNUSED(backend);
-    // this is no-op because we don't have any async operations
+    ggml_backend_rpc_context * rpc_ctx = (ggml_backend_rpc_context *)backend->context;
+    auto sock = get_socket(rpc_ctx->endpoint);
+    std::lock_guard<std::mutex> lock(sock->mutex);
+    bool status = recv_rpc_rsps(*sock, 0);
+    RPC_STATUS_ASSERT(status);
+    // synchronize cannot return an error, a failed graph is returned by the next graph_compute
 }
 
 static void add_tensor(ggml_tensor * tensor, std::vector<rpc_tensor> & tensors, std::unordered_set<ggml_tensor*> & visited) {
@@ -757,15 +956,120 @@ static void serialize_graph(const ggml_cgraph * cgraph, std::vector<uint8_t> & o
     memcpy(out_tensors, tensors.data(), n_tensors * sizeof(rpc_tensor));
 }
 
+// offset of the tensors in a serialized graph, 0 if the data is malformed
+static size_t graph_tensors_offset(const std::vector<uint8_t> & graph, uint32_t & n_tensors) {
+    uint32_t n_nodes;
+    if (graph.size() < sizeof(n_nodes)) {
+        return 0;
+    }
+    memcpy(&n_nodes, graph.data(), sizeof(n_nodes));
+    const size_t offset = sizeof(n_nodes) + n_nodes*sizeof(uint64_t) + sizeof(n_tensors);
+    if (graph.size() < offset) {
+        return 0;
+    }
+    memcpy(&n_tensors, graph.data() + offset - sizeof(n_tensors), sizeof(n_tensors));
+    if (graph.size() != offset + n_tensors*sizeof(rpc_tensor)) {
+        return 0;
+    }
+    return offset;
+}
+
+// appends the tensors of graph that differ from base to delta, as | index (4 bytes) | rpc_tensor |
+// returns false if the graphs have a different structure
+static bool serialize_graph_delta(const std::vector<uint8_t> & base, const std::vector<uint8_t> & graph, std::vector<uint8_t> & delta) {
+    uint32_t n_tensors;
+    const size_t offset = graph_tensors_offset(graph, n_tensors);
+    if (offset == 0 || base.size() != graph.size() || memcmp(base.data(), graph.data(), offset) != 0) {
+        return false;
+    }
+    for (uint32_t i = 0; i < n_tensors; i++) {
+        const uint8_t * t = graph.data() + offset + i*sizeof(rpc_tensor);
+        if (memcmp(base.data() + offset + i*sizeof(rpc_tensor), t, sizeof(rpc_tensor)) != 0) {
+            delta.insert(delta.end(), (const uint8_t *) &i, (const uint8_t *) &i + sizeof(i));
+            delta.insert(delta.end(), t, t + sizeof(rpc_tensor));
+        }
+    }
+    return true;
+}
+
 static enum ggml_status ggml_backend_rpc_graph_compute(ggml_backend_t backend, ggml_cgraph * cgraph) {
     ggml_backend_rpc_context * rpc_ctx = (ggml_backend_rpc_context *)backend->context;
-    std::vector<uint8_t> input;
-    serialize_graph(cgraph, input);
-    rpc_msg_graph_compute_rsp response;
+    std::vector<uint8_t> graph;
+    serialize_graph(cgraph, graph);
+    const uint64_t hash = graph_hash(graph.data(), graph.size());
+
     auto sock = get_socket(rpc_ctx->endpoint);
-    bool status = send_rpc_cmd(sock, RPC_CMD_GRAPH_COMPUTE, input.data(), input.size(), &response, sizeof(response));
+    std::lock_guard<std::mutex> lock(sock->mutex);
+
+    // the graphs are computed asynchronously, so a failure is only known once the response has been received and it is
+    // returned here, by the next graph_compute on this connection
+    if (sock->graph_status != GGML_STATUS_SUCCESS) {
+        const enum ggml_status res = (enum ggml_status) sock->graph_status;
+        sock->graph_status = GGML_STATUS_SUCCESS;
+        return res;
+    }
+
+    // The server keeps the last graphs, so that only the hash of a graph that was already computed is sent, or only the
+    // tensors that changed when the graph has the same structure, e.g. the KV cache views at the next position.
+    // Both sides update their caches in the same order.
+    auto & graphs = sock->graphs;
+    auto it = std::find_if(graphs.begin(), graphs.end(), [&](const rpc_cached_graph & g) { return g.hash == hash; });
+    if (it != graphs.end() && it->data != graph) {
+        // hash collision
+        graphs.erase(it);
+        it = graphs.end();
+    }
+
+    // input serialization format for RPC_CMD_GRAPH_RECOMPUTE:
+    // | hash (8 bytes) | base hash (8 bytes) | n_changed (4 bytes) | changed tensors (n_changed * (index (4 bytes) | rpc_tensor)) |
+    std::vector<uint8_t> delta;
+    if (it != graphs.end()) {
+        std::rotate(graphs.begin(), it, it + 1);
+        delta.resize(2*sizeof(uint64_t) + sizeof(uint32_t), 0);
+        memcpy(delta.data(), &hash, sizeof(hash));
+        memcpy(delta.data() + sizeof(hash), &hash, sizeof(hash));
+    } else {
+        for (const auto & base : graphs) {
+            delta.resize(2*sizeof(uint64_t) + sizeof(uint32_t));
+            if (!serialize_graph_delta(base.data, graph, delta)) {
+                continue;
+            }
+            if (delta.size() > graph.size()/2) {
+                // not worth it
+                delta.clear();
+                break;
+            }
+            const uint32_t n_changed = (delta.size() - 2*sizeof(uint64_t) - sizeof(uint32_t)) / (sizeof(uint32_t) + sizeof(rpc_tensor));
+            memcpy(delta.data(), &hash, sizeof(hash));
+            memcpy(delta.data() + sizeof(hash), &base.hash, sizeof(base.hash));
+            memcpy(delta.data() + 2*sizeof(uint64_t), &n_changed, sizeof(n_changed));
+            break;
+        }
+        if (delta.size() <= 2*sizeof(uint64_t) + sizeof(uint32_t)) {
+            delta.clear();
+        }
+    }
+
+    bool status;
+    if (!delta.empty()) {
+        status = send_rpc_req_async(*sock, RPC_CMD_GRAPH_RECOMPUTE, delta.data(), delta.size(), nullptr, 0);
+    } else {
+        // input serialization format: | hash (8 bytes) | graph |
+        std::vector<uint8_t> input(sizeof(hash) + graph.size());
+        memcpy(input.data(), &hash, sizeof(hash));
+        memcpy(input.data() + sizeof(hash), graph.data(), graph.size());
+        status = send_rpc_req_async(*sock, RPC_CMD_GRAPH_COMPUTE, input.data(), input.size(), nullptr, 0);
+    }
     RPC_STATUS_ASSERT(status);
-    return (enum ggml_status)response.result;
+
+    if (it == graphs.end()) {
+        graphs.insert(graphs.begin(), {hash, std::move(graph)});
+        if (graphs.size() > GRAPH_CACHE_SIZE) {
+            graphs.pop_back();
+        }
+    }
+    // the status of this graph is returned by the next graph_compute
+    return GGML_STATUS_SUCCESS;
 }
 
 static ggml_backend_i ggml_backend_rpc_interface = {
@@ -863,6 +1167,7 @@ public:
     ~rpc_server();
 
     void hello(rpc_msg_hello_rsp & response);
+    void get_features(rpc_msg_get_features_rsp & response);
     void alloc_buffer(const rpc_msg_alloc_buffer_req & request, rpc_msg_alloc_buffer_rsp & response);
     void get_alignment(rpc_msg_get_alignment_rsp & response);
     void get_max_size(rpc_msg_get_max_size_rsp & response);
@@ -870,15 +1175,18 @@ public:
     bool free_buffer(const rpc_msg_free_buffer_req & request);
     bool buffer_clear(const rpc_msg_buffer_clear_req & request);
     bool set_tensor(const std::vector<uint8_t> & input);
+    bool set_tensor_lz4(const std::vector<uint8_t> & input);
     bool set_tensor_hash(const rpc_msg_set_tensor_hash_req & request, rpc_msg_set_tensor_hash_rsp & response);
     bool get_tensor(const rpc_msg_get_tensor_req & request, std::vector<uint8_t> & response);
     bool copy_tensor(const rpc_msg_copy_tensor_req & request, rpc_msg_copy_tensor_rsp & response);
     bool graph_compute(const std::vector<uint8_t> & input, rpc_msg_graph_compute_rsp & response);
+    bool graph_recompute(const std::vector<uint8_t> & input, rpc_msg_graph_compute_rsp & response);
     bool init_tensor(const rpc_msg_init_tensor_req & request);
     bool get_alloc_size(const rpc_msg_get_alloc_size_req & request, rpc_msg_get_alloc_size_rsp & response);
 
 private:
     bool get_cached_file(uint64_t hash, std::vector<uint8_t> & data);
+    ggml_cgraph * add_graph(uint64_t hash, std::vector<uint8_t> && data);
     ggml_tensor * deserialize_tensor(struct ggml_context * ctx, const rpc_tensor * tensor);
     ggml_tensor * create_node(uint64_t id,
                               struct ggml_context * ctx,
@@ -886,9 +1194,17 @@ private:
                               std::unordered_map<uint64_t, struct ggml_tensor*> & tensor_map);
 
 
+    struct cached_graph {
+        uint64_t             hash;
+        std::vector<uint8_t> data; // serialized graph
+        ggml_context_ptr     ctx;
+        ggml_cgraph *        graph;
+    };
+
     ggml_backend_t backend;
     const char * cache_dir;
     std::unordered_set<ggml_backend_buffer_t> buffers;
+    std::vector<cached_graph> graphs; // most recently used first, same order as in the client
 };
 
 void rpc_server::hello(rpc_msg_hello_rsp & response) {
@@ -898,6 +1214,13 @@ void rpc_server::hello(rpc_msg_hello_rsp & response) {
     GGML_PRINT_DEBUG("[%s] version: %d.%d.%d\n", __func__, response.major, response.minor, response.patch);
 }
 
+void rpc_server::get_features(rpc_msg_get_features_rsp & response) {
+    response.features = 0;
+#ifdef GGML_RPC_LZ4
+    response.features |= RPC_FEATURE_LZ4;
+#endif
+}
+
 bool rpc_server::get_alloc_size(const rpc_msg_get_alloc_size_req & request, rpc_msg_get_alloc_size_rsp & response) {
     ggml_backend_buffer_type_t buft;
     struct ggml_init_params params {
@@ -978,6 +1301,8 @@ bool rpc_server::free_buffer(const rpc_msg_free_buffer_req & request) {
     }
     ggml_backend_buffer_free(buffer);
     buffers.erase(buffer);
+    // the cached graphs may reference the buffer, the client drops its copies too
+    graphs.clear();
     return true;
 }
 
@@ -1088,6 +1413,43 @@ bool rpc_server::set_tensor(const std::vector<uint8_t> & input) {
     return true;
 }
 
+bool rpc_server::set_tensor_lz4(const std::vector<uint8_t> & input) {
+#ifdef GGML_RPC_LZ4
+    // serialization format: | rpc_tensor | offset (8 bytes) | size (8 bytes) | compressed data |
+    const size_t header_size = sizeof(rpc_tensor) + 2*sizeof(uint64_t);
+    if (input.size() < header_size) {
+        return false;
+    }
+    uint64_t size;
+    memcpy(&size, input.data() + sizeof(rpc_tensor) + sizeof(uint64_t), sizeof(size));
+    // LZ4 cannot expand the data by more than 255x, the bounds are checked by set_tensor
+    const size_t compressed_size = input.size() - header_size;
+    if (size > 255*compressed_size + 16 || size > INT32_MAX) {
+        GGML_LOG_ERROR("[%s] invalid size %" PRIu64 " for %zu bytes of compressed data\n", __func__, size, compressed_size);
+        return false;
+    }
+    std::vector<uint8_t> data;
+    try {
+        data.resize(sizeof(rpc_tensor) + sizeof(uint64_t) + size);
+    } catch (const std::bad_alloc & e) {
+        fprintf(stderr, "Failed to allocate buffer of size %" PRIu64 "\n", size);
+        return false;
+    }
+    memcpy(data.data(), input.data(), sizeof(rpc_tensor) + sizeof(uint64_t));
+    const int n = LZ4_decompress_safe((const char *) input.data() + header_size, (char *) data.data() + sizeof(rpc_tensor) + sizeof(uint64_t),
+                                      compressed_size, size);
+    if (n < 0 || (uint64_t) n != size) {
+        GGML_LOG_ERROR("[%s] failed to decompress %zu bytes\n", __func__, compressed_size);
+        return false;
+    }
+    return set_tensor(data);
+#else
+    GGML_UNUSED(input);
+    GGML_LOG_ERROR("[%s] LZ4 support is not enabled in this build\n", __func__);
+    return false;
+#endif
+}
+
 bool rpc_server::get_cached_file(uint64_t hash, std::vector<uint8_t> & data) {
     if (!cache_dir) {
         return false;
@@ -1310,25 +1672,26 @@ ggml_tensor * rpc_server::create_node(uint64_t id,
     return result;
 }
 
-bool rpc_server::graph_compute(const std::vector<uint8_t> & input, rpc_msg_graph_compute_rsp & response) {
+// deserializes the graph and adds it to the cache, returns nullptr if the data is malformed
+ggml_cgraph * rpc_server::add_graph(uint64_t hash, std::vector<uint8_t> && data) {
     // serialization format:
     // | n_nodes (4 bytes) | nodes (n_nodes * sizeof(uint64_t) | n_tensors (4 bytes) | tensors (n_tensors * sizeof(rpc_tensor)) |
-    if (input.size() < sizeof(uint32_t)) {
-        return false;
+    if (data.size() < sizeof(uint32_t)) {
+        return nullptr;
     }
     uint32_t n_nodes;
-    memcpy(&n_nodes, input.data(), sizeof(n_nodes));
-    if (input.size() < sizeof(uint32_t) + n_nodes*sizeof(uint64_t) + sizeof(uint32_t)) {
-        return false;
+    memcpy(&n_nodes, data.data(), sizeof(n_nodes));
+    if (data.size() < sizeof(uint32_t) + n_nodes*sizeof(uint64_t) + sizeof(uint32_t)) {
+        return nullptr;
     }
-    const uint64_t * nodes = (const uint64_t *)(input.data() + sizeof(n_nodes));
+    const uint64_t * nodes = (const uint64_t *)(data.data() + sizeof(n_nodes));
     uint32_t n_tensors;
-    memcpy(&n_tensors, input.data() + sizeof(n_nodes) + n_nodes*sizeof(uint64_t), sizeof(n_tensors));
-    if (input.size() < sizeof(uint32_t) + n_nodes*sizeof(uint64_t) + sizeof(uint32_t) + n_tensors*sizeof(rpc_tensor)) {
-        return false;
+    memcpy(&n_tensors, data.data() + sizeof(n_nodes) + n_nodes*sizeof(uint64_t), sizeof(n_tensors));
+    if (data.size() < sizeof(uint32_t) + n_nodes*sizeof(uint64_t) + sizeof(uint32_t) + n_tensors*sizeof(rpc_tensor)) {
+        return nullptr;
     }
-    const rpc_tensor * tensors = (const rpc_tensor *)(input.data() + sizeof(n_nodes) + n_nodes*sizeof(uint64_t) + sizeof(n_tensors));
-    GGML_PRINT_DEBUG("[%s] n_nodes: %u, n_tensors: %u\n", __func__, n_nodes, n_tensors);
+    const rpc_tensor * tensors = (const rpc_tensor *)(data.data() + sizeof(n_nodes) + n_nodes*sizeof(uint64_t) + sizeof(n_tensors));
+    GGML_PRINT_DEBUG("[%s] n_nodes: %u, n_tensors: %u, hash: %" PRIx64 "\n", __func__, n_nodes, n_tensors, hash);
 
     size_t buf_size = ggml_tensor_overhead()*(n_nodes + n_tensors) + ggml_graph_overhead_custom(n_nodes, false);
 
@@ -1357,6 +1720,85 @@ bool rpc_server::graph_compute(const std::vector<uint8_t> & input, rpc_msg_graph
         // If id was non-zero and create_node returned nullptr, it indicates a deserialization error.
         if (graph->nodes[i] == nullptr && id != 0) {
             GGML_LOG_ERROR("[%s] failed to create graph node %d (id=%" PRId64 ")\n", __func__, i, id);
+            return nullptr;
+        }
+    }
+
+    // same updates as the cache of the client
+    auto it = std::find_if(graphs.begin(), graphs.end(), [&](const cached_graph & g) { return g.hash == hash; });
+    if (it != graphs.end()) {
+        graphs.erase(it);
+    }
+    graphs.insert(graphs.begin(), {hash, std::move(data), std::move(ctx_ptr), graph});
+    if (graphs.size() > GRAPH_CACHE_SIZE) {
+        graphs.pop_back();
+    }
+    return graph;
+}
+
+bool rpc_server::graph_compute(const std::vector<uint8_t> & input, rpc_msg_graph_compute_rsp & response) {
+    // serialization format: | hash (8 bytes) | graph |
+    if (input.size() < sizeof(uint64_t)) {
+        return false;
+    }
+    uint64_t hash;
+    memcpy(&hash, input.data(), sizeof(hash));
+    ggml_cgraph * graph = add_graph(hash, std::vector<uint8_t>(input.begin() + sizeof(hash), input.end()));
+    if (graph == nullptr) {
+        return false;
+    }
+    ggml_status status = ggml_backend_graph_compute(backend, graph);
+    response.result = status;
+    return true;
+}
+
+bool rpc_server::graph_recompute(const std::vector<uint8_t> & input, rpc_msg_graph_compute_rsp & response) {
+    // serialization format:
+    // | hash (8 bytes) | base hash (8 bytes) | n_changed (4 bytes) | changed tensors (n_changed * (index (4 bytes) | rpc_tensor)) |
+    const size_t header_size = 2*sizeof(uint64_t) + sizeof(uint32_t);
+    if (input.size() < header_size) {
+        return false;
+    }
+    uint64_t hash;
+    uint64_t base_hash;
+    uint32_t n_changed;
+    memcpy(&hash,      input.data(),                        sizeof(hash));
+    memcpy(&base_hash, input.data() + sizeof(hash),         sizeof(base_hash));
+    memcpy(&n_changed, input.data() + 2*sizeof(uint64_t),   sizeof(n_changed));
+    if (input.size() != header_size + (size_t) n_changed*(sizeof(uint32_t) + sizeof(rpc_tensor))) {
+        return false;
+    }
+    auto it = std::find_if(graphs.begin(), graphs.end(), [&](const cached_graph & g) { return g.hash == base_hash; });
+    if (it == graphs.end()) {
+        GGML_LOG_ERROR("[%s] graph %" PRIx64 " not found\n", __func__, base_hash);
+        return false;
+    }
+    GGML_PRINT_DEBUG("[%s] hash: %" PRIx64 ", base: %" PRIx64 ", n_changed: %u\n", __func__, hash, base_hash, n_changed);
+
+    ggml_cgraph * graph = nullptr;
+    if (hash == base_hash && n_changed == 0) {
+        std::rotate(graphs.begin(), it, it + 1);
+        graph = graphs.front().graph;
+    } else {
+        std::vector<uint8_t> data = it->data;
+        uint32_t n_nodes;
+        uint32_t n_tensors;
+        memcpy(&n_nodes, data.data(), sizeof(n_nodes));
+        const size_t offset = sizeof(n_nodes) + n_nodes*sizeof(uint64_t) + sizeof(n_tensors);
+        memcpy(&n_tensors, data.data() + offset - sizeof(n_tensors), sizeof(n_tensors));
+        const uint8_t * changed = input.data() + header_size;
+        for (uint32_t i = 0; i < n_changed; i++) {
+            uint32_t index;
+            memcpy(&index, changed, sizeof(index));
+            if (index >= n_tensors) {
+                GGML_LOG_ERROR("[%s] invalid tensor index %u\n", __func__, index);
+                return false;
+            }
+            memcpy(data.data() + offset + index*sizeof(rpc_tensor), changed + sizeof(index), sizeof(rpc_tensor));
+            changed += sizeof(index) + sizeof(rpc_tensor);
+        }
+        graph = add_graph(hash, std::move(data));
+        if (graph == nullptr) {
             return false;
         }
     }
@@ -1400,11 +1842,26 @@ static void rpc_serve_client(ggml_backend_t backend, const char * cache_dir,
             fprintf(stderr, "Unknown command: %d\n", cmd);
             break;
         }
+        uint32_t id;
+        if (!recv_data(sockfd, &id, sizeof(id))) {
+            break;
+        }
         switch (cmd) {
             case RPC_CMD_HELLO: {
                 // HELLO command is handled above
                 return;
             }
+            case RPC_CMD_GET_FEATURES: {
+                if (!recv_msg(sockfd, nullptr, 0)) {
+                    return;
+                }
+                rpc_msg_get_features_rsp response;
+                server.get_features(response);
+                if (!send_rsp(sockfd, id, &response, sizeof(response))) {
+                    return;
+                }
+                break;
+            }
             case RPC_CMD_ALLOC_BUFFER: {
                 rpc_msg_alloc_buffer_req request;
                 if (!recv_msg(sockfd, &request, sizeof(request))) {
@@ -1412,7 +1869,7 @@ static void rpc_serve_client(ggml_backend_t backend, const char * cache_dir,
                 }
                 rpc_msg_alloc_buffer_rsp response;
                 server.alloc_buffer(request, response);
-                if (!send_msg(sockfd, &response, sizeof(response))) {
+                if (!send_rsp(sockfd, id, &response, sizeof(response))) {
                     return;
                 }
                 break;
@@ -1426,7 +1883,7 @@ static void rpc_serve_client(ggml_backend_t backend, const char * cache_dir,
                 if (!server.get_alloc_size(request, response)) {
                     return;
                 }
-                if (!send_msg(sockfd, &response, sizeof(response))) {
+                if (!send_rsp(sockfd, id, &response, sizeof(response))) {
                     return;
                 }
                 break;
@@ -1437,7 +1894,7 @@ static void rpc_serve_client(ggml_backend_t backend, const char * cache_dir,
                 }
                 rpc_msg_get_alignment_rsp response;
                 server.get_alignment(response);
-                if (!send_msg(sockfd, &response, sizeof(response))) {
+                if (!send_rsp(sockfd, id, &response, sizeof(response))) {
                     return;
                 }
                 break;
@@ -1448,7 +1905,7 @@ static void rpc_serve_client(ggml_backend_t backend, const char * cache_dir,
                 }
                 rpc_msg_get_max_size_rsp response;
                 server.get_max_size(response);
-                if (!send_msg(sockfd, &response, sizeof(response))) {
+                if (!send_rsp(sockfd, id, &response, sizeof(response))) {
                     return;
                 }
                 break;
@@ -1462,7 +1919,7 @@ static void rpc_serve_client(ggml_backend_t backend, const char * cache_dir,
                 if (!server.buffer_get_base(request, response)) {
                     return;
                 }
-                if (!send_msg(sockfd, &response, sizeof(response))) {
+                if (!send_rsp(sockfd, id, &response, sizeof(response))) {
                     return;
                 }
                 break;
@@ -1475,7 +1932,7 @@ static void rpc_serve_client(ggml_backend_t backend, const char * cache_dir,
                 if (!server.free_buffer(request)) {
                     return;
                 }
-                if (!send_msg(sockfd, nullptr, 0)) {
+                if (!send_rsp(sockfd, id, nullptr, 0)) {
                     return;
                 }
                 break;
@@ -1488,7 +1945,7 @@ static void rpc_serve_client(ggml_backend_t backend, const char * cache_dir,
                 if (!server.buffer_clear(request)) {
                     return;
                 }
-                if (!send_msg(sockfd, nullptr, 0)) {
+                if (!send_rsp(sockfd, id, nullptr, 0)) {
                     return;
                 }
                 break;
@@ -1503,6 +1960,16 @@ static void rpc_serve_client(ggml_backend_t backend, const char * cache_dir,
                 }
                 break;
             }
+            case RPC_CMD_SET_TENSOR_LZ4: {
+                std::vector<uint8_t> input;
+                if (!recv_msg(sockfd, input)) {
+                    return;
+                }
+                if (!server.set_tensor_lz4(input)) {
+                    return;
+                }
+                break;
+            }
             case RPC_CMD_SET_TENSOR_HASH: {
                 rpc_msg_set_tensor_hash_req request;
                 if (!recv_msg(sockfd, &request, sizeof(request))) {
@@ -1512,7 +1979,7 @@ static void rpc_serve_client(ggml_backend_t backend, const char * cache_dir,
                 if (!server.set_tensor_hash(request, response)) {
                     return;
                 }
-                if (!send_msg(sockfd, &response, sizeof(response))) {
+                if (!send_rsp(sockfd, id, &response, sizeof(response))) {
                     return;
                 }
                 break;
@@ -1525,7 +1992,7 @@ static void rpc_serve_client(ggml_backend_t backend, const char * cache_dir,
                 if (!server.init_tensor(request)) {
                     return;
                 }
-                if (!send_msg(sockfd, nullptr, 0)) {
+                if (!send_rsp(sockfd, id, nullptr, 0)) {
                     return;
                 }
                 break;
@@ -1539,7 +2006,7 @@ static void rpc_serve_client(ggml_backend_t backend, const char * cache_dir,
                 if (!server.get_tensor(request, response)) {
                     return;
                 }
-                if (!send_msg(sockfd, response.data(), response.size())) {
+                if (!send_rsp(sockfd, id, response.data(), response.size())) {
                     return;
                 }
                 break;
@@ -1553,7 +2020,7 @@ static void rpc_serve_client(ggml_backend_t backend, const char * cache_dir,
                 if (!server.copy_tensor(request, response)) {
                     return;
                 }
-                if (!send_msg(sockfd, &response, sizeof(response))) {
+                if (!send_rsp(sockfd, id, &response, sizeof(response))) {
                     return;
                 }
                 break;
@@ -1567,7 +2034,21 @@ static void rpc_serve_client(ggml_backend_t backend, const char * cache_dir,
                 if (!server.graph_compute(input, response)) {
                     return;
                 }
-                if (!send_msg(sockfd, &response, sizeof(response))) {
+                if (!send_rsp(sockfd, id, &response, sizeof(response))) {
+                    return;
+                }
+                break;
+            }
+            case RPC_CMD_GRAPH_RECOMPUTE: {
+                std::vector<uint8_t> input;
+                if (!recv_msg(sockfd, input)) {
+                    return;
+                }
+                rpc_msg_graph_compute_rsp response;
+                if (!server.graph_recompute(input, response)) {
+                    return;
+                }
+                if (!send_rsp(sockfd, id, &response, sizeof(response))) {
                     return;
                 }
                 break;
@@ -1579,7 +2060,7 @@ static void rpc_serve_client(ggml_backend_t backend, const char * cache_dir,
                 rpc_msg_get_device_memory_rsp response;
                 response.free_mem = free_mem;
                 response.total_mem = total_mem;
-                if (!send_msg(sockfd, &response, sizeof(response))) {
+                if (!send_rsp(sockfd, id, &response, sizeof(response))) {
                     return;
                 }
                 break;
@@ -1601,6 +2082,11 @@ void ggml_backend_rpc_start_server(ggml_backend_t backend, const char * endpoint
         RPC_PROTO_PATCH_VERSION);
     printf("  endpoint       : %s\n", endpoint);
     printf("  local cache    : %s\n", cache_dir ? cache_dir : "n/a");
+#ifdef GGML_RPC_LZ4
+    printf("  compression    : lz4\n");
+#else
+    printf("  compression    : n/a\n");
+#endif
     printf("  backend memory : %zu MB\n", free_mem / (1024 * 1024));
 
     std::string host;
@@ -10,11 +10,27 @@
 #include <cstdlib>
 #include <cstring>
 #include <map>
+#include <mutex>
 #include <new>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#ifndef NOMINMAX
+#    define NOMINMAX
+#endif
+#include <windows.h>
+#include <io.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 template <typename T>
 struct type_to_gguf_type;
 
@@ -123,8 +139,20 @@ struct gguf_kv {
     bool is_array;
     enum gguf_type type;
 
-    std::vector<int8_t>      data;
-    std::vector<std::string> data_string;
+    std::vector<int8_t>              data;
+    mutable std::vector<std::string> data_string;
+
+    // in a mapped context, strings and numeric arrays point into the mapping of the file instead of being copied
+    // the strings are copied into data_string only when they are requested as C strings, guarded by map_mutex
+    const int8_t *                map_data   = nullptr;
+    size_t                        map_nbytes = 0;
+    std::vector<std::string_view> map_str;
+    std::mutex *                  map_mutex  = nullptr;
+
+    gguf_kv(const std::string & key, const enum gguf_type type, const bool is_array)
+            : key(key), is_array(is_array), type(type) {
+        GGML_ASSERT(!key.empty());
+    }
 
     template <typename T>
     gguf_kv(const std::string & key, const T value)
@@ -165,15 +193,27 @@ struct gguf_kv {
         return type;
     }
 
+    bool is_mapped_str() const {
+        return map_mutex != nullptr;
+    }
+
+    const int8_t * get_data() const {
+        return map_data ? map_data : data.data();
+    }
+
+    size_t get_nbytes() const {
+        return map_data ? map_nbytes : data.size();
+    }
+
     size_t get_ne() const {
         if (type == GGUF_TYPE_STRING) {
-            const size_t ne = data_string.size();
+            const size_t ne = is_mapped_str() ? map_str.size() : data_string.size();
             GGML_ASSERT(is_array || ne == 1);
             return ne;
         }
         const size_t type_size = gguf_type_size(type);
-        GGML_ASSERT(data.size() % type_size == 0);
-        const size_t ne = data.size() / type_size;
+        GGML_ASSERT(get_nbytes() % type_size == 0);
+        const size_t ne = get_nbytes() / type_size;
         GGML_ASSERT(is_array || ne == 1);
         return ne;
     }
@@ -182,18 +222,35 @@ struct gguf_kv {
     const T & get_val(const size_t i = 0) const {
         GGML_ASSERT(type_to_gguf_type<T>::value == type);
         if constexpr (std::is_same<T, std::string>::value) {
+            if (is_mapped_str()) {
+                std::lock_guard<std::mutex> lock(*map_mutex);
+                if (data_string.empty()) {
+                    data_string.assign(map_str.begin(), map_str.end());
+                }
+            }
             GGML_ASSERT(data_string.size() >= i+1);
             return data_string[i];
         }
         const size_t type_size = gguf_type_size(type);
-        GGML_ASSERT(data.size() % type_size == 0);
-        GGML_ASSERT(data.size() >= (i+1)*type_size);
-        return reinterpret_cast<const T *>(data.data())[i];
+        GGML_ASSERT(get_nbytes() % type_size == 0);
+        GGML_ASSERT(get_nbytes() >= (i+1)*type_size);
+        return reinterpret_cast<const T *>(get_data())[i];
+    }
+
+    // same as get_val<std::string>, without copying the strings of a mapped context
+    std::string_view get_str(const size_t i = 0) const {
+        GGML_ASSERT(type == GGUF_TYPE_STRING);
+        if (is_mapped_str()) {
+            GGML_ASSERT(map_str.size() >= i+1);
+            return map_str[i];
+        }
+        GGML_ASSERT(data_string.size() >= i+1);
+        return data_string[i];
     }
 
     void cast(const enum gguf_type new_type) {
         const size_t new_type_size = gguf_type_size(new_type);
-        GGML_ASSERT(data.size() % new_type_size == 0);
+        GGML_ASSERT(get_nbytes() % new_type_size == 0);
         type = new_type;
     }
 };
@@ -203,27 +260,106 @@ struct gguf_tensor_info {
     uint64_t offset;      // offset from start of `data`, must be a multiple of `ALIGNMENT`
 };
 
+// maps a whole file read-only, returns nullptr if the file cannot be mapped
+static void * gguf_map_file(FILE * file, size_t & size) {
+#if defined(_WIN32)
+    HANDLE hfile = (HANDLE) _get_osfhandle(_fileno(file));
+    LARGE_INTEGER file_size;
+    if (hfile == INVALID_HANDLE_VALUE || !GetFileSizeEx(hfile, &file_size) || file_size.QuadPart <= 0 ||
+        uint64_t(file_size.QuadPart) > SIZE_MAX) {
+        return nullptr;
+    }
+    HANDLE hmapping = CreateFileMappingA(hfile, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (hmapping == NULL) {
+        return nullptr;
+    }
+    void * addr = MapViewOfFile(hmapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(hmapping); // the view keeps the mapping alive
+    if (addr == NULL) {
+        return nullptr;
+    }
+    size = file_size.QuadPart;
+    return addr;
+#elif defined(_POSIX_MAPPED_FILES)
+    struct stat st;
+    if (fstat(fileno(file), &st) != 0 || st.st_size <= 0 || uint64_t(st.st_size) > SIZE_MAX) {
+        return nullptr;
+    }
+    void * addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fileno(file), 0);
+    if (addr == MAP_FAILED) {
+        return nullptr;
+    }
+    size = st.st_size;
+    return addr;
+#else
+    GGML_UNUSED(file);
+    GGML_UNUSED(size);
+    return nullptr;
+#endif
+}
+
+static void gguf_unmap_file(void * addr, size_t size) {
+#if defined(_WIN32)
+    GGML_UNUSED(size);
+    UnmapViewOfFile(addr);
+#elif defined(_POSIX_MAPPED_FILES)
+    munmap(addr, size);
+#else
+    GGML_UNUSED(addr);
+    GGML_UNUSED(size);
+#endif
+}
+
 struct gguf_context {
     uint32_t version = GGUF_VERSION;
 
     std::vector<struct gguf_kv> kv;
     std::vector<struct gguf_tensor_info> info;
 
+    // key and tensor name -> id
+    std::unordered_map<std::string, int64_t> kv_index;
+    std::unordered_map<std::string, int64_t> info_index;
+
     size_t alignment = GGUF_DEFAULT_ALIGNMENT;
     size_t offset    = 0; // offset of `data` from beginning of file
     size_t size      = 0; // size of `data` in bytes
 
     void * data = nullptr;
+
+    // mapping of the file for gguf_init_from_file_mmap, the mapped KV pairs point into it
+    void *     map_addr = nullptr;
+    size_t     map_size = 0;
+    std::mutex map_mutex;
+
+    ~gguf_context() {
+        if (map_addr) {
+            gguf_unmap_file(map_addr, map_size);
+        }
+    }
 };
 
+template <typename... Args>
+static void gguf_emplace_kv(struct gguf_context * ctx, Args &&... args) {
+    ctx->kv.emplace_back(std::forward<Args>(args)...);
+    ctx->kv_index[ctx->kv.back().get_key()] = ctx->kv.size() - 1;
+}
+
 struct gguf_reader {
     FILE * file;
 
+    // if not null, the file is read from this mapping instead
+    const char *   map_addr = nullptr;
+    size_t         map_size = 0;
+    mutable size_t map_pos  = 0;
+
     gguf_reader(FILE * file) : file(file) {}
 
+    gguf_reader(FILE * file, const void * map_addr, size_t map_size)
+        : file(file), map_addr((const char *) map_addr), map_size(map_size) {}
+
     template <typename T>
     bool read(T & dst) const {
-        return fread(&dst, 1, sizeof(dst), file) == sizeof(dst);
+        return read(&dst, sizeof(dst));
     }
 
     template <typename T>
@@ -277,13 +413,66 @@ struct gguf_reader {
         if (!read(size)) {
             return false;
         }
+        if (map_addr && size > remaining()) {
+            return false;
+        }
         dst.resize(size);
-        return fread(dst.data(), 1, dst.length(), file) == dst.length();
+        return read(dst.data(), dst.length());
+    }
+
+    // reads a string of the mapping without copying it
+    bool read(std::string_view & dst) const {
+        uint64_t size = -1;
+        if (!read(size)) {
+            return false;
+        }
+        const char * data = view(size);
+        if (!data) {
+            return false;
+        }
+        dst = std::string_view(data, size);
+        return true;
     }
 
     bool read(void * dst, const size_t size) const {
+        if (map_addr) {
+            const char * src = view(size);
+            if (!src) {
+                return false;
+            }
+            memcpy(dst, src, size);
+            return true;
+        }
         return fread(dst, 1, size, file) == size;
     }
+
+    // returns a pointer to the next size bytes of the mapping and skips them, nullptr if they are out of bounds
+    const char * view(const size_t size) const {
+        GGML_ASSERT(map_addr);
+        if (size > remaining()) {
+            return nullptr;
+        }
+        const char * data = map_addr + map_pos;
+        map_pos += size;
+        return data;
+    }
+
+    size_t remaining() const {
+        GGML_ASSERT(map_addr);
+        return map_pos < map_size ? map_size - map_pos : 0;
+    }
+
+    size_t tell() const {
+        return map_addr ? map_pos : ftell(file);
+    }
+
+    bool seek(const size_t offset) const {
+        if (map_addr) {
+            map_pos = offset;
+            return true;
+        }
+        return fseek(file, offset, SEEK_SET) == 0;
+    }
 };
 
 struct gguf_context * gguf_init_empty(void) {
@@ -316,10 +505,49 @@ bool gguf_read_emplace_helper(const struct gguf_reader & gr, std::vector<struct
     return true;
 }
 
-struct gguf_context * gguf_init_from_file_impl(FILE * file, struct gguf_init_params params) {
-    const struct gguf_reader gr(file);
+// reads a string or a numeric array of a mapped file without copying it
+static bool gguf_read_map_helper(const struct gguf_reader & gr, struct gguf_context * ctx, const std::string & key, const enum gguf_type type, const bool is_array, const size_t n) {
+    struct gguf_kv kv(key, type, is_array);
+
+    if (type == GGUF_TYPE_STRING) {
+        // each string takes at least the 8 bytes of its length
+        if (n > gr.remaining()/sizeof(uint64_t)) {
+            GGML_LOG_ERROR("%s: array of %zu strings for key '%s' is out of bounds\n", __func__, n, key.c_str());
+            return false;
+        }
+        kv.map_str.resize(n);
+        for (size_t i = 0; i < n; ++i) {
+            if (!gr.read(kv.map_str[i])) {
+                return false;
+            }
+        }
+        kv.map_mutex = &ctx->map_mutex;
+    } else {
+        const size_t type_size = gguf_type_size(type);
+        if (n > gr.remaining()/type_size) {
+            GGML_LOG_ERROR("%s: array of %zu elements for key '%s' is out of bounds\n", __func__, n, key.c_str());
+            return false;
+        }
+        kv.map_nbytes = n*type_size;
+        kv.map_data   = (const int8_t *) gr.view(kv.map_nbytes);
+    }
+
+    ctx->kv.push_back(std::move(kv));
+    return true;
+}
+
+static struct gguf_context * gguf_init_impl(FILE * file, struct gguf_init_params params, bool use_mmap) {
     struct gguf_context * ctx = new gguf_context;
 
+    if (use_mmap) {
+        ctx->map_addr = gguf_map_file(file, ctx->map_size);
+        if (!ctx->map_addr) {
+            GGML_LOG_DEBUG("%s: failed to map the file, reading it instead\n", __func__);
+        }
+    }
+
+    const struct gguf_reader gr = ctx->map_addr ? gguf_reader(file, ctx->map_addr, ctx->map_size) : gguf_reader(file);
+
     bool ok = true;
 
     // file magic
@@ -422,9 +650,10 @@ struct gguf_context * gguf_init_from_file_impl(FILE * file, struct gguf_init_par
                 GGML_LOG_ERROR("%s: encountered bad_alloc error while reading key %" PRIi64 "\n", __func__, i);
                 ok = false;
             }
-            for (size_t j = 0; ok && j < ctx->kv.size(); ++j) {
-                if (key == ctx->kv[j].key) {
-                    GGML_LOG_ERROR("%s: duplicate key '%s' for tensors %zu and %" PRIi64 " \n", __func__, key.c_str(), j, i);
+            if (ok) {
+                const auto it = ctx->kv_index.find(key);
+                if (it != ctx->kv_index.end()) {
+                    GGML_LOG_ERROR("%s: duplicate key '%s' for tensors %" PRIi64 " and %" PRIi64 " \n", __func__, key.c_str(), it->second, i);
                     ok = false;
                 }
             }
@@ -442,25 +671,38 @@ struct gguf_context * gguf_init_from_file_impl(FILE * file, struct gguf_init_par
                 break;
             }
 
-            switch (type) {
-                case GGUF_TYPE_UINT8:   ok = ok && gguf_read_emplace_helper<uint8_t>    (gr, ctx->kv, key, is_array, n); break;
-                case GGUF_TYPE_INT8:    ok = ok && gguf_read_emplace_helper<int8_t>     (gr, ctx->kv, key, is_array, n); break;
-                case GGUF_TYPE_UINT16:  ok = ok && gguf_read_emplace_helper<uint16_t>   (gr, ctx->kv, key, is_array, n); break;
-                case GGUF_TYPE_INT16:   ok = ok && gguf_read_emplace_helper<int16_t>    (gr, ctx->kv, key, is_array, n); break;
-                case GGUF_TYPE_UINT32:  ok = ok && gguf_read_emplace_helper<uint32_t>   (gr, ctx->kv, key, is_array, n); break;
-                case GGUF_TYPE_INT32:   ok = ok && gguf_read_emplace_helper<int32_t>    (gr, ctx->kv, key, is_array, n); break;
-                case GGUF_TYPE_FLOAT32: ok = ok && gguf_read_emplace_helper<float>      (gr, ctx->kv, key, is_array, n); break;
-                case GGUF_TYPE_BOOL:    ok = ok && gguf_read_emplace_helper<bool>       (gr, ctx->kv, key, is_array, n); break;
-                case GGUF_TYPE_STRING:  ok = ok && gguf_read_emplace_helper<std::string>(gr, ctx->kv, key, is_array, n); break;
-                case GGUF_TYPE_UINT64:  ok = ok && gguf_read_emplace_helper<uint64_t>   (gr, ctx->kv, key, is_array, n); break;
-                case GGUF_TYPE_INT64:   ok = ok && gguf_read_emplace_helper<int64_t>    (gr, ctx->kv, key, is_array, n); break;
-                case GGUF_TYPE_FLOAT64: ok = ok && gguf_read_emplace_helper<double>     (gr, ctx->kv, key, is_array, n); break;
-                case GGUF_TYPE_ARRAY:
-                default:
-                    {
-                        GGML_LOG_ERROR("%s: key '%s' has invalid GGUF type %d\n", __func__, key.c_str(), type);
-                        ok = false;
-                    } break;
+            // strings and numeric arrays are not copied from a mapped file, unless the array is misaligned
+            // bools are always copied, so that they are read as 0 or 1
+            const bool map_value = gr.map_addr &&
+                (type == GGUF_TYPE_STRING || (is_array && type != GGUF_TYPE_BOOL && gguf_type_size(type) != 0 &&
+                 (uintptr_t) (gr.map_addr + gr.map_pos) % gguf_type_size(type) == 0));
+
+            if (map_value) {
+                ok = ok && gguf_read_map_helper(gr, ctx, key, type, is_array, n);
+            } else {
+                switch (type) {
+                    case GGUF_TYPE_UINT8:   ok = ok && gguf_read_emplace_helper<uint8_t>    (gr, ctx->kv, key, is_array, n); break;
+                    case GGUF_TYPE_INT8:    ok = ok && gguf_read_emplace_helper<int8_t>     (gr, ctx->kv, key, is_array, n); break;
+                    case GGUF_TYPE_UINT16:  ok = ok && gguf_read_emplace_helper<uint16_t>   (gr, ctx->kv, key, is_array, n); break;
+                    case GGUF_TYPE_INT16:   ok = ok && gguf_read_emplace_helper<int16_t>    (gr, ctx->kv, key, is_array, n); break;
+                    case GGUF_TYPE_UINT32:  ok = ok && gguf_read_emplace_helper<uint32_t>   (gr, ctx->kv, key, is_array, n); break;
+                    case GGUF_TYPE_INT32:   ok = ok && gguf_read_emplace_helper<int32_t>    (gr, ctx->kv, key, is_array, n); break;
+                    case GGUF_TYPE_FLOAT32: ok = ok && gguf_read_emplace_helper<float>      (gr, ctx->kv, key, is_array, n); break;
+                    case GGUF_TYPE_BOOL:    ok = ok && gguf_read_emplace_helper<bool>       (gr, ctx->kv, key, is_array, n); break;
+                    case GGUF_TYPE_STRING:  ok = ok && gguf_read_emplace_helper<std::string>(gr, ctx->kv, key, is_array, n); break;
+                    case GGUF_TYPE_UINT64:  ok = ok && gguf_read_emplace_helper<uint64_t>   (gr, ctx->kv, key, is_array, n); break;
+                    case GGUF_TYPE_INT64:   ok = ok && gguf_read_emplace_helper<int64_t>    (gr, ctx->kv, key, is_array, n); break;
+                    case GGUF_TYPE_FLOAT64: ok = ok && gguf_read_emplace_helper<double>     (gr, ctx->kv, key, is_array, n); break;
+                    case GGUF_TYPE_ARRAY:
+                    default:
+                        {
+                            GGML_LOG_ERROR("%s: key '%s' has invalid GGUF type %d\n", __func__, key.c_str(), type);
+                            ok = false;
+                        } break;
+                }
+            }
+            if (ok) {
+                ctx->kv_index[key] = i;
             }
         }
 
@@ -505,9 +747,10 @@ struct gguf_context * gguf_init_from_file_impl(FILE * file, struct gguf_init_par
             ggml_set_name(&info.t, name.c_str());
 
             // make sure there are no duplicate tensor names
-            for (int64_t j = 0; ok && j < i; ++j) {
-                if (strcmp(info.t.name, ctx->info[j].t.name) == 0) {
-                    GGML_LOG_ERROR("%s: duplicate tensor name '%s' for tensors %" PRIi64 " and %" PRIi64 "\n", __func__, info.t.name, j, i);
+            if (ok) {
+                const auto it = ctx->info_index.find(info.t.name);
+                if (it != ctx->info_index.end()) {
+                    GGML_LOG_ERROR("%s: duplicate tensor name '%s' for tensors %" PRIi64 " and %" PRIi64 "\n", __func__, info.t.name, it->second, i);
                     ok = false;
                     break;
                 }
@@ -595,6 +838,7 @@ struct gguf_context * gguf_init_from_file_impl(FILE * file, struct gguf_init_par
         // tensor data offset within buffer
         ok = ok && gr.read(info.offset);
 
+        ctx->info_index[info.t.name] = ctx->info.size();
         ctx->info.push_back(info);
     }
 
@@ -606,14 +850,14 @@ struct gguf_context * gguf_init_from_file_impl(FILE * file, struct gguf_init_par
     GGML_ASSERT(int64_t(ctx->info.size()) == n_tensors);
 
     // we require the data section to be aligned, so take into account any padding
-    if (fseek(file, GGML_PAD(ftell(file), ctx->alignment), SEEK_SET) != 0) {
+    if (!gr.seek(GGML_PAD(gr.tell(), ctx->alignment))) {
         GGML_LOG_ERROR("%s: failed to seek to beginning of data section\n", __func__);
         gguf_free(ctx);
         return nullptr;
     }
 
     // store the current file offset - this is where the data section starts
-    ctx->offset = ftell(file);
+    ctx->offset = gr.tell();
 
     // compute the total size of the data section, taking into account the alignment
     {
@@ -719,6 +963,14 @@ struct gguf_context * gguf_init_from_file_impl(FILE * file, struct gguf_init_par
     return ctx;
 }
 
+struct gguf_context * gguf_init_from_file_impl(FILE * file, struct gguf_init_params params) {
+    return gguf_init_impl(file, params, /*use_mmap =*/ false);
+}
+
+struct gguf_context * gguf_init_from_file_mmap_impl(FILE * file, struct gguf_init_params params) {
+    return gguf_init_impl(file, params, /*use_mmap =*/ true);
+}
+
 struct gguf_context * gguf_init_from_file(const char * fname, struct gguf_init_params params) {
     FILE * file = ggml_fopen(fname, "rb");
 
@@ -732,6 +984,19 @@ struct gguf_context * gguf_init_from_file(const char * fname, struct gguf_init_p
     return result;
 }
 
+struct gguf_context * gguf_init_from_file_mmap(const char * fname, struct gguf_init_params params) {
+    FILE * file = ggml_fopen(fname, "rb");
+
+    if (!file) {
+        GGML_LOG_ERROR("%s: failed to open GGUF file '%s'\n", __func__, fname);
+        return nullptr;
+    }
+
+    struct gguf_context * result = gguf_init_from_file_mmap_impl(file, params);
+    fclose(file);
+    return result;
+}
+
 void gguf_free(struct gguf_context * ctx) {
     if (ctx == nullptr) {
         return;
@@ -762,18 +1027,8 @@ int64_t gguf_get_n_kv(const struct gguf_context * ctx) {
 
 int64_t gguf_find_key(const struct gguf_context * ctx, const char * key) {
     // return -1 if key not found
-    int64_t keyfound = -1;
-
-    const int64_t n_kv = gguf_get_n_kv(ctx);
-
-    for (int64_t i = 0; i < n_kv; ++i) {
-        if (strcmp(key, gguf_get_key(ctx, i)) == 0) {
-            keyfound = i;
-            break;
-        }
-    }
-
-    return keyfound;
+    const auto it = ctx->kv_index.find(key);
+    return it == ctx->kv_index.end() ? -1 : it->second;
 }
 
 const char * gguf_get_key(const struct gguf_context * ctx, int64_t key_id) {
@@ -795,25 +1050,33 @@ enum gguf_type gguf_get_arr_type(const struct gguf_context * ctx, int64_t key_id
 const void * gguf_get_arr_data(const struct gguf_context * ctx, int64_t key_id) {
     GGML_ASSERT(key_id >= 0 && key_id < gguf_get_n_kv(ctx));
     GGML_ASSERT(ctx->kv[key_id].get_type() != GGUF_TYPE_STRING);
-    return ctx->kv[key_id].data.data();
+    return ctx->kv[key_id].get_data();
 }
 
 const char * gguf_get_arr_str(const struct gguf_context * ctx, int64_t key_id, size_t i) {
     GGML_ASSERT(key_id >= 0 && key_id < gguf_get_n_kv(ctx));
     GGML_ASSERT(ctx->kv[key_id].get_type() == GGUF_TYPE_STRING);
-    return ctx->kv[key_id].data_string[i].c_str();
+    return ctx->kv[key_id].get_val<std::string>(i).c_str();
+}
+
+const char * gguf_get_arr_str_view(const struct gguf_context * ctx, int64_t key_id, size_t i, size_t * len) {
+    GGML_ASSERT(key_id >= 0 && key_id < gguf_get_n_kv(ctx));
+    GGML_ASSERT(ctx->kv[key_id].get_type() == GGUF_TYPE_STRING);
+    const std::string_view str = ctx->kv[key_id].get_str(i);
+    *len = str.size();
+    return str.data();
 }
 
 size_t gguf_get_arr_n(const struct gguf_context * ctx, int64_t key_id) {
     GGML_ASSERT(key_id >= 0 && key_id < gguf_get_n_kv(ctx));
 
     if (ctx->kv[key_id].type == GGUF_TYPE_STRING) {
-        return ctx->kv[key_id].data_string.size();
+        return ctx->kv[key_id].is_mapped_str() ? ctx->kv[key_id].map_str.size() : ctx->kv[key_id].data_string.size();
     }
 
     const size_t type_size = gguf_type_size(ctx->kv[key_id].type);
-    GGML_ASSERT(ctx->kv[key_id].data.size() % type_size == 0);
-    return ctx->kv[key_id].data.size() / type_size;
+    GGML_ASSERT(ctx->kv[key_id].get_nbytes() % type_size == 0);
+    return ctx->kv[key_id].get_nbytes() / type_size;
 }
 
 uint8_t gguf_get_val_u8(const struct gguf_context * ctx, int64_t key_id) {
@@ -888,11 +1151,19 @@ const char * gguf_get_val_str(const struct gguf_context * ctx, int64_t key_id) {
     return ctx->kv[key_id].get_val<std::string>().c_str();
 }
 
+const char * gguf_get_val_str_view(const struct gguf_context * ctx, int64_t key_id, size_t * len) {
+    GGML_ASSERT(key_id >= 0 && key_id < gguf_get_n_kv(ctx));
+    GGML_ASSERT(ctx->kv[key_id].get_ne() == 1);
+    const std::string_view str = ctx->kv[key_id].get_str();
+    *len = str.size();
+    return str.data();
+}
+
 const void * gguf_get_val_data(const struct gguf_context * ctx, int64_t key_id) {
     GGML_ASSERT(key_id >= 0 && key_id < gguf_get_n_kv(ctx));
     GGML_ASSERT(ctx->kv[key_id].get_ne() == 1);
     GGML_ASSERT(ctx->kv[key_id].get_type() != GGUF_TYPE_STRING);
-    return ctx->kv[key_id].data.data();
+    return ctx->kv[key_id].get_data();
 }
 
 int64_t gguf_get_n_tensors(const struct gguf_context * ctx) {
@@ -901,18 +1172,8 @@ int64_t gguf_get_n_tensors(const struct gguf_context * ctx) {
 
 int64_t gguf_find_tensor(const struct gguf_context * ctx, const char * name) {
     // return -1 if tensor not found
-    int64_t tensor_id = -1;
-
-    const int64_t n_tensors = gguf_get_n_tensors(ctx);
-
-    for (int64_t i = 0; i < n_tensors; ++i) {
-        if (strcmp(name, gguf_get_tensor_name(ctx, i)) == 0) {
-            tensor_id = i;
-            break;
-        }
-    }
-
-    return tensor_id;
+    const auto it = ctx->info_index.find(name);
+    return it == ctx->info_index.end() ? -1 : it->second;
 }
 
 size_t gguf_get_tensor_offset(const struct gguf_context * ctx, int64_t tensor_id) {
@@ -939,6 +1200,12 @@ int64_t gguf_remove_key(struct gguf_context * ctx, const char * key) {
     const int64_t key_id = gguf_find_key(ctx, key);
     if (key_id >= 0) {
         ctx->kv.erase(ctx->kv.begin() + key_id);
+        ctx->kv_index.erase(key);
+        for (auto & it : ctx->kv_index) {
+            if (it.second > key_id) {
+                it.second--;
+            }
+        }
     }
     return key_id;
 }
@@ -958,73 +1225,73 @@ static void gguf_check_reserved_keys(const std::string & key, const T val) {
 void gguf_set_val_u8(struct gguf_context * ctx, const char * key, uint8_t val) {
     gguf_check_reserved_keys(key, val);
     gguf_remove_key(ctx, key);
-    ctx->kv.emplace_back(key, val);
+    gguf_emplace_kv(ctx, key, val);
 }
 
 void gguf_set_val_i8(struct gguf_context * ctx, const char * key, int8_t val) {
     gguf_check_reserved_keys(key, val);
     gguf_remove_key(ctx, key);
-    ctx->kv.emplace_back(key, val);
+    gguf_emplace_kv(ctx, key, val);
 }
 
 void gguf_set_val_u16(struct gguf_context * ctx, const char * key, uint16_t val) {
     gguf_check_reserved_keys(key, val);
     gguf_remove_key(ctx, key);
-    ctx->kv.emplace_back(key, val);
+    gguf_emplace_kv(ctx, key, val);
 }
 
 void gguf_set_val_i16(struct gguf_context * ctx, const char * key, int16_t val) {
     gguf_check_reserved_keys(key, val);
     gguf_remove_key(ctx, key);
-    ctx->kv.emplace_back(key, val);
+    gguf_emplace_kv(ctx, key, val);
 }
 
 void gguf_set_val_u32(struct gguf_context * ctx, const char * key, uint32_t val) {
     gguf_check_reserved_keys(key, val);
     gguf_remove_key(ctx, key);
-    ctx->kv.emplace_back(key, val);
+    gguf_emplace_kv(ctx, key, val);
 }
 
 void gguf_set_val_i32(struct gguf_context * ctx, const char * key, int32_t val) {
     gguf_check_reserved_keys(key, val);
     gguf_remove_key(ctx, key);
-    ctx->kv.emplace_back(key, val);
+    gguf_emplace_kv(ctx, key, val);
 }
 
 void gguf_set_val_f32(struct gguf_context * ctx, const char * key, float val) {
     gguf_check_reserved_keys(key, val);
     gguf_remove_key(ctx, key);
-    ctx->kv.emplace_back(key, val);
+    gguf_emplace_kv(ctx, key, val);
 }
 
 void gguf_set_val_u64(struct gguf_context * ctx, const char * key, uint64_t val) {
     gguf_check_reserved_keys(key, val);
     gguf_remove_key(ctx, key);
-    ctx->kv.emplace_back(key, val);
+    gguf_emplace_kv(ctx, key, val);
 }
 
 void gguf_set_val_i64(struct gguf_context * ctx, const char * key, int64_t val) {
     gguf_check_reserved_keys(key, val);
     gguf_remove_key(ctx, key);
-    ctx->kv.emplace_back(key, val);
+    gguf_emplace_kv(ctx, key, val);
 }
 
 void gguf_set_val_f64(struct gguf_context * ctx, const char * key, double val) {
     gguf_check_reserved_keys(key, val);
     gguf_remove_key(ctx, key);
-    ctx->kv.emplace_back(key, val);
+    gguf_emplace_kv(ctx, key, val);
 }
 
 void gguf_set_val_bool(struct gguf_context * ctx, const char * key, bool val) {
     gguf_check_reserved_keys(key, val);
     gguf_remove_key(ctx, key);
-    ctx->kv.emplace_back(key, val);
+    gguf_emplace_kv(ctx, key, val);
 }
 
 void gguf_set_val_str(struct gguf_context * ctx, const char * key, const char * val) {
     gguf_check_reserved_keys(key, val);
     gguf_remove_key(ctx, key);
-    ctx->kv.emplace_back(key, std::string(val));
+    gguf_emplace_kv(ctx, key, std::string(val));
 }
 
 void gguf_set_arr_data(struct gguf_context * ctx, const char * key, enum gguf_type type, const void * data, size_t n) {
@@ -1036,7 +1303,7 @@ void gguf_set_arr_data(struct gguf_context * ctx, const char * key, enum gguf_ty
     if (!tmp.empty()) {
         memcpy(tmp.data(), data, nbytes);
     }
-    ctx->kv.emplace_back(key, tmp);
+    gguf_emplace_kv(ctx, key, tmp);
     ctx->kv.back().cast(type);
 }
 
@@ -1048,7 +1315,7 @@ void gguf_set_arr_str(struct gguf_context * ctx, const char * key, const char **
     for (size_t i = 0; i < n; ++i) {
         tmp[i] = data[i];
     }
-    ctx->kv.emplace_back(key, tmp);
+    gguf_emplace_kv(ctx, key, tmp);
 }
 
 // set or add KV pairs from another context
@@ -1091,12 +1358,12 @@ void gguf_set_kv(struct gguf_context * ctx, const struct gguf_context * src) {
             case GGUF_TYPE_INT64:
             case GGUF_TYPE_FLOAT64:
             case GGUF_TYPE_BOOL: {
-                gguf_set_arr_data(ctx, kv.get_key().c_str(), kv.get_type(), kv.data.data(), ne);
+                gguf_set_arr_data(ctx, kv.get_key().c_str(), kv.get_type(), kv.get_data(), ne);
             } break;
             case GGUF_TYPE_STRING: {
                 std::vector<const char *> tmp(ne);
                 for (size_t j = 0; j < ne; ++j) {
-                    tmp[j] = kv.data_string[j].c_str();
+                    tmp[j] = kv.get_val<std::string>(j).c_str();
                 }
                 gguf_set_arr_str(ctx, kv.get_key().c_str(), tmp.data(), ne);
             } break;
@@ -1118,6 +1385,7 @@ void gguf_add_tensor(
     ti.t = *tensor;
     ti.offset = ctx->info.empty() ? 0 :
         ctx->info.back().offset + GGML_PAD(ggml_nbytes(&ctx->info.back().t), ctx->alignment);
+    ctx->info_index[ti.t.name] = ctx->info.size();
     ctx->info.push_back(ti);
 }
 
@@ -1171,12 +1439,20 @@ struct gguf_writer {
         buf.insert(buf.end(), val.begin(), val.end());
     }
 
+    void write(const int8_t * data, const size_t size) const {
+        buf.insert(buf.end(), data, data + size);
+    }
+
     void write(const bool & val) const {
         const int8_t val8 = val ? 1 : 0;
         write(val8);
     }
 
     void write(const std::string & val) const {
+        write(std::string_view(val));
+    }
+
+    void write(const std::string_view & val) const {
         {
             const uint64_t n = val.length();
             write(n);
@@ -1222,7 +1498,7 @@ struct gguf_writer {
             case GGUF_TYPE_UINT64:
             case GGUF_TYPE_INT64:
             case GGUF_TYPE_FLOAT64: {
-                write(kv.data);
+                write(kv.get_data(), kv.get_nbytes());
             } break;
             case GGUF_TYPE_BOOL: {
                 for (size_t i = 0; i < ne; ++i) {
@@ -1231,7 +1507,7 @@ struct gguf_writer {
             } break;
             case GGUF_TYPE_STRING: {
                 for (size_t i = 0; i < ne; ++i) {
-                    write(kv.get_val<std::string>(i));
+                    write(kv.get_str(i));
                 }
             } break;
             case GGUF_TYPE_ARRAY:
@@ -322,11 +322,19 @@ extern "C" {
         // override key-value pairs of the model meta data
         const struct llama_model_kv_override * kv_overrides;
 
+        // directory of the cache of the weights converted for the CPU (e.g. repacked Q4_0), NULL = disabled
+        // the converted weights are saved on the first load and mapped from the cache on the next loads
+        const char * repack_cache_dir;
+
+        // number of threads reading the weights in parallel, in file order, when mmap is not used (0 = sequential reads)
+        int32_t n_load_threads;
+
         // Keep the booleans together to avoid misalignment during copy-by-value.
         bool vocab_only;    // only load the vocabulary, no weights
         bool use_mmap;      // use mmap if possible
         bool use_mlock;     // force system to keep model in RAM
         bool check_tensors; // validate model tensor data
+        bool use_direct_io; // read the weights bypassing the page cache (O_DIRECT) where supported, disables mmap
     };
 
     // NOTE: changing the default values of parameters marked as [EXPERIMENTAL] may cause crashes or incorrect results in certain configurations
@@ -365,6 +373,10 @@ extern "C" {
         ggml_abort_callback abort_callback;
         void *              abort_callback_data;
 
+        // paged KV placement: when a batch does not fit in contiguous KV cells, split it into runs of at least
+        // n_kv_block free cells instead of failing, 0 = disabled (default)
+        uint32_t n_kv_block;
+
         // Keep the booleans together and at the end of the struct to avoid misalignment during copy-by-value.
         bool embeddings;  // if true, extract embeddings (together with logits)
         bool offload_kqv; // offload the KQV ops (including the KV cache) to GPU
@@ -374,6 +386,8 @@ extern "C" {
         bool swa_full;    // use full-size SWA cache (https://github.com/ggml-org/llama.cpp/pull/13194#issuecomment-2868343055)
                           // NOTE: setting to false when n_seq_max > 1 can cause bad performance in some cases
                           //       ref: https://github.com/ggml-org/llama.cpp/pull/13845#issuecomment-2924800573
+        bool swap_output; // double-buffer the outputs (logits, embeddings) - the outputs of the previous llama_decode()
+                          // remain readable with llama_get_logits_prev_ith() while the next one is being computed
     };
 
     // model quantization parameters
@@ -1018,6 +1032,13 @@ extern "C" {
     // otherwise: float[n_embd] (1-dimensional)
     LLAMA_API float * llama_get_embeddings_seq(struct llama_context * ctx, llama_seq_id seq_id);
 
+    // Outputs of the llama_decode() call preceding the last one (requires llama_context_params.swap_output)
+    // The indices refer to the batch of that call. These do not wait for the last llama_decode() to complete,
+    // so the outputs of a batch can be sampled while the next batch is computed.
+    // returns NULL for invalid ids or if the outputs are not double-buffered.
+    LLAMA_API float * llama_get_logits_prev_ith    (struct llama_context * ctx, int32_t i);
+    LLAMA_API float * llama_get_embeddings_prev_ith(struct llama_context * ctx, int32_t i);
+
     //
     // Vocab
     //
@@ -1265,6 +1286,11 @@ extern "C" {
     /// @details Dynamic temperature implementation (a.k.a. entropy) described in the paper https://arxiv.org/abs/2309.02772.
     LLAMA_API struct llama_sampler * llama_sampler_init_temp_ext   (float   t, float   delta, float exponent);
 
+    /// @details Same as the chain top_k -> top_p -> min_p -> temp -> dist, executed in a single sampler that
+    /// selects the survivors without sorting the full candidate array and computes a single softmax over them.
+    /// Setting top_k <= 0, top_p >= 1.0f or min_p <= 0.0f disables the corresponding stage.
+    LLAMA_API struct llama_sampler * llama_sampler_init_fused      (int32_t top_k, float top_p, float min_p, size_t min_keep, float t, uint32_t seed);
+
     /// @details XTC sampler as described in https://github.com/oobabooga/text-generation-webui/pull/6335
     LLAMA_API struct llama_sampler * llama_sampler_init_xtc        (float   p, float   t,     size_t min_keep, uint32_t seed);
 
@@ -1426,6 +1452,9 @@ extern "C" {
 
         int32_t n_p_eval;
         int32_t n_eval;
+
+        double  t_inp_ms; // time spent setting the graph inputs (KQ masks, positions, ...)
+        int32_t n_inp;    // number of ubatches with graph inputs set
     };
 
     struct llama_perf_sampler_data {
@@ -101,7 +101,8 @@ llama_context::llama_context(
 
     cparams.n_ubatch = std::min(cparams.n_batch, params.n_ubatch == 0 ? params.n_batch : params.n_ubatch);
 
-    cparams.op_offload = params.op_offload;
+    cparams.op_offload  = params.op_offload;
+    cparams.swap_output = params.swap_output;
 
     const uint32_t n_ctx_per_seq = cparams.n_ctx / cparams.n_seq_max;
 
@@ -192,6 +193,7 @@ llama_context::llama_context(
             /*.type_k   =*/ params.type_k,
             /*.type_v   =*/ params.type_v,
             /*.swa_full =*/ params.swa_full,
+            /*.n_block  =*/ params.n_kv_block,
         };
 
         memory.reset(model.create_memory(params_mem, cparams));
@@ -491,38 +493,43 @@ enum llama_pooling_type llama_context::pooling_type() const {
     return cparams.pooling_type;
 }
 
+// map the batch index i to a row of the output buffers - throws for invalid ids
+static int64_t output_row(const std::vector<int32_t> & output_ids, uint32_t n_outputs, int32_t i) {
+    int64_t j = -1;
+
+    if (i < 0) {
+        j = n_outputs + i;
+        if (j < 0) {
+            throw std::runtime_error(format("negative index out of range [0, %d)", n_outputs));
+        }
+    } else if ((size_t) i >= output_ids.size()) {
+        throw std::runtime_error(format("out of range [0, %zu)", output_ids.size()));
+    } else {
+        j = output_ids[i];
+    }
+
+    if (j < 0) {
+        throw std::runtime_error(format("batch.logits[%d] != true", i));
+    }
+    if (j >= n_outputs) {
+        // This should not happen
+        throw std::runtime_error(format("corrupt output buffer (j=%" PRId64 ", n_outputs=%d)", j, n_outputs));
+    }
+
+    return j;
+}
+
 float * llama_context::get_logits() {
     return logits;
 }
 
 float * llama_context::get_logits_ith(int32_t i) {
-    int64_t j = -1;
-
     try {
         if (logits == nullptr) {
             throw std::runtime_error("no logits");
         }
 
-        if (i < 0) {
-            j = n_outputs + i;
-            if (j < 0) {
-                throw std::runtime_error(format("negative index out of range [0, %d)", n_outputs));
-            }
-        } else if ((size_t) i >= output_ids.size()) {
-            throw std::runtime_error(format("out of range [0, %zu)", output_ids.size()));
-        } else {
-            j = output_ids[i];
-        }
-
-        if (j < 0) {
-            throw std::runtime_error(format("batch.logits[%d] != true", i));
-        }
-        if (j >= n_outputs) {
-            // This should not happen
-            throw std::runtime_error(format("corrupt output buffer (j=%" PRId64 ", n_outputs=%d)", j, n_outputs));
-        }
-
-        return logits + j*model.vocab.n_tokens();
+        return logits + output_row(output_ids, n_outputs, i)*model.vocab.n_tokens();
     } catch (const std::exception & err) {
         LLAMA_LOG_ERROR("%s: invalid logits id %d, reason: %s\n", __func__, i, err.what());
 #ifndef NDEBUG
@@ -538,33 +545,12 @@ float * llama_context::get_embeddings() {
 }
 
 float * llama_context::get_embeddings_ith(int32_t i) {
-    int64_t j = -1;
-
     try {
         if (embd == nullptr) {
             throw std::runtime_error("no embeddings");
         }
 
-        if (i < 0) {
-            j = n_outputs + i;
-            if (j < 0) {
-                throw std::runtime_error(format("negative index out of range [0, %d)", n_outputs));
-            }
-        } else if ((size_t) i >= output_ids.size()) {
-            throw std::runtime_error(format("out of range [0, %zu)", output_ids.size()));
-        } else {
-            j = output_ids[i];
-        }
-
-        if (j < 0) {
-            throw std::runtime_error(format("batch.logits[%d] != true", i));
-        }
-        if (j >= n_outputs) {
-            // This should not happen
-            throw std::runtime_error(format("corrupt output buffer (j=%" PRId64 ", n_outputs=%d)", j, n_outputs));
-        }
-
-        return embd + j*model.hparams.n_embd;
+        return embd + output_row(output_ids, n_outputs, i)*model.hparams.n_embd;
     } catch (const std::exception & err) {
         LLAMA_LOG_ERROR("%s: invalid embeddings id %d, reason: %s\n", __func__, i, err.what());
 #ifndef NDEBUG
@@ -584,6 +570,38 @@ float * llama_context::get_embeddings_seq(llama_seq_id seq_id) {
     return it->second.data();
 }
 
+float * llama_context::get_logits_prev_ith(int32_t i) {
+    try {
+        if (!cparams.swap_output) {
+            throw std::runtime_error("the outputs are not double-buffered");
+        }
+        if (output_prev.logits == nullptr) {
+            throw std::runtime_error("no logits");
+        }
+
+        return output_prev.logits + output_row(output_prev.output_ids, output_prev.n_outputs, i)*model.vocab.n_tokens();
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: invalid logits id %d, reason: %s\n", __func__, i, err.what());
+        return nullptr;
+    }
+}
+
+float * llama_context::get_embeddings_prev_ith(int32_t i) {
+    try {
+        if (!cparams.swap_output) {
+            throw std::runtime_error("the outputs are not double-buffered");
+        }
+        if (output_prev.embd == nullptr) {
+            throw std::runtime_error("no embeddings");
+        }
+
+        return output_prev.embd + output_row(output_prev.output_ids, output_prev.n_outputs, i)*model.hparams.n_embd;
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: invalid embeddings id %d, reason: %s\n", __func__, i, err.what());
+        return nullptr;
+    }
+}
+
 void llama_context::attach_threadpool(
            ggml_threadpool_t threadpool,
            ggml_threadpool_t threadpool_batch) {
@@ -707,7 +725,14 @@ llm_graph_result_ptr llama_context::process_ubatch(const llama_ubatch & ubatch,
         return nullptr;
     }
 
-    res->set_inputs(&ubatch);
+    {
+        const int64_t t_inp_start_us = ggml_time_us();
+
+        res->set_inputs(&ubatch);
+
+        t_inp_us += ggml_time_us() - t_inp_start_us;
+        n_inp++;
+    }
 
     const auto status = graph_compute(gf, ubatch.n_tokens > 1);
     if (status != GGML_STATUS_SUCCESS) {
@@ -920,14 +945,17 @@ int llama_context::decode(const llama_batch & batch_inp) {
 
     GGML_ASSERT((cparams.causal_attn || cparams.n_ubatch >= n_tokens_all) && "non-causal attention requires n_ubatch >= n_tokens");
 
+    // with double-buffered outputs, the outputs of the last decode are handed out while this one is computed
+    // so the async copies into them must be complete
+    if (cparams.swap_output) {
+        synchronize();
+    }
+
     if (t_compute_start_us == 0) {
         t_compute_start_us = ggml_time_us();
     }
     n_queued_tokens += n_tokens_all;
 
-    // TODO: this clear of the buffer can easily be forgotten - need something better
-    embd_seq.clear();
-
     bool did_optimize = false;
 
     // handle any pending defrags/shifts
@@ -978,6 +1006,15 @@ int llama_context::decode(const llama_batch & batch_inp) {
         break;
     }
 
+    // keep the outputs of the previous decode readable while this one is computed
+    // note: this is done only after the memory was prepared, so a failed decode does not discard them
+    if (cparams.swap_output) {
+        output_swap();
+    }
+
+    // TODO: this clear of the buffer can easily be forgotten - need something better
+    embd_seq.clear();
+
     // reserve output buffer
     if (output_reserve(n_outputs_all) < n_outputs_all) {
         LLAMA_LOG_ERROR("%s: could not reserve space for batch with %d outputs\n", __func__, n_outputs_all);
@@ -1272,6 +1309,17 @@ uint32_t llama_context::output_reserve(int32_t n_outputs) {
     return n_outputs_max;
 }
 
+void llama_context::output_swap() {
+    std::swap(buf_output,  output_prev.buf);
+    std::swap(logits_size, output_prev.logits_size);
+    std::swap(logits,      output_prev.logits);
+    std::swap(embd_size,   output_prev.embd_size);
+    std::swap(embd,        output_prev.embd);
+    std::swap(embd_seq,    output_prev.embd_seq);
+    std::swap(n_outputs,   output_prev.n_outputs);
+    std::swap(output_ids,  output_prev.output_ids);
+}
+
 //
 // graph
 //
@@ -1929,8 +1977,10 @@ llama_perf_context_data llama_context::perf_get_data() const {
     data.t_load_ms   = 1e-3 * t_load_us;
     data.t_p_eval_ms = 1e-3 * t_p_eval_us;
     data.t_eval_ms   = 1e-3 * t_eval_us;
+    data.t_inp_ms    = 1e-3 * t_inp_us;
     data.n_p_eval    = std::max(1, n_p_eval);
     data.n_eval      = std::max(1, n_eval);
+    data.n_inp       = std::max(1, n_inp);
 
     return data;
 }
@@ -1939,6 +1989,7 @@ void llama_context::perf_reset() {
     t_start_us  = ggml_time_us();
     t_eval_us   = n_eval = 0;
     t_p_eval_us = n_p_eval = 0;
+    t_inp_us    = n_inp    = 0;
 }
 
 //
@@ -2182,12 +2233,14 @@ llama_context_params llama_context_default_params() {
         /*.type_v                      =*/ GGML_TYPE_F16,
         /*.abort_callback              =*/ nullptr,
         /*.abort_callback_data         =*/ nullptr,
+        /*.n_kv_block                  =*/ 0,
         /*.embeddings                  =*/ false,
         /*.offload_kqv                 =*/ true,
         /*.flash_attn                  =*/ false,
         /*.no_perf                     =*/ true,
         /*.op_offload                  =*/ true,
         /*.swa_full                    =*/ true,
+        /*.swap_output                 =*/ false,
     };
 
     return result;
@@ -2349,6 +2402,14 @@ float * llama_get_embeddings_seq(llama_context * ctx, llama_seq_id seq_id) {
     return ctx->get_embeddings_seq(seq_id);
 }
 
+float * llama_get_logits_prev_ith(llama_context * ctx, int32_t i) {
+    return ctx->get_logits_prev_ith(i);
+}
+
+float * llama_get_embeddings_prev_ith(llama_context * ctx, int32_t i) {
+    return ctx->get_embeddings_prev_ith(i);
+}
+
 // llama adapter API
 
 int32_t llama_set_adapter_lora(
@@ -2807,6 +2868,8 @@ void llama_perf_context_print(const llama_context * ctx) {
             __func__, data.t_p_eval_ms, data.n_p_eval, data.t_p_eval_ms / data.n_p_eval, 1e3 / data.t_p_eval_ms * data.n_p_eval);
     LLAMA_LOG_INFO("%s:        eval time = %10.2f ms / %5d runs   (%8.2f ms per token, %8.2f tokens per second)\n",
             __func__, data.t_eval_ms, data.n_eval, data.t_eval_ms / data.n_eval, 1e3 / data.t_eval_ms * data.n_eval);
+    LLAMA_LOG_INFO("%s:       input time = %10.2f ms / %5d ubatches (%8.2f ms per ubatch)\n",
+            __func__, data.t_inp_ms, data.n_inp, data.t_inp_ms / data.n_inp);
     LLAMA_LOG_INFO("%s:       total time = %10.2f ms / %5d tokens\n", __func__, (t_end_ms - data.t_start_ms), (data.n_p_eval + data.n_eval));
 }
 
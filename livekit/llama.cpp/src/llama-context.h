@@ -62,6 +62,10 @@ struct llama_context {
     float * get_embeddings_ith(int32_t i);
     float * get_embeddings_seq(llama_seq_id seq_id);
 
+    // outputs of the previous decode (cparams.swap_output)
+    float * get_logits_prev_ith(int32_t i);
+    float * get_embeddings_prev_ith(int32_t i);
+
     void attach_threadpool(
             ggml_threadpool_t threadpool,
             ggml_threadpool_t threadpool_batch);
@@ -183,6 +187,10 @@ private:
     // Returns max number of outputs for which space was reserved.
     uint32_t output_reserve(int32_t n_outputs);
 
+    // Keep the outputs of the last decode as the previous outputs and make the other buffer current.
+    // The last decode must have been synchronized.
+    void output_swap();
+
     //
     // graph
     //
@@ -281,6 +289,23 @@ private:
     // host buffer for the model output (logits and embeddings)
     ggml_backend_buffer_ptr buf_output;
 
+    // outputs of the previous decode, swapped with the current ones at the start of each decode (cparams.swap_output)
+    struct {
+        ggml_backend_buffer_ptr buf;
+
+        size_t  logits_size = 0;
+        float * logits      = nullptr;
+
+        size_t  embd_size = 0;
+        float * embd      = nullptr;
+
+        std::map<llama_seq_id, std::vector<float>> embd_seq;
+
+        uint32_t n_outputs = 0;
+
+        std::vector<int32_t> output_ids;
+    } output_prev;
+
     bool has_evaluated_once = false;
 
     // perf
@@ -288,10 +313,12 @@ private:
     mutable int64_t t_load_us   = 0;
     mutable int64_t t_p_eval_us = 0;
     mutable int64_t t_eval_us   = 0;
+    mutable int64_t t_inp_us    = 0;
 
     mutable int64_t t_compute_start_us = 0;
     mutable int64_t n_queued_tokens    = 0;
 
     mutable int32_t n_p_eval = 0; // number of tokens in eval calls for the prompt (with batch size > 1)
     mutable int32_t n_eval   = 0; // number of eval calls
+    mutable int32_t n_inp    = 0; // number of ubatches with graph inputs set
 };
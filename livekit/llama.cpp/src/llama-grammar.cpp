@@ -6,7 +6,9 @@
 
 #include <cmath>
 #include <algorithm>
+#include <mutex>
 #include <stdexcept>
+#include <unordered_map>
 
 //
 // helpers
@@ -823,11 +825,14 @@ llama_grammar_stacks & llama_grammar_get_stacks(struct llama_grammar * grammar)
     return grammar->stacks;
 }
 
-void llama_grammar_accept(struct llama_grammar * grammar, uint32_t chr) {
-    llama_grammar_stacks stacks_new;
-    stacks_new.reserve(grammar->stacks.size());
+static void llama_grammar_accept_chr(
+        const llama_grammar_rules  & rules,
+        const llama_grammar_stacks & stacks,
+        const uint32_t               chr,
+              llama_grammar_stacks & stacks_new) {
+    stacks_new.reserve(stacks.size());
 
-    for (const auto & stack : grammar->stacks) {
+    for (const auto & stack : stacks) {
         if (stack.empty()) {
             continue;
         }
@@ -841,9 +846,14 @@ void llama_grammar_accept(struct llama_grammar * grammar, uint32_t chr) {
             if (!llama_grammar_is_end_of_sequence(pos)) {
                 new_stack.push_back(pos);
             }
-            llama_grammar_advance_stack(grammar->rules, new_stack, stacks_new);
+            llama_grammar_advance_stack(rules, new_stack, stacks_new);
         }
     }
+}
+
+void llama_grammar_accept(struct llama_grammar * grammar, uint32_t chr) {
+    llama_grammar_stacks stacks_new;
+    llama_grammar_accept_chr(grammar->rules, grammar->stacks, chr, stacks_new);
 
     grammar->stacks = std::move(stacks_new);
 }
@@ -903,6 +913,246 @@ llama_grammar_candidates llama_grammar_reject_candidates_for_stack(
     return rejects;
 }
 
+//
+// compiled grammar
+//
+
+// the pieces of the vocabulary decoded to code points and stored in a prefix tree
+// the nodes are in pre-order, so that the subtree of a node is the range of nodes [i + 1, end)
+// tokens sharing a prefix are matched against the grammar only once for that prefix
+struct llama_grammar_token_trie {
+    struct node {
+        uint32_t chr;       // code point of the edge leading to this node
+        uint32_t end;       // one past the last node of the subtree
+        uint32_t tok_begin; // tokens whose code points end at this node
+        uint32_t tok_end;
+    };
+
+    struct token {
+        llama_token        id;
+        llama_partial_utf8 partial_utf8; // trailing incomplete UTF-8 sequence, if any
+    };
+
+    std::vector<node>  nodes;
+    std::vector<token> tokens;   // tokens [0, n_root) have no complete code point
+    uint32_t           n_root = 0;
+
+    std::vector<llama_token> eog; // end-of-generation tokens, allowed iff the grammar can end
+};
+
+// max number of cached masks per grammar, the cache is cleared when it is full
+#define LLAMA_GRAMMAR_MAX_MASKS 512
+
+struct llama_grammar_compiled {
+    std::mutex mutex;
+
+    // built on first use
+    std::unique_ptr<const llama_grammar_token_trie> trie;
+
+    // allowed tokens (one bit per token) keyed by the encoded stacks, see llama_grammar_stacks_key
+    std::unordered_map<std::string, std::shared_ptr<const std::vector<uint32_t>>> masks;
+};
+
+static std::unique_ptr<const llama_grammar_token_trie> llama_grammar_build_trie(const llama_vocab & vocab) {
+    struct entry {
+        std::vector<uint32_t> code_points;
+        llama_grammar_token_trie::token tok;
+    };
+
+    auto trie = std::make_unique<llama_grammar_token_trie>();
+
+    std::vector<entry> entries;
+    entries.reserve(vocab.n_tokens());
+
+    for (llama_token id = 0; id < (llama_token) vocab.n_tokens(); ++id) {
+        if (vocab.is_eog(id)) {
+            trie->eog.push_back(id);
+            continue;
+        }
+
+        const std::string & piece = vocab.token_to_piece(id);
+        if (piece.empty() || piece[0] == 0) {
+            continue;
+        }
+
+        auto decoded = decode_utf8(piece, {});
+        if (decoded.second.n_remain < 0) {
+            // invalid UTF-8, never allowed
+            continue;
+        }
+
+        decoded.first.pop_back(); // terminating 0
+        entries.push_back({ std::move(decoded.first), { id, decoded.second } });
+    }
+
+    // after sorting, the tokens of a node directly follow the tokens of its parent
+    std::stable_sort(entries.begin(), entries.end(), [](const entry & a, const entry & b) {
+        return a.code_points < b.code_points;
+    });
+
+    auto & nodes  = trie->nodes;
+    auto & tokens = trie->tokens;
+
+    std::vector<uint32_t> path; // open nodes from the root to the last inserted node
+    for (const auto & e : entries) {
+        size_t n_common = 0;
+        while (n_common < path.size() && n_common < e.code_points.size() && nodes[path[n_common]].chr == e.code_points[n_common]) {
+            n_common++;
+        }
+        while (path.size() > n_common) {
+            nodes[path.back()].end = nodes.size();
+            path.pop_back();
+        }
+        for (size_t i = n_common; i < e.code_points.size(); ++i) {
+            path.push_back(nodes.size());
+            nodes.push_back({ e.code_points[i], 0, (uint32_t) tokens.size(), (uint32_t) tokens.size() });
+        }
+
+        tokens.push_back(e.tok);
+        if (path.empty()) {
+            trie->n_root++;
+        } else {
+            nodes[path.back()].tok_end = tokens.size();
+        }
+    }
+    while (!path.empty()) {
+        nodes[path.back()].end = nodes.size();
+        path.pop_back();
+    }
+
+    return trie;
+}
+
+// encodes the stacks as (rule, offset) pairs, which do not depend on the address of the rules
+// so that the clones of a grammar share the cached masks
+static std::string llama_grammar_stacks_key(const llama_grammar_rules & rules, const llama_grammar_stacks & stacks) {
+    std::vector<std::pair<const llama_grammar_element *, uint32_t>> begins;
+    begins.reserve(rules.size());
+    for (size_t i = 0; i < rules.size(); ++i) {
+        begins.emplace_back(rules[i].data(), i);
+    }
+    std::sort(begins.begin(), begins.end());
+
+    std::vector<uint32_t> key;
+    for (const auto & stack : stacks) {
+        key.push_back(stack.size());
+        for (const auto * pos : stack) {
+            auto it = std::upper_bound(begins.begin(), begins.end(), std::make_pair(pos, UINT32_MAX)) - 1;
+            key.push_back(it->second);
+            key.push_back(pos - it->first);
+        }
+    }
+
+    return std::string((const char *) key.data(), key.size()*sizeof(uint32_t));
+}
+
+// returns true iff a token ending with the given partial UTF-8 sequence is allowed by one of the stacks
+// (same conditions as llama_grammar_reject_candidates_for_stack at the end of the code points)
+static bool llama_grammar_match_token_end(const llama_grammar_stacks & stacks, const llama_partial_utf8 & partial_utf8) {
+    if (partial_utf8.n_remain == 0) {
+        return !stacks.empty();
+    }
+    for (const auto & stack : stacks) {
+        if (!stack.empty() && llama_grammar_match_partial_char(stack.back(), partial_utf8)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void llama_grammar_fill_mask(
+        const llama_grammar_rules      & rules,
+        const llama_grammar_token_trie & trie,
+        const llama_grammar_stacks     & stacks,
+        uint32_t                         begin,
+        uint32_t                         end,
+        std::vector<uint32_t>          & mask) {
+    for (uint32_t i = begin; i < end; i = trie.nodes[i].end) {
+        const auto & node = trie.nodes[i];
+
+        llama_grammar_stacks stacks_new;
+        llama_grammar_accept_chr(rules, stacks, node.chr, stacks_new);
+        if (stacks_new.empty()) {
+            // no token with this prefix is allowed
+            continue;
+        }
+
+        for (uint32_t it = node.tok_begin; it < node.tok_end; ++it) {
+            const auto & tok = trie.tokens[it];
+            if (llama_grammar_match_token_end(stacks_new, tok.partial_utf8)) {
+                mask[tok.id / 32] |= 1u << (tok.id % 32);
+            }
+        }
+
+        llama_grammar_fill_mask(rules, trie, stacks_new, i + 1, node.end, mask);
+    }
+}
+
+// returns the mask of the tokens allowed in the current state of the grammar
+// if the state is not cached and build is false, returns nullptr
+static std::shared_ptr<const std::vector<uint32_t>> llama_grammar_get_mask(const llama_grammar & grammar, bool build) {
+    auto & compiled = *grammar.compiled;
+
+    const std::string key = llama_grammar_stacks_key(grammar.rules, grammar.stacks);
+
+    const llama_grammar_token_trie * trie = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(compiled.mutex);
+
+        auto it = compiled.masks.find(key);
+        if (it != compiled.masks.end()) {
+            return it->second;
+        }
+
+        if (!build) {
+            return nullptr;
+        }
+
+        if (!compiled.trie) {
+            const int64_t t_start_us = ggml_time_us();
+            compiled.trie = llama_grammar_build_trie(*grammar.vocab);
+            LLAMA_LOG_DEBUG("%s: built token trie with %zu nodes in %.2f ms\n", __func__,
+                    compiled.trie->nodes.size(), (ggml_time_us() - t_start_us) / 1000.0);
+        }
+        trie = compiled.trie.get();
+    }
+
+    auto mask = std::make_shared<std::vector<uint32_t>>((grammar.vocab->n_tokens() + 31) / 32, 0);
+
+    bool allow_eog = false;
+    for (const auto & stack : grammar.stacks) {
+        if (stack.empty()) {
+            allow_eog = true;
+            break;
+        }
+    }
+    if (allow_eog) {
+        for (const llama_token id : trie->eog) {
+            (*mask)[id / 32] |= 1u << (id % 32);
+        }
+    }
+
+    for (uint32_t it = 0; it < trie->n_root; ++it) {
+        const auto & tok = trie->tokens[it];
+        if (llama_grammar_match_token_end(grammar.stacks, tok.partial_utf8)) {
+            (*mask)[tok.id / 32] |= 1u << (tok.id % 32);
+        }
+    }
+
+    llama_grammar_fill_mask(grammar.rules, *trie, grammar.stacks, 0, trie->nodes.size(), *mask);
+
+    {
+        std::lock_guard<std::mutex> lock(compiled.mutex);
+
+        if (compiled.masks.size() >= LLAMA_GRAMMAR_MAX_MASKS) {
+            compiled.masks.clear();
+        }
+        compiled.masks.emplace(key, mask);
+    }
+
+    return mask;
+}
+
 ////////////////////
 
 struct llama_grammar * llama_grammar_init_impl(
@@ -970,6 +1220,7 @@ struct llama_grammar * llama_grammar_init_impl(
         /* .trigger_buffer = */   "",
         /* .trigger_tokens   = */ {},
         /* .trigger_patterns    = */ {},
+        /* .compiled = */         vocab ? std::make_shared<llama_grammar_compiled>() : nullptr,
     };
 }
 
@@ -1075,6 +1326,7 @@ struct llama_grammar * llama_grammar_init_impl(
         /* .trigger_buffer = */   "",
         std::move(vec_trigger_tokens),
         std::move(vec_trigger_patterns),
+        /* .compiled = */         vocab ? std::make_shared<llama_grammar_compiled>() : nullptr,
     };
 }
 
@@ -1097,6 +1349,7 @@ struct llama_grammar * llama_grammar_clone_impl(const struct llama_grammar & gra
         grammar.trigger_buffer,
         grammar.trigger_tokens,
         grammar.trigger_patterns,
+        grammar.compiled,
     };
 
     // redirect elements in stacks to point to new rules
@@ -1122,6 +1375,26 @@ void llama_grammar_apply_impl(const struct llama_grammar & grammar, llama_token_
         return;
     }
 
+    // compiled mode: look up the allowed tokens of the current state instead of matching every candidate
+    // the mask is built on a cache miss only when most of the vocabulary is being constrained, as building it
+    // costs about as much as interpreting the grammar over the full vocabulary
+    // note: a partial UTF-8 sequence from the previous token changes how the pieces are decoded, so it is not cached
+    if (grammar.compiled && grammar.partial_utf8.n_remain <= 0) {
+        const bool build = cur_p->size >= grammar.vocab->n_tokens() / 8;
+
+        const auto mask = llama_grammar_get_mask(grammar, build);
+        if (mask) {
+            const uint32_t * bits = mask->data();
+            for (size_t i = 0; i < cur_p->size; ++i) {
+                const llama_token id = cur_p->data[i].id;
+                if (!(bits[id / 32] & (1u << (id % 32)))) {
+                    cur_p->data[i].logit = -INFINITY;
+                }
+            }
+            return;
+        }
+    }
+
     bool allow_eog = false;
     for (const auto & stack : grammar.stacks) {
         if (stack.empty()) {
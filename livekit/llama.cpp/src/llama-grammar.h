@@ -3,6 +3,7 @@
 #include "llama.h"
 
 #include <map>
+#include <memory>
 #include <regex>
 #include <string>
 #include <vector>
@@ -106,6 +107,9 @@ struct llama_grammar_parser {
     void print(FILE * file);
 };
 
+// compiled form of a grammar: per-state masks of the allowed tokens, shared between the clones of a grammar
+struct llama_grammar_compiled;
+
 struct llama_grammar_trigger_pattern {
     std::string pattern;
     std::regex  regex;
@@ -132,6 +136,8 @@ struct llama_grammar {
                              trigger_patterns;         // Regular expressions that trigger a lazy grammar. Must be a full match of the entire generated
                                                        // string, and the grammar will be given the string from the first match group onwards.
 
+    // cache of the allowed tokens per stack state, nullptr to always interpret the grammar (see llama_grammar_apply_impl)
+    std::shared_ptr<llama_grammar_compiled> compiled;
 };
 
 //
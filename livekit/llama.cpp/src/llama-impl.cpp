@@ -144,7 +144,9 @@ std::string gguf_kv_to_str(const struct gguf_context * ctx_gguf, int i) {
                 ss << "[";
                 for (int j = 0; j < arr_n; j++) {
                     if (arr_type == GGUF_TYPE_STRING) {
-                        std::string val = gguf_get_arr_str(ctx_gguf, i, j);
+                        size_t len = 0;
+                        const char * str = gguf_get_arr_str_view(ctx_gguf, i, j, &len);
+                        std::string val(str, strnlen(str, len));
                         // escape quotes
                         replace_all(val, "\\", "\\\\");
                         replace_all(val, "\"", "\\\"");
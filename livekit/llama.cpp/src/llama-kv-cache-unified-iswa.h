@@ -23,7 +23,8 @@ public:
                      uint32_t   kv_size,
                      uint32_t   n_seq_max,
                      uint32_t   n_ubatch,
-                     uint32_t   n_pad);
+                     uint32_t   n_pad,
+                     uint32_t   n_block);
 
     ~llama_kv_cache_unified_iswa() = default;
 
@@ -68,6 +69,9 @@ public:
 private:
     const llama_hparams & hparams;
 
+    // min number of cells in a run for the paged placement (0 = disabled)
+    const uint32_t n_block = 0;
+
     std::unique_ptr<llama_kv_cache_unified> kv_base;
     std::unique_ptr<llama_kv_cache_unified> kv_swa;
 };
@@ -27,9 +27,10 @@ llama_kv_cache_unified::llama_kv_cache_unified(
                  uint32_t    n_seq_max,
                  uint32_t    n_pad,
                  uint32_t    n_swa,
-           llama_swa_type    swa_type) :
+           llama_swa_type    swa_type,
+                 uint32_t    n_block) :
     model(model), hparams(model.hparams), v_trans(v_trans),
-    n_seq_max(n_seq_max), n_pad(n_pad), n_swa(n_swa), swa_type(swa_type) {
+    n_seq_max(n_seq_max), n_pad(n_pad), n_swa(n_swa), n_block(n_block), swa_type(swa_type) {
 
     GGML_ASSERT(kv_size % n_pad == 0);
 
@@ -130,11 +131,17 @@ llama_kv_cache_unified::llama_kv_cache_unified(
 
     const char * LLAMA_KV_CACHE_DEBUG = getenv("LLAMA_KV_CACHE_DEBUG");
     debug = LLAMA_KV_CACHE_DEBUG ? atoi(LLAMA_KV_CACHE_DEBUG) : 0;
+
+    if (n_block > 0) {
+        LLAMA_LOG_INFO("%s: paged placement enabled, n_block = %u\n", __func__, n_block);
+    }
 }
 
 void llama_kv_cache_unified::clear(bool data) {
     cells.reset();
 
+    n_mod++;
+
     head = 0;
 
     if (data) {
@@ -147,6 +154,8 @@ void llama_kv_cache_unified::clear(bool data) {
 bool llama_kv_cache_unified::seq_rm(llama_seq_id seq_id, llama_pos p0, llama_pos p1) {
     uint32_t new_head = cells.size();
 
+    n_mod++;
+
     if (p0 < 0) {
         p0 = 0;
     }
@@ -195,6 +204,8 @@ void llama_kv_cache_unified::seq_cp(llama_seq_id seq_id_src, llama_seq_id seq_id
         return;
     }
 
+    n_mod++;
+
     if (p0 < 0) {
         p0 = 0;
     }
@@ -217,6 +228,8 @@ void llama_kv_cache_unified::seq_cp(llama_seq_id seq_id_src, llama_seq_id seq_id
 void llama_kv_cache_unified::seq_keep(llama_seq_id seq_id) {
     uint32_t new_head = cells.size();
 
+    n_mod++;
+
     for (uint32_t i = 0; i < cells.size(); ++i) {
         if (cells.seq_keep(i, seq_id)) {
             if (new_head == cells.size()) {
@@ -251,6 +264,8 @@ void llama_kv_cache_unified::seq_add(llama_seq_id seq_id, llama_pos p0, llama_po
         return;
     }
 
+    n_mod++;
+
     for (uint32_t i = 0; i < cells.size(); ++i) {
         if (!cells.pos_in(i, p0, p1)) {
             continue;
@@ -288,6 +303,8 @@ void llama_kv_cache_unified::seq_div(llama_seq_id seq_id, llama_pos p0, llama_po
         return;
     }
 
+    n_mod++;
+
     for (uint32_t i = 0; i < cells.size(); ++i) {
         if (!cells.pos_in(i, p0, p1)) {
             continue;
@@ -328,6 +345,10 @@ llama_memory_context_ptr llama_kv_cache_unified::init_batch(
         }
 
         auto heads = prepare(ubatches);
+        if (heads.empty() && n_block > 0) {
+            heads = prepare_paged(balloc, n_ubatch, ubatches);
+        }
+
         if (heads.empty()) {
             break;
         }
@@ -389,6 +410,10 @@ llama_kv_cache_unified::ubatch_heads llama_kv_cache_unified::prepare(const std::
     // remember the old state of the cells so we can restore it in the end
     std::vector<state> states;
 
+    const uint32_t n_mod_old      = n_mod;
+    const uint32_t n_apply_old    = n_apply;
+    const uint32_t head_apply_old = head_apply;
+
     bool success = true;
 
     for (const auto & ubatch : ubatches) {
@@ -415,6 +440,11 @@ llama_kv_cache_unified::ubatch_heads llama_kv_cache_unified::prepare(const std::
         head = it->head_old;
     }
 
+    // the cells are back in their original state, so the KQ mask of the last ubatch is still valid
+    n_mod      = n_mod_old;
+    n_apply    = n_apply_old;
+    head_apply = head_apply_old;
+
     if (!success) {
         return {};
     }
@@ -422,11 +452,81 @@ llama_kv_cache_unified::ubatch_heads llama_kv_cache_unified::prepare(const std::
     return res;
 }
 
+llama_kv_cache_unified::ubatch_heads llama_kv_cache_unified::prepare_paged(llama_batch_allocr & balloc, uint32_t n_ubatch, std::vector<llama_ubatch> & ubatches) {
+    llama_kv_cache_unified::ubatch_heads res;
+
+    struct state {
+        uint32_t head_old;
+        uint32_t head_new;
+
+        llama_kv_cells_unified cells;
+    };
+
+    std::vector<state> states;
+
+    const uint32_t n_mod_old      = n_mod;
+    const uint32_t n_apply_old    = n_apply;
+    const uint32_t head_apply_old = head_apply;
+
+    bool success = true;
+
+    balloc.split_reset();
+    ubatches.clear();
+
+    uint32_t n_left = balloc.get_n_tokens();
+
+    while (n_left > 0) {
+        // a run shorter than a block is only used for the tail of the batch
+        uint32_t n_run = 0;
+
+        const int32_t head_new = find_run(std::min(n_block, n_left), std::min(n_ubatch, n_left), n_run);
+        if (head_new < 0) {
+            success = false;
+            break;
+        }
+
+        auto ubatch = balloc.split_simple(n_run);
+        GGML_ASSERT(ubatch.n_tokens == n_run);
+
+        res.push_back(head_new);
+
+        states.push_back({head, (uint32_t) head_new, cells.cp(head_new, ubatch.n_tokens)});
+
+        apply_ubatch(head_new, ubatch);
+
+        n_left -= ubatch.n_tokens;
+
+        ubatches.push_back(std::move(ubatch)); // NOLINT
+    }
+
+    for (auto it = states.rbegin(); it != states.rend(); ++it) {
+        cells.set(it->head_new, it->cells);
+        head = it->head_old;
+    }
+
+    n_mod      = n_mod_old;
+    n_apply    = n_apply_old;
+    head_apply = head_apply_old;
+
+    if (!success) {
+        ubatches.clear();
+        return {};
+    }
+
+    LLAMA_LOG_DEBUG("%s: placed %u tokens in %zu runs\n", __func__, balloc.get_n_tokens(), res.size());
+
+    return res;
+}
+
 bool llama_kv_cache_unified::update(llama_context * lctx, bool do_shift, const defrag_info & dinfo) {
     bool updated = false;
 
     auto * sched = lctx->get_sched();
 
+    if (do_shift || !dinfo.empty()) {
+        n_mod++;
+    }
+
     if (do_shift) {
         if (!get_can_shift()) {
             GGML_ABORT("The current KV cache / model configuration does not support K-shift");
@@ -598,37 +698,7 @@ int32_t llama_kv_cache_unified::find_slot(const llama_ubatch & ubatch) const {
 
         bool found = true;
         for (uint32_t i = 0; i < n_tokens; i++) {
-            //const llama_pos    pos    = ubatch.pos[i];
-            //const llama_seq_id seq_id = ubatch.seq_id[i][0];
-
-            // can we use this cell? either:
-            //  - the cell is empty
-            //  - the cell is occupied only by one sequence:
-            //    - (disabled) mask causally, if the sequence is the same as the one we are inserting
-            //    - mask SWA, using current max pos for that sequence in the cache
-            //                always insert in the cell with minimum pos
-            bool can_use = cells.is_empty(head_cur + i);
-
-            if (!can_use && cells.seq_count(head_cur + i) == 1) {
-                const llama_pos pos_cell = cells.pos_get(head_cur + i);
-
-                // (disabled) causal mask
-                // note: it's better to purge any "future" tokens beforehand
-                //if (cells.seq_has(head_cur + i, seq_id)) {
-                //    can_use = pos_cell >= pos;
-                //}
-
-                if (!can_use) {
-                    const llama_seq_id seq_id_cell = cells.seq_get(head_cur + i);
-
-                    // SWA mask
-                    if (is_masked_swa(pos_cell, cells.seq_pos_max(seq_id_cell) + 1)) {
-                        can_use = true;
-                    }
-                }
-            }
-
-            if (!can_use) {
+            if (!can_use_cell(head_cur + i)) {
                 found = false;
                 head_cur += i + 1;
                 n_tested += i + 1;
@@ -649,6 +719,86 @@ int32_t llama_kv_cache_unified::find_slot(const llama_ubatch & ubatch) const {
     return head_cur;
 }
 
+int32_t llama_kv_cache_unified::find_run(uint32_t n_min, uint32_t n_max, uint32_t & n_run) const {
+    const uint32_t size = cells.size();
+
+    if (n_min == 0 || n_min > n_max || n_min > size) {
+        return -1;
+    }
+
+    // scan the ring buffer once, starting at the head
+    uint32_t run_start = 0;
+    uint32_t run_len   = 0;
+
+    for (uint32_t k = 0; k < size; ++k) {
+        const uint32_t i = (head + k) % size;
+
+        // runs cannot wrap around the end of the buffer
+        if (i == 0) {
+            run_len = 0;
+        }
+
+        if (!can_use_cell(i)) {
+            run_len = 0;
+            continue;
+        }
+
+        if (run_len == 0) {
+            run_start = i;
+        }
+
+        run_len++;
+
+        if (run_len >= n_max) {
+            break;
+        }
+
+        // a run that is long enough and cannot be extended any further
+        if (run_len >= n_min && (i + 1 == size || !can_use_cell(i + 1))) {
+            break;
+        }
+    }
+
+    if (run_len < n_min) {
+        return -1;
+    }
+
+    n_run = std::min(run_len, n_max);
+
+    return run_start;
+}
+
+bool llama_kv_cache_unified::can_use_cell(uint32_t i) const {
+    // can we use this cell? either:
+    //  - the cell is empty
+    //  - the cell is occupied only by one sequence:
+    //    - (disabled) mask causally, if the sequence is the same as the one we are inserting
+    //    - mask SWA, using current max pos for that sequence in the cache
+    //                always insert in the cell with minimum pos
+    if (cells.is_empty(i)) {
+        return true;
+    }
+
+    if (cells.seq_count(i) == 1) {
+        const llama_pos pos_cell = cells.pos_get(i);
+
+        // (disabled) causal mask
+        // note: it's better to purge any "future" tokens beforehand
+        //if (cells.seq_has(i, seq_id)) {
+        //    return pos_cell >= pos;
+        //}
+
+        const llama_seq_id seq_id_cell = cells.seq_get(i);
+
+        // SWA mask
+        if (is_masked_swa(pos_cell, cells.seq_pos_max(seq_id_cell) + 1)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
 void llama_kv_cache_unified::apply_ubatch(uint32_t head_cur, const llama_ubatch & ubatch) {
     // keep track of the max sequence position that we would overwrite with this ubatch
     // for non-SWA cache, this would be always empty
@@ -667,6 +817,8 @@ void llama_kv_cache_unified::apply_ubatch(uint32_t head_cur, const llama_ubatch
             seq_pos_max_rm[seq_id] = std::max(seq_pos_max_rm[seq_id], pos);
 
             cells.rm(head_cur + i);
+
+            n_mod++;
         }
 
         cells.pos_set(head_cur + i, ubatch.pos[i]);
@@ -694,6 +846,9 @@ void llama_kv_cache_unified::apply_ubatch(uint32_t head_cur, const llama_ubatch
 
     // move the head at the end of the slot
     head = head_cur + ubatch.n_tokens;
+
+    n_apply++;
+    head_apply = head_cur;
 }
 
 bool llama_kv_cache_unified::get_can_shift() const {
@@ -807,53 +962,151 @@ void llama_kv_cache_unified::set_input_kq_mask(ggml_tensor * dst, const llama_ub
     //      xxxxx-----
     //      xxxxx-----
     // To visualize the mask, see https://github.com/ggml-org/llama.cpp/pull/12615
-    for (uint32_t h = 0; h < 1; ++h) {
+    if (!set_input_kq_mask_incr(data, n_kv, ubatch, causal_attn)) {
+        // map the sequences of the ubatch to [0, n_seqs)
+        int32_t seq_idx[LLAMA_MAX_SEQ];
+        std::fill(seq_idx, seq_idx + LLAMA_MAX_SEQ, -1);
+
+        llama_seq_id seqs[LLAMA_MAX_SEQ];
+        uint32_t n_seqs = 0;
+
         for (uint32_t i = 0; i < n_tokens; ++i) {
             const llama_seq_id seq_id = ubatch->seq_id[i][0];
 
-            const llama_pos p1 = ubatch->pos[i];
+            if (seq_idx[seq_id] < 0) {
+                seq_idx[seq_id] = n_seqs;
+                seqs[n_seqs++] = seq_id;
+            }
+        }
 
-            for (uint32_t j = 0; j < n_kv; ++j) {
-                float f = 0.0f;
+        // gather the positions of the cells once per sequence, so that the rows below are simple vectorizable loops
+        kq_mask_pos.resize(n_seqs*n_kv);
 
-                bool masked = false;
+        for (int64_t j = 0; j < n_kv; ++j) {
+            const llama_pos p0 = cells.is_empty(j) ? -1 : cells.pos_get(j);
 
-                if (cells.is_empty(j)) {
-                    masked = true;
-                } else {
-                    const llama_pos p0 = cells.pos_get(j);
+            for (uint32_t s = 0; s < n_seqs; ++s) {
+                kq_mask_pos[s*n_kv + j] = p0 >= 0 && cells.seq_has(j, seqs[s]) ? p0 : -1;
+            }
+        }
 
-                    // mask the token if not the same sequence
-                    masked = masked || (!cells.seq_has(j, seq_id));
+        const bool use_alibi = hparams.use_alibi;
+        const bool use_swa   = swa_type != LLAMA_SWA_TYPE_NONE;
+
+        for (uint32_t i = 0; i < n_tokens; ++i) {
+            const llama_pos p1 = ubatch->pos[i];
 
-                    // mask future tokens
-                    masked = masked || (causal_attn && p0 > p1);
+            const llama_pos * pos = kq_mask_pos.data() + seq_idx[ubatch->seq_id[i][0]]*n_kv;
 
-                    // apply SWA if any
-                    masked = masked || (is_masked_swa(p0, p1));
+            float * row = data + i*n_kv;
 
-                    if (!masked && hparams.use_alibi) {
-                        f = -std::abs(p0 - p1);
+            if (!use_alibi && !use_swa) {
+                if (causal_attn) {
+                    for (int64_t j = 0; j < n_kv; ++j) {
+                        row[j] = pos[j] >= 0 && pos[j] <= p1 ? 0.0f : -INFINITY;
+                    }
+                } else {
+                    for (int64_t j = 0; j < n_kv; ++j) {
+                        row[j] = pos[j] >= 0 ? 0.0f : -INFINITY;
                     }
                 }
+                continue;
+            }
 
-                if (masked) {
-                    f = -INFINITY;
-                }
+            for (int64_t j = 0; j < n_kv; ++j) {
+                const llama_pos p0 = pos[j];
+
+                // mask empty cells, cells of other sequences, future tokens and tokens outside of the SWA window
+                const bool masked = p0 < 0 || (causal_attn && p0 > p1) || is_masked_swa(p0, p1);
 
-                data[h*(n_kv*n_tokens) + i*n_kv + j] = f;
+                row[j] = masked ? -INFINITY : use_alibi ? -std::abs(p0 - p1) : 0.0f;
             }
         }
+    }
 
-        // mask padded tokens
-        if (data) {
-            for (uint32_t i = n_tokens; i < GGML_PAD(n_tokens, GGML_KQ_MASK_PAD); ++i) {
-                for (uint32_t j = 0; j < n_kv; ++j) {
-                    data[h*(n_kv*n_tokens) + i*n_kv + j] = -INFINITY;
-                }
-            }
+    // mask padded tokens
+    std::fill(data + n_tokens*n_kv, data + GGML_PAD(n_tokens, GGML_KQ_MASK_PAD)*n_kv, -INFINITY);
+
+    // remember the mask of decode-like ubatches, so that the next one can be built incrementally:
+    //   - each row is the last token of a distinct sequence
+    //   - the mask depends only on the sequence membership and the causality (no SWA, no ALiBi)
+    auto & last = kq_mask_last;
+
+    last.valid = false;
+
+    if (hparams.use_alibi || swa_type != LLAMA_SWA_TYPE_NONE || n_tokens > LLAMA_MAX_SEQ) {
+        return;
+    }
+
+    std::bitset<LLAMA_MAX_SEQ> seen;
+
+    for (uint32_t i = 0; i < n_tokens; ++i) {
+        const llama_seq_id seq_id = ubatch->seq_id[i][0];
+
+        if (seen.test(seq_id) || cells.seq_pos_max(seq_id) != ubatch->pos[i]) {
+            return;
+        }
+
+        seen.set(seq_id);
+    }
+
+    last.valid       = true;
+    last.causal_attn = causal_attn;
+    last.n_mod       = n_mod;
+    last.n_apply     = n_apply;
+    last.n_kv        = n_kv;
+
+    last.seq_id.resize(n_tokens);
+    last.pos   .resize(n_tokens);
+
+    for (uint32_t i = 0; i < n_tokens; ++i) {
+        last.seq_id[i] = ubatch->seq_id[i][0];
+        last.pos   [i] = ubatch->pos[i];
+    }
+
+    last.data.assign(data, data + n_tokens*n_kv);
+}
+
+bool llama_kv_cache_unified::set_input_kq_mask_incr(float * data, int64_t n_kv, const llama_ubatch * ubatch, bool causal_attn) const {
+    const auto & last = kq_mask_last;
+
+    const uint32_t n_tokens = ubatch->n_tokens;
+
+    // the cells must have changed only by placing the current ubatch after the last mask was built
+    if (!last.valid || last.causal_attn != causal_attn || last.n_mod != n_mod || last.n_apply + 1 != n_apply) {
+        return false;
+    }
+
+    if (last.seq_id.size() != n_tokens || last.n_kv > n_kv) {
+        return false;
+    }
+
+    // each sequence advanced by exactly one token, so all of its old cells remain visible
+    for (uint32_t i = 0; i < n_tokens; ++i) {
+        if (ubatch->seq_id[i][0] != last.seq_id[i] || ubatch->pos[i] != last.pos[i] + 1) {
+            return false;
+        }
+    }
+
+    for (uint32_t i = 0; i < n_tokens; ++i) {
+        float * row = data + i*n_kv;
+
+        std::copy(last.data.begin() + i*last.n_kv, last.data.begin() + (i + 1)*last.n_kv, row);
+        std::fill(row + last.n_kv, row + n_kv, -INFINITY);
+    }
+
+    // patch the columns of the newly placed cells
+    for (uint32_t j = head_apply; j < head_apply + n_tokens && j < n_kv; ++j) {
+        const llama_pos p0 = cells.pos_get(j);
+
+        for (uint32_t i = 0; i < n_tokens; ++i) {
+            const bool masked = !cells.seq_has(j, ubatch->seq_id[i][0]) || (causal_attn && p0 > ubatch->pos[i]);
+
+            data[i*n_kv + j] = masked ? -INFINITY : 0.0f;
         }
     }
+
+    return true;
 }
 
 void llama_kv_cache_unified::set_input_k_shift(ggml_tensor * dst) const {
@@ -1363,6 +1616,8 @@ void llama_kv_cache_unified::state_write(llama_io_write_i & io, llama_seq_id seq
 }
 
 void llama_kv_cache_unified::state_read(llama_io_read_i & io, llama_seq_id seq_id) {
+    n_mod++;
+
     uint32_t cell_count;
     io.read_to(&cell_count, sizeof(cell_count));
 
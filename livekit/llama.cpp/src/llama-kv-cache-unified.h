@@ -48,7 +48,8 @@ public:
                      uint32_t    n_seq_max,
                      uint32_t    n_pad,
                      uint32_t    n_swa,
-               llama_swa_type    swa_type);
+               llama_swa_type    swa_type,
+                     uint32_t    n_block);
 
     ~llama_kv_cache_unified() = default;
 
@@ -113,12 +114,22 @@ public:
     // return empty vector on failure
     ubatch_heads prepare(const std::vector<llama_ubatch> & ubatches);
 
+    // paged placement: split the batch into ubatches, each one placed in a run of at least n_block free cells
+    // used when the ubatches do not fit in contiguous slots, so that fragmentation does not require a defrag
+    // return empty vector on failure
+    ubatch_heads prepare_paged(llama_batch_allocr & balloc, uint32_t n_ubatch, std::vector<llama_ubatch> & ubatches);
+
     bool update(llama_context * lctx, bool do_shift, const defrag_info & dinfo);
 
     // return the cell position where we can insert the ubatch
     // return -1 on failure to find a contiguous slot of kv cells
     int32_t find_slot(const llama_ubatch & ubatch) const;
 
+    // return the cell position of the first run of at least n_min usable cells, starting the search at head
+    // the length of the run (at most n_max) is stored in n_run
+    // return -1 if there is no such run
+    int32_t find_run(uint32_t n_min, uint32_t n_max, uint32_t & n_run) const;
+
     // emplace the ubatch context into slot: [head_cur, head_cur + ubatch.n_tokens)
     void apply_ubatch(uint32_t head_cur, const llama_ubatch & ubatch);
 
@@ -159,6 +170,36 @@ private:
 
     int debug = 0;
 
+    // min number of cells in a run for the paged placement (0 = disabled)
+    const uint32_t n_block = 0;
+
+    // incremented on every change of the cells, except for placing a ubatch into empty cells with apply_ubatch()
+    uint32_t n_mod = 0;
+
+    // number of ubatches placed with apply_ubatch() and the head of the last one
+    uint32_t n_apply    = 0;
+    uint32_t head_apply = 0;
+
+    // the last KQ mask of a decode-like ubatch (one token per sequence), reused by set_input_kq_mask()
+    struct kq_mask_state {
+        bool valid = false;
+        bool causal_attn = true;
+
+        uint32_t n_mod   = 0;
+        uint32_t n_apply = 0;
+
+        int64_t n_kv = 0;
+
+        std::vector<llama_seq_id> seq_id; // sequence of each row
+        std::vector<llama_pos>    pos;    // position of each row
+        std::vector<float>        data;   // [n_rows][n_kv]
+    };
+
+    mutable kq_mask_state kq_mask_last;
+
+    // scratch buffer for set_input_kq_mask(): cell positions per sequence of the ubatch, -1 if not in the sequence
+    mutable std::vector<llama_pos> kq_mask_pos;
+
     const llama_swa_type swa_type = LLAMA_SWA_TYPE_NONE;
 
     std::vector<ggml_context_ptr>        ctxs;
@@ -181,6 +222,12 @@ private:
 
     bool is_masked_swa(llama_pos p0, llama_pos p1) const;
 
+    // try to build the KQ mask by patching the last one - returns false if it cannot be reused
+    bool set_input_kq_mask_incr(float * data, int64_t n_kv, const llama_ubatch * ubatch, bool causal_attn) const;
+
+    // check if a new token can be stored in cell i
+    bool can_use_cell(uint32_t i) const;
+
     ggml_tensor * build_rope_shift(
             const llama_cparams & cparams,
                    ggml_context * ctx,
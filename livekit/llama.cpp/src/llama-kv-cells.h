@@ -3,13 +3,196 @@
 #include "llama.h"
 #include "llama-cparams.h"
 
+#include <algorithm>
 #include <bitset>
 #include <cassert>
+#include <map>
 #include <vector>
 #include <set>
 
+// counted histogram of the positions of a sequence with O(1) min/max
+// the counts are stored densely in the window [p_base, p_base + cnt.size()), which is cheap because the positions of a
+// sequence are (mostly) contiguous. the window is re-based/resized only when a position falls outside of it
+// if the positions are too sparse for the window (e.g. a few cells far apart), the counts are kept in an ordered map
+// instead, so that the memory is bounded by the number of cells and not by the span of the positions
+class llama_kv_pos_hist {
+public:
+    void clear() {
+        cnt.clear();
+        cnt_sparse.clear();
+
+        n = 0;
+
+        p_base =  0;
+        p_min  = -1;
+        p_max  = -1;
+    }
+
+    bool empty() const {
+        return n == 0;
+    }
+
+    // return -1 if empty
+    llama_pos min() const {
+        return p_min;
+    }
+
+    // return -1 if empty
+    llama_pos max() const {
+        return p_max;
+    }
+
+    void insert(llama_pos p) {
+        assert(p >= 0);
+
+        if (n == 0) {
+            // all counts are zero, so the window can be moved freely
+            cnt_sparse.clear();
+
+            p_min = p;
+            p_max = p;
+        }
+
+        p_min = std::min(p_min, p);
+        p_max = std::max(p_max, p);
+
+        n++;
+
+        if (!cnt_sparse.empty()) {
+            cnt_sparse[p]++;
+
+            // go back to the window once the positions are dense enough
+            if (dense_fits(p_max - p_min + 1)) {
+                to_dense();
+            }
+
+            return;
+        }
+
+        if (p < p_base || p >= p_base + (llama_pos) cnt.size()) {
+            if (!dense_fits(p_max - p_min + 1)) {
+                to_sparse();
+                cnt_sparse[p]++;
+
+                return;
+            }
+
+            fit(p);
+        }
+
+        cnt[p - p_base]++;
+    }
+
+    // note: call only if p is present
+    void erase(llama_pos p) {
+        assert(n > 0);
+        assert(p >= p_min && p <= p_max);
+
+        n--;
+
+        if (!cnt_sparse.empty()) {
+            auto it = cnt_sparse.find(p);
+            assert(it != cnt_sparse.end());
+
+            if (--it->second == 0) {
+                cnt_sparse.erase(it);
+            }
+
+            p_min = n == 0 ? -1 : cnt_sparse.begin()->first;
+            p_max = n == 0 ? -1 : cnt_sparse.rbegin()->first;
+
+            return;
+        }
+
+        assert(cnt[p - p_base] > 0);
+
+        if (--cnt[p - p_base] > 0) {
+            return;
+        }
+
+        if (n == 0) {
+            p_min = -1;
+            p_max = -1;
+
+            return;
+        }
+
+        // the scans are amortized over the removals, since p_min/p_max move monotonically until the next insert
+        if (p == p_min) {
+            while (cnt[p_min - p_base] == 0) {
+                p_min++;
+            }
+        }
+
+        if (p == p_max) {
+            while (cnt[p_max - p_base] == 0) {
+                p_max--;
+            }
+        }
+    }
+
+private:
+    // the window is used while its size is within a constant factor of the number of cells
+    bool dense_fits(llama_pos span) const {
+        return span <= std::max<llama_pos>(4096, 8*(llama_pos) n);
+    }
+
+    // resize/re-base the window so that it contains [p_min, p_max] and p, leaving room to grow in the direction of p
+    // note: p_min/p_max already include p
+    void fit(llama_pos p) {
+        const llama_pos span = p_max - p_min + 1;
+        const llama_pos size = std::max<llama_pos>(2*span, 256);
+
+        const llama_pos base = p == p_max ? p_min : std::max<llama_pos>(0, p_max - size + 1);
+
+        std::vector<uint32_t> res(size, 0);
+
+        // copy the counts of the previous positions, if there are any
+        for (llama_pos i = std::max(p_min, p_base); i < std::min(p_max + 1, p_base + (llama_pos) cnt.size()); ++i) {
+            res[i - base] = cnt[i - p_base];
+        }
+
+        cnt    = std::move(res);
+        p_base = base;
+    }
+
+    void to_sparse() {
+        for (size_t i = 0; i < cnt.size(); ++i) {
+            if (cnt[i] > 0) {
+                cnt_sparse[p_base + (llama_pos) i] = cnt[i];
+            }
+        }
+
+        cnt.clear();
+        cnt.shrink_to_fit();
+
+        p_base = 0;
+    }
+
+    void to_dense() {
+        cnt.assign(std::max<llama_pos>(2*(p_max - p_min + 1), 256), 0);
+
+        p_base = p_min;
+
+        for (const auto & [p, c] : cnt_sparse) {
+            cnt[p - p_base] = c;
+        }
+
+        cnt_sparse.clear();
+    }
+
+    std::vector<uint32_t> cnt; // cnt[p - p_base]: number of cells of the sequence at position p
+
+    std::map<llama_pos, uint32_t> cnt_sparse; // used instead of cnt when it is not empty
+
+    uint32_t n = 0; // total number of cells of the sequence
+
+    llama_pos p_base =  0;
+    llama_pos p_min  = -1;
+    llama_pos p_max  = -1;
+};
+
 // meta information about KV cells that can be part of multiple sequences at the same time
-// TODO: add unit tests
 class llama_kv_cells_unified {
 public:
     void reset() {
@@ -255,11 +438,7 @@ public:
         assert(seq_id >= 0);
         assert(seq_id < LLAMA_MAX_SEQ);
 
-        if (seq_pos[seq_id].empty()) {
-            return -1;
-        }
-
-        return *seq_pos[seq_id].begin();
+        return seq_pos[seq_id].min();
     }
 
     // the maximum position of sequence seq_id currently present in any of the cells
@@ -268,11 +447,7 @@ public:
         assert(seq_id >= 0);
         assert(seq_id < LLAMA_MAX_SEQ);
 
-        if (seq_pos[seq_id].empty()) {
-            return -1;
-        }
-
-        return *seq_pos[seq_id].rbegin();
+        return seq_pos[seq_id].max();
     }
 
     // note: call only if the cell is not empty
@@ -389,14 +564,18 @@ private:
     // the bitset seq[i] tells us which sequences are currently occupying the i-th cell
     std::vector<seq_set_t> seq;
 
-    // the set seq_pos[s] tells us which positions are currently present for sequence s
-    // this way seq_pos[s].begin() and seq_pos[s].rbegin() give us the min/max positions currently in the cache
-    std::set<llama_pos> seq_pos[LLAMA_MAX_SEQ];
+    // the histogram seq_pos[s] tells us which positions are currently present for sequence s
+    // this way seq_pos[s].min() and seq_pos[s].max() give us the min/max positions currently in the cache
+    llama_kv_pos_hist seq_pos[LLAMA_MAX_SEQ];
 
     // helper functions for updating `seq_pos`, once cell at a time:
 
     // remove cell i
     void seq_pos_rm(uint32_t i) {
+        if (seq[i].none()) {
+            return;
+        }
+
         for (int s = 0; s < LLAMA_MAX_SEQ; ++s) {
             if (seq[i].test(s)) {
                 seq_pos[s].erase(pos[i]);
@@ -406,6 +585,10 @@ private:
 
     // add cell i
     void seq_pos_add(uint32_t i) {
+        if (seq[i].none()) {
+            return;
+        }
+
         for (int s = 0; s < LLAMA_MAX_SEQ; ++s) {
             if (seq[i].test(s)) {
                 seq_pos[s].insert(pos[i]);
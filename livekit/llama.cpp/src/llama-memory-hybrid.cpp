@@ -18,6 +18,7 @@ llama_memory_hybrid::llama_memory_hybrid(
              uint32_t    n_pad,
              uint32_t    n_swa,
        llama_swa_type    swa_type,
+             uint32_t    n_block,
                          /* recurrent */
             ggml_type    type_r,
             ggml_type    type_s,
@@ -29,6 +30,7 @@ llama_memory_hybrid::llama_memory_hybrid(
       layer_filter_cb && filter_attn,
       layer_filter_cb && filter_recr) :
     hparams(model.hparams),
+    n_block(n_block),
     mem_attn(new llama_kv_cache_unified(
         model,
         filter_attn == nullptr ?
@@ -42,7 +44,8 @@ llama_memory_hybrid::llama_memory_hybrid(
         n_seq_max,
         n_pad,
         n_swa,
-        swa_type
+        swa_type,
+        n_block
     )),
     mem_recr(new llama_memory_recurrent(
         model,
@@ -90,14 +93,58 @@ llama_memory_context_ptr llama_memory_hybrid::init_batch(llama_batch_allocr & ba
         // prepare the attention cache
         auto heads_attn = mem_attn->prepare(ubatches);
         if (heads_attn.empty()) {
-            LLAMA_LOG_ERROR("%s: failed to prepare attention ubatches\n", __func__);
+            break;
+        }
+
+        return std::make_unique<llama_memory_hybrid_context>(
+                this, std::move(heads_attn), std::move(ubatches));
+    } while(false);
+
+    // if the attention cache is too fragmented and the paged placement is enabled, split in ubatches of at most
+    // n_block tokens, so that each one only needs a run of n_block free cells
+    do {
+        if (n_block == 0 || n_block >= n_ubatch) {
+            break;
+        }
+
+        balloc.split_reset();
+
+        std::vector<llama_ubatch> ubatches;
+
+        while (true) {
+            llama_ubatch ubatch;
+
+            if (embd_all) {
+                ubatch = balloc.split_seq(n_block);
+            } else {
+                ubatch = balloc.split_equal(n_block);
+            }
+
+            if (ubatch.n_tokens == 0) {
+                break;
+            }
+
+            ubatches.push_back(std::move(ubatch)); // NOLINT
+        }
+
+        if (!mem_recr->prepare(ubatches)) {
+            LLAMA_LOG_ERROR("%s: failed to prepare recurrent ubatches\n", __func__);
             return std::make_unique<llama_memory_hybrid_context>(LLAMA_MEMORY_STATUS_FAILED_PREPARE);
         }
 
+        auto heads_attn = mem_attn->prepare(ubatches);
+        if (heads_attn.empty()) {
+            break;
+        }
+
+        LLAMA_LOG_DEBUG("%s: placed %u tokens in %zu runs\n", __func__, balloc.get_n_tokens(), ubatches.size());
+
         return std::make_unique<llama_memory_hybrid_context>(
                 this, std::move(heads_attn), std::move(ubatches));
     } while(false);
 
+    LLAMA_LOG_ERROR("%s: failed to prepare attention ubatches\n", __func__);
+
     return std::make_unique<llama_memory_hybrid_context>(LLAMA_MEMORY_STATUS_FAILED_PREPARE);
 }
 
@@ -32,6 +32,7 @@ public:
                  uint32_t    n_pad,
                  uint32_t    n_swa,
            llama_swa_type    swa_type,
+                 uint32_t    n_block,
                              /* recurrent */
                 ggml_type    type_r,
                 ggml_type    type_s,
@@ -86,6 +87,9 @@ public:
 private:
     const llama_hparams & hparams;
 
+    // min number of cells in a run for the paged placement of the attention cache (0 = disabled)
+    const uint32_t n_block = 0;
+
     const std::unique_ptr<llama_kv_cache_unified> mem_attn;
     const std::unique_ptr<llama_memory_recurrent> mem_recr;
 };
@@ -18,6 +18,9 @@ struct llama_memory_params {
 
     // use full-size SWA cache
     bool swa_full;
+
+    // min number of cells in a run for the paged placement (0 = disabled)
+    uint32_t n_block;
 };
 
 enum llama_memory_status {
@@ -9,6 +9,11 @@
 #include <stdexcept>
 #include <cerrno>
 #include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
 
 #ifdef __has_include
     #if __has_include(<unistd.h>)
@@ -74,7 +79,7 @@ struct llama_file::impl {
         return ret;
     }
 
-    impl(const char * fname, const char * mode) {
+    impl(const char * fname, const char * mode) : fname(fname) {
         fp = ggml_fopen(fname, mode);
         if (fp == NULL) {
             throw std::runtime_error(format("failed to open %s: %s", fname, strerror(errno)));
@@ -126,6 +131,26 @@ struct llama_file::impl {
         }
     }
 
+    void read_raw_at(void * ptr, size_t len, size_t offset) const {
+        size_t bytes_read = 0;
+        while (bytes_read < len) {
+            size_t chunk_size = std::min<size_t>(len - bytes_read, 64*1024*1024);
+            OVERLAPPED ov = {};
+            ov.Offset     = (DWORD) ((offset + bytes_read) & 0xFFFFFFFF);
+            ov.OffsetHigh = (DWORD) ((uint64_t) (offset + bytes_read) >> 32);
+            DWORD chunk_read = 0;
+            BOOL result = ReadFile(fp_win32, reinterpret_cast<char*>(ptr) + bytes_read, chunk_size, &chunk_read, &ov);
+            if (!result) {
+                throw std::runtime_error(format("read error: %s", GetErrorMessageWin32(GetLastError()).c_str()));
+            }
+            if (chunk_read < chunk_size || chunk_read == 0) {
+                throw std::runtime_error("unexpectedly reached end of file");
+            }
+
+            bytes_read += chunk_read;
+        }
+    }
+
     uint32_t read_u32() const {
         uint32_t val;
         read_raw(&val, sizeof(val));
@@ -159,7 +184,7 @@ struct llama_file::impl {
         }
     }
 #else
-    impl(const char * fname, const char * mode) {
+    impl(const char * fname, const char * mode) : fname(fname) {
         fp = ggml_fopen(fname, mode);
         if (fp == NULL) {
             throw std::runtime_error(format("failed to open %s: %s", fname, strerror(errno)));
@@ -209,6 +234,25 @@ struct llama_file::impl {
         }
     }
 
+    void read_raw_at(void * ptr, size_t len, size_t offset) const {
+        const int fd = fileno(fp);
+        size_t bytes_read = 0;
+        while (bytes_read < len) {
+            ssize_t ret = pread(fd, (char *) ptr + bytes_read, len - bytes_read, (off_t) (offset + bytes_read));
+            if (ret == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error(format("read error: %s", strerror(errno)));
+            }
+            if (ret == 0) {
+                throw std::runtime_error("unexpectedly reached end of file");
+            }
+
+            bytes_read += ret;
+        }
+    }
+
     uint32_t read_u32() const {
         uint32_t ret;
         read_raw(&ret, sizeof(ret));
@@ -237,6 +281,7 @@ struct llama_file::impl {
     }
 #endif
 
+    std::string fname;
     FILE * fp;
     size_t size;
 };
@@ -259,8 +304,11 @@ int llama_file::file_id() const {
 #endif
 }
 
+const std::string & llama_file::fname() const { return pimpl->fname; }
+
 void llama_file::seek(size_t offset, int whence) const { pimpl->seek(offset, whence); }
 void llama_file::read_raw(void * ptr, size_t len) const { pimpl->read_raw(ptr, len); }
+void llama_file::read_raw_at(void * ptr, size_t len, size_t offset) const { pimpl->read_raw_at(ptr, len, offset); }
 
 uint32_t llama_file::read_u32() const { return pimpl->read_u32(); }
 
@@ -452,6 +500,208 @@ const bool llama_mmap::SUPPORTED  = true;
 const bool llama_mmap::SUPPORTED  = false;
 #endif
 
+// llama_file_reader
+
+#if defined(_POSIX_MAPPED_FILES) && defined(O_DIRECT)
+#define LLAMA_DIRECT_IO
+#endif
+
+struct llama_file_reader::impl {
+    // O_DIRECT requires the offset, the size and the buffer of the reads to be aligned to the logical block size
+    static constexpr size_t DIRECT_IO_ALIGNMENT = 4096;
+
+    struct request {
+        size_t idx;
+        size_t offset;
+        size_t len;
+        void * dst;
+
+        bool done = false;
+        std::exception_ptr error;
+    };
+
+    impl(const llama_files & files, int n_threads, bool direct_io) : files(files) {
+#ifdef LLAMA_DIRECT_IO
+        if (direct_io) {
+            for (const auto & file : files) {
+                int fd = open(file->fname().c_str(), O_RDONLY | O_DIRECT);
+                if (fd == -1) {
+                    LLAMA_LOG_WARN("%s: failed to open %s with O_DIRECT, using buffered reads: %s\n",
+                            __func__, file->fname().c_str(), strerror(errno));
+                    close_direct();
+                    break;
+                }
+                fds_direct.push_back(fd);
+            }
+        }
+#else
+        if (direct_io) {
+            LLAMA_LOG_WARN("%s: direct I/O is not supported on this platform, using buffered reads\n", __func__);
+        }
+#endif
+#ifdef __linux__
+        if (fds_direct.empty()) {
+            for (const auto & file : files) {
+                posix_fadvise(file->file_id(), 0, 0, POSIX_FADV_SEQUENTIAL);
+            }
+        }
+#endif
+
+        for (int i = 0; i < std::max(1, n_threads); ++i) {
+            workers.emplace_back([this] { worker(); });
+        }
+    }
+
+    ~impl() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        cv_work.notify_all();
+        for (auto & worker : workers) {
+            worker.join();
+        }
+        close_direct();
+    }
+
+    size_t read(size_t idx, size_t offset, size_t len, void * dst) {
+        GGML_ASSERT(idx < files.size());
+
+        size_t id;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            id = requests.size();
+            requests.push_back({ idx, offset, len, dst, false, nullptr });
+        }
+        cv_work.notify_one();
+
+        return id;
+    }
+
+    void wait(size_t id) {
+        std::unique_lock<std::mutex> lock(mutex);
+        GGML_ASSERT(id < requests.size());
+        cv_done.wait(lock, [&] { return requests[id].done; });
+        if (requests[id].error) {
+            std::rethrow_exception(requests[id].error);
+        }
+    }
+
+    void worker() {
+        std::vector<uint8_t> buf; // bounce buffer for unaligned direct reads
+
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            cv_work.wait(lock, [&] { return stop || next < requests.size(); });
+            if (stop) {
+                break;
+            }
+
+            // deque elements are not moved by push_back, the request stays valid while the lock is released
+            request & req = requests[next++];
+
+            lock.unlock();
+            std::exception_ptr error;
+            try {
+                if (fds_direct.empty()) {
+                    files[req.idx]->read_raw_at(req.dst, req.len, req.offset);
+                } else {
+                    read_direct(fds_direct[req.idx], req, buf);
+                }
+            } catch (...) {
+                error = std::current_exception();
+            }
+            lock.lock();
+
+            req.done  = true;
+            req.error = error;
+            cv_done.notify_all();
+        }
+    }
+
+    void read_direct(int fd, const request & req, std::vector<uint8_t> & buf) const {
+#ifdef LLAMA_DIRECT_IO
+        const size_t first = req.offset & ~(DIRECT_IO_ALIGNMENT - 1);
+        const size_t last  = GGML_PAD(req.offset + req.len, DIRECT_IO_ALIGNMENT);
+
+        uint8_t * dst = (uint8_t *) req.dst;
+        size_t    len = req.len;
+
+        const bool aligned = first == req.offset && last == req.offset + req.len && (uintptr_t) dst % DIRECT_IO_ALIGNMENT == 0;
+        if (!aligned) {
+            buf.resize(last - first + DIRECT_IO_ALIGNMENT);
+            dst = (uint8_t *) GGML_PAD((uintptr_t) buf.data(), DIRECT_IO_ALIGNMENT);
+            len = last - first;
+        }
+
+        // the aligned range can extend past the end of the file, in which case the last read is short
+        const size_t n_needed = req.offset + req.len - first;
+
+        size_t bytes_read = 0;
+        while (bytes_read < len) {
+            ssize_t ret = pread(fd, dst + bytes_read, len - bytes_read, (off_t) (first + bytes_read));
+            if (ret == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error(format("read error: %s", strerror(errno)));
+            }
+            if (ret == 0) {
+                break;
+            }
+            bytes_read += ret;
+        }
+        if (bytes_read < n_needed) {
+            throw std::runtime_error("unexpectedly reached end of file");
+        }
+
+        if (!aligned) {
+            memcpy(req.dst, dst + (req.offset - first), req.len);
+        }
+#else
+        GGML_UNUSED(fd);
+        GGML_UNUSED(req);
+        GGML_UNUSED(buf);
+        GGML_ABORT("direct I/O is not supported");
+#endif
+    }
+
+    void close_direct() {
+#ifdef LLAMA_DIRECT_IO
+        for (int fd : fds_direct) {
+            close(fd);
+        }
+#endif
+        fds_direct.clear();
+    }
+
+    const llama_files & files;
+    std::vector<int>    fds_direct; // one per file, empty for buffered reads
+
+    std::mutex              mutex;
+    std::condition_variable cv_work;
+    std::condition_variable cv_done;
+    std::deque<request>     requests;
+    size_t                  next = 0;
+    bool                    stop = false;
+
+    std::vector<std::thread> workers;
+};
+
+llama_file_reader::llama_file_reader(const llama_files & files, int n_threads, bool direct_io) : pimpl(std::make_unique<impl>(files, n_threads, direct_io)) {}
+llama_file_reader::~llama_file_reader() = default;
+
+size_t llama_file_reader::read(size_t idx, size_t offset, size_t len, void * dst) { return pimpl->read(idx, offset, len, dst); }
+void   llama_file_reader::wait(size_t id) { pimpl->wait(id); }
+
+bool llama_file_reader::direct_io() const { return !pimpl->fds_direct.empty(); }
+
+#ifdef LLAMA_DIRECT_IO
+const bool llama_file_reader::DIRECT_IO_SUPPORTED = true;
+#else
+const bool llama_file_reader::DIRECT_IO_SUPPORTED = false;
+#endif
+
 // llama_mlock
 
 struct llama_mlock::impl {
@@ -2,6 +2,7 @@
 
 #include <cstdint>
 #include <memory>
+#include <string>
 #include <vector>
 
 struct llama_file;
@@ -21,9 +22,14 @@ struct llama_file {
 
     int file_id() const; // fileno overload
 
+    const std::string & fname() const;
+
     void seek(size_t offset, int whence) const;
 
     void read_raw(void * ptr, size_t len) const;
+
+    // reads at the given offset without using the file position, can be called from several threads at once
+    void read_raw_at(void * ptr, size_t len, size_t offset) const;
     uint32_t read_u32() const;
 
     void write_raw(const void * ptr, size_t len) const;
@@ -51,6 +57,28 @@ private:
     std::unique_ptr<impl> pimpl;
 };
 
+// reads ranges of files with a pool of threads, starting the reads in the order they are queued
+// with direct_io the reads bypass the page cache (O_DIRECT) when the platform and the file system support it
+struct llama_file_reader {
+    llama_file_reader(const llama_file_reader &) = delete;
+    llama_file_reader(const llama_files & files, int n_threads, bool direct_io);
+    ~llama_file_reader();
+
+    // queues a read of len bytes at offset of files[idx] into dst, returns an id to wait for it
+    size_t read(size_t idx, size_t offset, size_t len, void * dst);
+
+    // waits for the read with the given id to complete, rethrows its error if it failed
+    void wait(size_t id);
+
+    bool direct_io() const;
+
+    static const bool DIRECT_IO_SUPPORTED;
+
+private:
+    struct impl;
+    std::unique_ptr<impl> pimpl;
+};
+
 struct llama_mlock {
     llama_mlock();
     ~llama_mlock();
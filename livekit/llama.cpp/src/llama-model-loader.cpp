@@ -2,9 +2,11 @@
 
 #include "ggml.h"
 
+#include <algorithm>
 #include <array>
 #include <cinttypes>
 #include <cstring>
+#include <deque>
 #include <future>
 
 static const size_t kiB = 1024;
@@ -470,6 +472,8 @@ llama_model_loader::llama_model_loader(
         std::vector<std::string> & splits,
         bool use_mmap,
         bool check_tensors,
+        int n_load_threads,
+        bool use_direct_io,
         const llama_model_kv_override * param_overrides_p,
         const llama_model_tensor_buft_override * param_tensor_buft_overrides_p) {
     int trace = 0;
@@ -492,7 +496,8 @@ llama_model_loader::llama_model_loader(
         /*.ctx      = */ &ctx,
     };
 
-    meta.reset(gguf_init_from_file(fname.c_str(), params));
+    // with mmap, the meta data is mapped as well, so that large arrays such as the vocab are not copied
+    meta.reset(use_mmap ? gguf_init_from_file_mmap(fname.c_str(), params) : gguf_init_from_file(fname.c_str(), params));
     if (!meta) {
         throw std::runtime_error(format("%s: failed to load model from %s", __func__, fname.c_str()));
     }
@@ -551,7 +556,7 @@ llama_model_loader::llama_model_loader(
                 /*.no_alloc = */ true,
                 /*.ctx      = */ &ctx,
             };
-            gguf_context_ptr ctx_gguf { gguf_init_from_file(fname_split, split_params) };
+            gguf_context_ptr ctx_gguf { use_mmap ? gguf_init_from_file_mmap(fname_split, split_params) : gguf_init_from_file(fname_split, split_params) };
             if (!ctx_gguf) {
                 throw std::runtime_error(format("%s: failed to load GGUF split from %s", __func__, fname_split));
             }
@@ -711,8 +716,16 @@ llama_model_loader::llama_model_loader(
         use_mmap = false;
     }
 
+    if (use_direct_io && use_mmap) {
+        // the mapped pages would go through the page cache anyway
+        LLAMA_LOG_INFO("%s: direct I/O requested, disabling mmap\n", __func__);
+        use_mmap = false;
+    }
+
     this->use_mmap = use_mmap;
     this->check_tensors = check_tensors;
+    this->n_load_threads = n_load_threads;
+    this->use_direct_io = use_direct_io;
 }
 
 std::string llama_model_loader::get_arch_name() const {
@@ -915,6 +928,14 @@ void llama_model_loader::load_data_for(struct ggml_tensor * cur) const {
     }
 }
 
+void llama_model_loader::skip_data(struct ggml_context * ctx) {
+    for (struct ggml_tensor * cur = ggml_get_first_tensor(ctx); cur != NULL; cur = ggml_get_next_tensor(ctx, cur)) {
+        if (get_weight(ggml_get_name(cur)) != nullptr) {
+            size_done += ggml_nbytes(cur);
+        }
+    }
+}
+
 bool llama_model_loader::load_all_data(
         struct ggml_context * ctx,
         llama_buf_map & bufs,
@@ -923,13 +944,28 @@ bool llama_model_loader::load_all_data(
         void * progress_callback_user_data) {
     GGML_ASSERT(size_data != 0 && "call init_mappings() first");
 
+    const int64_t t_start_us = ggml_time_us();
+
     std::vector<no_init<uint8_t>> read_buf;
     std::vector<std::future<std::pair<ggml_tensor *, bool>>> validation_result;
 
+    // parallel reads in file order, used instead of the sequential reads when not using mmap
+    const bool use_reader = !use_mmap && (n_load_threads > 0 || use_direct_io);
+
     // 4 staging buffers for async uploads, each sized 1MB seems to be a good default for single NVMe drives.
     // NVMe raid configurations might require more / larger buffers.
-    constexpr size_t n_buffers = 4;
-    constexpr size_t buffer_size = 1 * 1024 * 1024; // 1MB
+    // With parallel reads the tensors are read in 16MB chunks, and the staging buffers form a read-ahead window
+    // of 2 chunks per thread that also bounds the reads into host buffers.
+    const size_t n_buffers   = use_reader ? std::max<size_t>(4, 2*n_load_threads) : 4;
+    const size_t buffer_size = use_reader ? 16*MiB : 1*MiB;
+
+    // staging buffers of the parallel reads when the uploads are not async
+    std::vector<std::vector<no_init<uint8_t>>> read_bufs;
+
+    std::unique_ptr<llama_file_reader> reader;
+    if (use_reader) {
+        reader = std::make_unique<llama_file_reader>(files, n_load_threads, use_direct_io);
+    }
 
     std::vector<ggml_backend_buffer_t> host_buffers;
     std::vector<ggml_backend_event_t> events;
@@ -1015,91 +1051,238 @@ bool llama_model_loader::load_all_data(
             ggml_backend_name(upload_backend));
     }
 
-    for (struct ggml_tensor * cur = ggml_get_first_tensor(ctx); cur != NULL; cur = ggml_get_next_tensor(ctx, cur)) {
-        const auto * weight = get_weight(ggml_get_name(cur));
-        if (weight == nullptr) {
-            // this can happen with split experts models
-            continue;
+    if (reader) {
+        // read the tensors in file order, so that the reads of the threads are close to each other
+        std::vector<std::pair<ggml_tensor *, const llama_tensor_weight *>> tensors;
+        for (struct ggml_tensor * cur = ggml_get_first_tensor(ctx); cur != NULL; cur = ggml_get_next_tensor(ctx, cur)) {
+            const auto * weight = get_weight(ggml_get_name(cur));
+            if (weight == nullptr) {
+                // this can happen with split experts models
+                continue;
+            }
+            tensors.emplace_back(cur, weight);
+        }
+        std::sort(tensors.begin(), tensors.end(), [](const auto & a, const auto & b) {
+            return std::make_pair(a.second->idx, a.second->offs) < std::make_pair(b.second->idx, b.second->offs);
+        });
+
+        struct pending_read {
+            size_t        id;
+            ggml_tensor * cur;
+            size_t        offs; // offset in the tensor
+            size_t        size;
+            int           slot; // staging buffer, -1 when reading directly into a host buffer
+        };
+
+        std::deque<pending_read> pending;
+        std::vector<bool> slot_busy(n_buffers, false);
+        size_t n_pending = 0;
+        size_t slot_next = 0;
+
+        if (!upload_backend) {
+            read_bufs.resize(n_buffers);
         }
 
-        if (progress_callback) {
-            if (!progress_callback((float) size_done / size_data, progress_callback_user_data)) {
-                return false;
+        // counts a tensor whose data has been read completely, returns false if the load was cancelled
+        auto complete_tensor = [&](ggml_tensor * cur, bool validate) -> bool {
+            const size_t n_size = ggml_nbytes(cur);
+
+            if (check_tensors && validate) {
+                validation_result.emplace_back(std::async(std::launch::async, [cur, n_size] {
+                    return std::make_pair(cur, ggml_validate_row_data(cur->type, cur->data, n_size));
+                }));
             }
-        }
 
-        size_t n_size = ggml_nbytes(cur);
+            size_done += n_size;
 
-        if (use_mmap) {
-            const auto & mapping = mappings.at(weight->idx);
-            ggml_backend_buffer_t buf_mmap = nullptr;
-            if (bufs.count(weight->idx)) {
-                buf_mmap = bufs.at(weight->idx);
+            if (progress_callback) {
+                return progress_callback((float) size_done / size_data, progress_callback_user_data);
             }
-            uint8_t * data = (uint8_t *) mapping->addr() + weight->offs;
 
-            if (check_tensors) {
-                validation_result.emplace_back(std::async(std::launch::async, [cur, data, n_size] {
-                    return std::make_pair(cur, ggml_validate_row_data(cur->type, data, n_size));
-                }));
+            return true;
+        };
+
+        // waits for the oldest read and uploads it if it was staged, returns false if the load was cancelled
+        auto complete_read = [&]() -> bool {
+            const pending_read r = pending.front();
+            pending.pop_front();
+
+            reader->wait(r.id);
+            n_pending -= r.size;
+
+            if (r.slot >= 0) {
+                void * data = upload_backend ? host_ptrs[r.slot] : read_bufs[r.slot].data();
+
+                // staged chunks are a multiple of the block size, so that they can be validated separately
+                if (check_tensors && !ggml_validate_row_data(r.cur->type, data, r.size)) {
+                    throw std::runtime_error(format("tensor '%s' has invalid data", ggml_get_name(r.cur)));
+                }
+
+                if (upload_backend) {
+                    ggml_backend_tensor_set_async(upload_backend, r.cur, data, r.offs, r.size);
+                    ggml_backend_event_record(events[r.slot], upload_backend);
+                } else {
+                    ggml_backend_tensor_set(r.cur, data, r.offs, r.size);
+                }
+                slot_busy[r.slot] = false;
+            }
+
+            n_bytes_read += r.size;
+
+            if (r.offs + r.size == ggml_nbytes(r.cur)) {
+                // the staged chunks have been validated already
+                return complete_tensor(r.cur, r.slot < 0);
+            }
+
+            return true;
+        };
+
+        for (const auto & [cur, weight] : tensors) {
+            const size_t n_size  = ggml_nbytes(cur);
+            const bool   is_host = ggml_backend_buffer_is_host(cur->buffer);
+            const size_t chunk   = is_host ? buffer_size : buffer_size - buffer_size % ggml_type_size(cur->type);
+
+            if (n_size == 0) {
+                // there is nothing to read, so there is no read to complete the tensor
+                if (!complete_tensor(cur, false)) {
+                    return false;
+                }
+                continue;
             }
 
-            GGML_ASSERT(buf_mmap || cur->data); // either we have a buffer to allocate the tensor in, or it is already allocated
-            if (buf_mmap && cur->data == nullptr) {
-                ggml_backend_tensor_alloc(buf_mmap, cur, data);
-                if (lmlocks) {
-                    const auto & lmlock = lmlocks->at(weight->idx);
-                    lmlock->grow_to(weight->offs + n_size);
+            for (size_t offs = 0; offs < n_size; offs += chunk) {
+                const size_t size = std::min(chunk, n_size - offs);
+
+                // stay within the read-ahead window
+                while (!pending.empty() && n_pending + size > n_buffers*buffer_size) {
+                    if (!complete_read()) {
+                        return false;
+                    }
                 }
 
-                auto & mmap_used = mmaps_used[weight->idx];
-                mmap_used.first  = std::min(mmap_used.first,  weight->offs);
-                mmap_used.second = std::max(mmap_used.second, weight->offs + n_size);
-            } else {
-                ggml_backend_tensor_set(cur, data, 0, n_size);
+                int    slot = -1;
+                void * dst  = (uint8_t *) cur->data + offs;
+
+                if (!is_host) {
+                    slot = slot_next;
+                    slot_next = (slot_next + 1) % n_buffers;
+
+                    while (slot_busy[slot]) {
+                        if (!complete_read()) {
+                            return false;
+                        }
+                    }
+
+                    if (upload_backend) {
+                        ggml_backend_event_synchronize(events[slot]);
+                        dst = host_ptrs[slot];
+                    } else {
+                        read_bufs[slot].resize(buffer_size);
+                        dst = read_bufs[slot].data();
+                    }
+                    slot_busy[slot] = true;
+                }
+
+                pending.push_back({ reader->read(weight->idx, weight->offs + offs, size, dst), cur, offs, size, slot });
+                n_pending += size;
             }
-        } else {
-            const auto & file = files.at(weight->idx);
-            if (ggml_backend_buffer_is_host(cur->buffer)) {
-                file->seek(weight->offs, SEEK_SET);
-                file->read_raw(cur->data, n_size);
-                if (check_tensors) {
-                    validation_result.emplace_back(std::async(std::launch::async, [cur, n_size] {
-                        return std::make_pair(cur, ggml_validate_row_data(cur->type, cur->data, n_size));
-                    }));
+        }
+
+        while (!pending.empty()) {
+            if (!complete_read()) {
+                return false;
+            }
+        }
+    } else {
+        for (struct ggml_tensor * cur = ggml_get_first_tensor(ctx); cur != NULL; cur = ggml_get_next_tensor(ctx, cur)) {
+            const auto * weight = get_weight(ggml_get_name(cur));
+            if (weight == nullptr) {
+                // this can happen with split experts models
+                continue;
+            }
+
+            if (progress_callback) {
+                if (!progress_callback((float) size_done / size_data, progress_callback_user_data)) {
+                    return false;
                 }
-            } else {
-                // If upload_backend is valid load the tensor in chunks to pinned memory and upload the buffers asynchronously to the GPU.
-                if (upload_backend) {
-                    file->seek(weight->offs, SEEK_SET);
+            }
 
-                    size_t bytes_read = 0;
+            size_t n_size = ggml_nbytes(cur);
 
-                    while (bytes_read < n_size) {
-                        size_t read_iteration = std::min<size_t>(buffer_size, n_size - bytes_read);
+            if (use_mmap) {
+                const auto & mapping = mappings.at(weight->idx);
+                ggml_backend_buffer_t buf_mmap = nullptr;
+                if (bufs.count(weight->idx)) {
+                    buf_mmap = bufs.at(weight->idx);
+                }
+                uint8_t * data = (uint8_t *) mapping->addr() + weight->offs;
 
-                        ggml_backend_event_synchronize(events[buffer_idx]);
-                        file->read_raw(host_ptrs[buffer_idx], read_iteration);
-                        ggml_backend_tensor_set_async(upload_backend, cur, host_ptrs[buffer_idx], bytes_read, read_iteration);
-                        ggml_backend_event_record(events[buffer_idx], upload_backend);
+                if (check_tensors) {
+                    validation_result.emplace_back(std::async(std::launch::async, [cur, data, n_size] {
+                        return std::make_pair(cur, ggml_validate_row_data(cur->type, data, n_size));
+                    }));
+                }
 
-                        bytes_read += read_iteration;
-                        ++buffer_idx;
-                        buffer_idx %= n_buffers;
+                GGML_ASSERT(buf_mmap || cur->data); // either we have a buffer to allocate the tensor in, or it is already allocated
+                if (buf_mmap && cur->data == nullptr) {
+                    ggml_backend_tensor_alloc(buf_mmap, cur, data);
+                    if (lmlocks) {
+                        const auto & lmlock = lmlocks->at(weight->idx);
+                        lmlock->grow_to(weight->offs + n_size);
                     }
+
+                    auto & mmap_used = mmaps_used[weight->idx];
+                    mmap_used.first  = std::min(mmap_used.first,  weight->offs);
+                    mmap_used.second = std::max(mmap_used.second, weight->offs + n_size);
                 } else {
-                    read_buf.resize(n_size);
+                    ggml_backend_tensor_set(cur, data, 0, n_size);
+                }
+            } else {
+                const auto & file = files.at(weight->idx);
+                if (ggml_backend_buffer_is_host(cur->buffer)) {
                     file->seek(weight->offs, SEEK_SET);
-                    file->read_raw(read_buf.data(), n_size);
-                    ggml_backend_tensor_set(cur, read_buf.data(), 0, n_size);
-                    if (check_tensors && !ggml_validate_row_data(cur->type, read_buf.data(), n_size)) {
-                        throw std::runtime_error(format("tensor '%s' has invalid data", ggml_get_name(cur)));
+                    file->read_raw(cur->data, n_size);
+                    if (check_tensors) {
+                        validation_result.emplace_back(std::async(std::launch::async, [cur, n_size] {
+                            return std::make_pair(cur, ggml_validate_row_data(cur->type, cur->data, n_size));
+                        }));
+                    }
+                } else {
+                    // If upload_backend is valid load the tensor in chunks to pinned memory and upload the buffers asynchronously to the GPU.
+                    if (upload_backend) {
+                        file->seek(weight->offs, SEEK_SET);
+
+                        size_t bytes_read = 0;
+
+                        while (bytes_read < n_size) {
+                            size_t read_iteration = std::min<size_t>(buffer_size, n_size - bytes_read);
+
+                            ggml_backend_event_synchronize(events[buffer_idx]);
+                            file->read_raw(host_ptrs[buffer_idx], read_iteration);
+                            ggml_backend_tensor_set_async(upload_backend, cur, host_ptrs[buffer_idx], bytes_read, read_iteration);
+                            ggml_backend_event_record(events[buffer_idx], upload_backend);
+
+                            bytes_read += read_iteration;
+                            ++buffer_idx;
+                            buffer_idx %= n_buffers;
+                        }
+                    } else {
+                        read_buf.resize(n_size);
+                        file->seek(weight->offs, SEEK_SET);
+                        file->read_raw(read_buf.data(), n_size);
+                        ggml_backend_tensor_set(cur, read_buf.data(), 0, n_size);
+                        if (check_tensors && !ggml_validate_row_data(cur->type, read_buf.data(), n_size)) {
+                            throw std::runtime_error(format("tensor '%s' has invalid data", ggml_get_name(cur)));
+                        }
                     }
                 }
             }
-        }
 
-        size_done += n_size;
+            if (!use_mmap) {
+                n_bytes_read += n_size;
+            }
+            size_done += n_size;
+        }
     }
 
     // free temporary resources used for async uploads
@@ -1125,8 +1308,17 @@ bool llama_model_loader::load_all_data(
         throw std::runtime_error("found tensors with invalid data");
     }
 
+    t_load_us += ggml_time_us() - t_start_us;
+
     // check if this is the last call and do final cleanup
     if (size_done >= size_data) {
+        if (!use_mmap && t_load_us > 0) {
+            LLAMA_LOG_INFO("%s: read %.2f MiB in %.2f s (%.2f GB/s, %s%s)\n", __func__,
+                n_bytes_read/1024.0/1024.0, t_load_us/1e6, n_bytes_read/1e3/t_load_us,
+                use_reader ? format("%d threads", std::max(1, n_load_threads)).c_str() : "sequential",
+                reader && reader->direct_io() ? ", direct I/O" : "");
+        }
+
         // unmap offloaded tensors and metadata
         if (use_mmap) {
             for (uint32_t idx = 0; idx < mappings.size(); idx++) {
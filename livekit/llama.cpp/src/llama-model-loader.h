@@ -70,6 +70,8 @@ struct llama_model_loader {
 
     bool use_mmap = false;
     bool check_tensors;
+    bool use_direct_io  = false;
+    int  n_load_threads = 0;
 
     llama_files files;
     llama_ftype ftype;
@@ -89,6 +91,10 @@ struct llama_model_loader {
 
     size_t size_done = 0;
     size_t size_data = 0;
+
+    // bytes read from the files and time spent in load_all_data, for the read throughput
+    size_t  n_bytes_read = 0;
+    int64_t t_load_us    = 0;
     std::vector<std::pair<size_t, size_t>> mmaps_used;
 
     llama_model_loader(
@@ -96,6 +102,8 @@ struct llama_model_loader {
         std::vector<std::string> & splits, // optional, only need if the split does not follow naming scheme
         bool use_mmap,
         bool check_tensors,
+        int n_load_threads, // number of threads reading the tensors in parallel without mmap, 0 = sequential reads
+        bool use_direct_io, // bypass the page cache (O_DIRECT) when reading the tensors without mmap
         const llama_model_kv_override * param_overrides_p,
         const llama_model_tensor_buft_override * param_tensor_buft_overrides_p);
 
@@ -155,6 +163,9 @@ struct llama_model_loader {
     // for backwards compatibility, does not support ggml-backend
     void load_data_for(struct ggml_tensor * cur) const;
 
+    // accounts for the tensors of ctx whose data has been loaded without reading the files (e.g. from a repack cache)
+    void skip_data(struct ggml_context * ctx);
+
     // Returns false if cancelled by progress_callback
     bool load_all_data(
             struct ggml_context * ctx,
@@ -5,6 +5,7 @@
 #include "llama-batch.h"
 #include "llama-cparams.h"
 #include "llama-model-loader.h"
+#include "llama-repack-cache.h"
 
 #include "llama-kv-cache-unified.h"
 #include "llama-kv-cache-unified-iswa.h"
@@ -4292,6 +4293,9 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
     std::vector<std::pair<ggml_context *, llama_buf_map>> ctx_bufs;
     ctx_bufs.reserve(ctx_map.size());
 
+    // buffers of converted weights to save to the repack cache once they are loaded
+    std::vector<std::pair<std::unique_ptr<llama_repack_cache>, ggml_backend_buffer_t>> repack_cache_saves;
+
     // Ensure we have enough capacity for the maximum backend buffer we will potentially create
     const size_t n_max_backend_buffer = ctx_map.size() * ml.files.size();
     pimpl->bufs.reserve(n_max_backend_buffer);
@@ -4308,6 +4312,9 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
         llama_buf_map buf_map;
         buf_map.reserve(n_max_backend_buffer);
 
+        // the tensors are already loaded from the repack cache
+        bool from_cache = false;
+
         // check if it is possible to use buffer_from_host_ptr with this buffer type
         ggml_backend_dev_t dev = ggml_backend_buft_get_device(buft);
         if (!dev) {
@@ -4342,6 +4349,27 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
                 buf_map.emplace(idx, buf);
             }
         }
+        else if (params.repack_cache_dir && !is_default_buft && ggml_backend_dev_type(dev) == GGML_BACKEND_DEVICE_TYPE_CPU) {
+            // the weights of the extra CPU buffer types are converted while they are loaded, map the converted weights
+            // from the repack cache or save them there after loading
+            auto cache = std::make_unique<llama_repack_cache>(params.repack_cache_dir, ml, buft, ctx);
+
+            ggml_backend_buffer_t buf = cache->load(pimpl->mappings);
+            if (buf) {
+                ml.skip_data(ctx);
+                from_cache = true;
+            } else {
+                buf = ggml_backend_alloc_ctx_tensors_from_buft(ctx, buft);
+                if (buf == nullptr) {
+                    throw std::runtime_error(format("unable to allocate %s buffer", ggml_backend_buft_name(buft)));
+                }
+                repack_cache_saves.emplace_back(std::move(cache), buf);
+            }
+            pimpl->bufs.emplace_back(buf);
+            for (uint32_t idx = 0; idx < ml.files.size(); idx++) {
+                buf_map.emplace(idx, buf);
+            }
+        }
         else {
             ggml_backend_buffer_t buf = ggml_backend_alloc_ctx_tensors_from_buft(ctx, buft);
             if (buf == nullptr) {
@@ -4369,7 +4397,9 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
             ggml_backend_buffer_set_usage(buf.second, GGML_BACKEND_BUFFER_USAGE_WEIGHTS);
         }
 
-        ctx_bufs.emplace_back(ctx, buf_map);
+        if (!from_cache) {
+            ctx_bufs.emplace_back(ctx, buf_map);
+        }
     }
 
     if (llama_supports_gpu_offload()) {
@@ -4407,6 +4437,10 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
         }
     }
 
+    for (const auto & [cache, buf] : repack_cache_saves) {
+        cache->save(buf);
+    }
+
     if (use_mmap_buffer) {
         for (auto & mapping : ml.mappings) {
             pimpl->mappings.emplace_back(std::move(mapping));
@@ -13790,6 +13824,7 @@ llama_memory_i * llama_model::create_memory(const llama_memory_params & params,
                         /* attn_n_pad        */ padding,
                         /* attn_n_swa        */ hparams.n_swa,
                         /* attn_swa_type     */ hparams.swa_type,
+                        /* attn_n_block      */ params.n_block,
                         /* recurrent_type_k  */ GGML_TYPE_F32,
                         /* recurrent_type_v  */ GGML_TYPE_F32,
                         /* recurrent_kv_size */ std::max((uint32_t) 1, cparams.n_seq_max),
@@ -13815,7 +13850,8 @@ llama_memory_i * llama_model::create_memory(const llama_memory_params & params,
                                 cparams.n_ctx,
                                 cparams.n_seq_max,
                                 cparams.n_ubatch,
-                                padding);
+                                padding,
+                                params.n_block);
                     } else {
                         GGML_ASSERT(!hparams.is_swa_any());
 
@@ -13830,7 +13866,8 @@ llama_memory_i * llama_model::create_memory(const llama_memory_params & params,
                                 cparams.n_seq_max,
                                 padding,
                                 hparams.n_swa,
-                                hparams.swa_type);
+                                hparams.swa_type,
+                                params.n_block);
                     }
                 }
             }
@@ -14144,10 +14181,13 @@ llama_model_params llama_model_default_params() {
         /*.progress_callback           =*/ nullptr,
         /*.progress_callback_user_data =*/ nullptr,
         /*.kv_overrides                =*/ nullptr,
+        /*.repack_cache_dir            =*/ nullptr,
+        /*.n_load_threads              =*/ 0,
         /*.vocab_only                  =*/ false,
         /*.use_mmap                    =*/ true,
         /*.use_mlock                   =*/ false,
         /*.check_tensors               =*/ false,
+        /*.use_direct_io               =*/ false,
     };
 
 #ifdef GGML_USE_METAL
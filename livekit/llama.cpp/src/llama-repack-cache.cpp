@@ -0,0 +1,337 @@
+#include "llama-repack-cache.h"
+
+#include "llama-impl.h"
+#include "llama-model-loader.h"
+
+#include "ggml-cpp.h"
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <stdexcept>
+
+#if defined(_WIN32)
+    #define WIN32_LEAN_AND_MEAN
+    #ifndef NOMINMAX
+        #define NOMINMAX
+    #endif
+    #include <windows.h>
+#else
+    #include <sys/stat.h>
+#endif
+
+static const uint32_t LLAMA_REPACK_CACHE_MAGIC   = 0x47475243; // 'GGRC'
+static const uint32_t LLAMA_REPACK_CACHE_VERSION = 2;
+
+// the data is page aligned in the file, so that the mapped tensors keep the alignment of the buffer type
+static const size_t LLAMA_REPACK_CACHE_ALIGNMENT = 4096;
+
+// FNV-1a
+static uint64_t llama_repack_cache_hash(uint64_t h, const void * data, size_t size) {
+    const uint8_t * p = (const uint8_t *) data;
+    for (size_t i = 0; i < size; ++i) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static uint64_t llama_repack_cache_hash(uint64_t h, const std::string & str) {
+    return llama_repack_cache_hash(h, str.c_str(), str.size() + 1);
+}
+
+template <typename T>
+static uint64_t llama_repack_cache_hash(uint64_t h, const T & val) {
+    return llama_repack_cache_hash(h, &val, sizeof(val));
+}
+
+// FNV-1a over 64-bit words, for hashing the weights
+static uint64_t llama_repack_cache_hash_words(uint64_t h, const void * data, size_t size) {
+    const uint8_t * p = (const uint8_t *) data;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+        uint64_t w;
+        memcpy(&w, p + i, sizeof(w));
+        h ^= w;
+        h *= 0x100000001b3ULL;
+        h ^= h >> 32;
+    }
+    return llama_repack_cache_hash(h, p + i, size - i);
+}
+
+// the identity of a model file: its path, size and modification time
+// on POSIX systems also the inode and the change time, which is updated by every write even if the modification time is restored
+static bool llama_repack_cache_hash_file(uint64_t & h, const llama_file & file) {
+    h = llama_repack_cache_hash(h, file.fname());
+    h = llama_repack_cache_hash(h, (uint64_t) file.size());
+#if defined(_WIN32)
+    WIN32_FILE_ATTRIBUTE_DATA attr;
+    if (!GetFileAttributesExA(file.fname().c_str(), GetFileExInfoStandard, &attr)) {
+        LLAMA_LOG_WARN("%s: failed to get the attributes of %s\n", __func__, file.fname().c_str());
+        return false;
+    }
+    h = llama_repack_cache_hash(h, attr.ftLastWriteTime);
+#else
+    struct stat st;
+    if (fstat(file.file_id(), &st) != 0) {
+        LLAMA_LOG_WARN("%s: failed to stat %s: %s\n", __func__, file.fname().c_str(), strerror(errno));
+        return false;
+    }
+    h = llama_repack_cache_hash(h, (uint64_t) st.st_dev);
+    h = llama_repack_cache_hash(h, (uint64_t) st.st_ino);
+#if defined(__APPLE__)
+    h = llama_repack_cache_hash(h, st.st_mtimespec);
+    h = llama_repack_cache_hash(h, st.st_ctimespec);
+#else
+    h = llama_repack_cache_hash(h, st.st_mtim);
+    h = llama_repack_cache_hash(h, st.st_ctim);
+#endif
+#endif
+    return true;
+}
+
+llama_repack_cache::llama_repack_cache(const std::string & dir, const llama_model_loader & ml, ggml_backend_buffer_type_t buft, ggml_context * ctx) : ml(ml), buft(buft), ctx(ctx) {
+    ggml_backend_dev_t dev = ggml_backend_buft_get_device(buft);
+    ggml_backend_reg_t reg = dev ? ggml_backend_dev_backend_reg(dev) : nullptr;
+
+    uint64_t h = 0xcbf29ce484222325ULL;
+    h = llama_repack_cache_hash(h, LLAMA_REPACK_CACHE_VERSION);
+    h = llama_repack_cache_hash(h, std::string(ggml_backend_buft_name(buft)));
+
+    if (reg) {
+        buffer_from_ptr = (ggml_backend_extra_buffer_from_ptr_t) ggml_backend_reg_get_proc_address(reg, "ggml_backend_extra_buffer_from_ptr");
+
+        // the layout of the converted tensors depends on the features of the CPU
+        auto * get_features_fn = (ggml_backend_get_features_t) ggml_backend_reg_get_proc_address(reg, "ggml_backend_get_features");
+        if (get_features_fn) {
+            for (ggml_backend_feature * feature = get_features_fn(reg); feature->name; feature++) {
+                h = llama_repack_cache_hash(h, std::string(feature->name));
+                h = llama_repack_cache_hash(h, std::string(feature->value));
+            }
+        }
+    }
+
+    // the model is identified by the identity of its files and the layout of the tensors, so that the key can be
+    // computed without reading the weights
+    // the cache file also stores the hash of all the weights, which is checked when the tensors are validated
+    for (const auto & file : ml.files) {
+        if (!llama_repack_cache_hash_file(h, *file)) {
+            // the model cannot be identified, do not use the cache
+            buffer_from_ptr = nullptr;
+        }
+    }
+
+    for (ggml_tensor * cur = ggml_get_first_tensor(ctx); cur != nullptr; cur = ggml_get_next_tensor(ctx, cur)) {
+        h = llama_repack_cache_hash(h, std::string(ggml_get_name(cur)));
+        h = llama_repack_cache_hash(h, cur->type);
+        h = llama_repack_cache_hash(h, cur->ne);
+
+        const auto * weight = ml.get_weight(ggml_get_name(cur));
+        if (weight) {
+            h = llama_repack_cache_hash(h, (uint64_t) weight->idx);
+            h = llama_repack_cache_hash(h, (uint64_t) weight->offs);
+        }
+    }
+
+    key = h;
+
+    std::string fname = ml.files.at(0)->fname();
+    const size_t pos = fname.find_last_of("/\\");
+    if (pos != std::string::npos) {
+        fname = fname.substr(pos + 1);
+    }
+
+    path = dir;
+    if (!path.empty() && path.back() != '/' && path.back() != '\\') {
+        path += '/';
+    }
+    path += format("%s.%s.%016" PRIx64 ".cache", fname.c_str(), ggml_backend_buft_name(buft), key);
+}
+
+uint64_t llama_repack_cache::hash_data(bool validate) const {
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    std::vector<uint8_t> data;
+    for (ggml_tensor * cur = ggml_get_first_tensor(ctx); cur != nullptr; cur = ggml_get_next_tensor(ctx, cur)) {
+        const auto * weight = ml.get_weight(ggml_get_name(cur));
+        if (!weight) {
+            continue;
+        }
+
+        data.resize(ggml_nbytes(cur));
+        ml.files.at(weight->idx)->read_raw_at(data.data(), data.size(), weight->offs);
+
+        if (validate && !ggml_validate_row_data(cur->type, data.data(), data.size())) {
+            throw std::runtime_error(format("tensor '%s' has invalid data", ggml_get_name(cur)));
+        }
+
+        h = llama_repack_cache_hash_words(h, data.data(), data.size());
+    }
+
+    return h;
+}
+
+ggml_backend_buffer_t llama_repack_cache::load(llama_mmaps & mappings) const {
+    if (!buffer_from_ptr || !llama_mmap::SUPPORTED) {
+        return nullptr;
+    }
+
+    std::unique_ptr<llama_file> file;
+    try {
+        file = std::make_unique<llama_file>(path.c_str(), "rb");
+    } catch (const std::exception &) {
+        // not cached yet
+        return nullptr;
+    }
+
+    try {
+        if (file->read_u32() != LLAMA_REPACK_CACHE_MAGIC) {
+            throw std::runtime_error("bad magic");
+        }
+        if (file->read_u32() != LLAMA_REPACK_CACHE_VERSION) {
+            throw std::runtime_error("unsupported version");
+        }
+
+        uint64_t file_key;
+        uint64_t file_hash;
+        uint64_t n_tensors;
+        uint64_t data_offs;
+        uint64_t data_size;
+        file->read_raw(&file_key,  sizeof(file_key));
+        file->read_raw(&file_hash, sizeof(file_hash));
+        file->read_raw(&n_tensors, sizeof(n_tensors));
+        file->read_raw(&data_offs, sizeof(data_offs));
+        file->read_raw(&data_size, sizeof(data_size));
+
+        if (file_key != key) {
+            throw std::runtime_error("key mismatch");
+        }
+        uint64_t n_ctx_tensors = 0;
+        for (ggml_tensor * cur = ggml_get_first_tensor(ctx); cur != nullptr; cur = ggml_get_next_tensor(ctx, cur)) {
+            n_ctx_tensors++;
+        }
+        if (n_tensors != n_ctx_tensors) {
+            throw std::runtime_error("tensor count mismatch");
+        }
+        if (data_offs % LLAMA_REPACK_CACHE_ALIGNMENT != 0 || data_offs + data_size != file->size()) {
+            throw std::runtime_error("truncated file");
+        }
+
+        std::vector<uint64_t> offs(n_tensors);
+        file->read_raw(offs.data(), offs.size()*sizeof(uint64_t));
+
+        // check all the tensors before allocating any of them, so that the model can still be loaded normally on error
+        size_t i = 0;
+        for (ggml_tensor * cur = ggml_get_first_tensor(ctx); cur != nullptr; cur = ggml_get_next_tensor(ctx, cur), ++i) {
+            if (offs[i] + ggml_backend_buft_get_alloc_size(buft, cur) > data_size) {
+                throw std::runtime_error(format("tensor '%s' is out of bounds", ggml_get_name(cur)));
+            }
+        }
+
+        // the converted data cannot be validated, so with --check-tensors the weights in the model files are validated
+        // and compared with the ones the cache was made from
+        if (ml.check_tensors && hash_data(true) != file_hash) {
+            throw std::runtime_error("the weights have changed");
+        }
+
+        auto mapping = std::make_unique<llama_mmap>(file.get());
+        uint8_t * data = (uint8_t *) mapping->addr() + data_offs;
+
+        ggml_backend_buffer_ptr buf(buffer_from_ptr(buft, data, data_size));
+        if (!buf) {
+            return nullptr;
+        }
+
+        i = 0;
+        for (ggml_tensor * cur = ggml_get_first_tensor(ctx); cur != nullptr; cur = ggml_get_next_tensor(ctx, cur), ++i) {
+            if (ggml_backend_tensor_alloc(buf.get(), cur, data + offs[i]) != GGML_STATUS_SUCCESS) {
+                // the tensors are allocated again from another buffer by the caller
+                for (ggml_tensor * t = ggml_get_first_tensor(ctx); t != nullptr; t = ggml_get_next_tensor(ctx, t)) {
+                    t->buffer = nullptr;
+                    t->data   = nullptr;
+                    t->extra  = nullptr;
+                }
+                throw std::runtime_error(format("failed to initialize tensor '%s'", ggml_get_name(cur)));
+            }
+        }
+
+        LLAMA_LOG_INFO("%s: mapped %.2f MiB of %s tensors from %s\n", __func__,
+                data_size/1024.0/1024.0, ggml_backend_buft_name(buft), path.c_str());
+
+        mappings.emplace_back(std::move(mapping));
+
+        return buf.release();
+    } catch (const std::exception & err) {
+        LLAMA_LOG_WARN("%s: ignoring %s: %s\n", __func__, path.c_str(), err.what());
+    }
+
+    return nullptr;
+}
+
+void llama_repack_cache::save(ggml_backend_buffer_t buf) const {
+    if (!buffer_from_ptr) {
+        return;
+    }
+
+    uint8_t *    base = (uint8_t *) ggml_backend_buffer_get_base(buf);
+    const size_t size = ggml_backend_buffer_get_size(buf);
+
+    // only the buffer types that can be created again from the saved data are cached
+    ggml_backend_buffer_t probe = buffer_from_ptr(buft, base, size);
+    if (probe == nullptr) {
+        return;
+    }
+    ggml_backend_buffer_free(probe);
+
+    std::vector<uint64_t> offs;
+    for (ggml_tensor * cur = ggml_get_first_tensor(ctx); cur != nullptr; cur = ggml_get_next_tensor(ctx, cur)) {
+        GGML_ASSERT(cur->buffer == buf);
+        offs.push_back((uint8_t *) cur->data - base);
+    }
+
+    const uint64_t n_tensors = offs.size();
+    const uint64_t data_offs = GGML_PAD(2*sizeof(uint32_t) + 5*sizeof(uint64_t) + offs.size()*sizeof(uint64_t), LLAMA_REPACK_CACHE_ALIGNMENT);
+    const uint64_t data_size = size;
+
+    // written to a temporary file first, so that other processes never see a partial file
+    const std::string path_tmp = path + format(".%08x.tmp", std::random_device{}());
+
+    try {
+        const uint64_t data_hash = hash_data(false);
+
+        {
+            llama_file file(path_tmp.c_str(), "wb");
+            file.write_u32(LLAMA_REPACK_CACHE_MAGIC);
+            file.write_u32(LLAMA_REPACK_CACHE_VERSION);
+            file.write_raw(&key,       sizeof(key));
+            file.write_raw(&data_hash, sizeof(data_hash));
+            file.write_raw(&n_tensors, sizeof(n_tensors));
+            file.write_raw(&data_offs, sizeof(data_offs));
+            file.write_raw(&data_size, sizeof(data_size));
+            file.write_raw(offs.data(), offs.size()*sizeof(uint64_t));
+
+            const std::vector<uint8_t> padding(data_offs - file.tell(), 0);
+            file.write_raw(padding.data(), padding.size());
+            file.write_raw(base, size);
+        }
+
+#if defined(_WIN32)
+        // std::rename does not replace an existing file on Windows
+        if (!MoveFileExA(path_tmp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+            throw std::runtime_error(format("failed to rename %s: error %lu", path_tmp.c_str(), GetLastError()));
+        }
+#else
+        if (std::rename(path_tmp.c_str(), path.c_str()) != 0) {
+            throw std::runtime_error(format("failed to rename %s: %s", path_tmp.c_str(), strerror(errno)));
+        }
+#endif
+
+        LLAMA_LOG_INFO("%s: saved %.2f MiB of %s tensors to %s\n", __func__,
+                size/1024.0/1024.0, ggml_backend_buft_name(buft), path.c_str());
+    } catch (const std::exception & err) {
+        std::remove(path_tmp.c_str());
+        LLAMA_LOG_WARN("%s: failed to save %s: %s\n", __func__, path.c_str(), err.what());
+    }
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "llama-mmap.h"
+
+#include "ggml-backend.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct llama_model_loader;
+
+//
+// llama_repack_cache
+//
+
+// sidecar file with the tensors of a buffer type that converts the weights while they are loaded, such as the CPU
+// repack buffer type. The file is keyed by the identity of the model files and the CPU features, later loads map it
+// instead of reading and converting the weights again, so that the processes using the same model share one copy in
+// the page cache.
+struct llama_repack_cache {
+    llama_repack_cache(const std::string & dir, const llama_model_loader & ml, ggml_backend_buffer_type_t buft, ggml_context * ctx);
+
+    // maps the cache file and allocates the tensors of ctx in it, the mapping is added to mappings
+    // returns nullptr if there is no cache file for this model or it cannot be used
+    // with check_tensors, the weights in the model files are validated and compared with the hash stored in the cache
+    ggml_backend_buffer_t load(llama_mmaps & mappings) const;
+
+    // saves the tensors of ctx after they have been loaded into buf
+    void save(ggml_backend_buffer_t buf) const;
+
+    std::string path;
+
+private:
+    // hash of the data of the tensors of ctx in the model files
+    uint64_t hash_data(bool validate) const;
+
+    const llama_model_loader & ml;
+
+    ggml_backend_buffer_type_t buft;
+    ggml_context *             ctx;
+
+    ggml_backend_extra_buffer_from_ptr_t buffer_from_ptr = nullptr;
+
+    uint64_t key = 0;
+};
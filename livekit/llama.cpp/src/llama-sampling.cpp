@@ -1111,6 +1111,184 @@ struct llama_sampler * llama_sampler_init_temp_ext(float temp, float delta, floa
     );
 }
 
+// fused
+
+struct llama_sampler_fused {
+    const int32_t top_k;
+    const float   top_p;
+    const float   min_p;
+    const size_t  min_keep;
+    const float   temp;
+
+    const uint32_t seed;
+          uint32_t seed_cur;
+
+    std::mt19937 rng;
+};
+
+static const char * llama_sampler_fused_name(const struct llama_sampler * /*smpl*/) {
+    return "fused";
+}
+
+// same result as the chain top-k -> top-p -> min-p -> temp -> dist, without sorting the full candidate array:
+//  - large top-k values use a partial selection (O(n)) instead of a bucket sort
+//  - the candidates are sorted in windows of decreasing logits, only until the top-p mass or the min-p bound is reached
+//  - a single softmax over the survivors
+static void llama_sampler_fused_apply(struct llama_sampler * smpl, llama_token_data_array * cur_p) {
+    auto * ctx = (llama_sampler_fused *) smpl->ctx;
+
+    GGML_ASSERT(cur_p->size > 0);
+
+    const auto comp = [](const llama_token_data & a, const llama_token_data & b) {
+        return a.logit > b.logit;
+    };
+
+    llama_token_data * data = cur_p->data;
+
+    size_t n = cur_p->size;
+
+    bool sorted = cur_p->sorted;
+
+    // top-k
+    if (ctx->top_k > 0 && (size_t) ctx->top_k < n) {
+        if (!sorted) {
+            if (ctx->top_k <= 128) {
+                std::partial_sort(data, data + ctx->top_k, data + n, comp);
+                sorted = true;
+            } else {
+                std::nth_element(data, data + ctx->top_k - 1, data + n, comp);
+            }
+        }
+        n = ctx->top_k;
+    }
+
+    const bool use_top_p = ctx->top_p < 1.0f;
+    const bool use_min_p = ctx->min_p > 0.0f;
+
+    float max_l = -INFINITY;
+    for (size_t i = 0; i < n; ++i) {
+        max_l = std::max(max_l, data[i].logit);
+    }
+
+    // normalization of the top-p probabilities, over all the candidates that survived top-k
+    float sum = 0.0f;
+    if (use_top_p) {
+        for (size_t i = 0; i < n; ++i) {
+            sum += expf(data[i].logit - max_l);
+        }
+    }
+
+    const float min_logit = use_min_p ? max_l + logf(ctx->min_p) : -INFINITY;
+
+    // the candidates are sorted in windows of decreasing logits until one of the bounds is found
+    // the first n_windows windows are `window` wide, the last one takes everything that is left
+    constexpr float window    = 2.0f;
+    constexpr int   n_windows = 8;
+
+    size_t n_sorted = sorted ? n : 0;
+    size_t n_keep   = n;
+
+    float lo      = use_min_p ? min_logit : max_l - window;
+    int   n_split = 0;
+
+    float cum_sum = 0.0f;
+
+    for (size_t i = 0; i < n; ) {
+        if (i == n_sorted) {
+            if (n_split++ == n_windows) {
+                lo = -INFINITY;
+            }
+
+            auto * end = std::partition(data + n_sorted, data + n, [lo](const llama_token_data & td) {
+                return td.logit >= lo;
+            });
+
+            std::sort(data + n_sorted, end, comp);
+
+            n_sorted = end - data;
+
+            lo -= window;
+
+            continue;
+        }
+
+        // min-p: this token and the following ones are below the bound
+        if (use_min_p && i > 0 && i >= ctx->min_keep && data[i].logit < min_logit) {
+            n_keep = i;
+            break;
+        }
+
+        // top-p: this token completes the mass
+        if (use_top_p) {
+            cum_sum += expf(data[i].logit - max_l)/sum;
+            if (cum_sum >= ctx->top_p && i + 1 >= ctx->min_keep) {
+                n_keep = i + 1;
+                break;
+            }
+        }
+
+        ++i;
+    }
+
+    cur_p->size   = n_keep;
+    cur_p->sorted = true;
+
+    llama_sampler_temp_impl   (cur_p, ctx->temp);
+    llama_sampler_softmax_impl(cur_p);
+
+    cur_p->selected = llama_sample_dist(cur_p, ctx->rng);
+}
+
+static struct llama_sampler * llama_sampler_fused_clone(const struct llama_sampler * smpl) {
+    const auto * ctx = (const llama_sampler_fused *) smpl->ctx;
+    auto * result = llama_sampler_init_fused(ctx->top_k, ctx->top_p, ctx->min_p, ctx->min_keep, ctx->temp, ctx->seed);
+
+    // copy the state
+    {
+        auto * result_ctx = (llama_sampler_fused *) result->ctx;
+
+        result_ctx->rng = ctx->rng;
+    }
+
+    return result;
+}
+
+static void llama_sampler_fused_reset(struct llama_sampler * smpl) {
+    auto * ctx = (llama_sampler_fused *) smpl->ctx;
+    ctx->seed_cur = get_rng_seed(ctx->seed);
+    ctx->rng.seed(ctx->seed_cur);
+}
+
+static void llama_sampler_fused_free(struct llama_sampler * smpl) {
+    delete (llama_sampler_fused *) smpl->ctx;
+}
+
+static struct llama_sampler_i llama_sampler_fused_i = {
+    /* .name   = */ llama_sampler_fused_name,
+    /* .accept = */ nullptr,
+    /* .apply  = */ llama_sampler_fused_apply,
+    /* .reset  = */ llama_sampler_fused_reset,
+    /* .clone  = */ llama_sampler_fused_clone,
+    /* .free   = */ llama_sampler_fused_free,
+};
+
+struct llama_sampler * llama_sampler_init_fused(int32_t top_k, float top_p, float min_p, size_t min_keep, float temp, uint32_t seed) {
+    auto seed_cur = get_rng_seed(seed);
+    return llama_sampler_init(
+        /* .iface = */ &llama_sampler_fused_i,
+        /* .ctx   = */ new llama_sampler_fused {
+            /* .top_k    = */ top_k,
+            /* .top_p    = */ top_p,
+            /* .min_p    = */ min_p,
+            /* .min_keep = */ min_keep,
+            /* .temp     = */ temp,
+            /* .seed     = */ seed,
+            /* .seed_cur = */ seed_cur,
+            /* .rng      = */ std::mt19937(seed_cur),
+        }
+    );
+}
+
 // xtc
 
 struct llama_sampler_xtc {
@@ -1470,6 +1648,9 @@ static void llama_sampler_grammar_reset(struct llama_sampler * smpl) {
                                                  ctx->grammar->lazy, trigger_patterns_c.data(), trigger_patterns_c.size(),
                                                  ctx->grammar->trigger_tokens.data(), ctx->grammar->trigger_tokens.size());
 
+    // same rules, keep the cached token masks
+    grammar_new->compiled = ctx->grammar->compiled;
+
     llama_grammar_free_impl(ctx->grammar);
     ctx->grammar = grammar_new;
 }
@@ -2519,6 +2700,10 @@ uint32_t llama_sampler_get_seed(const struct llama_sampler * smpl) {
         return ((const llama_sampler_dist *) smpl->ctx)->seed_cur;
     }
 
+    if (smpl->iface == &llama_sampler_fused_i) {
+        return ((const llama_sampler_fused *) smpl->ctx)->seed_cur;
+    }
+
     if (smpl->iface == &llama_sampler_mirostat_i) {
         return ((const llama_sampler_mirostat *) smpl->ctx)->seed_cur;
     }
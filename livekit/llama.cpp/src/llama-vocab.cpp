@@ -8,6 +8,7 @@
 #include "unicode.h"
 
 #include <algorithm>
+#include <array>
 #include <cassert>
 #include <cctype>
 #include <cfloat>
@@ -15,9 +16,12 @@
 #include <cstring>
 #include <forward_list>
 #include <limits>
+#include <list>
 #include <map>
+#include <mutex>
 #include <queue>
 #include <set>
+#include <string_view>
 #include <unordered_map>
 
 //
@@ -270,173 +274,244 @@ struct llm_bigram_bpe {
     using queue = llama_priority_queue<llm_bigram_bpe, queue_storage, comparator>;
     llm_symbol::index left;
     llm_symbol::index right;
-    std::string text;
+    llama_token token; // merged token, LLAMA_TOKEN_NULL if it is not in the vocab
     int rank;
     size_t size;
 };
 
+// LRU cache of the tokens of the last words, long texts repeat the same words over and over
+// the words are spread over shards with their own lock, so that concurrent tokenizations rarely wait for each other
+struct llm_bpe_word_cache {
+    // appends the tokens of word to output
+    bool get(const std::string & word, std::vector<llama_token> & output) {
+        auto & s = get_shard(word);
+
+        std::lock_guard<std::mutex> lock(s.mutex);
+
+        auto it = s.map.find(word);
+        if (it == s.map.end()) {
+            return false;
+        }
+
+        s.lru.splice(s.lru.begin(), s.lru, it->second);
+        output.insert(output.end(), it->second->second.begin(), it->second->second.end());
+        return true;
+    }
+
+    void put(const std::string & word, const llama_token * tokens, size_t n_tokens) {
+        if (word.size() > max_word_size) {
+            return;
+        }
+
+        auto & s = get_shard(word);
+
+        std::lock_guard<std::mutex> lock(s.mutex);
+
+        if (s.map.find(word) != s.map.end()) {
+            return;
+        }
+
+        if (s.lru.size() >= capacity/n_shards) {
+            s.map.erase(s.lru.back().first);
+            s.lru.pop_back();
+        }
+
+        s.lru.emplace_front(word, std::vector<llama_token>(tokens, tokens + n_tokens));
+        s.map.emplace(s.lru.front().first, s.lru.begin());
+    }
+
+private:
+    static constexpr size_t capacity      = 8192;
+    static constexpr size_t max_word_size = 256;
+    static constexpr size_t n_shards      = 16;
+
+    using entry = std::pair<std::string, std::vector<llama_token>>;
+
+    struct shard {
+        std::mutex mutex;
+        std::list<entry> lru; // most recently used first
+        std::unordered_map<std::string_view, std::list<entry>::iterator> map;
+    };
+
+    shard & get_shard(const std::string & word) {
+        return shards[std::hash<std::string_view>{}(word) % n_shards];
+    }
+
+    std::array<shard, n_shards> shards;
+};
+
+std::vector<std::string> llama_vocab_pre_type_regex_exprs(enum llama_vocab_pre_type pre_type) {
+    std::vector<std::string> regex_exprs;
+
+    switch (pre_type) {
+        case LLAMA_VOCAB_PRE_TYPE_LLAMA3:
+            regex_exprs = {
+                // original regex from tokenizer.json
+                //"(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+
+                // adapted: https://github.com/ggerganov/llama.cpp/pull/6920#issuecomment-2080233989
+                "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+            };
+            break;
+        case LLAMA_VOCAB_PRE_TYPE_DBRX:
+        case LLAMA_VOCAB_PRE_TYPE_SMAUG:
+            regex_exprs = {
+                // same as llama3
+                "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+            };
+            break;
+        case LLAMA_VOCAB_PRE_TYPE_DEEPSEEK_LLM:
+            regex_exprs = {
+                "[\r\n]",
+                "\\s?[A-Za-zµÀ-ÖØ-öø-ƺƼ-ƿǄ-ʓʕ-ʯͰ-ͳͶͷͻ-ͽͿΆΈ-ΊΌΎ-ΡΣ-ϵϷ-ҁҊ-ԯԱ-ՖႠ-ჅᎠ-Ᏽᏸ-ᏽᲐ-ᲺᲽ-Ჿᴀ-ᴫᵫ-ᵷᵹ-ᶚḀ-ἕἘ-Ἕἠ-ὅὈ-Ὅὐ-ὗὙὛὝὟ-ώᾀ-ᾴᾶ-ᾼιῂ-ῄῆ-ῌῐ-ΐῖ-Ίῠ-Ῥῲ-ῴῶ-ῼℂℇℊ-ℓℕℙ-ℝℤΩℨK-ℭℯ-ℴℹℼ-ℿⅅ-ⅉⅎↃↄⰀ-ⱻⱾ-ⳤⳫ-ⳮⳲⳳꙀ-ꙭꚀ-ꚛꜢ-ꝯꝱ-ꞇꞋ-ꞎꭰ-ꮿﬀ-ﬆﬓ-ﬗＡ-Ｚａ-ｚ𐐀-𐑏𐒰-𐓓𐓘-𐓻𐲀-𐲲𐳀-𐳲𑢠-𑣟𞤀-𞥃]+",
+                "\\s?[!-/:-~！-／：-～‘-‟　-。]+",
+                "\\s+$",
+                "[一-龥ࠀ-一가-퟿]+",
+                "\\p{N}+",
+            };
+            break;
+        case LLAMA_VOCAB_PRE_TYPE_DEEPSEEK3_LLM:
+            regex_exprs = {
+                "\\p{N}{1,3}",
+                "[一-龥぀-ゟ゠-ヿ]+",
+                "[!\"#$%&'()*+,\\-./:;<=>?@\\[\\\\\\]^_`{|}~][A-Za-z]+|[^\r\n\\p{L}\\p{P}\\p{S}]?[\\p{L}\\p{M}]+| ?[\\p{P}\\p{S}]+[\r\n]*|\\s*[\r\n]+|\\s+(?!\\S)|\\s+",
+            };
+            break;
+        case LLAMA_VOCAB_PRE_TYPE_DEEPSEEK_CODER:
+            regex_exprs = {
+                "[\r\n]",
+                "\\s?\\p{L}+",
+                "\\s?\\p{P}+",
+                "[一-龥ࠀ-一가-퟿]+",
+                "\\p{N}",
+            };
+            break;
+        case LLAMA_VOCAB_PRE_TYPE_FALCON:
+            regex_exprs = {
+                "[\\p{P}\\$\\+<=>\\^~\\|`]+",
+                "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)",
+                "[0-9][0-9][0-9]",
+            };
+            break;
+        case LLAMA_VOCAB_PRE_TYPE_STARCODER:
+        case LLAMA_VOCAB_PRE_TYPE_REFACT:
+        case LLAMA_VOCAB_PRE_TYPE_COMMAND_R:
+        case LLAMA_VOCAB_PRE_TYPE_SMOLLM:
+        case LLAMA_VOCAB_PRE_TYPE_CODESHELL:
+        case LLAMA_VOCAB_PRE_TYPE_EXAONE:
+        case LLAMA_VOCAB_PRE_TYPE_MINERVA:
+            regex_exprs = {
+                "\\p{N}",
+                "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)",
+            };
+            break;
+        case LLAMA_VOCAB_PRE_TYPE_GPT2:
+        case LLAMA_VOCAB_PRE_TYPE_MPT:
+        case LLAMA_VOCAB_PRE_TYPE_OLMO:
+        case LLAMA_VOCAB_PRE_TYPE_JAIS:
+        case LLAMA_VOCAB_PRE_TYPE_TRILLION:
+            regex_exprs = {
+                "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)",
+            };
+            break;
+        case LLAMA_VOCAB_PRE_TYPE_STABLELM2:
+        case LLAMA_VOCAB_PRE_TYPE_QWEN2:
+            regex_exprs = {
+                // original regex from tokenizer.json
+                // "(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+"
+                "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+            };
+            break;
+        case LLAMA_VOCAB_PRE_TYPE_PORO:
+        case LLAMA_VOCAB_PRE_TYPE_BLOOM:
+        case LLAMA_VOCAB_PRE_TYPE_GPT3_FINNISH:
+            regex_exprs = {
+                " ?[^(\\s|.,!?…。，、।۔،)]+",
+            };
+            break;
+        case LLAMA_VOCAB_PRE_TYPE_CHATGLM4:
+            regex_exprs = {
+                "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+            };
+            break;
+        case LLAMA_VOCAB_PRE_TYPE_VIKING:
+            regex_exprs = {
+                " ?[^(\\s|.,!?…。，、।۔،)]+",
+                "\\p{N}",
+            };
+            break;
+        case LLAMA_VOCAB_PRE_TYPE_TEKKEN:
+            // original regex from tokenizer.json
+            // "[^\\r\\n\\p{L}\\p{N}]?[\\p{Lu}\\p{Lt}\\p{Lm}\\p{Lo}\\p{M}]*[\\p{Ll}\\p{Lm}\\p{Lo}\\p{M}]+|[^\\r\\n\\p{L}\\p{N}]?[\\p{Lu}\\p{Lt}\\p{Lm}\\p{Lo}\\p{M}]+[\\p{Ll}\\p{Lm}\\p{Lo}\\p{M}]*|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n/]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+"
+            regex_exprs = {
+                "[^\\r\\n\\p{L}\\p{N}]?((?=[\\p{L}])([^a-z]))*((?=[\\p{L}])([^A-Z]))+|[^\\r\\n\\p{L}\\p{N}]?((?=[\\p{L}])([^a-z]))+((?=[\\p{L}])([^A-Z]))*|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n/]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+            };
+            break;
+        case LLAMA_VOCAB_PRE_TYPE_CHAMELEON:
+            // Note: in theory, the special token (sentinel and image token) regex_exprs below
+            // are unnecessary, as they are split in `tokenizer_st_partition` anyway.
+            // However, since the upstream pre-tokenizer uses them, they are also
+            // included here (see https://huggingface.co/facebook/chameleon-7b).
+            regex_exprs = {
+                "<sentinel:[0-9]+>",  // Sentinel tokens
+                "(IMGIMG)((A|B|C|D|E|F|G|H|I){1,4})Z",  // Image tokens
+                "([\\t\\n]|    |  )",  // directly from tokenizer.json
+                "\\p{N}", // Individual digits
+                "[\\p{P}!-/:-@\\[-`{-~]",  // Punctuation, Isolated
+                "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)",
+            };
+            break;
+        case LLAMA_VOCAB_PRE_TYPE_GPT4O:
+            regex_exprs = {
+                // original regex from tokenizer.json
+                // "[^\\r\\n\\p{L}\\p{N}]?[\\p{Lu}\\p{Lt}\\p{Lm}\\p{Lo}\\p{M}]*[\\p{Ll}\\p{Lm}\\p{Lo}\\p{M}]+(?i:'s|'t|'re|'ve|'m|'ll|'d)?|[^\\r\\n\\p{L}\\p{N}]?[\\p{Lu}\\p{Lt}\\p{Lm}\\p{Lo}\\p{M}]+[\\p{Ll}\\p{Lm}\\p{Lo}\\p{M}]*(?i:'s|'t|'re|'ve|'m|'ll|'d)?|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n/]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+                "[^\\r\\n\\p{L}\\p{N}]?((?=[\\p{L}])([^a-z]))*((?=[\\p{L}])([^A-Z]))+(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])?|[^\\r\\n\\p{L}\\p{N}]?((?=[\\p{L}])([^a-z]))+((?=[\\p{L}])([^A-Z]))*(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])?|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n/]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+            };
+            break;
+        case LLAMA_VOCAB_PRE_TYPE_SUPERBPE:
+            regex_exprs = {
+                "\\p{N}+",
+                "(?=(\\d{3})+(?!\\d))",
+            };
+            break;
+        case LLAMA_VOCAB_PRE_TYPE_BAILINGMOE:
+            regex_exprs = {
+                // original regex from tokenizer.json
+                // "'(?i:[sdmt]|ll|ve|re)|[^\\r\\n\\p{L}\\p{N}]?+\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]++[\\r\\n]*|\\s*[\\r\\n]|\\s+(?!\\S)|\\s+"
+                // FIXME? Changed possessive quantifiers (?+ and ++) to greedy to avoid errors and imatrix hanging (tried atomic grouping but it's not supported?)
+                "'(?:[sSdDmMtT]|[lL][lL]|[vV][eE]|[rR][eE])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]|\\s+(?!\\S)|\\s+",
+            };
+            break;
+        case LLAMA_VOCAB_PRE_TYPE_SEED_CODER:
+            regex_exprs = {
+                // original regex from tokenizer.json
+                // "(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\r\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1}| ?[^\\s\\p{L}\\p{N}\r\n]+|\\s*[\r\n]+|\\s+(?!\\S)|\\s+"
+                "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1}| ?[^\\s\\p{L}\\p{N}\\r\\n]+|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+            };
+            break;
+        default:
+            // default regex for BPE tokenization pre-processing
+            regex_exprs = {
+                "[\\p{P}\\$\\+<=>\\^~\\|]+",
+                "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)",
+                "\\p{N}+",
+                "[0-9][0-9][0-9]",
+            };
+            break;
+    }
+
+    return regex_exprs;
+}
+
 struct llm_tokenizer_bpe : llm_tokenizer {
     llm_tokenizer_bpe(const llama_vocab & vocab) {
         GGML_ASSERT(vocab.get_type() == LLAMA_VOCAB_TYPE_BPE);
-        switch (vocab.get_pre_type()) {
-            case LLAMA_VOCAB_PRE_TYPE_LLAMA3:
-                regex_exprs = {
-                    // original regex from tokenizer.json
-                    //"(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
-
-                    // adapted: https://github.com/ggerganov/llama.cpp/pull/6920#issuecomment-2080233989
-                    "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
-                };
-                break;
-            case LLAMA_VOCAB_PRE_TYPE_DBRX:
-            case LLAMA_VOCAB_PRE_TYPE_SMAUG:
-                regex_exprs = {
-                    // same as llama3
-                    "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
-                };
-                break;
-            case LLAMA_VOCAB_PRE_TYPE_DEEPSEEK_LLM:
-                regex_exprs = {
-                    "[\r\n]",
-                    "\\s?[A-Za-zµÀ-ÖØ-öø-ƺƼ-ƿǄ-ʓʕ-ʯͰ-ͳͶͷͻ-ͽͿΆΈ-ΊΌΎ-ΡΣ-ϵϷ-ҁҊ-ԯԱ-ՖႠ-ჅᎠ-Ᏽᏸ-ᏽᲐ-ᲺᲽ-Ჿᴀ-ᴫᵫ-ᵷᵹ-ᶚḀ-ἕἘ-Ἕἠ-ὅὈ-Ὅὐ-ὗὙὛὝὟ-ώᾀ-ᾴᾶ-ᾼιῂ-ῄῆ-ῌῐ-ΐῖ-Ίῠ-Ῥῲ-ῴῶ-ῼℂℇℊ-ℓℕℙ-ℝℤΩℨK-ℭℯ-ℴℹℼ-ℿⅅ-ⅉⅎↃↄⰀ-ⱻⱾ-ⳤⳫ-ⳮⳲⳳꙀ-ꙭꚀ-ꚛꜢ-ꝯꝱ-ꞇꞋ-ꞎꭰ-ꮿﬀ-ﬆﬓ-ﬗＡ-Ｚａ-ｚ𐐀-𐑏𐒰-𐓓𐓘-𐓻𐲀-𐲲𐳀-𐳲𑢠-𑣟𞤀-𞥃]+",
-                    "\\s?[!-/:-~！-／：-～‘-‟　-。]+",
-                    "\\s+$",
-                    "[一-龥ࠀ-一가-퟿]+",
-                    "\\p{N}+",
-                };
-                break;
-            case LLAMA_VOCAB_PRE_TYPE_DEEPSEEK3_LLM:
-                regex_exprs = {
-                    "\\p{N}{1,3}",
-                    "[一-龥぀-ゟ゠-ヿ]+",
-                    "[!\"#$%&'()*+,\\-./:;<=>?@\\[\\\\\\]^_`{|}~][A-Za-z]+|[^\r\n\\p{L}\\p{P}\\p{S}]?[\\p{L}\\p{M}]+| ?[\\p{P}\\p{S}]+[\r\n]*|\\s*[\r\n]+|\\s+(?!\\S)|\\s+",
-                };
-                break;
-            case LLAMA_VOCAB_PRE_TYPE_DEEPSEEK_CODER:
-                regex_exprs = {
-                    "[\r\n]",
-                    "\\s?\\p{L}+",
-                    "\\s?\\p{P}+",
-                    "[一-龥ࠀ-一가-퟿]+",
-                    "\\p{N}",
-                };
-                break;
-            case LLAMA_VOCAB_PRE_TYPE_FALCON:
-                regex_exprs = {
-                    "[\\p{P}\\$\\+<=>\\^~\\|`]+",
-                    "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)",
-                    "[0-9][0-9][0-9]",
-                };
-                break;
-            case LLAMA_VOCAB_PRE_TYPE_STARCODER:
-            case LLAMA_VOCAB_PRE_TYPE_REFACT:
-            case LLAMA_VOCAB_PRE_TYPE_COMMAND_R:
-            case LLAMA_VOCAB_PRE_TYPE_SMOLLM:
-            case LLAMA_VOCAB_PRE_TYPE_CODESHELL:
-            case LLAMA_VOCAB_PRE_TYPE_EXAONE:
-            case LLAMA_VOCAB_PRE_TYPE_MINERVA:
-                regex_exprs = {
-                    "\\p{N}",
-                    "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)",
-                };
-                break;
-            case LLAMA_VOCAB_PRE_TYPE_GPT2:
-            case LLAMA_VOCAB_PRE_TYPE_MPT:
-            case LLAMA_VOCAB_PRE_TYPE_OLMO:
-            case LLAMA_VOCAB_PRE_TYPE_JAIS:
-            case LLAMA_VOCAB_PRE_TYPE_TRILLION:
-                regex_exprs = {
-                    "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)",
-                };
-                break;
-            case LLAMA_VOCAB_PRE_TYPE_STABLELM2:
-            case LLAMA_VOCAB_PRE_TYPE_QWEN2:
-                regex_exprs = {
-                    // original regex from tokenizer.json
-                    // "(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+"
-                    "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
-                };
-                break;
-            case LLAMA_VOCAB_PRE_TYPE_PORO:
-            case LLAMA_VOCAB_PRE_TYPE_BLOOM:
-            case LLAMA_VOCAB_PRE_TYPE_GPT3_FINNISH:
-                regex_exprs = {
-                    " ?[^(\\s|.,!?…。，、।۔،)]+",
-                };
-                break;
-            case LLAMA_VOCAB_PRE_TYPE_CHATGLM4:
-                regex_exprs = {
-                    "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
-                };
-                break;
-            case LLAMA_VOCAB_PRE_TYPE_VIKING:
-                regex_exprs = {
-                    " ?[^(\\s|.,!?…。，、।۔،)]+",
-                    "\\p{N}",
-                };
-                break;
-            case LLAMA_VOCAB_PRE_TYPE_TEKKEN:
-                // original regex from tokenizer.json
-                // "[^\\r\\n\\p{L}\\p{N}]?[\\p{Lu}\\p{Lt}\\p{Lm}\\p{Lo}\\p{M}]*[\\p{Ll}\\p{Lm}\\p{Lo}\\p{M}]+|[^\\r\\n\\p{L}\\p{N}]?[\\p{Lu}\\p{Lt}\\p{Lm}\\p{Lo}\\p{M}]+[\\p{Ll}\\p{Lm}\\p{Lo}\\p{M}]*|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n/]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+"
-                regex_exprs = {
-                    "[^\\r\\n\\p{L}\\p{N}]?((?=[\\p{L}])([^a-z]))*((?=[\\p{L}])([^A-Z]))+|[^\\r\\n\\p{L}\\p{N}]?((?=[\\p{L}])([^a-z]))+((?=[\\p{L}])([^A-Z]))*|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n/]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
-                };
-                break;
-            case LLAMA_VOCAB_PRE_TYPE_CHAMELEON:
-                // Note: in theory, the special token (sentinel and image token) regex_exprs below
-                // are unnecessary, as they are split in `tokenizer_st_partition` anyway.
-                // However, since the upstream pre-tokenizer uses them, they are also
-                // included here (see https://huggingface.co/facebook/chameleon-7b).
-                regex_exprs = {
-                    "<sentinel:[0-9]+>",  // Sentinel tokens
-                    "(IMGIMG)((A|B|C|D|E|F|G|H|I){1,4})Z",  // Image tokens
-                    "([\\t\\n]|    |  )",  // directly from tokenizer.json
-                    "\\p{N}", // Individual digits
-                    "[\\p{P}!-/:-@\\[-`{-~]",  // Punctuation, Isolated
-                    "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)",
-                };
-                break;
-            case LLAMA_VOCAB_PRE_TYPE_GPT4O:
-                regex_exprs = {
-                    // original regex from tokenizer.json
-                    // "[^\\r\\n\\p{L}\\p{N}]?[\\p{Lu}\\p{Lt}\\p{Lm}\\p{Lo}\\p{M}]*[\\p{Ll}\\p{Lm}\\p{Lo}\\p{M}]+(?i:'s|'t|'re|'ve|'m|'ll|'d)?|[^\\r\\n\\p{L}\\p{N}]?[\\p{Lu}\\p{Lt}\\p{Lm}\\p{Lo}\\p{M}]+[\\p{Ll}\\p{Lm}\\p{Lo}\\p{M}]*(?i:'s|'t|'re|'ve|'m|'ll|'d)?|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n/]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
-                    "[^\\r\\n\\p{L}\\p{N}]?((?=[\\p{L}])([^a-z]))*((?=[\\p{L}])([^A-Z]))+(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])?|[^\\r\\n\\p{L}\\p{N}]?((?=[\\p{L}])([^a-z]))+((?=[\\p{L}])([^A-Z]))*(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])?|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n/]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
-                };
-                break;
-            case LLAMA_VOCAB_PRE_TYPE_SUPERBPE:
-                regex_exprs = {
-                    "\\p{N}+",
-                    "(?=(\\d{3})+(?!\\d))",
-                };
-                break;
-            case LLAMA_VOCAB_PRE_TYPE_BAILINGMOE:
-                regex_exprs = {
-                    // original regex from tokenizer.json
-                    // "'(?i:[sdmt]|ll|ve|re)|[^\\r\\n\\p{L}\\p{N}]?+\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]++[\\r\\n]*|\\s*[\\r\\n]|\\s+(?!\\S)|\\s+"
-                    // FIXME? Changed possessive quantifiers (?+ and ++) to greedy to avoid errors and imatrix hanging (tried atomic grouping but it's not supported?)
-                    "'(?:[sSdDmMtT]|[lL][lL]|[vV][eE]|[rR][eE])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]|\\s+(?!\\S)|\\s+",
-                };
-                break;
-            case LLAMA_VOCAB_PRE_TYPE_SEED_CODER:
-                regex_exprs = {
-                    // original regex from tokenizer.json
-                    // "(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\r\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1}| ?[^\\s\\p{L}\\p{N}\r\n]+|\\s*[\r\n]+|\\s+(?!\\S)|\\s+"
-                    "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1}| ?[^\\s\\p{L}\\p{N}\\r\\n]+|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
-                };
-                break;
-            default:
-                // default regex for BPE tokenization pre-processing
-                regex_exprs = {
-                    "[\\p{P}\\$\\+<=>\\^~\\|]+",
-                    "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)",
-                    "\\p{N}+",
-                    "[0-9][0-9][0-9]",
-                };
-                break;
-        }
+        regex_exprs = llama_vocab_pre_type_regex_exprs(vocab.get_pre_type());
     }
 
     std::vector<std::string> regex_exprs;
+
+    mutable llm_bpe_word_cache cache;
 };
 
 struct llm_tokenizer_bpe_session {
@@ -480,121 +555,120 @@ struct llm_tokenizer_bpe_session {
     }
 
     void tokenize(const std::string & text, std::vector<llama_token> & output) {
-        int final_prev_index = -1;
         const auto word_collection = unicode_regex_split(text, tokenizer.regex_exprs);
 
-        symbols_final.clear();
-
         for (const auto & word : word_collection) {
-            work_queue = llm_bigram_bpe::queue();
-            symbols.clear();
+            if (tokenizer.cache.get(word, output)) {
+                continue;
+            }
 
-            int index = 0;
-            size_t offset = 0;
+            const size_t n_prev = output.size();
+            tokenize_word(word, output);
+            tokenizer.cache.put(word, output.data() + n_prev, output.size() - n_prev);
+        }
+    }
 
-            //if (vocab.tokenizer_ignore_merges && vocab.token_to_id.find(word) != vocab.token_to_id.end()) {
-            if (vocab.get_ignore_merges() && vocab.text_to_token(word) != LLAMA_TOKEN_NULL) {
-                symbols.emplace_back(llm_symbol{-1, -1, word.c_str(), word.size()});
-                offset = word.size();
-            }
+private:
+    void tokenize_word(const std::string & word, std::vector<llama_token> & output) {
+        work_queue = llm_bigram_bpe::queue();
+        symbols.clear();
+        symbol_tokens.clear();
 
-            while (offset < word.size()) {
-                llm_symbol sym;
-                size_t char_len = std::min(word.size() - offset, (size_t) unicode_len_utf8(word[offset]));
-                sym.text = word.c_str() + offset;
-                sym.n = char_len;
-                offset += sym.n;
-                sym.prev = index - 1;
-                sym.next = offset == word.size() ? -1 : index + 1;
-                index++;
-                symbols.emplace_back(sym);
+        //if (vocab.tokenizer_ignore_merges && vocab.token_to_id.find(word) != vocab.token_to_id.end()) {
+        if (vocab.get_ignore_merges()) {
+            const llama_token token = vocab.text_to_token(word);
+            if (token != LLAMA_TOKEN_NULL) {
+                output.push_back(token);
+                return;
             }
-            for (int i = 1; i < (int) symbols.size(); ++i) {
-                add_new_bigram(i - 1, i);
-            }
-
-            // build token(s)
-            while (!work_queue.empty()) {
-                auto bigram = work_queue.pop_move();
+        }
 
-                auto & left_symbol = symbols[bigram.left];
-                auto & right_symbol = symbols[bigram.right];
+        int index = 0;
+        size_t offset = 0;
 
-                if (left_symbol.n == 0 || right_symbol.n == 0) {
-                    continue;
-                }
-                std::string left_token = std::string(left_symbol.text, left_symbol.n);
-                std::string right_token = std::string(right_symbol.text, right_symbol.n);
-                if (left_token + right_token != bigram.text) {
-                    continue;  // Skip this bigram if it's outdated
-                }
+        while (offset < word.size()) {
+            llm_symbol sym;
+            size_t char_len = std::min(word.size() - offset, (size_t) unicode_len_utf8(word[offset]));
+            sym.text = word.c_str() + offset;
+            sym.n = char_len;
+            offset += sym.n;
+            sym.prev = index - 1;
+            sym.next = offset == word.size() ? -1 : index + 1;
+            index++;
+            symbols.emplace_back(sym);
+            symbol_tokens.push_back(vocab.text_to_token(std::string(sym.text, sym.n)));
+        }
+        for (int i = 1; i < (int) symbols.size(); ++i) {
+            add_new_bigram(i - 1, i);
+        }
 
-                // merge the right sym into the left one
-                left_symbol.n += right_symbol.n;
-                right_symbol.n = 0;
+        // build token(s)
+        while (!work_queue.empty()) {
+            auto bigram = work_queue.pop_move();
 
-                // remove the right sym from the chain
-                left_symbol.next = right_symbol.next;
-                if (right_symbol.next >= 0) {
-                    symbols[right_symbol.next].prev = bigram.left;
-                }
+            auto & left_symbol = symbols[bigram.left];
+            auto & right_symbol = symbols[bigram.right];
 
-                add_new_bigram(left_symbol.prev, bigram.left);  // left side of current symbol
-                add_new_bigram(bigram.left, left_symbol.next);  // right side of current symbol
+            // the symbols only grow, so the bigram is outdated if any of them has changed since it was added
+            if (left_symbol.n == 0 || right_symbol.n == 0 || left_symbol.n + right_symbol.n != bigram.size) {
+                continue;
             }
 
-            // add the finished tokens to the final list keeping correct order for next and prev
-            for (auto & sym : symbols) {
-                if (sym.n > 0) {
-                    sym.prev = final_prev_index;
-                    sym.next = -1;
-                    if (final_prev_index != -1) {
-                        symbols_final[final_prev_index].next = symbols_final.size();
-                    }
-                    symbols_final.emplace_back(sym);
-                    final_prev_index = symbols_final.size() - 1;
-                }
-            }
-        }
+            // merge the right sym into the left one
+            left_symbol.n += right_symbol.n;
+            right_symbol.n = 0;
+            symbol_tokens[bigram.left] = bigram.token;
 
-        symbols = symbols_final;
+            // remove the right sym from the chain
+            left_symbol.next = right_symbol.next;
+            if (right_symbol.next >= 0) {
+                symbols[right_symbol.next].prev = bigram.left;
+            }
 
-        if (!symbols.empty()) {
-            for (int i = 0; i != -1; i = symbols[i].next) {
-                auto & symbol = symbols[i];
-                if (symbol.n == 0) {
-                    continue;
-                }
+            add_new_bigram(left_symbol.prev, bigram.left);  // left side of current symbol
+            add_new_bigram(bigram.left, left_symbol.next);  // right side of current symbol
+        }
 
-                const std::string str = std::string(symbol.text, symbol.n);
-                const auto token = vocab.text_to_token(str);
+        for (size_t i = 0; i < symbols.size(); ++i) {
+            const auto & symbol = symbols[i];
+            if (symbol.n == 0) {
+                continue;
+            }
 
-                if (token == LLAMA_TOKEN_NULL) {
-                    for (auto j = str.begin(); j != str.end(); ++j) {
-                        std::string byte_str(1, *j);
-                        auto token_multibyte = vocab.text_to_token(byte_str);
-                        if (token_multibyte != LLAMA_TOKEN_NULL) {
-                            output.push_back(token_multibyte);
-                        }
+            if (symbol_tokens[i] == LLAMA_TOKEN_NULL) {
+                for (size_t j = 0; j < symbol.n; ++j) {
+                    std::string byte_str(1, symbol.text[j]);
+                    auto token_multibyte = vocab.text_to_token(byte_str);
+                    if (token_multibyte != LLAMA_TOKEN_NULL) {
+                        output.push_back(token_multibyte);
                     }
-                } else {
-                    output.push_back(token);
                 }
+            } else {
+                output.push_back(symbol_tokens[i]);
             }
         }
     }
 
-private:
     void add_new_bigram(int left, int right) {
         if (left == -1 || right == -1) {
             return;
         }
-        std::string left_token  = std::string(symbols[left].text,  symbols[left].n);
-        std::string right_token = std::string(symbols[right].text, symbols[right].n);
 
+        llama_token token = LLAMA_TOKEN_NULL;
         int rank_found = -1;
 
-        rank_found = vocab.find_bpe_rank(left_token, right_token);
+        if (symbol_tokens[left] != LLAMA_TOKEN_NULL && symbol_tokens[right] != LLAMA_TOKEN_NULL) {
+            rank_found = vocab.find_bpe_rank(symbol_tokens[left], symbol_tokens[right], token);
+        } else {
+            // the symbols that are not in the vocab can only be merged by text
+            std::string left_token  = std::string(symbols[left].text,  symbols[left].n);
+            std::string right_token = std::string(symbols[right].text, symbols[right].n);
+
+            rank_found = vocab.find_bpe_rank(left_token, right_token);
+            if (rank_found >= 0) {
+                token = vocab.text_to_token(left_token + right_token);
+            }
+        }
 
         if (rank_found < 0) {
             return;
@@ -604,8 +678,8 @@ private:
 
         bigram.left  = left;
         bigram.right = right;
-        bigram.text  = left_token + right_token;
-        bigram.size  = left_token.size() + right_token.size();
+        bigram.token = token;
+        bigram.size  = symbols[left].n + symbols[right].n;
         bigram.rank  = rank_found;
 
         work_queue.push(bigram);
@@ -615,7 +689,7 @@ private:
     const llm_tokenizer_bpe & tokenizer;
 
     std::vector<llm_symbol> symbols;
-    std::vector<llm_symbol> symbols_final;
+    std::vector<llama_token> symbol_tokens; // token of each symbol, LLAMA_TOKEN_NULL if it is not in the vocab
     llm_bigram_bpe::queue work_queue;
 };
 
@@ -1289,6 +1363,13 @@ struct llama_vocab::impl {
     };
     std::unordered_map<std::pair<std::string, std::string>, int, pair_hash> bpe_ranks;
 
+    // bpe_ranks keyed by the ids of the tokens, for the merges of tokens that are in the vocab
+    struct bpe_merge {
+        int         rank;
+        llama_token token; // merged token
+    };
+    std::unordered_map<uint64_t, bpe_merge> bpe_ranks_by_id;
+
     // set of all tokens that cause "end of generation"
     std::set<llama_token> special_eog_ids;
 
@@ -1435,7 +1516,9 @@ void llama_vocab::impl::load(llama_model_loader & ml, const LLM_KV & kv) {
 
             const int n_merges = gguf_get_arr_n(ctx, merges_keyidx);
             for (int i = 0; i < n_merges; i++) {
-                const std::string word = gguf_get_arr_str(ctx, merges_keyidx, i);
+                size_t len = 0;
+                const char * str = gguf_get_arr_str_view(ctx, merges_keyidx, i, &len);
+                const std::string word(str, strnlen(str, len));
                 //GGML_ASSERT(unicode_cpts_from_utf8(word).size() > 0);
 
                 std::string first;
@@ -1712,7 +1795,10 @@ void llama_vocab::impl::load(llama_model_loader & ml, const LLM_KV & kv) {
     id_to_token.resize(n_tokens);
 
     for (uint32_t i = 0; i < n_tokens; i++) {
-        std::string word = gguf_get_arr_str(ctx, token_idx, i);
+        // the strings are read without a copy in gguf, up to the first null character like gguf_get_arr_str
+        size_t len = 0;
+        const char * str = gguf_get_arr_str_view(ctx, token_idx, i, &len);
+        std::string word(str, strnlen(str, len));
         if (word.empty()) {
             LLAMA_LOG_WARN("%s: empty token at index %u\n", __func__, i);
             word = "[EMPTY_" + std::to_string(i) + "]";
@@ -1741,6 +1827,19 @@ void llama_vocab::impl::load(llama_model_loader & ml, const LLM_KV & kv) {
     }
     GGML_ASSERT(id_to_token.size() == token_to_id.size());
 
+    for (const auto & it : bpe_ranks) {
+        const auto & [first, second] = it.first;
+
+        const llama_token token_left  = vocab.text_to_token(first);
+        const llama_token token_right = vocab.text_to_token(second);
+        if (token_left == LLAMA_TOKEN_NULL || token_right == LLAMA_TOKEN_NULL) {
+            continue;
+        }
+
+        const uint64_t key = ((uint64_t) (uint32_t) token_left << 32) | (uint32_t) token_right;
+        bpe_ranks_by_id.emplace(key, bpe_merge{ it.second, vocab.text_to_token(first + second) });
+    }
+
     init_tokenizer(type);
 
     // determine the newline token: LLaMA "<0x0A>" == 10 == '\n', Falcon 193 == '\n'
@@ -3053,6 +3152,19 @@ int llama_vocab::find_bpe_rank(const std::string & token_left, const std::string
     return it->second;
 }
 
+int llama_vocab::find_bpe_rank(llama_token token_left, llama_token token_right, llama_token & token_merged) const {
+    const uint64_t key = ((uint64_t) (uint32_t) token_left << 32) | (uint32_t) token_right;
+
+    auto it = pimpl->bpe_ranks_by_id.find(key);
+    if (it == pimpl->bpe_ranks_by_id.end()) {
+        token_merged = LLAMA_TOKEN_NULL;
+        return -1;
+    }
+
+    token_merged = it->second.token;
+    return it->second.rank;
+}
+
 std::vector<std::string> llama_vocab::get_bpe_merges() const {
     std::vector<std::string> result(pimpl->bpe_ranks.size());
 
@@ -84,6 +84,8 @@ struct llama_vocab {
     int max_token_len() const;
 
     int find_bpe_rank(const std::string & token_left, const std::string & token_right) const;
+    // same as above for two tokens of the vocab, token_merged is set to the merged token (or LLAMA_TOKEN_NULL if it is not in the vocab)
+    int find_bpe_rank(llama_token token_left, llama_token token_right, llama_token & token_merged) const;
     std::vector<std::string> get_bpe_merges() const;
 
     std::vector<char> get_precompiled_charsmap() const;
@@ -130,3 +132,6 @@ private:
     struct impl;
     std::unique_ptr<impl> pimpl;
 };
+
+// the regexes of the BPE pre-tokenizer of pre_type, in the order they are applied by unicode_regex_split
+std::vector<std::string> llama_vocab_pre_type_regex_exprs(enum llama_vocab_pre_type pre_type);
@@ -93,7 +93,8 @@ static int llama_model_load(const std::string & fname, std::vector<std::string>
     model.t_start_us = tm.t_start_us;
 
     try {
-        llama_model_loader ml(fname, splits, params.use_mmap, params.check_tensors, params.kv_overrides, params.tensor_buft_overrides);
+        llama_model_loader ml(fname, splits, params.use_mmap, params.check_tensors, params.n_load_threads, params.use_direct_io,
+            params.kv_overrides, params.tensor_buft_overrides);
 
         ml.print_info();
 
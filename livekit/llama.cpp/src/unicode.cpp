@@ -6,12 +6,16 @@
 #include "unicode-data.h"
 
 #include <algorithm>
+#include <array>
 #include <cassert>
+#include <cctype>
 #include <codecvt>
 #include <cstddef>
 #include <cstdint>
 #include <locale>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <regex>
 #include <stdexcept>
 #include <string>
@@ -239,12 +243,10 @@ static std::vector<std::string> unicode_byte_encoding_process(const std::vector<
 }
 
 // GPT2 system regex:  's|'t|'re|'ve|'m|'ll|'d| ?\p{L}+| ?\p{N}+| ?[^\s\p{L}\p{N}]+|\s+(?!\S)|\s+
-static std::vector<size_t> unicode_regex_split_custom_gpt2(const std::string & text, const std::vector<size_t> & offsets) {
+static std::vector<size_t> unicode_regex_split_custom_gpt2(const std::vector<uint32_t> & cpts, const std::vector<size_t> & offsets) {
     std::vector<size_t> bpe_offsets; // store the offset of each word
     bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
 
-    const auto cpts = unicode_cpts_from_utf8(text);
-
     size_t start = 0;
     for (auto offset : offsets) {
         const size_t offset_ini = start;
@@ -357,12 +359,10 @@ static std::vector<size_t> unicode_regex_split_custom_gpt2(const std::string & t
 }
 
 // LLAMA3 system regex: "(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\r\n\p{L}\p{N}]?\p{L}+|\p{N}{1,3}| ?[^\s\p{L}\p{N}]+[\r\n]*|\s*[\r\n]+|\s+(?!\S)|\s+"
-static std::vector<size_t> unicode_regex_split_custom_llama3(const std::string & text, const std::vector<size_t> & offsets) {
+static std::vector<size_t> unicode_regex_split_custom_llama3(const std::vector<uint32_t> & cpts, const std::vector<size_t> & offsets) {
     std::vector<size_t> bpe_offsets; // store the offset of each word
     bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
 
-    const auto cpts = unicode_cpts_from_utf8(text);
-
     size_t start = 0;
     for (auto offset : offsets) {
         const size_t offset_ini = start;
@@ -497,6 +497,439 @@ static std::vector<size_t> unicode_regex_split_custom_llama3(const std::string &
     return bpe_offsets;
 }
 
+//
+// splitters for the collapsed text
+//
+// these work on the same representation as the std::regex fallback in unicode_regex_split, where each
+// non-ASCII codepoint is collapsed into a single byte for its category, so they produce the exact same
+// splits as the original regex:
+//
+//   \p{N} -> 0xD1, \p{L} -> 0xD2, \p{P} -> 0xD3, \p{M} -> 0xD4, \p{S} -> 0xD5, other -> 0xD0, \s -> 0x0B
+//
+
+static inline bool unicode_collapsed_is_whitespace(uint32_t c) {
+    return c == ' ' || ('\t' <= c && c <= '\r');
+}
+
+static inline bool unicode_collapsed_is_letter(uint32_t c) {
+    return c == 0xD2 || ('A' <= c && c <= 'Z') || ('a' <= c && c <= 'z');
+}
+
+static inline bool unicode_collapsed_is_number(uint32_t c) {
+    return c == 0xD1 || ('0' <= c && c <= '9');
+}
+
+static inline bool unicode_collapsed_is_accent_mark(uint32_t c) {
+    return c == 0xD4;
+}
+
+static inline bool unicode_collapsed_is_punctuation(uint32_t c) {
+    // !-#%-*,-/:-;?-@[-]_{}
+    return c == 0xD3 || ('!' <= c && c <= '#') || ('%' <= c && c <= '*') || (',' <= c && c <= '/') ||
+           c == ':' || c == ';' || c == '?' || c == '@' || ('[' <= c && c <= ']') || c == '_' || c == '{' || c == '}';
+}
+
+static inline bool unicode_collapsed_is_symbol(uint32_t c) {
+    // $+<=>^`|
+    return c == 0xD5 || c == '$' || c == '+' || ('<' <= c && c <= '>') || c == '^' || c == '`' || c == '|';
+}
+
+// one offset of the collapsed text
+struct unicode_collapsed_segment {
+    static const uint32_t OUT_OF_RANGE = 0xFFFFFFFF;
+
+    const std::string & text;
+
+    const size_t ini;
+    const size_t end;
+
+    uint32_t get(const size_t pos) const {
+        return (ini <= pos && pos < end) ? (uint8_t) text[pos] : OUT_OF_RANGE;
+    }
+
+    // regex: [^\s\p{L}\p{N}]
+    bool is_other(const size_t pos) const {
+        const uint32_t c = get(pos);
+        return c != OUT_OF_RANGE && !unicode_collapsed_is_whitespace(c) && !unicode_collapsed_is_letter(c) && !unicode_collapsed_is_number(c);
+    }
+
+    // regex: (?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])
+    // returns the length of the match at pos, 0 if none
+    size_t contraction(const size_t pos) const {
+        if (get(pos) != '\'') {
+            return 0;
+        }
+        auto _lower = [&] (const size_t p) -> uint32_t {
+            const uint32_t c = get(p);
+            return ('A' <= c && c <= 'Z') ? c + ('a' - 'A') : c;
+        };
+        const uint32_t c1 = _lower(pos + 1);
+        if (c1 == 's' || c1 == 't' || c1 == 'm' || c1 == 'd') {
+            return 2;
+        }
+        const uint32_t c2 = _lower(pos + 2);
+        if ((c1 == 'r' && c2 == 'e') || (c1 == 'v' && c2 == 'e') || (c1 == 'l' && c2 == 'l')) {
+            return 3;
+        }
+        return 0;
+    }
+
+    // regex: \s*[\r\n]+|\s+(?!\S)|\s+
+    // returns the end of the match at pos, pos if none
+    size_t whitespace(const size_t pos) const {
+        size_t cur = pos;
+        size_t last_end_r_or_n = 0;
+        while (unicode_collapsed_is_whitespace(get(cur))) {
+            const uint32_t c = get(cur++);
+            if (c == '\r' || c == '\n') {
+                last_end_r_or_n = cur;
+            }
+        }
+        if (last_end_r_or_n > 0) {
+            return last_end_r_or_n;
+        }
+        if (cur - pos > 1 && cur < end) {
+            return cur - 1;
+        }
+        return cur;
+    }
+};
+
+// QWEN2 system regex: "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\r\n\p{L}\p{N}]?\p{L}+|\p{N}| ?[^\s\p{L}\p{N}]+[\r\n]*|\s*[\r\n]+|\s+(?!\S)|\s+"
+// also used for the BAILINGMOE and SEED_CODER variants, which match the same words except for the [\r\n]* after punctuation
+static std::vector<size_t> unicode_regex_split_custom_qwen2(const std::string & text_collapsed, const std::vector<size_t> & offsets, bool trailing_newlines) {
+    std::vector<size_t> bpe_offsets; // store the offset of each word
+    bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
+
+    size_t start = 0;
+    for (auto offset : offsets) {
+        const unicode_collapsed_segment seg = { text_collapsed, start, start + offset };
+        assert(seg.end <= text_collapsed.size());
+        start = seg.end;
+
+        size_t _prev_end = seg.ini;
+        auto _add_token = [&] (const size_t end) {
+            assert(_prev_end <= end && end <= seg.end);
+            if (end > _prev_end) {
+                bpe_offsets.push_back(end - _prev_end);
+            }
+            _prev_end = end;
+        };
+        auto _add_match = [&] (const size_t pos, const size_t end) -> size_t {
+            _add_token(pos);
+            _add_token(end);
+            return end;
+        };
+
+        for (size_t pos = seg.ini; pos < seg.end; /*pos++*/ ) {
+            const uint32_t cpt = seg.get(pos);
+
+            // regex: (?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])
+            if (const size_t len = seg.contraction(pos)) {
+                pos = _add_match(pos, pos + len);
+                continue;
+            }
+
+            // regex: [^\r\n\p{L}\p{N}]?\p{L}+
+            if (!(cpt == '\r' || cpt == '\n' || unicode_collapsed_is_number(cpt))) {
+                if (unicode_collapsed_is_letter(cpt) || unicode_collapsed_is_letter(seg.get(pos + 1))) {
+                    size_t end = pos + 1;
+                    while (unicode_collapsed_is_letter(seg.get(end))) {
+                        end++;
+                    }
+                    pos = _add_match(pos, end);
+                    continue;
+                }
+            }
+
+            // regex: \p{N}
+            if (unicode_collapsed_is_number(cpt)) {
+                pos = _add_match(pos, pos + 1);
+                continue;
+            }
+
+            // regex: <space>?[^\s\p{L}\p{N}]+[\r\n]*
+            if (seg.is_other(pos) || (cpt == ' ' && seg.is_other(pos + 1))) {
+                size_t end = pos + 1;
+                while (seg.is_other(end)) {
+                    end++;
+                }
+                while (trailing_newlines && (seg.get(end) == '\r' || seg.get(end) == '\n')) {
+                    end++;
+                }
+                pos = _add_match(pos, end);
+                continue;
+            }
+
+            // regex: \s*[\r\n]+|\s+(?!\S)|\s+
+            const size_t end = seg.whitespace(pos);
+            if (end > pos) {
+                pos = _add_match(pos, end);
+                continue;
+            }
+
+            // no matches
+            pos++;
+        }
+
+        _add_token(seg.end);
+    }
+
+    return bpe_offsets;
+}
+
+// DEEPSEEK3_LLM system regex: "[!\"#$%&'()*+,\-./:;<=>?@\[\\\]^_`{|}~][A-Za-z]+|[^\r\n\p{L}\p{P}\p{S}]?[\p{L}\p{M}]+| ?[\p{P}\p{S}]+[\r\n]*|\s*[\r\n]+|\s+(?!\S)|\s+"
+static std::vector<size_t> unicode_regex_split_custom_deepseek3(const std::string & text_collapsed, const std::vector<size_t> & offsets) {
+    std::vector<size_t> bpe_offsets; // store the offset of each word
+    bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
+
+    auto _is_ascii_punct = [] (const uint32_t c) {
+        return ('!' <= c && c <= '/') || (':' <= c && c <= '@') || ('[' <= c && c <= '`') || ('{' <= c && c <= '~');
+    };
+    auto _is_ascii_letter = [] (const uint32_t c) {
+        return ('A' <= c && c <= 'Z') || ('a' <= c && c <= 'z');
+    };
+    auto _is_letter_or_mark = [] (const uint32_t c) {
+        return unicode_collapsed_is_letter(c) || unicode_collapsed_is_accent_mark(c);
+    };
+    auto _is_punct_or_symbol = [] (const uint32_t c) {
+        return unicode_collapsed_is_punctuation(c) || unicode_collapsed_is_symbol(c);
+    };
+
+    size_t start = 0;
+    for (auto offset : offsets) {
+        const unicode_collapsed_segment seg = { text_collapsed, start, start + offset };
+        assert(seg.end <= text_collapsed.size());
+        start = seg.end;
+
+        size_t _prev_end = seg.ini;
+        auto _add_token = [&] (const size_t end) {
+            assert(_prev_end <= end && end <= seg.end);
+            if (end > _prev_end) {
+                bpe_offsets.push_back(end - _prev_end);
+            }
+            _prev_end = end;
+        };
+        auto _add_match = [&] (const size_t pos, const size_t end) -> size_t {
+            _add_token(pos);
+            _add_token(end);
+            return end;
+        };
+
+        for (size_t pos = seg.ini; pos < seg.end; /*pos++*/ ) {
+            const uint32_t cpt = seg.get(pos);
+
+            // regex: [!\"#$%&'()*+,\-./:;<=>?@\[\\\]^_`{|}~][A-Za-z]+
+            if (_is_ascii_punct(cpt) && _is_ascii_letter(seg.get(pos + 1))) {
+                size_t end = pos + 1;
+                while (_is_ascii_letter(seg.get(end))) {
+                    end++;
+                }
+                pos = _add_match(pos, end);
+                continue;
+            }
+
+            // regex: [^\r\n\p{L}\p{P}\p{S}]?[\p{L}\p{M}]+
+            {
+                const bool prefix = cpt != seg.OUT_OF_RANGE && cpt != '\r' && cpt != '\n' &&
+                    !unicode_collapsed_is_letter(cpt) && !_is_punct_or_symbol(cpt);
+                if ((prefix && _is_letter_or_mark(seg.get(pos + 1))) || _is_letter_or_mark(cpt)) {
+                    size_t end = pos + 1;
+                    while (_is_letter_or_mark(seg.get(end))) {
+                        end++;
+                    }
+                    pos = _add_match(pos, end);
+                    continue;
+                }
+            }
+
+            // regex: <space>?[\p{P}\p{S}]+[\r\n]*
+            if (_is_punct_or_symbol(cpt) || (cpt == ' ' && _is_punct_or_symbol(seg.get(pos + 1)))) {
+                size_t end = pos + 1;
+                while (_is_punct_or_symbol(seg.get(end))) {
+                    end++;
+                }
+                while (seg.get(end) == '\r' || seg.get(end) == '\n') {
+                    end++;
+                }
+                pos = _add_match(pos, end);
+                continue;
+            }
+
+            // regex: \s*[\r\n]+|\s+(?!\S)|\s+
+            const size_t end = seg.whitespace(pos);
+            if (end > pos) {
+                pos = _add_match(pos, end);
+                continue;
+            }
+
+            // no matches
+            pos++;
+        }
+
+        _add_token(seg.end);
+    }
+
+    return bpe_offsets;
+}
+
+// TEKKEN system regex: "[^\r\n\p{L}\p{N}]?((?=[\p{L}])([^a-z]))*((?=[\p{L}])([^A-Z]))+|[^\r\n\p{L}\p{N}]?((?=[\p{L}])([^a-z]))+((?=[\p{L}])([^A-Z]))*|\p{N}| ?[^\s\p{L}\p{N}]+[\r\n/]*|\s*[\r\n]+|\s+(?!\S)|\s+"
+// also used for GPT4O, which allows up to 3 digits per word and a contraction after the letters
+static std::vector<size_t> unicode_regex_split_custom_tekken(const std::string & text_collapsed, const std::vector<size_t> & offsets, size_t max_digits, bool contractions) {
+    std::vector<size_t> bpe_offsets; // store the offset of each word
+    bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
+
+    // regex: (?=[\p{L}])([^a-z]) and (?=[\p{L}])([^A-Z])
+    auto _is_upper = [] (const uint32_t c) {
+        return c == 0xD2 || ('A' <= c && c <= 'Z');
+    };
+    auto _is_lower = [] (const uint32_t c) {
+        return c == 0xD2 || ('a' <= c && c <= 'z');
+    };
+
+    size_t start = 0;
+    for (auto offset : offsets) {
+        const unicode_collapsed_segment seg = { text_collapsed, start, start + offset };
+        assert(seg.end <= text_collapsed.size());
+        start = seg.end;
+
+        size_t _prev_end = seg.ini;
+        auto _add_token = [&] (const size_t end) {
+            assert(_prev_end <= end && end <= seg.end);
+            if (end > _prev_end) {
+                bpe_offsets.push_back(end - _prev_end);
+            }
+            _prev_end = end;
+        };
+        auto _add_match = [&] (const size_t pos, const size_t end) -> size_t {
+            _add_token(pos);
+            _add_token(end);
+            return end;
+        };
+
+        for (size_t pos = seg.ini; pos < seg.end; /*pos++*/ ) {
+            const uint32_t cpt = seg.get(pos);
+
+            // regex: [^\r\n\p{L}\p{N}]?<upper>*<lower>+|[^\r\n\p{L}\p{N}]?<upper>+<lower>*
+            {
+                const bool prefix = !(cpt == '\r' || cpt == '\n' || unicode_collapsed_is_letter(cpt) || unicode_collapsed_is_number(cpt));
+                const size_t ini = pos + prefix;
+
+                size_t n_upper = 0;
+                while (_is_upper(seg.get(ini + n_upper))) {
+                    n_upper++;
+                }
+
+                // <upper>*<lower>+ : give back uppercase letters until a lowercase one follows
+                size_t end = std::string::npos;
+                for (size_t n = n_upper + 1; n-- > 0; ) {
+                    if (_is_lower(seg.get(ini + n))) {
+                        end = ini + n;
+                        break;
+                    }
+                }
+                // <upper>+<lower>*
+                if (end == std::string::npos && n_upper > 0) {
+                    end = ini + n_upper;
+                }
+                if (end != std::string::npos) {
+                    while (_is_lower(seg.get(end))) {
+                        end++;
+                    }
+                    if (contractions) {
+                        end += seg.contraction(end);
+                    }
+                    pos = _add_match(pos, end);
+                    continue;
+                }
+            }
+
+            // regex: \p{N}{1,max_digits}
+            if (unicode_collapsed_is_number(cpt)) {
+                size_t end = pos + 1;
+                while (end - pos < max_digits && unicode_collapsed_is_number(seg.get(end))) {
+                    end++;
+                }
+                pos = _add_match(pos, end);
+                continue;
+            }
+
+            // regex: <space>?[^\s\p{L}\p{N}]+[\r\n/]*
+            if (seg.is_other(pos) || (cpt == ' ' && seg.is_other(pos + 1))) {
+                size_t end = pos + 1;
+                while (seg.is_other(end)) {
+                    end++;
+                }
+                while (seg.get(end) == '\r' || seg.get(end) == '\n' || seg.get(end) == '/') {
+                    end++;
+                }
+                pos = _add_match(pos, end);
+                continue;
+            }
+
+            // regex: \s*[\r\n]+|\s+(?!\S)|\s+
+            const size_t end = seg.whitespace(pos);
+            if (end > pos) {
+                pos = _add_match(pos, end);
+                continue;
+            }
+
+            // no matches
+            pos++;
+        }
+
+        _add_token(seg.end);
+    }
+
+    return bpe_offsets;
+}
+
+// SUPERBPE digit grouping regex: "(?=(\d{3})+(?!\d))"
+// empty matches in front of every group of 3 digits, counted from the end of the number
+static std::vector<size_t> unicode_regex_split_custom_superbpe(const std::vector<uint32_t> & cpts, const std::vector<size_t> & offsets) {
+    std::vector<size_t> bpe_offsets; // store the offset of each word
+    bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
+
+    auto _is_digit = [] (const uint32_t c) {
+        return '0' <= c && c <= '9';
+    };
+
+    size_t start = 0;
+    for (auto offset : offsets) {
+        const size_t offset_ini = start;
+        const size_t offset_end = start + offset;
+        assert(offset_end <= cpts.size());
+        start = offset_end;
+
+        size_t prev_end = offset_ini;
+        for (size_t pos = offset_ini; pos < offset_end; /*pos++*/ ) {
+            if (!_is_digit(cpts[pos])) {
+                pos++;
+                continue;
+            }
+            size_t end = pos;
+            while (end < offset_end && _is_digit(cpts[end])) {
+                end++;
+            }
+            for (size_t cur = pos; cur < end; ++cur) {
+                if ((end - cur) % 3 == 0) {
+                    if (cur > prev_end) {
+                        bpe_offsets.push_back(cur - prev_end);
+                    }
+                    bpe_offsets.push_back(0);
+                    prev_end = cur;
+                }
+            }
+            pos = end;
+        }
+        if (offset_end > prev_end) {
+            bpe_offsets.push_back(offset_end - prev_end);
+        }
+    }
+
+    return bpe_offsets;
+}
+
 // use std::wregex to split the text
 static std::vector<size_t> unicode_regex_split_stl(const std::wstring & wtext, const std::wstring & regex_expr, const std::vector<size_t> & offsets) {
     std::wregex expr(regex_expr);
@@ -557,16 +990,491 @@ static std::vector<size_t> unicode_regex_split_stl(const std::string & text, con
     return bpe_offsets;
 }
 
-static std::vector<size_t> unicode_regex_split_custom(const std::string & text, const std::string & regex_expr, const std::vector<size_t> & offsets) {
+//
+// compiled regex rules
+//
+// the remaining pre-tokenizer regexes are simple enough to be matched without backtracking: alternatives of
+// sequences of character classes with greedy quantifiers, where a repeated class never overlaps the classes
+// that follow it. these are compiled once into a table of ranges and matched directly on the text given to
+// the std::regex fallback, which produces the same splits. anything else falls back to std::regex
+//
+
+// set of code units, stored as sorted disjoint ranges
+struct unicode_regex_class {
+    std::vector<std::pair<uint32_t, uint32_t>> ranges;
+
+    std::array<bool, 256> lut = {}; // fast path for the first 256 code units
+
+    void add(uint32_t first, uint32_t last) {
+        ranges.emplace_back(first, last);
+    }
+
+    void add(const unicode_regex_class & other) {
+        ranges.insert(ranges.end(), other.ranges.begin(), other.ranges.end());
+    }
+
+    // sort and merge the ranges, optionally take the complement
+    void build(bool negated) {
+        std::sort(ranges.begin(), ranges.end());
+
+        std::vector<std::pair<uint32_t, uint32_t>> merged;
+        for (const auto & range : ranges) {
+            if (!merged.empty() && (uint64_t) range.first <= (uint64_t) merged.back().second + 1) {
+                merged.back().second = std::max(merged.back().second, range.second);
+            } else {
+                merged.push_back(range);
+            }
+        }
+
+        if (negated) {
+            std::vector<std::pair<uint32_t, uint32_t>> complement;
+            uint64_t next = 0;
+            for (const auto & range : merged) {
+                if (range.first > next) {
+                    complement.emplace_back(next, range.first - 1);
+                }
+                next = (uint64_t) range.second + 1;
+            }
+            if (next <= UINT32_MAX) {
+                complement.emplace_back(next, UINT32_MAX);
+            }
+            merged = std::move(complement);
+        }
+
+        ranges = std::move(merged);
+
+        for (uint32_t c = 0; c < lut.size(); ++c) {
+            lut[c] = contains_slow(c);
+        }
+    }
+
+    bool contains_slow(uint32_t c) const {
+        auto it = std::upper_bound(ranges.begin(), ranges.end(), c, [](uint32_t c, const std::pair<uint32_t, uint32_t> & range) {
+            return c < range.first;
+        });
+        return it != ranges.begin() && c <= (it - 1)->second;
+    }
+
+    bool contains(uint32_t c) const {
+        return c < lut.size() ? lut[c] : contains_slow(c);
+    }
+
+    bool intersects(const unicode_regex_class & other) const {
+        size_t i = 0;
+        size_t j = 0;
+        while (i < ranges.size() && j < other.ranges.size()) {
+            if (ranges[i].second < other.ranges[j].first) {
+                i++;
+            } else if (other.ranges[j].second < ranges[i].first) {
+                j++;
+            } else {
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+struct unicode_regex_rule {
+    static const size_t MAX_REPEAT = SIZE_MAX;
+
+    // class{min,max}
+    struct element {
+        unicode_regex_class cls;
+
+        size_t min;
+        size_t max;
+    };
+
+    struct sequence {
+        std::vector<element> elements;
+
+        bool anchored = false; // ends with $
+    };
+
+    // tried in order, the first one that matches wins
+    std::vector<sequence> alternatives;
+
+    // returns the end of the match at pos, std::string::npos if none
+    template <typename T>
+    size_t match(const T * text, size_t pos, size_t end) const {
+        for (const auto & seq : alternatives) {
+            size_t cur = pos;
+            bool ok = true;
+            for (const auto & elem : seq.elements) {
+                size_t n = 0;
+                while (n < elem.max && cur + n < end && elem.cls.contains(unit(text[cur + n]))) {
+                    n++;
+                }
+                if (n < elem.min) {
+                    ok = false;
+                    break;
+                }
+                cur += n;
+            }
+            if (ok && (!seq.anchored || cur == end)) {
+                return cur;
+            }
+        }
+        return std::string::npos;
+    }
+
+    static uint32_t unit(char c)    { return (uint8_t) c; }
+    static uint32_t unit(wchar_t c) { return (uint32_t) c; }
+};
+
+// compiles the subset of the ECMAScript syntax used by the pre-tokenizers, throws on anything else
+class unicode_regex_rule_parser {
+public:
+    unicode_regex_rule_parser(const std::vector<uint32_t> & src) : src(src) {}
+
+    unicode_regex_rule parse() {
+        unicode_regex_rule rule;
+        rule.alternatives = parse_alternatives();
+        if (pos != src.size()) {
+            throw std::runtime_error("unexpected ')'");
+        }
+
+        for (const auto & seq : rule.alternatives) {
+            bool empty = true;
+            for (size_t i = 0; i < seq.elements.size(); ++i) {
+                const auto & elem = seq.elements[i];
+                empty = empty && elem.min == 0;
+                if (elem.min == elem.max) {
+                    continue;
+                }
+                // a greedy element never needs to give back code units if the following ones cannot match them
+                for (size_t j = i + 1; j < seq.elements.size(); ++j) {
+                    if (elem.cls.intersects(seq.elements[j].cls)) {
+                        throw std::runtime_error("backtracking is not supported");
+                    }
+                    if (seq.elements[j].min > 0) {
+                        break;
+                    }
+                }
+            }
+            if (empty) {
+                throw std::runtime_error("empty matches are not supported");
+            }
+        }
+
+        return rule;
+    }
+
+private:
+    const std::vector<uint32_t> & src;
+
+    size_t pos = 0;
+    int    depth = 0;
+
+    bool eof() const {
+        return pos >= src.size();
+    }
+
+    uint32_t peek() const {
+        return eof() ? 0 : src[pos];
+    }
+
+    bool end_of_sequence() const {
+        return eof() || peek() == '|' || peek() == ')';
+    }
+
+    std::vector<unicode_regex_rule::sequence> parse_alternatives() {
+        std::vector<unicode_regex_rule::sequence> result;
+        while (true) {
+            auto seqs = parse_sequence();
+            result.insert(result.end(), seqs.begin(), seqs.end());
+            if (peek() != '|') {
+                break;
+            }
+            pos++;
+        }
+        return result;
+    }
+
+    // usually a single sequence, unless it consists of a group with alternatives
+    std::vector<unicode_regex_rule::sequence> parse_sequence() {
+        unicode_regex_rule::sequence seq;
+        while (!end_of_sequence()) {
+            if (peek() == '$') {
+                pos++;
+                if (depth > 0 || !end_of_sequence()) {
+                    throw std::runtime_error("unsupported '$'");
+                }
+                seq.anchored = true;
+                break;
+            }
+
+            auto atom = parse_atom();
+
+            size_t min = 1;
+            size_t max = 1;
+            const bool quantified = parse_quantifier(min, max);
+
+            if (quantified) {
+                // only single code units can be repeated: (a|b|[c-d])+
+                unicode_regex_class cls;
+                for (const auto & alt : atom) {
+                    if (alt.elements.size() != 1 || alt.elements[0].min != 1 || alt.elements[0].max != 1) {
+                        throw std::runtime_error("unsupported quantified group");
+                    }
+                    cls.add(alt.elements[0].cls);
+                }
+                cls.build(false);
+                seq.elements.push_back({ std::move(cls), min, max });
+            } else if (atom.size() == 1) {
+                seq.elements.insert(seq.elements.end(), atom[0].elements.begin(), atom[0].elements.end());
+            } else if (seq.elements.empty() && end_of_sequence()) {
+                // (a|b) -> a|b
+                return atom;
+            } else {
+                throw std::runtime_error("unsupported group");
+            }
+        }
+        return { std::move(seq) };
+    }
+
+    std::vector<unicode_regex_rule::sequence> parse_atom() {
+        const uint32_t c = src[pos++];
+
+        if (c == '(') {
+            if (peek() == '?') {
+                pos++;
+                if (peek() != ':') {
+                    throw std::runtime_error("lookarounds are not supported");
+                }
+                pos++;
+            }
+            depth++;
+            auto result = parse_alternatives();
+            depth--;
+            if (peek() != ')') {
+                throw std::runtime_error("expected ')'");
+            }
+            pos++;
+            return result;
+        }
+
+        unicode_regex_class cls;
+        if (c == '[') {
+            parse_class(cls);
+        } else if (c == '\\') {
+            if (!parse_escape(cls)) {
+                const uint32_t e = parse_escaped_char();
+                cls.add(e, e);
+            }
+            cls.build(false);
+        } else if (c == '.' || c == '^' || c == '*' || c == '+' || c == '?' || c == '{' || c == '}' || c == ']') {
+            throw std::runtime_error("unsupported character");
+        } else {
+            cls.add(c, c);
+            cls.build(false);
+        }
+
+        unicode_regex_rule::sequence seq;
+        seq.elements.push_back({ std::move(cls), 1, 1 });
+        return { std::move(seq) };
+    }
+
+    // after the opening '['
+    void parse_class(unicode_regex_class & cls) {
+        bool negated = false;
+        if (peek() == '^') {
+            negated = true;
+            pos++;
+        }
+        while (true) {
+            if (eof()) {
+                throw std::runtime_error("expected ']'");
+            }
+            uint32_t first = src[pos++];
+            if (first == ']') {
+                break;
+            }
+            if (first == '\\') {
+                if (parse_escape(cls)) {
+                    continue;
+                }
+                first = parse_escaped_char();
+            }
+            uint32_t last = first;
+            if (peek() == '-' && pos + 1 < src.size() && src[pos + 1] != ']') {
+                pos++;
+                last = src[pos++];
+                if (last == '\\') {
+                    last = parse_escaped_char();
+                }
+                if (last < first) {
+                    throw std::runtime_error("invalid range");
+                }
+            }
+            cls.add(first, last);
+        }
+        cls.build(negated);
+    }
+
+    // class escapes after '\', returns false if not a class
+    bool parse_escape(unicode_regex_class & cls) {
+        switch (peek()) {
+            case 's':
+                // same as std::regex \s in the C locale, non-ASCII whitespaces have already been replaced with \v
+                cls.add('\t', '\r');
+                cls.add(' ', ' ');
+                break;
+            case 'd':
+                cls.add('0', '9');
+                break;
+            default:
+                return false;
+        }
+        pos++;
+        return true;
+    }
+
+    // single code unit after '\'
+    uint32_t parse_escaped_char() {
+        if (eof()) {
+            throw std::runtime_error("unexpected end of regex");
+        }
+        const uint32_t c = src[pos++];
+        switch (c) {
+            case 'r': return '\r';
+            case 'n': return '\n';
+            case 't': return '\t';
+            case 'v': return '\v';
+            case 'f': return '\f';
+        }
+        if (c < 128 && std::isalnum((int) c)) {
+            throw std::runtime_error("unsupported escape");
+        }
+        return c;
+    }
+
+    // returns false if there is no quantifier
+    bool parse_quantifier(size_t & min, size_t & max) {
+        switch (peek()) {
+            case '?': min = 0; max = 1;                             pos++; break;
+            case '*': min = 0; max = unicode_regex_rule::MAX_REPEAT; pos++; break;
+            case '+': min = 1; max = unicode_regex_rule::MAX_REPEAT; pos++; break;
+            case '{':
+                {
+                    pos++;
+                    min = parse_number();
+                    max = min;
+                    if (peek() == ',') {
+                        pos++;
+                        max = peek() == '}' ? unicode_regex_rule::MAX_REPEAT : parse_number();
+                    }
+                    if (peek() != '}' || max < min) {
+                        throw std::runtime_error("invalid quantifier");
+                    }
+                    pos++;
+                } break;
+            default:
+                return false;
+        }
+        if (peek() == '?') {
+            throw std::runtime_error("lazy quantifiers are not supported");
+        }
+        return true;
+    }
+
+    size_t parse_number() {
+        if (!('0' <= peek() && peek() <= '9')) {
+            throw std::runtime_error("expected number");
+        }
+        size_t result = 0;
+        while ('0' <= peek() && peek() <= '9') {
+            result = 10*result + (src[pos++] - '0');
+        }
+        return result;
+    }
+};
+
+// returns nullptr if the regex is not supported
+template <typename T>
+static const unicode_regex_rule * unicode_regex_rule_get(const std::string & regex_expr, const std::basic_string<T> & src) {
+    static std::mutex mutex;
+    static std::unordered_map<std::string, std::unique_ptr<unicode_regex_rule>> rules;
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    auto it = rules.find(regex_expr);
+    if (it == rules.end()) {
+        std::unique_ptr<unicode_regex_rule> rule;
+        try {
+            std::vector<uint32_t> units;
+            units.reserve(src.size());
+            for (const T c : src) {
+                units.push_back(unicode_regex_rule::unit(c));
+            }
+            rule = std::make_unique<unicode_regex_rule>(unicode_regex_rule_parser(units).parse());
+        } catch (const std::exception & /*ex*/) {
+            // not supported, use std::regex instead
+        }
+        it = rules.emplace(regex_expr, std::move(rule)).first;
+    }
+
+    return it->second.get();
+}
+
+// same result as unicode_regex_split_stl()
+template <typename T>
+static std::vector<size_t> unicode_regex_split_rule(const unicode_regex_rule & rule, const std::basic_string<T> & text, const std::vector<size_t> & offsets) {
+    std::vector<size_t> bpe_offsets; // store the offset of each word
+    bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
+    size_t start = 0;
+    for (auto offset : offsets) {
+        const size_t end = start + offset;
+
+        size_t prev_end = start;
+        for (size_t pos = start; pos < end; /*pos++*/ ) {
+            const size_t match_end = rule.match(text.data(), pos, end);
+            if (match_end == std::string::npos) {
+                pos++;
+                continue;
+            }
+            if (pos > prev_end) {
+                bpe_offsets.emplace_back(pos - prev_end);
+            }
+            bpe_offsets.emplace_back(match_end - pos);
+            pos = prev_end = match_end;
+        }
+
+        if (end > prev_end) {
+            bpe_offsets.emplace_back(end - prev_end);
+        }
+        start = end;
+    }
+
+    return bpe_offsets;
+}
+
+static std::vector<size_t> unicode_regex_split_custom(const std::vector<uint32_t> & cpts, const std::string & text_collapsed, const std::string & regex_expr, const std::vector<size_t> & offsets) {
     std::vector<size_t> bpe_offsets;
 
     if (regex_expr == "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)") {
-        bpe_offsets = unicode_regex_split_custom_gpt2(text, offsets);
+        bpe_offsets = unicode_regex_split_custom_gpt2(cpts, offsets);
     } else if (
             regex_expr == "(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+" ||
             regex_expr == "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+") {
 
-        bpe_offsets = unicode_regex_split_custom_llama3(text, offsets);
+        bpe_offsets = unicode_regex_split_custom_llama3(cpts, offsets);
+    } else if (
+            regex_expr == "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+" ||
+            regex_expr == "'(?:[sSdDmMtT]|[lL][lL]|[vV][eE]|[rR][eE])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]|\\s+(?!\\S)|\\s+") {
+
+        bpe_offsets = unicode_regex_split_custom_qwen2(text_collapsed, offsets, true);
+    } else if (regex_expr == "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1}| ?[^\\s\\p{L}\\p{N}\\r\\n]+|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+") {
+        bpe_offsets = unicode_regex_split_custom_qwen2(text_collapsed, offsets, false);
+    } else if (regex_expr == "[!\"#$%&'()*+,\\-./:;<=>?@\\[\\\\\\]^_`{|}~][A-Za-z]+|[^\r\n\\p{L}\\p{P}\\p{S}]?[\\p{L}\\p{M}]+| ?[\\p{P}\\p{S}]+[\r\n]*|\\s*[\r\n]+|\\s+(?!\\S)|\\s+") {
+        bpe_offsets = unicode_regex_split_custom_deepseek3(text_collapsed, offsets);
+    } else if (regex_expr == "[^\\r\\n\\p{L}\\p{N}]?((?=[\\p{L}])([^a-z]))*((?=[\\p{L}])([^A-Z]))+|[^\\r\\n\\p{L}\\p{N}]?((?=[\\p{L}])([^a-z]))+((?=[\\p{L}])([^A-Z]))*|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n/]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+") {
+        bpe_offsets = unicode_regex_split_custom_tekken(text_collapsed, offsets, 1, false);
+    } else if (regex_expr == "[^\\r\\n\\p{L}\\p{N}]?((?=[\\p{L}])([^a-z]))*((?=[\\p{L}])([^A-Z]))+(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])?|[^\\r\\n\\p{L}\\p{N}]?((?=[\\p{L}])([^a-z]))+((?=[\\p{L}])([^A-Z]))*(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])?|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n/]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+") {
+        bpe_offsets = unicode_regex_split_custom_tekken(text_collapsed, offsets, 3, true);
+    } else if (regex_expr == "(?=(\\d{3})+(?!\\d))") {
+        bpe_offsets = unicode_regex_split_custom_superbpe(cpts, offsets);
     }
 
     return bpe_offsets;
@@ -672,7 +1580,7 @@ uint32_t unicode_tolower(uint32_t cpt) {
     return cpt;  // Return the original code point if no lowercase mapping is found
 }
 
-std::vector<std::string> unicode_regex_split(const std::string & text, const std::vector<std::string> & regex_exprs) {
+std::vector<std::string> unicode_regex_split(const std::string & text, const std::vector<std::string> & regex_exprs, bool use_custom) {
     // unicode categories
     static const std::map<std::string, int> k_ucat_enum = {
         { "\\p{N}", unicode_cpt_flags::NUMBER },
@@ -740,11 +1648,14 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
         }
     }
 
+    // codepoints for std::wregex, generated on first use
+    std::wstring wtext;
+
     std::vector<size_t> bpe_offsets = { cpts.size() };
 
     for (const auto & regex_expr : regex_exprs) {
         // first, see if we have an efficient custom regex implementation
-        auto tmp = unicode_regex_split_custom(text, regex_expr, bpe_offsets);
+        auto tmp = use_custom ? unicode_regex_split_custom(cpts, text_collapsed, regex_expr, bpe_offsets) : std::vector<size_t>();
 
         if (!tmp.empty()) {
             bpe_offsets = std::move(tmp);
@@ -814,22 +1725,34 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
 
                 //printf("text_collapsed: %s\n", text_collapsed.c_str());
                 //printf("regex_expr_collapsed: %s\n", regex_expr_collapsed.c_str());
-                bpe_offsets = unicode_regex_split_stl(text_collapsed, regex_expr_collapsed, bpe_offsets);
+                const auto * rule = use_custom ? unicode_regex_rule_get(regex_expr, regex_expr_collapsed) : nullptr;
+                if (rule) {
+                    bpe_offsets = unicode_regex_split_rule(*rule, text_collapsed, bpe_offsets);
+                } else {
+                    bpe_offsets = unicode_regex_split_stl(text_collapsed, regex_expr_collapsed, bpe_offsets);
+                }
             } else {
                 // no unicode category used, we can use std::wregex directly
                 const std::wstring wregex_expr = unicode_wstring_from_utf8(regex_expr);
 
                 // std::wregex \s does not mach non-ASCII whitespaces, using 0x0B as fallback
-                std::wstring wtext(cpts.begin(), cpts.end());
-                for (size_t i = 0; i < wtext.size(); ++i) {
-                    if (wtext[i] > 0x7F && unicode_cpt_flags_from_cpt(wtext[i]).is_whitespace) {
-                        wtext[i] = 0x0B;
+                if (wtext.size() != cpts.size()) {
+                    wtext.assign(cpts.begin(), cpts.end());
+                    for (size_t i = 0; i < wtext.size(); ++i) {
+                        if (wtext[i] > 0x7F && unicode_cpt_flags_from_cpt(wtext[i]).is_whitespace) {
+                            wtext[i] = 0x0B;
+                        }
                     }
                 }
 
                 //printf("text: %s\n", text.c_str());
                 //printf("regex_expr: %s\n", regex_expr.c_str());
-                bpe_offsets = unicode_regex_split_stl(wtext, wregex_expr, bpe_offsets);
+                const auto * rule = use_custom ? unicode_regex_rule_get(regex_expr, wregex_expr) : nullptr;
+                if (rule) {
+                    bpe_offsets = unicode_regex_split_rule(*rule, wtext, bpe_offsets);
+                } else {
+                    bpe_offsets = unicode_regex_split_stl(wtext, wregex_expr, bpe_offsets);
+                }
             }
         } catch (std::regex_error & e) {
             fprintf(stderr, "Failed to process regex: '%s'\n", regex_expr.c_str());
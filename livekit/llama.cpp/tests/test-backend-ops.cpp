@@ -100,7 +100,7 @@ static void init_tensor_uniform(ggml_tensor * tensor, float min = -1.0f, float m
             };
 
             const size_t min_blocks_per_thread = 1;
-            const size_t n_threads = std::min<size_t>(std::thread::hardware_concurrency()/2,
+            const size_t n_threads = std::min<size_t>(std::max<size_t>(1, std::thread::hardware_concurrency()/2),
                                                       std::max<size_t>(1, n_blocks / min_blocks_per_thread));
             std::vector<std::future<void>> tasks;
             tasks.reserve(n_threads);
@@ -334,6 +334,12 @@ struct test_case {
         return 1e-7;
     }
 
+    // compute the whole graph and compare only the output, instead of comparing the nodes one at a time
+    // used to test the fused kernels of the backends
+    virtual bool run_whole_graph() {
+        return false;
+    }
+
     virtual double max_maa_err() {
         return 1e-4;
     }
@@ -574,7 +580,9 @@ struct test_case {
             GGML_UNUSED(index);
         };
 
-        const bool cmp_ok = ggml_backend_compare_graph_backend(backend1, backend2, gf, callback, &ud);
+        const bool cmp_ok = run_whole_graph()
+            ? ggml_backend_compare_graph_backend_node(backend1, backend2, gf, callback, &ud, out)
+            : ggml_backend_compare_graph_backend     (backend1, backend2, gf, callback, &ud);
 
         if (!cmp_ok) {
             printf("compare failed ");
@@ -1104,6 +1112,48 @@ struct test_unary : public test_case {
 
 };
 
+// GGML_UNARY_OP_SILU + GGML_OP_MUL
+struct test_silu_mul : public test_case {
+    const std::array<int64_t, 4> ne;
+    const bool swapped; // mul(y, silu(x)) instead of mul(silu(x), y)
+
+    std::string op_desc(ggml_tensor * t) override {
+        GGML_UNUSED(t);
+        return "SILU_MUL";
+    }
+
+    std::string vars() override {
+        return VARS_TO_STR2(ne, swapped);
+    }
+
+    bool run_whole_graph() override {
+        return true;
+    }
+
+    test_silu_mul(std::array<int64_t, 4> ne = {128, 2, 2, 2}, bool swapped = false)
+        : ne(ne), swapped(swapped) {}
+
+    ggml_tensor * build_graph(ggml_context * ctx) override {
+        ggml_tensor * x = ggml_new_tensor(ctx, GGML_TYPE_F32, 4, ne.data());
+        ggml_set_name(x, "x");
+
+        ggml_tensor * y = ggml_new_tensor(ctx, GGML_TYPE_F32, 4, ne.data());
+        ggml_set_name(y, "y");
+
+        ggml_tensor * gate = ggml_silu(ctx, x);
+        ggml_set_name(gate, "gate");
+
+        // computed between the silu and the mul, as the up projection of a feed-forward block
+        ggml_tensor * up = ggml_scale(ctx, y, 0.5f);
+        ggml_set_name(up, "up");
+
+        ggml_tensor * out = swapped ? ggml_mul(ctx, up, gate) : ggml_mul(ctx, gate, up);
+        ggml_set_name(out, "out");
+
+        return out;
+    }
+};
+
 // GGML_OP_GET_ROWS
 struct test_get_rows : public test_case {
     const ggml_type type;
@@ -1791,6 +1841,68 @@ struct test_rms_norm : public test_case {
     }
 };
 
+// GGML_OP_ADD + GGML_OP_RMS_NORM + GGML_OP_MUL
+struct test_add_rms_norm_mul : public test_case {
+    const std::array<int64_t, 4> ne;
+    const std::array<int64_t, 4> ne_w; // broadcast to ne, also used for the second operand of the add
+    const bool add;
+    const bool mul;
+    const float eps;
+
+    std::string op_desc(ggml_tensor * t) override {
+        GGML_UNUSED(t);
+        return std::string(add ? "ADD_" : "") + "RMS_NORM" + (mul ? "_MUL" : "");
+    }
+
+    std::string vars() override {
+        return VARS_TO_STR5(ne, ne_w, add, mul, eps);
+    }
+
+    bool run_whole_graph() override {
+        return true;
+    }
+
+    test_add_rms_norm_mul(std::array<int64_t, 4> ne = {64, 5, 4, 3},
+            std::array<int64_t, 4> ne_w = {64, 1, 1, 1},
+            bool add = true,
+            bool mul = true,
+            float eps = 1e-6f)
+        : ne(ne), ne_w(ne_w), add(add), mul(mul), eps(eps) {}
+
+    ggml_tensor * build_graph(ggml_context * ctx) override {
+        ggml_tensor * a = ggml_new_tensor(ctx, GGML_TYPE_F32, 4, ne.data());
+        ggml_set_name(a, "a");
+
+        if (add) {
+            ggml_tensor * b = ggml_new_tensor(ctx, GGML_TYPE_F32, 4, ne_w.data());
+            ggml_set_name(b, "b");
+
+            a = ggml_add(ctx, a, b);
+            ggml_set_name(a, "a_add_b");
+        }
+
+        ggml_tensor * out = ggml_rms_norm(ctx, a, eps);
+
+        if (mul) {
+            ggml_set_name(out, "rms_norm");
+
+            ggml_tensor * w = ggml_new_tensor(ctx, GGML_TYPE_F32, 4, ne_w.data());
+            ggml_set_name(w, "w");
+
+            out = ggml_mul(ctx, out, w);
+        }
+        ggml_set_name(out, "out");
+
+        return out;
+    }
+
+    void initialize_tensors(ggml_context * ctx) override {
+        for (ggml_tensor * t = ggml_get_first_tensor(ctx); t != NULL; t = ggml_get_next_tensor(ctx, t)) {
+            init_tensor_uniform(t, -10.f, 10.f);
+        }
+    }
+};
+
 // GGML_OP_RMS_NORM_BACK
 struct test_rms_norm_back : public test_case {
     const ggml_type type;
@@ -2075,6 +2187,54 @@ struct test_mul_mat : public test_case {
     }
 };
 
+// GGML_OP_MUL_MAT + GGML_OP_ADD
+struct test_mul_mat_add : public test_case {
+    const ggml_type type_a;
+    const int64_t m;
+    const int64_t n;
+    const int64_t k;
+    const bool bias_row; // the bias is a single row broadcast to all the rows of the result
+
+    std::string op_desc(ggml_tensor * t) override {
+        GGML_UNUSED(t);
+        return "MUL_MAT_ADD";
+    }
+
+    std::string vars() override {
+        return VARS_TO_STR5(type_a, m, n, k, bias_row);
+    }
+
+    double max_nmse_err() override {
+        return 5e-4;
+    }
+
+    bool run_whole_graph() override {
+        return true;
+    }
+
+    test_mul_mat_add(ggml_type type_a = GGML_TYPE_F32, int64_t m = 32, int64_t n = 32, int64_t k = 32, bool bias_row = true)
+        : type_a(type_a), m(m), n(n), k(k), bias_row(bias_row) {}
+
+    ggml_tensor * build_graph(ggml_context * ctx) override {
+        ggml_tensor * a = ggml_new_tensor_2d(ctx, type_a, k, m);
+        ggml_set_name(a, "a");
+
+        ggml_tensor * b = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, k, n);
+        ggml_set_name(b, "b");
+
+        ggml_tensor * bias = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, m, bias_row ? 1 : n);
+        ggml_set_name(bias, "bias");
+
+        ggml_tensor * out = ggml_mul_mat(ctx, a, b);
+        ggml_set_name(out, "mul_mat");
+
+        out = ggml_add(ctx, out, bias);
+        ggml_set_name(out, "out");
+
+        return out;
+    }
+};
+
 // GGML_OP_MUL_MAT_ID
 struct test_mul_mat_id : public test_case {
     const ggml_type type_a;
@@ -4222,6 +4382,25 @@ static std::vector<std::unique_ptr<test_case>> make_test_cases_eval() {
 
     test_cases.emplace_back(new test_l2_norm(GGML_TYPE_F32, {64, 5, 4, 3}, 1e-12f));
 
+    // fused by some backends
+    for (bool add : {false, true}) {
+        for (bool mul : {false, true}) {
+            test_cases.emplace_back(new test_add_rms_norm_mul({64, 5, 4, 3}, {64, 1, 1, 1}, add, mul));
+            test_cases.emplace_back(new test_add_rms_norm_mul({64, 5, 4, 3}, {64, 5, 4, 3}, add, mul));
+            test_cases.emplace_back(new test_add_rms_norm_mul({64, 5, 4, 3}, {64, 5, 1, 3}, add, mul));
+        }
+    }
+    for (bool swapped : {false, true}) {
+        test_cases.emplace_back(new test_silu_mul({128, 2, 2, 2}, swapped));
+        test_cases.emplace_back(new test_silu_mul({1024, 7, 1, 1}, swapped));
+    }
+    for (ggml_type type_a : {GGML_TYPE_F32, GGML_TYPE_F16, GGML_TYPE_Q4_0, GGML_TYPE_Q8_0}) {
+        for (int64_t n : {1, 7, 64}) {
+            test_cases.emplace_back(new test_mul_mat_add(type_a, 256, n, 256, true));
+            test_cases.emplace_back(new test_mul_mat_add(type_a, 256, n, 256, false));
+        }
+    }
+
     test_cases.emplace_back(new test_ssm_conv(GGML_TYPE_F32, {4, 1536, 1, 1}, {4, 1536, 1, 1}));
     test_cases.emplace_back(new test_ssm_conv(GGML_TYPE_F32, {8, 1536, 1, 1}, {4, 1536, 1, 1}));
     test_cases.emplace_back(new test_ssm_conv(GGML_TYPE_F32, {4, 1536, 4, 1}, {4, 1536, 1, 1}));
@@ -4575,6 +4754,26 @@ static std::vector<std::unique_ptr<test_case>> make_test_cases_eval() {
         }
     }
 
+    // fewer q rows than threads and a long KV sequence: the CPU backend splits the KV sequence between the threads
+    // (run with -b CPU to compare against the CPU reference, which uses a different number of threads)
+    for (int hs : { 64, 128, }) {
+        for (bool mask : { true, false } ) {
+            for (float max_bias : { 0.0f, 8.0f }) {
+                if (!mask && max_bias > 0.0f) continue;
+                for (float logit_softcap : {0.0f, 10.0f}) {
+                    for (int nr : { 1, 2, }) {
+                        for (int kv : { 512, 1111, 4096, }) {
+                            for (ggml_type type_KV : {GGML_TYPE_F16, GGML_TYPE_Q8_0}) {
+                                test_cases.emplace_back(new test_flash_attn_ext(
+                                    hs, hs, 1, nr, kv, 1, mask, max_bias, logit_softcap, GGML_PREC_F32, type_KV));
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
     test_cases.emplace_back(new test_cross_entropy_loss     (GGML_TYPE_F32, {   10, 5, 4, 3}));
     test_cases.emplace_back(new test_cross_entropy_loss     (GGML_TYPE_F32, {30000, 1, 1, 1}));
     test_cases.emplace_back(new test_cross_entropy_loss_back(GGML_TYPE_F32, {   10, 5, 4, 3}));
@@ -4639,7 +4838,7 @@ static std::vector<std::unique_ptr<test_case>> make_test_cases_perf() {
         }
     }
 
-    for (int kv : { 4096, 8192, 16384, }) {
+    for (int kv : { 4096, 8192, 16384, 32768, }) {
         for (int hs : { 64, 128, }) {
             for (int nr : { 1, 4, }) {
                 test_cases.emplace_back(new test_flash_attn_ext(hs, hs, 8, nr, kv, 1, true, 0, 0, GGML_PREC_F32, GGML_TYPE_F16));
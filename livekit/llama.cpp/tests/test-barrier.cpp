@@ -7,10 +7,203 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cassert>
+#include <cstring>
+#include <string>
 #include <vector>
 
 #define MAX_NARGS 2
 
+static struct ggml_tensor * rand_tensor(struct ggml_context * ctx, enum ggml_type type, int64_t ne0, int64_t ne1) {
+    struct ggml_tensor * t = ggml_new_tensor_2d(ctx, type, ne0, ne1);
+
+    float * data = (float *) t->data;
+    for (int64_t i = 0; i < ne0*ne1; i++) {
+        data[i] = (float) (rand() % 1000) / 1000.0f - 0.5f;
+    }
+
+    return t;
+}
+
+// computes the graph with a barrier after every node, with the default dependency-based barriers and with fused nodes,
+// reports the number of barriers and the time per graph, and checks that the results are the same
+static void bench(const char * name, struct ggml_cgraph * gf, struct ggml_tensor * out,
+        struct ggml_threadpool * threadpool, int n_threads, int n_rounds) {
+    const int n_nodes = ggml_graph_n_nodes(gf);
+
+    // Create compute plan
+    struct ggml_cplan cplan = ggml_graph_plan(gf, n_threads, threadpool);
+
+    std::vector<uint8_t> work_data(cplan.work_size);
+    cplan.work_data = work_data.data();
+
+    std::cerr << "graph-compute " << name << " with"
+              << "\n n_threads: " << n_threads
+              << "\n   n_nodes: " << n_nodes
+              << "\n  n_rounds: " << n_rounds
+              << "\n";
+    // ggml_graph_print(gf);
+
+    std::vector<float> ref;
+
+    const struct {
+        const char * name;
+        bool sync_all;
+        bool no_fusion;
+    } modes[] = {
+        { "sync all nodes", true,  true  },
+        { "dependencies  ", false, true  },
+        { "fused nodes   ", false, false },
+    };
+
+    for (const auto & mode : modes) {
+        cplan.sync_all  = mode.sync_all;
+        cplan.no_fusion = mode.no_fusion;
+
+        // Warmup
+        ggml_graph_compute(gf, &cplan);
+
+        auto t0 = std::chrono::high_resolution_clock::now();
+
+        for (int i=0; i < n_rounds; i++) {
+            ggml_graph_compute(gf, &cplan);
+        }
+
+        auto t1 = std::chrono::high_resolution_clock::now();
+
+        auto usec = std::chrono::duration_cast<std::chrono::microseconds>(t1-t0).count();
+        auto nsec = std::chrono::duration_cast<std::chrono::nanoseconds>(t1-t0).count();
+        std::cerr << " " << mode.name << ": "
+                  << cplan.n_barriers << " barriers, "
+                  << cplan.n_fused << " fused, "
+                  << cplan.n_chunk_steals << " chunk steals, "
+                  << (float) usec / n_rounds << " usec per-iter, "
+                  << (float) nsec / (n_rounds * n_nodes) << " nsec per-node"
+                  << "\n";
+
+        const float * data = (const float *) out->data;
+        if (ref.empty()) {
+            ref.assign(data, data + ggml_nelements(out));
+        } else if (memcmp(data, ref.data(), ggml_nbytes(out)) != 0) {
+            fprintf(stderr, "%s: %s: results differ from the results with a barrier after every node\n", __func__, name);
+            exit(1);
+        }
+    }
+}
+
+static struct ggml_tensor * rand_tensor_q(struct ggml_context * ctx, enum ggml_type type, int64_t ne0, int64_t ne1) {
+    if (type == GGML_TYPE_F32) {
+        return rand_tensor(ctx, type, ne0, ne1);
+    }
+
+    std::vector<float> data(ne0*ne1);
+    for (auto & x : data) {
+        x = (float) (rand() % 1000) / 1000.0f - 0.5f;
+    }
+
+    struct ggml_tensor * t = ggml_new_tensor_2d(ctx, type, ne0, ne1);
+    ggml_quantize_chunk(type, data.data(), t->data, 0, ne1, ne0, nullptr);
+
+    return t;
+}
+
+// computes the graph without and with fused nodes, checks the number of fused nodes and that the results of all the
+// nodes are the same
+static void test_fusion(const char * name, struct ggml_cgraph * gf, int n_fused,
+        struct ggml_threadpool * threadpool, int n_threads) {
+    const int n_nodes = ggml_graph_n_nodes(gf);
+
+    // the fusion is disabled for the whole process by GGML_CPU_NO_FUSION
+    if (getenv("GGML_CPU_NO_FUSION") != nullptr) {
+        n_fused = 0;
+    }
+
+    struct ggml_cplan cplan = ggml_graph_plan(gf, n_threads, threadpool);
+
+    std::vector<uint8_t> work_data(cplan.work_size);
+    cplan.work_data = work_data.data();
+
+    std::vector<std::vector<uint8_t>> ref(n_nodes);
+
+    for (bool no_fusion : { true, false }) {
+        cplan.no_fusion = no_fusion;
+
+        // the results of the other mode must not be left in the tensors
+        for (int i = 0; i < n_nodes; i++) {
+            struct ggml_tensor * node = ggml_graph_node(gf, i);
+            if (node->view_src == nullptr) {
+                memset(node->data, 0xff, ggml_nbytes(node));
+            }
+        }
+
+        ggml_graph_compute(gf, &cplan);
+
+        const int n_fused_exp = no_fusion ? 0 : n_fused;
+        if (cplan.n_fused != n_fused_exp) {
+            fprintf(stderr, "%s: %s: %d fused nodes, expected %d\n", __func__, name, cplan.n_fused, n_fused_exp);
+            exit(1);
+        }
+
+        for (int i = 0; i < n_nodes; i++) {
+            const struct ggml_tensor * node = ggml_graph_node(gf, i);
+            const uint8_t * data = (const uint8_t *) node->data;
+
+            if (no_fusion) {
+                ref[i].assign(data, data + ggml_nbytes(node));
+            } else if (memcmp(data, ref[i].data(), ggml_nbytes(node)) != 0) {
+                fprintf(stderr, "%s: %s: results of node %d (%s) differ with fused nodes\n", __func__, name, i, ggml_op_desc(node));
+                exit(1);
+            }
+        }
+    }
+
+    std::cerr << "fusion " << name << ": " << cplan.n_fused << " fused nodes, OK\n";
+}
+
+// computes the matrix multiplications with one thread and with all the threads, checks that the results are the same
+// and returns the number of chunks stolen
+static int test_chunk_steals(const char * name, struct ggml_cgraph * gf,
+        struct ggml_threadpool * threadpool, int n_threads, int n_rounds) {
+    const int n_nodes = ggml_graph_n_nodes(gf);
+
+    std::vector<std::vector<uint8_t>> ref(n_nodes);
+
+    int n_chunk_steals = 0;
+
+    for (int round = 0; round <= n_rounds; round++) {
+        // the reference with a single thread
+        struct ggml_cplan cplan = ggml_graph_plan(gf, round == 0 ? 1 : n_threads, threadpool);
+
+        std::vector<uint8_t> work_data(cplan.work_size);
+        cplan.work_data = work_data.data();
+
+        // a chunk that is not computed must not keep the results of the previous round
+        for (int i = 0; i < n_nodes; i++) {
+            struct ggml_tensor * node = ggml_graph_node(gf, i);
+            memset(node->data, 0xff, ggml_nbytes(node));
+        }
+
+        ggml_graph_compute(gf, &cplan);
+
+        n_chunk_steals += cplan.n_chunk_steals;
+
+        for (int i = 0; i < n_nodes; i++) {
+            const struct ggml_tensor * node = ggml_graph_node(gf, i);
+            const uint8_t * data = (const uint8_t *) node->data;
+
+            if (round == 0) {
+                ref[i].assign(data, data + ggml_nbytes(node));
+            } else if (memcmp(data, ref[i].data(), ggml_nbytes(node)) != 0) {
+                fprintf(stderr, "%s: %s: results of node %d (%s) differ from the results with one thread\n", __func__, name, i, ggml_op_desc(node));
+                exit(1);
+            }
+        }
+    }
+
+    std::cerr << "chunk steals " << name << ": " << n_chunk_steals << " chunk steals in " << n_rounds << " rounds, OK\n";
+
+    return n_chunk_steals;
+}
+
 int main(int argc, char *argv[]) {
 
     int n_threads = 4;
@@ -32,22 +225,6 @@ int main(int argc, char *argv[]) {
 
     struct ggml_context * ctx = ggml_init(params);
 
-    // Create graph
-    struct ggml_cgraph * gf = ggml_new_graph(ctx);
-
-    // Lots of small, parallel ops where barriers in between will dominate
-    struct ggml_tensor * out = ggml_new_tensor_1d(ctx, GGML_TYPE_F32,  64);
-    for (int i = 0; i < 1000; i++) {
-        struct ggml_tensor * a = ggml_new_tensor_2d(ctx, GGML_TYPE_Q4_0, 64, 128);
-        out = ggml_mul_mat(ctx, a, out);
-
-        struct ggml_tensor * d = ggml_new_tensor_2d(ctx, GGML_TYPE_Q4_0, 128, 64);
-        out = ggml_mul_mat(ctx, d, out);
-    }
-
-    ggml_build_forward_expand(gf, out);
-    int n_nodes = ggml_graph_n_nodes(gf);
-
     // Create threadpool
     struct ggml_threadpool_params tpp  = ggml_threadpool_params_default(n_threads);
     struct ggml_threadpool* threadpool = ggml_threadpool_new(&tpp);
@@ -56,36 +233,166 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
 
-    // Create compute plan
-    struct ggml_cplan cplan = ggml_graph_plan(gf, n_threads, threadpool);
+    {
+        // Create graph
+        struct ggml_cgraph * gf = ggml_new_graph(ctx);
 
-    std::vector<uint8_t> work_data(cplan.work_size);
-    cplan.work_data = work_data.data();
+        // Lots of small, parallel ops where barriers in between will dominate
+        struct ggml_tensor * out = ggml_new_tensor_1d(ctx, GGML_TYPE_F32,  64);
+        for (int i = 0; i < 1000; i++) {
+            struct ggml_tensor * a = ggml_new_tensor_2d(ctx, GGML_TYPE_Q4_0, 64, 128);
+            out = ggml_mul_mat(ctx, a, out);
 
-    std::cerr << "graph-compute with"
-              << "\n n_threads: " << n_threads
-              << "\n   n_nodes: " << n_nodes
-              << "\n  n_rounds: " << n_rounds
-              << "\n";
-    // ggml_graph_print(gf);
+            struct ggml_tensor * d = ggml_new_tensor_2d(ctx, GGML_TYPE_Q4_0, 128, 64);
+            out = ggml_mul_mat(ctx, d, out);
+        }
 
-    // Warmup
-    ggml_graph_compute(gf, &cplan);
+        ggml_build_forward_expand(gf, out);
 
-    auto t0 = std::chrono::high_resolution_clock::now();
+        bench("mul_mat chain", gf, out, threadpool, n_threads, n_rounds);
+    }
 
-    for (int i=0; i < n_rounds; i++) {
-        ggml_graph_compute(gf, &cplan);
+    {
+        // Decode-like graph: views, independent branches and element-wise ops between the matrix multiplications
+        struct ggml_cgraph * gf = ggml_new_graph(ctx);
+
+        const int n_embd  = 256;
+        const int n_head  = 4;
+        const int n_cache = 64;
+
+        struct ggml_tensor * x = rand_tensor(ctx, GGML_TYPE_F32, n_embd, 1);
+
+        for (int il = 0; il < 32; il++) {
+            struct ggml_tensor * cache_k = rand_tensor(ctx, GGML_TYPE_F32, n_embd, n_cache);
+            struct ggml_tensor * cache_v = rand_tensor(ctx, GGML_TYPE_F32, n_embd, n_cache);
+
+            struct ggml_tensor * cur = ggml_rms_norm(ctx, x, 1e-5f);
+            cur = ggml_mul(ctx, cur, rand_tensor(ctx, GGML_TYPE_F32, n_embd, 1));
+
+            struct ggml_tensor * q = ggml_mul_mat(ctx, rand_tensor(ctx, GGML_TYPE_F32, n_embd, n_embd), cur);
+            q = ggml_add(ctx, q, rand_tensor(ctx, GGML_TYPE_F32, n_embd, 1));
+            struct ggml_tensor * k = ggml_mul_mat(ctx, rand_tensor(ctx, GGML_TYPE_F32, n_embd, n_embd), cur);
+            struct ggml_tensor * v = ggml_mul_mat(ctx, rand_tensor(ctx, GGML_TYPE_F32, n_embd, n_embd), cur);
+
+            q = ggml_reshape_2d(ctx, q, n_embd/n_head, n_head);
+            k = ggml_reshape_2d(ctx, k, n_embd/n_head, n_head);
+
+            q = ggml_rms_norm(ctx, q, 1e-5f);
+            k = ggml_rms_norm(ctx, k, 1e-5f);
+            v = ggml_scale(ctx, v, 0.5f);
+
+            // store into the caches (independent copies)
+            ggml_build_forward_expand(gf, ggml_cpy(ctx, k, ggml_view_1d(ctx, cache_k, n_embd, il % n_cache * cache_k->nb[1])));
+            ggml_build_forward_expand(gf, ggml_cpy(ctx, v, ggml_view_1d(ctx, cache_v, n_embd, il % n_cache * cache_v->nb[1])));
+
+            struct ggml_tensor * kq = ggml_mul_mat(ctx, cache_k, ggml_reshape_2d(ctx, q, n_embd, 1));
+            kq = ggml_soft_max(ctx, kq);
+
+            struct ggml_tensor * kqv = ggml_mul_mat(ctx, ggml_cont(ctx, ggml_transpose(ctx, cache_v)), kq);
+
+            struct ggml_tensor * g = ggml_silu(ctx, kqv);
+            struct ggml_tensor * u = ggml_gelu(ctx, kqv);
+
+            x = ggml_add(ctx, x, ggml_mul(ctx, g, u));
+        }
+
+        ggml_build_forward_expand(gf, x);
+
+        bench("decode-like", gf, x, threadpool, n_threads, n_rounds);
     }
 
-    auto t1 = std::chrono::high_resolution_clock::now();
+    const int n_embd = 256;
+    const int n_ff   = 512;
 
-    auto usec = std::chrono::duration_cast<std::chrono::microseconds>(t1-t0).count();
-    auto nsec = std::chrono::duration_cast<std::chrono::nanoseconds>(t1-t0).count();
-    std::cerr << "graph-compute took " << usec << " usec "
-              << "\n " << (float) usec / n_rounds << " usec per-iter"
-              << "\n " << (float) nsec / (n_rounds * n_nodes) << " nsec per-node"
-              << "\n";
+    for (int n_tokens : { 1, 7 }) {
+        // mul(rms_norm(add(x, r)), w) of the residual stream, and mul(rms_norm(x), w) of the first layer
+        struct ggml_cgraph * gf = ggml_new_graph(ctx);
+
+        struct ggml_tensor * x = rand_tensor(ctx, GGML_TYPE_F32, n_embd, n_tokens);
+        x = ggml_mul(ctx, ggml_rms_norm(ctx, x, 1e-5f), rand_tensor(ctx, GGML_TYPE_F32, n_embd, 1));
+
+        for (int il = 0; il < 4; il++) {
+            x = ggml_add(ctx, x, rand_tensor(ctx, GGML_TYPE_F32, n_embd, n_tokens));
+            x = ggml_mul(ctx, ggml_rms_norm(ctx, x, 1e-5f), rand_tensor(ctx, GGML_TYPE_F32, n_embd, 1));
+        }
+
+        ggml_build_forward_expand(gf, x);
+
+        test_fusion(n_tokens == 1 ? "ADD_RMS_NORM_MUL, 1 token" : "ADD_RMS_NORM_MUL, 7 tokens", gf, 1 + 4*2, threadpool, n_threads);
+    }
+
+    for (int n_tokens : { 1, 7 }) {
+        // mul(silu(gate), up) of the FFN, with the matrix multiplication of up between the silu and the mul, and the
+        // silu as the second operand
+        struct ggml_cgraph * gf = ggml_new_graph(ctx);
+
+        struct ggml_tensor * x = rand_tensor(ctx, GGML_TYPE_F32, n_embd, n_tokens);
+
+        for (int il = 0; il < 2; il++) {
+            struct ggml_tensor * gate = ggml_mul_mat(ctx, rand_tensor(ctx, GGML_TYPE_F32, n_embd, n_ff), x);
+            gate = ggml_silu(ctx, gate);
+            ggml_build_forward_expand(gf, gate);
+
+            struct ggml_tensor * up = ggml_mul_mat(ctx, rand_tensor(ctx, GGML_TYPE_F32, n_embd, n_ff), x);
+
+            struct ggml_tensor * cur = il % 2 == 0 ? ggml_mul(ctx, gate, up) : ggml_mul(ctx, up, gate);
+
+            x = ggml_mul_mat(ctx, rand_tensor(ctx, GGML_TYPE_F32, n_ff, n_embd), cur);
+        }
+
+        ggml_build_forward_expand(gf, x);
+
+        test_fusion(n_tokens == 1 ? "SILU_MUL, 1 token" : "SILU_MUL, 7 tokens", gf, 2, threadpool, n_threads);
+    }
+
+    for (enum ggml_type type : { GGML_TYPE_F32, GGML_TYPE_Q4_0 }) {
+        for (int n_tokens : { 1, 8 }) {
+            // add(mul_mat(a, b), bias) of the projections with a bias
+            struct ggml_cgraph * gf = ggml_new_graph(ctx);
+
+            struct ggml_tensor * x = rand_tensor(ctx, GGML_TYPE_F32, n_embd, n_tokens);
+
+            for (int il = 0; il < 2; il++) {
+                x = ggml_mul_mat(ctx, rand_tensor_q(ctx, type, n_embd, n_embd), x);
+                x = ggml_add(ctx, x, rand_tensor(ctx, GGML_TYPE_F32, n_embd, 1));
+            }
+
+            ggml_build_forward_expand(gf, x);
+
+            const std::string name = std::string("MUL_MAT_ADD, ") + ggml_type_name(type) + ", " + std::to_string(n_tokens) + " tokens";
+
+            test_fusion(name.c_str(), gf, 2, threadpool, n_threads);
+        }
+    }
+
+    // with GGML_CPU_CHUNK_QUEUES=N, the threads are split between N chunk queues and the chunks of the queues that are
+    // not done are stolen by the threads of the other queues
+    int n_chunk_steals = 0;
+
+    for (enum ggml_type type : { GGML_TYPE_F32, GGML_TYPE_Q4_0 }) {
+        for (int n_tokens : { 1, 16 }) {
+            // matrix multiplications with many more chunks than threads
+            struct ggml_cgraph * gf = ggml_new_graph(ctx);
+
+            const int n_rows = 8192;
+
+            struct ggml_tensor * x = rand_tensor(ctx, GGML_TYPE_F32, n_embd, n_tokens);
+            x = ggml_mul_mat(ctx, rand_tensor_q(ctx, type, n_embd, n_rows), x);
+            x = ggml_mul_mat(ctx, rand_tensor_q(ctx, type, n_rows, n_embd), x);
+
+            ggml_build_forward_expand(gf, x);
+
+            const std::string name = std::string("MUL_MAT, ") + ggml_type_name(type) + ", " + std::to_string(n_tokens) + " tokens";
+
+            n_chunk_steals += test_chunk_steals(name.c_str(), gf, threadpool, n_threads, 20);
+        }
+    }
+
+    const char * n_chunk_queues = getenv("GGML_CPU_CHUNK_QUEUES");
+    if (n_chunk_queues != nullptr && std::atoi(n_chunk_queues) > 1 && n_threads > 1 && n_chunk_steals == 0) {
+        fprintf(stderr, "no chunks stolen with %s chunk queues\n", n_chunk_queues);
+        exit(1);
+    }
 
     ggml_threadpool_free(threadpool);
     ggml_free(ctx);
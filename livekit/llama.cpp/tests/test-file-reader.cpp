@@ -0,0 +1,169 @@
+// tests for the parallel reads of the model files (llama_file_reader): buffered reads with a pool of threads, direct
+// I/O with offsets, sizes and buffers that are not aligned to the block size, and the fallback to buffered reads when
+// the files cannot be opened with O_DIRECT
+
+#include "../src/llama-mmap.h"
+
+#include "ggml.h"
+
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#undef NDEBUG
+#include <cassert>
+
+namespace fs = std::filesystem;
+
+// alignment required by O_DIRECT
+static const size_t alignment = 4096;
+
+struct test_range {
+    size_t idx;
+    size_t offset;
+    size_t len;
+    size_t shift; // offset of the destination from an aligned address
+};
+
+static std::vector<uint8_t> make_file(const std::string & path, size_t size, std::mt19937 & rng) {
+    std::vector<uint8_t> data(size);
+    for (auto & b : data) {
+        b = rng() & 0xff;
+    }
+
+    FILE * f = fopen(path.c_str(), "wb");
+    assert(f != nullptr);
+    assert(fwrite(data.data(), 1, data.size(), f) == data.size());
+    fclose(f);
+
+    return data;
+}
+
+// queues all reads at once, so that the threads of the reader complete them in any order, then checks the data
+static void check_reads(llama_file_reader & reader, const std::vector<std::vector<uint8_t>> & data, const std::vector<test_range> & ranges) {
+    std::vector<std::vector<uint8_t>> bufs(ranges.size());
+    std::vector<uint8_t *> dsts(ranges.size());
+    std::vector<size_t>    ids (ranges.size());
+
+    for (size_t i = 0; i < ranges.size(); ++i) {
+        const auto & r = ranges[i];
+
+        bufs[i].resize(r.len + r.shift + 2*alignment);
+        dsts[i] = (uint8_t *) GGML_PAD((uintptr_t) bufs[i].data(), alignment) + r.shift;
+
+        ids[i] = reader.read(r.idx, r.offset, r.len, dsts[i]);
+    }
+
+    for (size_t i = 0; i < ranges.size(); ++i) {
+        const auto & r = ranges[i];
+
+        reader.wait(ids[i]);
+
+        assert(memcmp(dsts[i], data[r.idx].data() + r.offset, r.len) == 0);
+    }
+}
+
+// reads at the start, in the middle and at the end of the files, aligned or not, including the unaligned tail of a file
+static std::vector<test_range> make_ranges(const std::vector<std::vector<uint8_t>> & data, std::mt19937 & rng) {
+    std::vector<test_range> ranges;
+
+    for (size_t idx = 0; idx < data.size(); ++idx) {
+        const size_t size = data[idx].size();
+
+        ranges.push_back({ idx, 0,                   size,                0 });
+        ranges.push_back({ idx, 0,                   alignment,           0 });
+        ranges.push_back({ idx, alignment,           2*alignment,         0 });
+        ranges.push_back({ idx, alignment,           2*alignment,         1 });
+        ranges.push_back({ idx, 1,                   alignment - 1,       0 });
+        ranges.push_back({ idx, alignment - 1,       2,                   3 });
+        ranges.push_back({ idx, alignment - 7,       alignment + 14,      0 });
+        ranges.push_back({ idx, 123,                 size - 123,          5 });
+        ranges.push_back({ idx, size - 1,            1,                   0 });
+        ranges.push_back({ idx, size - 100,          100,                 0 });
+        ranges.push_back({ idx, size - alignment,    alignment,           0 });
+
+        for (int i = 0; i < 32; ++i) {
+            const size_t offset = rng() % size;
+            const size_t len    = 1 + rng() % (size - offset);
+
+            ranges.push_back({ idx, offset, len, rng() % 2 ? 0 : (size_t) (rng() % alignment) });
+        }
+    }
+
+    return ranges;
+}
+
+// a read past the end of the file fails when it is waited for
+static void check_read_past_end(llama_file_reader & reader, size_t size) {
+    std::vector<uint8_t> buf(2*alignment);
+
+    const size_t id = reader.read(0, size - 10, 20, buf.data());
+
+    bool failed = false;
+    try {
+        reader.wait(id);
+    } catch (const std::runtime_error &) {
+        failed = true;
+    }
+    assert(failed);
+}
+
+int main() {
+    std::mt19937 rng(42);
+
+    const fs::path dir = fs::temp_directory_path() / ("test-file-reader-" + std::to_string(std::random_device{}()));
+    fs::create_directories(dir);
+
+    // the first file ends in the middle of a block, the second one on a block boundary
+    const std::vector<std::string> paths = { (dir / "a.bin").string(), (dir / "b.bin").string() };
+
+    std::vector<std::vector<uint8_t>> data;
+    data.push_back(make_file(paths[0], 5*alignment + 1234, rng));
+    data.push_back(make_file(paths[1], 3*alignment,        rng));
+
+    llama_files files;
+    for (const auto & path : paths) {
+        files.emplace_back(new llama_file(path.c_str(), "rb"));
+    }
+
+    const auto ranges = make_ranges(data, rng);
+
+    for (bool direct_io : { false, true }) {
+        for (int n_threads : { 0, 1, 4 }) {
+            llama_file_reader reader(files, n_threads, direct_io);
+
+            if (direct_io && !reader.direct_io()) {
+                fprintf(stderr, "%s: O_DIRECT is not supported for %s, testing the buffered reads\n", __func__, dir.string().c_str());
+            }
+            assert(!reader.direct_io() || direct_io);
+
+            check_reads(reader, data, ranges);
+            check_read_past_end(reader, data[0].size());
+        }
+    }
+
+    // the files cannot be opened again with O_DIRECT after they have been removed: the reader falls back to buffered
+    // reads with the files that are already open
+    if (llama_file_reader::DIRECT_IO_SUPPORTED) {
+        for (const auto & path : paths) {
+            fs::remove(path);
+        }
+
+        llama_file_reader reader(files, 4, true);
+        assert(!reader.direct_io());
+
+        check_reads(reader, data, ranges);
+    }
+
+    files.clear();
+
+    fs::remove_all(dir);
+
+    printf("OK\n");
+
+    return 0;
+}
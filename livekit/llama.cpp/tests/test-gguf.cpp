@@ -8,6 +8,7 @@
 #include <cstdio>
 #include <random>
 #include <string>
+#include <string_view>
 #include <vector>
 
 constexpr int offset_has_kv      = 1000;
@@ -659,7 +660,7 @@ static bool handcrafted_check_tensor_data(const gguf_context * gguf_ctx, const u
     return ok;
 }
 
-static std::pair<int, int> test_handcrafted_file(const unsigned int seed) {
+static std::pair<int, int> test_handcrafted_file(const unsigned int seed, const bool use_mmap) {
     int npass = 0;
     int ntest = 0;
 
@@ -698,7 +699,7 @@ static std::pair<int, int> test_handcrafted_file(const unsigned int seed) {
     };
 
     for (enum handcrafted_file_type hft : hfts) {
-        printf("%s: handcrafted_file_type=%s\n", __func__, handcrafted_file_type_name(hft).c_str());
+        printf("%s: handcrafted_file_type=%s, use_mmap=%s\n", __func__, handcrafted_file_type_name(hft).c_str(), use_mmap ? "yes" : "no");
         FILE * file = get_handcrafted_file(seed, hft);
 
 #ifdef _WIN32
@@ -717,7 +718,8 @@ static std::pair<int, int> test_handcrafted_file(const unsigned int seed) {
             /*ctx      =*/ hft >= offset_has_data ? &ctx : nullptr,
         };
 
-        struct gguf_context * gguf_ctx = gguf_init_from_file_impl(file, gguf_params);
+        struct gguf_context * gguf_ctx = use_mmap ?
+            gguf_init_from_file_mmap_impl(file, gguf_params) : gguf_init_from_file_impl(file, gguf_params);
 
         if (expect_context_not_null(hft)) {
             printf("%s:   - context_not_null: ", __func__);
@@ -972,6 +974,14 @@ static bool all_kv_in_other(const gguf_context * ctx, const gguf_context * other
                     if (str != str_other) {
                         ok = false;
                     }
+
+                    size_t len       = 0;
+                    size_t len_other = 0;
+                    const char * view       = gguf_get_arr_str_view(ctx,   id,        arr_i, &len);
+                    const char * view_other = gguf_get_arr_str_view(other, idx_other, arr_i, &len_other);
+                    if (std::string_view(view, len) != std::string_view(view_other, len_other)) {
+                        ok = false;
+                    }
                 }
                 continue;
             }
@@ -990,6 +1000,14 @@ static bool all_kv_in_other(const gguf_context * ctx, const gguf_context * other
             if (str != str_other) {
                 ok = false;
             }
+
+            size_t len       = 0;
+            size_t len_other = 0;
+            const char * view       = gguf_get_val_str_view(ctx,   id,        &len);
+            const char * view_other = gguf_get_val_str_view(other, idx_other, &len_other);
+            if (std::string_view(view, len) != std::string_view(view_other, len_other)) {
+                ok = false;
+            }
             continue;
         }
 
@@ -1070,10 +1088,10 @@ static bool same_tensor_data(const struct ggml_context * orig, const struct ggml
     return ok;
 }
 
-static std::pair<int, int> test_roundtrip(ggml_backend_dev_t dev, const unsigned int seed, const bool only_meta) {
+static std::pair<int, int> test_roundtrip(ggml_backend_dev_t dev, const unsigned int seed, const bool only_meta, const bool use_mmap) {
     ggml_backend_t backend = ggml_backend_dev_init(dev, nullptr);
-    printf("%s: device=%s, backend=%s, only_meta=%s\n",
-        __func__, ggml_backend_dev_description(dev), ggml_backend_name(backend), only_meta ? "yes" : "no");
+    printf("%s: device=%s, backend=%s, only_meta=%s, use_mmap=%s\n",
+        __func__, ggml_backend_dev_description(dev), ggml_backend_name(backend), only_meta ? "yes" : "no", use_mmap ? "yes" : "no");
 
     int npass = 0;
     int ntest = 0;
@@ -1112,7 +1130,8 @@ static std::pair<int, int> test_roundtrip(ggml_backend_dev_t dev, const unsigned
         /*no_alloc =*/ false,
         /*ctx      =*/ only_meta ? nullptr : &ctx_1,
     };
-    struct gguf_context * gguf_ctx_1 = gguf_init_from_file_impl(file, gguf_params);
+    struct gguf_context * gguf_ctx_1 = use_mmap ?
+        gguf_init_from_file_mmap_impl(file, gguf_params) : gguf_init_from_file_impl(file, gguf_params);
 
     printf("%s: same_version: ", __func__);
     if (gguf_get_version(gguf_ctx_0) == gguf_get_version(gguf_ctx_1)) {
@@ -1177,6 +1196,21 @@ static std::pair<int, int> test_roundtrip(ggml_backend_dev_t dev, const unsigned
     }
     ntest++;
 
+    printf("%s: same_meta: ", __func__);
+    {
+        std::vector<int8_t> buf_0;
+        std::vector<int8_t> buf_1;
+        gguf_write_to_buf(gguf_ctx_0, buf_0, /*only_meta =*/ true);
+        gguf_write_to_buf(gguf_ctx_1, buf_1, /*only_meta =*/ true);
+        if (buf_0 == buf_1) {
+            printf("\033[1;32mOK\033[0m\n");
+            npass++;
+        } else {
+            printf("\033[1;31mFAIL\033[0m\n");
+        }
+    }
+    ntest++;
+
     if (!only_meta) {
         printf("%s: same_tensor_data: ", __func__);
         if (same_tensor_data(ctx_0, ctx_1)) {
@@ -1292,6 +1326,154 @@ static std::pair<int, int> test_gguf_set_kv(ggml_backend_dev_t dev, const unsign
     return std::make_pair(npass, ntest);
 }
 
+// reads a vocab similar to the ones of recent models with and without mmap, checks that both read the same data and
+// prints the time it takes to load the vocab and look up all the tensors by name
+static std::pair<int, int> test_bench_vocab(const unsigned int seed) {
+    printf("%s:\n", __func__);
+
+    int npass = 0;
+    int ntest = 0;
+
+    std::mt19937 rng(seed);
+
+    const int n_vocab   = 150000;
+    const int n_tensors = 1000;
+
+    std::vector<std::string> tokens(n_vocab);
+    std::vector<std::string> merges(n_vocab);
+    std::vector<float>       scores(n_vocab);
+    std::vector<int32_t>     toktypes(n_vocab);
+    for (int i = 0; i < n_vocab; ++i) {
+        tokens[i].resize(1 + rng() % 16);
+        for (char & c : tokens[i]) {
+            c = 'a' + rng() % 26;
+        }
+        scores[i]   = -float(i);
+        toktypes[i] = 1;
+    }
+    for (int i = 0; i < n_vocab; ++i) {
+        merges[i] = tokens[rng() % n_vocab] + " " + tokens[rng() % n_vocab];
+    }
+
+    struct gguf_context * gguf_ctx_0 = gguf_init_empty();
+    {
+        std::vector<const char *> tmp(n_vocab);
+        for (int i = 0; i < n_vocab; ++i) {
+            tmp[i] = tokens[i].c_str();
+        }
+        gguf_set_arr_str(gguf_ctx_0, "tokenizer.ggml.tokens", tmp.data(), n_vocab);
+        for (int i = 0; i < n_vocab; ++i) {
+            tmp[i] = merges[i].c_str();
+        }
+        gguf_set_arr_str(gguf_ctx_0, "tokenizer.ggml.merges", tmp.data(), n_vocab);
+    }
+    gguf_set_arr_data(gguf_ctx_0, "tokenizer.ggml.scores",     GGUF_TYPE_FLOAT32, scores.data(),   n_vocab);
+    gguf_set_arr_data(gguf_ctx_0, "tokenizer.ggml.token_type", GGUF_TYPE_INT32,   toktypes.data(), n_vocab);
+
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ n_tensors*ggml_tensor_overhead(),
+        /*.mem_buffer =*/ nullptr,
+        /*.no_alloc   =*/ true,
+    };
+    struct ggml_context * ctx_0 = ggml_init(params);
+    for (int i = 0; i < n_tensors; ++i) {
+        struct ggml_tensor * t = ggml_new_tensor_1d(ctx_0, GGML_TYPE_F32, 64);
+        ggml_format_name(t, "blk.%d.weight", i);
+        gguf_add_tensor(gguf_ctx_0, t);
+    }
+
+    FILE * file = tmpfile();
+
+#ifdef _WIN32
+    if (!file) {
+        printf("failed to create tmpfile(), needs elevated privileges on Windows");
+        printf("skipping tests");
+        ggml_free(ctx_0);
+        gguf_free(gguf_ctx_0);
+        return std::make_pair(0, 0);
+    }
+#else
+    GGML_ASSERT(file);
+#endif // _WIN32
+
+    {
+        std::vector<int8_t> buf;
+        gguf_write_to_buf(gguf_ctx_0, buf, /*only_meta =*/ true);
+        GGML_ASSERT(fwrite(buf.data(), 1, buf.size(), file) == buf.size());
+        fflush(file);
+        printf("%s: meta data size: %.2f MiB\n", __func__, buf.size()/1024.0/1024.0);
+    }
+
+    for (bool use_mmap : {false, true}) {
+        rewind(file);
+
+        struct gguf_init_params gguf_params = {
+            /*no_alloc =*/ true,
+            /*ctx      =*/ nullptr,
+        };
+
+        const int64_t t_start_us = ggml_time_us();
+
+        struct gguf_context * gguf_ctx_1 = use_mmap ?
+            gguf_init_from_file_mmap_impl(file, gguf_params) : gguf_init_from_file_impl(file, gguf_params);
+        GGML_ASSERT(gguf_ctx_1);
+
+        const int64_t t_init_us = ggml_time_us();
+
+        // read the strings the way the vocab is loaded
+        bool ok = true;
+        {
+            const int64_t token_idx = gguf_find_key(gguf_ctx_1, "tokenizer.ggml.tokens");
+            const int64_t merges_idx = gguf_find_key(gguf_ctx_1, "tokenizer.ggml.merges");
+            const float * scores_1 = (const float *) gguf_get_arr_data(gguf_ctx_1, gguf_find_key(gguf_ctx_1, "tokenizer.ggml.scores"));
+
+            for (int i = 0; i < n_vocab; ++i) {
+                size_t len = 0;
+                const char * str = gguf_get_arr_str_view(gguf_ctx_1, token_idx, i, &len);
+                if (std::string(str, len) != tokens[i] || scores_1[i] != scores[i]) {
+                    ok = false;
+                }
+                str = gguf_get_arr_str_view(gguf_ctx_1, merges_idx, i, &len);
+                if (std::string(str, len) != merges[i]) {
+                    ok = false;
+                }
+            }
+        }
+
+        const int64_t t_vocab_us = ggml_time_us();
+
+        for (int i = 0; i < n_tensors; ++i) {
+            const std::string name = "blk." + std::to_string(i) + ".weight";
+            if (gguf_find_tensor(gguf_ctx_1, name.c_str()) != i) {
+                ok = false;
+            }
+        }
+
+        const int64_t t_find_us = ggml_time_us();
+
+        printf("%s: use_mmap=%s: init %7.2f ms, vocab %7.2f ms, find tensors %7.2f ms\n", __func__, use_mmap ? "yes" : "no",
+            (t_init_us - t_start_us)/1000.0, (t_vocab_us - t_init_us)/1000.0, (t_find_us - t_vocab_us)/1000.0);
+
+        printf("%s:   - same_vocab: ", __func__);
+        if (ok) {
+            printf("\033[1;32mOK\033[0m\n");
+            npass++;
+        } else {
+            printf("\033[1;31mFAIL\033[0m\n");
+        }
+        ntest++;
+
+        gguf_free(gguf_ctx_1);
+    }
+
+    fclose(file);
+    ggml_free(ctx_0);
+    gguf_free(gguf_ctx_0);
+
+    printf("\n");
+    return std::make_pair(npass, ntest);
+}
+
 static void print_usage() {
     printf("usage: test-gguf [seed]\n");
     printf("  if no seed is unspecified then a random seed is used\n");
@@ -1312,8 +1494,8 @@ int main(int argc, char ** argv) {
 
     int npass = 0;
     int ntest = 0;
-    {
-        std::pair<int, int> result = test_handcrafted_file(seed);
+    for (bool use_mmap : {false, true}) {
+        std::pair<int, int> result = test_handcrafted_file(seed, use_mmap);
         npass += result.first;
         ntest += result.second;
     }
@@ -1322,9 +1504,11 @@ int main(int argc, char ** argv) {
         ggml_backend_dev_t dev = ggml_backend_dev_get(i);
 
         for (bool only_meta : {true, false}) {
-            std::pair<int, int> result = test_roundtrip(dev, seed, only_meta);
-            npass += result.first;
-            ntest += result.second;
+            for (bool use_mmap : {false, true}) {
+                std::pair<int, int> result = test_roundtrip(dev, seed, only_meta, use_mmap);
+                npass += result.first;
+                ntest += result.second;
+            }
         }
 
         {
@@ -1334,6 +1518,12 @@ int main(int argc, char ** argv) {
         }
     }
 
+    {
+        std::pair<int, int> result = test_bench_vocab(seed);
+        npass += result.first;
+        ntest += result.second;
+    }
+
     printf("%d/%d tests passed\n", npass, ntest);
     if (npass != ntest) {
         printf("\033[1;31mFAIL\033[0m\n");
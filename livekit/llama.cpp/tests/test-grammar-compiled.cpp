@@ -0,0 +1,176 @@
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include "llama.h"
+#include "ggml.h"
+
+#include "../src/llama-grammar.h"
+#include "../src/llama-vocab.h"
+
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+// checks that the compiled grammar (cached token masks) allows exactly the same tokens as the interpreted grammar
+// along random walks through the grammar, and reports the time spent applying each of them
+
+static std::vector<llama_token_data> apply_full(const llama_grammar & grammar, int64_t & t_us) {
+    const int n_vocab = grammar.vocab->n_tokens();
+
+    std::vector<llama_token_data> cur(n_vocab);
+    for (llama_token id = 0; id < n_vocab; ++id) {
+        cur[id] = { id, 0.0f, 0.0f };
+    }
+
+    llama_token_data_array cur_p = { cur.data(), cur.size(), -1, false };
+
+    const int64_t t_start_us = ggml_time_us();
+    llama_grammar_apply_impl(grammar, &cur_p);
+    t_us += ggml_time_us() - t_start_us;
+
+    return cur;
+}
+
+static bool is_allowed(const llama_grammar & grammar, llama_token id) {
+    llama_token_data cur = { id, 0.0f, 0.0f };
+    llama_token_data_array cur_p = { &cur, 1, -1, false };
+
+    llama_grammar_apply_impl(grammar, &cur_p);
+
+    return cur.logit != -INFINITY;
+}
+
+static void test(const llama_vocab * vocab, const char * name, const char * grammar_str, int n_walks, int n_steps) {
+    fprintf(stderr, "%s: testing %s\n", __func__, name);
+
+    llama_grammar * grammar_c = llama_grammar_init_impl(vocab, grammar_str, "root", false, nullptr, 0, nullptr, 0);
+    assert(grammar_c != nullptr && grammar_c->compiled);
+
+    std::mt19937 rng(42);
+
+    int64_t t_interp_us   = 0;
+    int64_t t_compiled_us = 0;
+    int     n_applied     = 0;
+
+    for (int iw = 0; iw < n_walks; ++iw) {
+        // walks start from the initial state, so the compiled grammar reuses the masks of the previous walks
+        llama_grammar * compiled = llama_grammar_clone_impl(*grammar_c);
+        llama_grammar * interp   = llama_grammar_clone_impl(*grammar_c);
+        interp->compiled.reset();
+
+        for (int is = 0; is < n_steps; ++is) {
+            const auto cur_c = apply_full(*compiled, t_compiled_us);
+            const auto cur_i = apply_full(*interp,   t_interp_us);
+            n_applied++;
+
+            std::vector<llama_token> allowed;
+            for (size_t i = 0; i < cur_c.size(); ++i) {
+                const bool allowed_c = cur_c[i].logit != -INFINITY;
+                const bool allowed_i = cur_i[i].logit != -INFINITY;
+                if (allowed_c != allowed_i) {
+                    fprintf(stderr, "%s: mismatch at walk %d, step %d, token %zu ('%s'): compiled %d, interpreted %d\n",
+                            __func__, iw, is, i, vocab->token_to_piece(i).c_str(), allowed_c, allowed_i);
+                    assert(false);
+                }
+                if (allowed_c && !vocab->is_eog(i)) {
+                    allowed.push_back(i);
+                }
+            }
+
+            if (allowed.empty()) {
+                break;
+            }
+
+            const llama_token id = allowed[std::uniform_int_distribution<size_t>(0, allowed.size() - 1)(rng)];
+
+            // single candidate, as used by common_sampler to check the sampled token
+            assert(is_allowed(*compiled, id));
+
+            llama_grammar_accept_impl(*compiled, id);
+            llama_grammar_accept_impl(*interp,   id);
+        }
+
+        llama_grammar_free_impl(compiled);
+        llama_grammar_free_impl(interp);
+    }
+
+    fprintf(stderr, "%s: %-8s %4d steps, interpreted %8.3f ms/step, compiled %8.3f ms/step\n", __func__, name, n_applied,
+            t_interp_us / 1000.0 / n_applied, t_compiled_us / 1000.0 / n_applied);
+
+    llama_grammar_free_impl(grammar_c);
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <vocab-file>\n", argv[0]);
+        return 1;
+    }
+
+    const std::string fname = argv[1];
+
+    llama_backend_init();
+
+    llama_model * model;
+
+    {
+        auto mparams = llama_model_default_params();
+
+        mparams.vocab_only = true;
+
+        model = llama_model_load_from_file(fname.c_str(), mparams);
+
+        if (model == NULL) {
+            fprintf(stderr, "%s: error: failed to load vocab '%s'\n", __func__, fname.c_str());
+            return 1;
+        }
+    }
+
+    const llama_vocab * vocab = llama_model_get_vocab(model);
+
+    test(vocab, "json", R"""(
+root   ::= object
+value  ::= object | array | string | number | ("true" | "false" | "null") ws
+
+object ::=
+  "{" ws (
+            string ":" ws value
+    ("," ws string ":" ws value)*
+  )? "}" ws
+
+array  ::=
+  "[" ws (
+            value
+    ("," ws value)*
+  )? "]" ws
+
+string ::=
+  "\"" (
+    [^"\\\x7F\x00-\x1F] |
+    "\\" (["\\bfnrt] | "u" [0-9a-fA-F]{4}) # escapes
+  )* "\"" ws
+
+number ::= ("-"? ([0-9] | [1-9] [0-9]{0,15})) ("." [0-9]+)? ([eE] [-+]? [0-9] [1-9]{0,15})? ws
+
+ws ::= | " " | "\n" [ \t]{0,20}
+)""", 8, 48);
+
+    test(vocab, "tool", R"""(
+root ::= "{\"name\": \"" name "\", \"arguments\": {\"city\": \"" city "\", \"days\": " [1-9] "}}"
+name ::= "get_weather" | "get_time"
+city ::= [A-Z] [a-z]+ (" " [A-Z] [a-z]+)?
+)""", 8, 32);
+
+    // multi-byte characters, exercises the partial UTF-8 sequences
+    test(vocab, "unicode", R"""(
+root ::= ([α-ω] | [а-я] | [😀-🙏] | " ")+ "!"
+)""", 4, 24);
+
+    llama_model_free(model);
+    llama_backend_free();
+
+    return 0;
+}
@@ -0,0 +1,499 @@
+// tests and microbenchmark for the cell bookkeeping of the unified KV cache (llama_kv_cells_unified) and the
+// placement of the ubatches in the cells (llama_kv_cache_unified)
+//
+// usage: test-kv-cells [n_seq] [n_cells] [n_steps]
+
+#include "../src/llama-batch.h"
+#include "../src/llama-kv-cache-unified.h"
+#include "../src/llama-kv-cells.h"
+#include "../src/llama-model.h"
+#include "../src/llama-vocab.h"
+
+#include "ggml-alloc.h"
+#include "ggml-backend.h"
+#include "ggml-cpp.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <set>
+#include <vector>
+
+#undef NDEBUG
+#include <cassert>
+
+static int64_t time_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// compare the histogram against a std::multiset under random inserts/erases
+static void test_pos_hist() {
+    std::mt19937 rng(42);
+
+    llama_kv_pos_hist   hist;
+    std::multiset<llama_pos> ref;
+
+    for (int it = 0; it < 200000; ++it) {
+        const int op = rng() % 8;
+
+        if (op < 4 || ref.empty()) {
+            // mostly append after the current max, sometimes far away or below the min
+            // the positions around 1e9 do not fit in the dense window, so the histogram switches to the sparse counts
+            llama_pos p;
+            switch (rng() % 5) {
+                case 0:  p = ref.empty() ? 0 : *ref.rbegin() + 1;                    break;
+                case 1:  p = ref.empty() ? 0 : *ref.rbegin();                        break;
+                case 2:  p = rng() % 4096;                                           break;
+                case 3:  p = it % 7 == 0 ? 1000000000 + rng() % 64 : rng() % 64;     break;
+                default: p = ref.empty() ? 0 : std::max(0, *ref.begin() - (int) (rng() % 8)); break;
+            }
+
+            hist.insert(p);
+            ref.insert(p);
+        } else {
+            auto it_rm = ref.begin();
+            switch (rng() % 3) {
+                case 0:  it_rm = std::prev(ref.end());                break;
+                case 1:  it_rm = ref.begin();                         break;
+                default: std::advance(it_rm, rng() % ref.size());     break;
+            }
+
+            hist.erase(*it_rm);
+            ref.erase(it_rm);
+        }
+
+        assert(hist.empty() == ref.empty());
+        assert(hist.min() == (ref.empty() ? -1 : *ref.begin()));
+        assert(hist.max() == (ref.empty() ? -1 : *ref.rbegin()));
+
+        if (it % 10000 == 0) {
+            hist.clear();
+            ref.clear();
+        }
+    }
+}
+
+// check the seq_pos_min/seq_pos_max semantics of the cells, including cells shared by multiple sequences
+static void test_cells() {
+    llama_kv_cells_unified cells;
+
+    cells.resize(16);
+
+    for (uint32_t i = 0; i < 8; ++i) {
+        cells.pos_set(i, i);
+        cells.seq_add(i, 0);
+        if (i < 4) {
+            cells.seq_add(i, 1);
+        }
+    }
+
+    assert(cells.seq_pos_min(0) == 0 && cells.seq_pos_max(0) == 7);
+    assert(cells.seq_pos_min(1) == 0 && cells.seq_pos_max(1) == 3);
+    assert(cells.seq_pos_min(2) == -1 && cells.seq_pos_max(2) == -1);
+
+    // remove the tail of seq 0
+    for (uint32_t i = 5; i < 8; ++i) {
+        assert(cells.seq_rm(i, 0));
+    }
+    assert(cells.seq_pos_max(0) == 4);
+
+    // cells shared with seq 1 remain in the cache
+    assert(!cells.seq_rm(0, 0));
+    assert(cells.seq_pos_min(0) == 1);
+    assert(cells.seq_pos_min(1) == 0);
+
+    // shift seq 1 so that its first cell becomes empty
+    for (uint32_t i = 0; i < 4; ++i) {
+        if (cells.seq_has(i, 1)) {
+            cells.pos_add(i, -1);
+        }
+    }
+    assert(cells.seq_pos_min(1) == 0 && cells.seq_pos_max(1) == 2);
+    assert(cells.seq_pos_min(0) == 0 && cells.seq_pos_max(0) == 4);
+
+    // duplicated positions are counted
+    cells.pos_set(8, 4);
+    cells.seq_add(8, 0);
+    cells.rm(4);
+    assert(cells.seq_pos_max(0) == 4);
+    cells.rm(8);
+    assert(cells.seq_pos_max(0) == 2);
+
+    cells.seq_keep(1, 1);
+    assert(cells.seq_pos_min(0) == 1);
+
+    cells.reset();
+    assert(cells.seq_pos_min(0) == -1 && cells.get_used() == 0);
+}
+
+// a model with a single small layer, enough to create a KV cache on the CPU
+static std::unique_ptr<llama_model> make_model() {
+    auto model = std::make_unique<llama_model>(llama_model_default_params());
+
+    auto & hparams = model->hparams;
+
+    hparams.n_layer       = 1;
+    hparams.n_embd_head_k = 4;
+    hparams.n_embd_head_v = 4;
+    hparams.n_head_kv_arr.fill(1);
+
+    return model;
+}
+
+static std::unique_ptr<llama_kv_cache_unified> make_kv(const llama_model & model, uint32_t kv_size, uint32_t n_block, uint32_t n_seq_max = 2) {
+    return std::make_unique<llama_kv_cache_unified>(
+            model, nullptr, GGML_TYPE_F32, GGML_TYPE_F32, false, false, kv_size, n_seq_max, 1, 0, LLAMA_SWA_TYPE_NONE, n_block);
+}
+
+// a batch of embeddings with one token for each entry of seq_ids, the positions continue the sequences in the cache
+struct test_batch {
+    test_batch(const llama_kv_cache_unified & kv, const std::vector<llama_seq_id> & seq_ids) :
+        batch(llama_batch_init(seq_ids.size(), 1, 1)), balloc(1) {
+        std::vector<llama_pos> pos(LLAMA_MAX_SEQ);
+        for (int s = 0; s < LLAMA_MAX_SEQ; ++s) {
+            pos[s] = kv.seq_pos_max(s) + 1;
+        }
+
+        for (size_t i = 0; i < seq_ids.size(); ++i) {
+            batch.embd[i]      = 0.0f;
+            batch.pos[i]       = pos[seq_ids[i]]++;
+            batch.n_seq_id[i]  = 1;
+            batch.seq_id[i][0] = seq_ids[i];
+            batch.logits[i]    = false;
+        }
+        batch.n_tokens = seq_ids.size();
+
+        static llama_vocab vocab;
+
+        const bool ok = balloc.init(batch, vocab, &kv, 1, false);
+        assert(ok);
+    }
+
+    ~test_batch() {
+        llama_batch_free(batch);
+    }
+
+    llama_batch        batch;
+    llama_batch_allocr balloc;
+};
+
+// build the KQ mask of the current ubatch twice and compare them: the first one can be patched from the mask of the
+// previous ubatch, the second one is always rebuilt from the cells, since the mask of a ubatch is never reused for itself
+static void check_kq_mask(const llama_kv_cache_unified_context & mctx) {
+    const auto & ubatch = mctx.get_ubatch();
+
+    const int64_t n_kv   = mctx.get_n_kv();
+    const int64_t n_rows = GGML_PAD(ubatch.n_tokens, GGML_KQ_MASK_PAD);
+
+    ggml_init_params params = {
+        /*.mem_size   =*/ 2*ggml_tensor_overhead(),
+        /*.mem_buffer =*/ nullptr,
+        /*.no_alloc   =*/ true,
+    };
+
+    ggml_context_ptr ctx { ggml_init(params) };
+
+    ggml_tensor * mask_incr = ggml_new_tensor_2d(ctx.get(), GGML_TYPE_F32, n_kv, n_rows);
+    ggml_tensor * mask_full = ggml_new_tensor_2d(ctx.get(), GGML_TYPE_F32, n_kv, n_rows);
+
+    ggml_backend_buffer_ptr buf { ggml_backend_alloc_ctx_tensors_from_buft(ctx.get(), ggml_backend_cpu_buffer_type()) };
+    assert(buf);
+
+    mctx.set_input_kq_mask(mask_incr, &ubatch, true);
+    mctx.set_input_kq_mask(mask_full, &ubatch, true);
+
+    const float * data_incr = (const float *) mask_incr->data;
+    const float * data_full = (const float *) mask_full->data;
+
+    assert(std::equal(data_incr, data_incr + n_kv*n_rows, data_full));
+}
+
+// place the batch with init_batch() and apply all its ubatches, returns false if it does not fit
+static bool decode(llama_kv_cache_unified & kv, const std::vector<llama_seq_id> & seq_ids, uint32_t n_ubatch, size_t * n_ubatches = nullptr, bool check_mask = false) {
+    test_batch tb(kv, seq_ids);
+
+    auto mctx = kv.init_batch(tb.balloc, n_ubatch, false);
+    if (mctx->get_status() != LLAMA_MEMORY_STATUS_SUCCESS) {
+        return false;
+    }
+
+    size_t n = 0;
+    do {
+        mctx->apply();
+        if (check_mask) {
+            check_kq_mask(*static_cast<llama_kv_cache_unified_context *>(mctx.get()));
+        }
+        n++;
+    } while (mctx->next());
+
+    if (n_ubatches) {
+        *n_ubatches = n;
+    }
+
+    return true;
+}
+
+// check the paged placement (prepare_paged, find_run) against a cache fragmented into runs of 8 free cells
+static void test_paged() {
+    const auto model = make_model();
+
+    const uint32_t kv_size = 64;
+
+    // cells [0, 64) alternate between seq 0 and seq 1 every 8 cells, then seq 1 is removed
+    auto fragment = [&](llama_kv_cache_unified & kv) {
+        std::vector<llama_seq_id> seq_ids;
+        for (uint32_t i = 0; i < kv_size; ++i) {
+            seq_ids.push_back((i/8) % 2);
+        }
+
+        size_t n_ubatches = 0;
+        assert(decode(kv, seq_ids, kv_size, &n_ubatches));
+        assert(n_ubatches == 1);
+
+        kv.seq_rm(1, -1, -1);
+        assert(kv.seq_pos_max(0) == 31 && kv.seq_pos_max(1) == -1);
+    };
+
+    const std::vector<uint32_t> runs = { 8, 24, 40, 56 };
+
+    // the free runs are found and the batch is split across them
+    {
+        auto kv = make_kv(*model, kv_size, 8);
+        fragment(*kv);
+
+        uint32_t n_run = 0;
+        const int32_t head = kv->find_run(8, 32, n_run);
+        assert(std::find(runs.begin(), runs.end(), (uint32_t) head) != runs.end());
+        assert(n_run == 8);
+        assert(kv->find_run(9, 32, n_run) == -1);
+
+        test_batch tb(*kv, std::vector<llama_seq_id>(32, 1));
+
+        std::vector<llama_ubatch> ubatches;
+        {
+            tb.balloc.split_reset();
+            ubatches.push_back(tb.balloc.split_simple(32));
+            assert(kv->prepare(ubatches).empty());
+        }
+
+        auto heads = kv->prepare_paged(tb.balloc, 32, ubatches);
+        assert(heads.size() == 4 && ubatches.size() == 4);
+        for (const auto & ubatch : ubatches) {
+            assert(ubatch.n_tokens == 8);
+        }
+        std::sort(heads.begin(), heads.end());
+        assert(heads == runs);
+
+        // the cells are left untouched
+        assert(kv->seq_pos_max(1) == -1);
+        assert(kv->find_run(8, 8, n_run) >= 0);
+
+        // init_batch places the batch in the runs
+        size_t n_ubatches = 0;
+        assert(decode(*kv, std::vector<llama_seq_id>(32, 1), 32, &n_ubatches));
+        assert(n_ubatches == 4);
+        assert(kv->seq_pos_min(1) == 0 && kv->seq_pos_max(1) == 31);
+        assert(kv->find_run(1, 1, n_run) == -1);
+    }
+
+    // the tail of the batch can use a run shorter than a block
+    {
+        auto kv = make_kv(*model, kv_size, 8);
+        fragment(*kv);
+
+        test_batch tb(*kv, std::vector<llama_seq_id>(20, 1));
+
+        std::vector<llama_ubatch> ubatches;
+
+        const auto heads = kv->prepare_paged(tb.balloc, 32, ubatches);
+        assert(heads.size() == 3);
+        assert(ubatches[0].n_tokens == 8 && ubatches[1].n_tokens == 8 && ubatches[2].n_tokens == 4);
+    }
+
+    // runs shorter than a block are not used and without paged placement the batch does not fit
+    {
+        auto kv = make_kv(*model, kv_size, 16);
+        fragment(*kv);
+        assert(!decode(*kv, std::vector<llama_seq_id>(32, 1), 32));
+
+        kv = make_kv(*model, kv_size, 0);
+        fragment(*kv);
+        assert(!decode(*kv, std::vector<llama_seq_id>(32, 1), 32));
+        assert( decode(*kv, std::vector<llama_seq_id>( 8, 1), 32));
+    }
+
+    // the batch is placed in contiguous cells when they are available
+    {
+        auto kv = make_kv(*model, kv_size, 8);
+
+        size_t n_ubatches = 0;
+        assert(decode(*kv, std::vector<llama_seq_id>(32, 1), 32, &n_ubatches));
+        assert(n_ubatches == 1);
+    }
+}
+
+// the KQ masks patched incrementally during decoding are the same as the ones rebuilt from the cells, also after the
+// cells are modified with seq_rm, seq_cp and seq_add (shift)
+static void test_kq_mask() {
+    const auto model = make_model();
+
+    auto kv = make_kv(*model, 128, 0, 3);
+
+    auto step = [&](const std::vector<llama_seq_id> & seq_ids, int n_steps) {
+        for (int i = 0; i < n_steps; ++i) {
+            assert(decode(*kv, seq_ids, 64, nullptr, true));
+        }
+    };
+
+    // prompts of different lengths, then decode one token per sequence
+    {
+        std::vector<llama_seq_id> seq_ids(12, 0);
+        seq_ids.resize(17, 1);
+        assert(decode(*kv, seq_ids, 64, nullptr, true));
+    }
+    step({ 0, 1 }, 8);
+
+    // a ubatch with a different set of sequences, then a different order
+    step({ 1 }, 2);
+    step({ 1, 0 }, 4);
+
+    // rollback of the tail of a sequence
+    kv->seq_rm(1, kv->seq_pos_max(1) - 3, -1);
+    step({ 0, 1 }, 4);
+
+    // context shift: discard a part of the sequence and shift the rest back
+    kv->seq_rm (0, 4, 8);
+    kv->seq_add(0, 8, -1, -4);
+    step({ 0, 1 }, 4);
+
+    // a new sequence sharing the cells of another one
+    kv->seq_cp(0, 2, -1, -1);
+    step({ 0, 1, 2 }, 8);
+
+    // removal of a whole sequence
+    kv->seq_rm(1, -1, -1);
+    step({ 0, 2 }, 4);
+
+    // several tokens of a sequence in the same ubatch
+    step({ 0, 0, 2 }, 2);
+    step({ 0, 2 }, 4);
+}
+
+// simulate the bookkeeping of a server with n_seq parallel streams sharing n_cells cells:
+// prompt fill, decode steps with occasional rollbacks (speculative decoding) and context shifts
+static void bench_cells(int n_seq, uint32_t n_cells, int n_steps) {
+    llama_kv_cells_unified cells;
+
+    cells.resize(n_cells);
+
+    const uint32_t n_per_seq = n_cells / n_seq;
+    const uint32_t n_prompt  = n_per_seq / 2;
+
+    std::vector<uint32_t> n_used(n_seq, 0);
+
+    int64_t n_ops = 0;
+
+    const int64_t t_start_us = time_us();
+
+    // prompt
+    for (int s = 0; s < n_seq; ++s) {
+        for (uint32_t j = 0; j < n_prompt; ++j) {
+            const uint32_t i = s*n_per_seq + j;
+
+            cells.pos_set(i, j);
+            cells.seq_add(i, s);
+        }
+        n_used[s] = n_prompt;
+        n_ops += n_prompt;
+    }
+
+    const int64_t t_prompt_us = time_us();
+
+    for (int step = 0; step < n_steps; ++step) {
+        for (int s = 0; s < n_seq; ++s) {
+            const uint32_t i0 = s*n_per_seq;
+
+            // context shift: discard the second quarter of the cells and shift the rest back
+            if (n_used[s] == n_per_seq) {
+                const uint32_t n_keep    = n_per_seq/4;
+                const uint32_t n_discard = n_per_seq/4;
+
+                for (uint32_t j = n_keep; j < n_keep + n_discard; ++j) {
+                    cells.seq_rm(i0 + j, s);
+                }
+                for (uint32_t j = n_keep + n_discard; j < n_per_seq; ++j) {
+                    cells.pos_add(i0 + j, -(llama_pos) n_discard);
+                }
+                for (uint32_t j = n_keep + n_discard; j < n_per_seq; ++j) {
+                    cells.mv(i0 + j, i0 + j - n_discard);
+                }
+
+                n_used[s] -= n_discard;
+                n_ops += n_per_seq - n_keep;
+            }
+
+            // decode one token
+            const uint32_t i = i0 + n_used[s];
+
+            cells.pos_set(i, cells.seq_pos_max(s) + 1);
+            cells.seq_add(i, s);
+
+            n_used[s]++;
+            n_ops++;
+
+            // rollback of a rejected draft token
+            if (step % 4 == 3) {
+                cells.seq_rm(i, s);
+                n_used[s]--;
+                n_ops++;
+            }
+
+            assert(cells.seq_pos_max(s) - cells.seq_pos_min(s) + 1 == (llama_pos) n_used[s]);
+        }
+    }
+
+    const int64_t t_end_us = time_us();
+
+    printf("%s: n_seq = %d, n_cells = %u\n", __func__, n_seq, n_cells);
+    printf("%s:   prompt: %8.3f ms, %8.2f ns/cell\n", __func__,
+            1e-3*(t_prompt_us - t_start_us), 1e3*(t_prompt_us - t_start_us)/(n_seq*n_prompt));
+    printf("%s:   decode: %8.3f ms, %8.2f ns/op (%d steps, %lld ops in total)\n", __func__,
+            1e-3*(t_end_us - t_prompt_us), 1e3*(t_end_us - t_prompt_us)/n_ops, n_steps, (long long) n_ops);
+}
+
+int main(int argc, char ** argv) {
+    int      n_seq   = 64;
+    uint32_t n_cells = 128*1024;
+    int      n_steps = 4096;
+
+    if (argc > 1) {
+        n_seq = std::atoi(argv[1]);
+    }
+
+    if (argc > 2) {
+        n_cells = std::atoi(argv[2]);
+    }
+
+    if (argc > 3) {
+        n_steps = std::atoi(argv[3]);
+    }
+
+    if (n_seq < 1 || n_seq > LLAMA_MAX_SEQ || n_cells < (uint32_t) n_seq*8) {
+        fprintf(stderr, "%s: invalid arguments\n", argv[0]);
+        return 1;
+    }
+
+    test_pos_hist();
+    test_cells();
+    test_paged();
+    test_kq_mask();
+
+    bench_cells(n_seq, n_cells, n_steps);
+
+    printf("OK\n");
+
+    return 0;
+}
@@ -0,0 +1,198 @@
+//  Tests the pre-tokenizer splitters in unicode_regex_split against the std::regex implementation.
+//
+//  Usage: test-regex-split [file.inp ...]
+//
+//  In addition to the built-in inputs, the texts of the tokenizer test corpora (models/ggml-vocab-*.gguf.inp)
+//  can be passed on the command line.
+
+#include "../src/llama-vocab.h"
+#include "../src/unicode.h"
+
+#include <cstdio>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// the distinct regex sets of the pre-tokenizer types, see llama_vocab_pre_type_regex_exprs
+static std::vector<std::pair<std::string, std::vector<std::string>>> get_regex_sets() {
+    std::vector<std::pair<std::string, std::vector<std::string>>> result;
+
+    for (int pre_type = LLAMA_VOCAB_PRE_TYPE_DEFAULT; pre_type <= LLAMA_VOCAB_PRE_TYPE_SEED_CODER; ++pre_type) {
+        const auto regex_exprs = llama_vocab_pre_type_regex_exprs((enum llama_vocab_pre_type) pre_type);
+
+        bool found = false;
+        for (const auto & set : result) {
+            found = found || set.second == regex_exprs;
+        }
+        if (!found) {
+            result.push_back({ "pre_type " + std::to_string(pre_type), regex_exprs });
+        }
+    }
+
+    return result;
+}
+
+static const std::vector<std::string> k_texts = {
+    "",
+    " ",
+    "\n \n\n \t\t",
+    "Hello world",
+    " Hello World! How are you?\n",
+    "I'm sure you'll see they've DONE it, hasn't she? 'Tis IT'S",
+    "3 33 333 3333 33333 333333 1234567 12,345.678",
+    "<sentinel:12> <sentinel:> IMGIMGABCDZ IMGIMGABCDEZ IMGIMGZ",
+    "    if (x == 1) {\n        return y;\n    }  \n",
+    "HTTPServer getHTTPResponseCode XMLHttpRequest camelCase snake_case ÉCOLE école",
+    "path/to/file.txt\r\n// comment /* block */ a//b\n/\n",
+    "Ѐ ЁЂЃ ΑΒΓ αβγ ﬀ ＡＢＣ ａｂｃ 𐐀𐐨",
+    "你好，世界。这是一个测试！日本語のテキスト、カタカナ。한국어 텍스트",
+    "नमस्ते दुनिया। مرحبا بالعالم، كيف حالك؟ اردو۔",
+    "e\u0301 a\u0300\u0300 \u064b\u064c x\u20dd",
+    "\u00a0\u2003 \u3000x\u3000\u3000y \u0085z\u2028",
+    "emoji 😀😃 👍🏽 ❤️ ★☆ ∑∫ €$£ ~^`|<=>+",
+    "\x1c\x1d\x1e\x1f\x7f\x01 tab\tvt\vff\f",
+    "٣٤٥ ²³ Ⅻ ½ ➀",
+    "'''' ''s 's 'S 'LL 'll 'Re",
+};
+
+static std::string escape(const std::string & text) {
+    std::string result;
+    for (const auto cpt : unicode_cpts_from_utf8(text)) {
+        if (cpt < 0x20 || (0x7f <= cpt && cpt < 0xa0) || cpt == 0x2028 || cpt == 0x3000) {
+            char buf[16];
+            snprintf(buf, sizeof(buf), "\\u%04x", cpt);
+            result += buf;
+        } else {
+            result += unicode_cpt_to_utf8(cpt);
+        }
+    }
+    return result;
+}
+
+static std::string format_words(const std::vector<std::string> & words) {
+    std::string result;
+    for (const auto & word : words) {
+        result += "[" + escape(word) + "]";
+    }
+    return result;
+}
+
+// random text from a small alphabet with a mix of unicode categories
+static std::string random_text(std::mt19937 & rng) {
+    static const std::vector<uint32_t> alphabet = []() {
+        std::vector<uint32_t> result;
+        for (uint32_t c = 0x20; c < 0x7f; ++c) {
+            result.push_back(c);
+        }
+        for (uint32_t c : {
+                0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x1c, 0x85, 0xa0, 0x3000, 0x2028,     // whitespace
+                0xb5, 0xc9, 0xe9, 0xdf, 0x1c5, 0x3a9, 0x436, 0x4e2d, 0x65e5, 0xac00, // letters
+                0x3042, 0x30a2, 0x5b57, 0x10428, 0xff21,
+                0x301, 0x64b, 0x20dd,                                                // marks
+                0x663, 0xb2, 0x216b, 0xbd,                                           // numbers
+                0x2026, 0x3002, 0xff0c, 0x3001, 0x964, 0x6d4, 0x60c, 0x2018, 0x201c, // punctuation
+                0x20ac, 0x2211, 0x1f600, 0x2605,                                     // symbols
+                0xad, 0x200b, 0x378, 0xfffd,                                         // other
+            }) {
+            result.push_back(c);
+        }
+        return result;
+    }();
+
+    std::uniform_int_distribution<size_t> dist_len(0, 48);
+    std::uniform_int_distribution<size_t> dist_cpt(0, alphabet.size() - 1);
+    std::uniform_int_distribution<size_t> dist_ascii(0, 3);
+
+    std::string result;
+    const size_t len = dist_len(rng);
+    for (size_t i = 0; i < len; ++i) {
+        // bias towards letters, digits and spaces to get longer words
+        switch (dist_ascii(rng)) {
+            case 0:  result += "aB3 "[rng() % 4]; break;
+            default: result += unicode_cpt_to_utf8(alphabet[dist_cpt(rng)]); break;
+        }
+    }
+    return result;
+}
+
+static std::vector<std::string> read_texts(const char * fname) {
+    std::ifstream f(fname);
+    if (!f) {
+        fprintf(stderr, "%s : error: failed to open '%s'\n", __func__, fname);
+        exit(1);
+    }
+    std::stringstream ss;
+    ss << f.rdbuf();
+    const std::string content = ss.str();
+
+    // same separator as in test-tokenizer-0
+    const std::string separator = "\n__ggml_vocab_test__\n";
+
+    std::vector<std::string> result = { content };
+    for (size_t pos = 0; ; ) {
+        const size_t next = content.find(separator, pos);
+        result.push_back(content.substr(pos, next - pos));
+        if (next == std::string::npos) {
+            break;
+        }
+        pos = next + separator.size();
+    }
+    return result;
+}
+
+int main(int argc, char ** argv) {
+    std::vector<std::string> texts = k_texts;
+
+    std::mt19937 rng(42);
+    for (int i = 0; i < 2000; ++i) {
+        texts.push_back(random_text(rng));
+    }
+
+    for (int i = 1; i < argc; ++i) {
+        const auto inp = read_texts(argv[i]);
+        texts.insert(texts.end(), inp.begin(), inp.end());
+    }
+
+    int n_fail = 0;
+
+    for (const auto & set : get_regex_sets()) {
+        int n_fail_set = 0;
+
+        // each regex on its own, and the whole chain as used by the tokenizer
+        std::vector<std::vector<std::string>> tests;
+        for (const auto & regex_expr : set.second) {
+            tests.push_back({ regex_expr });
+        }
+        if (set.second.size() > 1) {
+            tests.push_back(set.second);
+        }
+
+        for (const auto & regex_exprs : tests) {
+            for (const auto & text : texts) {
+                const auto res = unicode_regex_split(text, regex_exprs, true);
+                const auto exp = unicode_regex_split(text, regex_exprs, false);
+
+                if (res != exp) {
+                    if (n_fail_set++ < 4) {
+                        fprintf(stderr, "%s : %s : mismatch for regex '%s'\n", __func__, set.first.c_str(), escape(regex_exprs.back()).c_str());
+                        fprintf(stderr, "  text:     '%s'\n", escape(text).c_str());
+                        fprintf(stderr, "  expected: %s\n", format_words(exp).c_str());
+                        fprintf(stderr, "  result:   %s\n", format_words(res).c_str());
+                    }
+                }
+            }
+        }
+
+        printf("%s : %-16s : %s\n", __func__, set.first.c_str(), n_fail_set == 0 ? "OK" : "FAILED");
+        n_fail += n_fail_set;
+    }
+
+    if (n_fail > 0) {
+        fprintf(stderr, "%s : %d mismatches\n", __func__, n_fail);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,198 @@
+// round trip and invalidation of the repack cache (llama_model_params::repack_cache_dir)
+//
+// usage: test-repack-cache <model.gguf>
+//
+// the model is copied to a temporary directory, so that it can be modified to check that a stale cache is not used
+
+#include "llama.h"
+#include "gguf.h"
+#include "get-model.h"
+
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <random>
+#include <string>
+#include <vector>
+
+#undef NDEBUG
+#include <cassert>
+
+namespace fs = std::filesystem;
+
+// number of times the repack cache was mapped and saved, counted from the log
+static int n_mapped = 0;
+static int n_saved  = 0;
+
+static void log_callback(ggml_log_level level, const char * text, void * /*user_data*/) {
+    if (strstr(text, "load: mapped")) {
+        n_mapped++;
+    }
+    if (strstr(text, "save: saved")) {
+        n_saved++;
+    }
+    if (level == GGML_LOG_LEVEL_ERROR || level == GGML_LOG_LEVEL_WARN) {
+        fputs(text, stderr);
+    }
+}
+
+// the logits of the last token of a fixed prompt
+static std::vector<float> eval(const std::string & path, const char * cache_dir, bool check_tensors) {
+    n_mapped = 0;
+    n_saved  = 0;
+
+    auto mparams = llama_model_default_params();
+    mparams.n_gpu_layers     = 0;
+    mparams.use_mmap         = true;
+    mparams.repack_cache_dir = cache_dir;
+    mparams.check_tensors    = check_tensors;
+
+    llama_model * model = llama_model_load_from_file(path.c_str(), mparams);
+    assert(model != nullptr);
+
+    auto cparams = llama_context_default_params();
+    cparams.n_ctx     = 64;
+    cparams.n_batch   = 64;
+    cparams.n_threads = 4;
+
+    llama_context * ctx = llama_init_from_model(model, cparams);
+    assert(ctx != nullptr);
+
+    const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(model));
+
+    std::vector<llama_token> tokens;
+    for (int i = 0; i < 16; ++i) {
+        tokens.push_back((1 + 37*i) % n_vocab);
+    }
+
+    if (llama_decode(ctx, llama_batch_get_one(tokens.data(), tokens.size())) != 0) {
+        assert(false);
+    }
+
+    const float * logits = llama_get_logits_ith(ctx, -1);
+    std::vector<float> res(logits, logits + n_vocab);
+
+    llama_free(ctx);
+    llama_model_free(model);
+
+    return res;
+}
+
+// overwrites the second half of the data of a layer tensor with the data of the same tensor of another layer, so that
+// the file keeps its size and structure but the weights change, then restores the modification time
+// returns false if the model has no such pair of tensors
+static bool modify_weights(const std::string & path) {
+    gguf_init_params params = { /*.no_alloc =*/ true, /*.ctx =*/ nullptr };
+    gguf_context * ctx = gguf_init_from_file(path.c_str(), params);
+    assert(ctx != nullptr);
+
+    const int64_t id_dst = gguf_find_tensor(ctx, "blk.0.ffn_up.weight");
+    const int64_t id_src = gguf_find_tensor(ctx, "blk.1.ffn_up.weight");
+    if (id_dst < 0 || id_src < 0 || gguf_get_tensor_type(ctx, id_dst) != gguf_get_tensor_type(ctx, id_src) ||
+            gguf_get_tensor_size(ctx, id_dst) != gguf_get_tensor_size(ctx, id_src)) {
+        gguf_free(ctx);
+        return false;
+    }
+
+    const size_t size = gguf_get_tensor_size(ctx, id_src);
+
+    const size_t offs_dst = gguf_get_data_offset(ctx) + gguf_get_tensor_offset(ctx, id_dst) + size/2;
+    const size_t offs_src = gguf_get_data_offset(ctx) + gguf_get_tensor_offset(ctx, id_src) + size/2;
+
+    std::vector<uint8_t> data(size - size/2);
+    gguf_free(ctx);
+
+    const auto t_mod = fs::last_write_time(path);
+
+    FILE * f = fopen(path.c_str(), "r+b");
+    assert(f != nullptr);
+    assert(fseek(f, offs_src, SEEK_SET) == 0);
+    assert(fread(data.data(), 1, data.size(), f) == data.size());
+    assert(fseek(f, offs_dst, SEEK_SET) == 0);
+    assert(fwrite(data.data(), 1, data.size(), f) == data.size());
+    fclose(f);
+
+    fs::last_write_time(path, t_mod);
+
+    return true;
+}
+
+static size_t n_cache_files(const fs::path & dir) {
+    size_t n = 0;
+    for (const auto & entry : fs::directory_iterator(dir)) {
+        if (entry.path().extension() == ".cache") {
+            n++;
+        }
+    }
+    return n;
+}
+
+int main(int argc, char ** argv) {
+    auto * model_path = get_model_or_exit(argc, argv);
+
+    const fs::path dir = fs::temp_directory_path() / ("test-repack-cache-" + std::to_string(std::random_device{}()));
+    fs::create_directories(dir);
+
+    const std::string path      = (dir / "model.gguf").string();
+    const std::string cache_dir = dir.string();
+
+    fs::copy_file(model_path, path);
+
+    llama_log_set(log_callback, nullptr);
+    llama_backend_init();
+
+    const auto ref = eval(path, nullptr, false);
+
+    // the first load converts the weights and saves them
+    {
+        const auto res = eval(path, cache_dir.c_str(), false);
+        if (n_saved == 0) {
+            fprintf(stderr, "%s: the model has no weights in a repacked buffer type on this CPU, skipping\n", __func__);
+            llama_backend_free();
+            fs::remove_all(dir);
+            return 0;
+        }
+        assert(n_mapped == 0);
+        assert(res == ref);
+        assert(n_cache_files(dir) == 1);
+    }
+
+    // the next loads map them
+    {
+        const auto res = eval(path, cache_dir.c_str(), false);
+        assert(n_mapped > 0 && n_saved == 0);
+        assert(res == ref);
+    }
+
+    // with check_tensors, the weights are validated and compared with the hash stored in the cache
+    {
+        const auto res = eval(path, cache_dir.c_str(), true);
+        assert(n_mapped > 0 && n_saved == 0);
+        assert(res == ref);
+    }
+
+    // the weights changed without changing the size or the modification time of the file: the cache is not used
+    if (modify_weights(path)) {
+        const auto ref_mod = eval(path, nullptr, false);
+        assert(ref_mod != ref);
+
+        const auto res = eval(path, cache_dir.c_str(), false);
+        assert(n_mapped == 0 && n_saved > 0);
+        assert(res == ref_mod);
+        assert(n_cache_files(dir) == 2);
+
+        const auto res_mapped = eval(path, cache_dir.c_str(), false);
+        assert(n_mapped > 0 && n_saved == 0);
+        assert(res_mapped == ref_mod);
+    } else {
+        fprintf(stderr, "%s: the model has no pair of layer tensors to swap, skipping the invalidation test\n", __func__);
+    }
+
+    llama_backend_free();
+
+    fs::remove_all(dir);
+
+    printf("OK\n");
+
+    return 0;
+}
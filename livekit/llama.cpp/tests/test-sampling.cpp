@@ -1,5 +1,6 @@
 #include "ggml.h"
 #include "llama.h"
+#include "sampling.h"
 
 #ifdef NDEBUG
 #undef NDEBUG
@@ -7,6 +8,7 @@
 
 #include <algorithm>
 #include <cmath>
+#include <random>
 #include <string>
 #include <vector>
 
@@ -267,6 +269,137 @@ static void test_sampler_queue(const size_t n_vocab, const std::string & sampler
            samplers_sequence.c_str(), n_vocab, top_k, top_p, min_p);
 }
 
+static llama_sampler * init_chain(int32_t top_k, float top_p, float min_p, size_t min_keep, float temp, uint32_t seed) {
+    llama_sampler * chain = llama_sampler_chain_init(llama_sampler_chain_default_params());
+
+    llama_sampler_chain_add(chain, llama_sampler_init_top_k(top_k));
+    llama_sampler_chain_add(chain, llama_sampler_init_top_p(top_p, min_keep));
+    llama_sampler_chain_add(chain, llama_sampler_init_min_p(min_p, min_keep));
+    llama_sampler_chain_add(chain, llama_sampler_init_temp (temp));
+    llama_sampler_chain_add(chain, llama_sampler_init_dist (seed));
+
+    return chain;
+}
+
+// the fused sampler must keep the same candidates and select the same tokens as the chain of the individual samplers
+// when the top-p bound falls in a long tail of tiny probabilities, the rounding of the cumulative sum decides the last
+// candidates - with exact == false only the number of candidates is compared, with a 1% tolerance
+static void test_fused(size_t n_vocab, int32_t top_k, float top_p, float min_p, size_t min_keep, float temp, float sigma, bool exact = true) {
+    std::mt19937 rng(42);
+    std::normal_distribution<float> dist(0.0f, sigma);
+
+    llama_sampler * chain = init_chain              (top_k, top_p, min_p, min_keep, temp, 1234);
+    llama_sampler * fused = llama_sampler_init_fused(top_k, top_p, min_p, min_keep, temp, 1234);
+
+    std::vector<llama_token_data> cur_chain(n_vocab);
+    std::vector<llama_token_data> cur_fused(n_vocab);
+
+    for (int it = 0; it < 16; ++it) {
+        for (llama_token token_id = 0; token_id < (llama_token) n_vocab; token_id++) {
+            cur_chain[token_id] = llama_token_data{token_id, dist(rng), 0.0f};
+        }
+        cur_fused = cur_chain;
+
+        llama_token_data_array cur_p_chain = { cur_chain.data(), cur_chain.size(), -1, false };
+        llama_token_data_array cur_p_fused = { cur_fused.data(), cur_fused.size(), -1, false };
+
+        llama_sampler_apply(chain, &cur_p_chain);
+        llama_sampler_apply(fused, &cur_p_fused);
+
+        if (!exact) {
+            GGML_ASSERT(std::abs((int64_t) cur_p_chain.size - (int64_t) cur_p_fused.size) <= (int64_t) cur_p_chain.size/100);
+            continue;
+        }
+
+        GGML_ASSERT(cur_p_chain.size == cur_p_fused.size);
+        GGML_ASSERT(cur_p_chain.data[cur_p_chain.selected].id == cur_p_fused.data[cur_p_fused.selected].id);
+        for (size_t i = 0; i < cur_p_chain.size; i++) {
+            GGML_ASSERT(cur_p_chain.data[i].id == cur_p_fused.data[i].id);
+            GGML_ASSERT(fabs(cur_p_chain.data[i].p - cur_p_fused.data[i].p) < 1e-5);
+        }
+    }
+
+    llama_sampler_free(chain);
+    llama_sampler_free(fused);
+
+    printf("Fused sampler OK with n_vocab=%06zu top_k=%05d top_p=%f min_p=%f min_keep=%zu temp=%f sigma=%f%s\n",
+           n_vocab, top_k, top_p, min_p, min_keep, temp, sigma, exact ? "" : " (approx)");
+}
+
+// sampling a batch of sequences with the pool must give the same tokens as sampling each sequence on its own
+// the per-sequence state (RNG, penalties) must not leak between the sequences sampled by the threads of the pool
+static void test_sample_batch(const char * vocab_file, int n_threads) {
+    auto mparams = llama_model_default_params();
+    mparams.vocab_only = true;
+
+    llama_model * model = llama_model_load_from_file(vocab_file, mparams);
+    GGML_ASSERT(model != nullptr);
+
+    llama_context * ctx = llama_init_from_model(model, llama_context_default_params());
+    GGML_ASSERT(ctx != nullptr);
+
+    const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(model));
+    const int n_seq   = 8;
+    const int n_steps = 32;
+
+    std::vector<common_sampler *> smpls_seq;
+    std::vector<common_sampler *> smpls_batch;
+
+    for (int s = 0; s < n_seq; ++s) {
+        common_params_sampling params;
+        params.seed           = 1234 + s;
+        params.temp           = s % 4 == 0 ? 0.0f : 0.5f + 0.1f*s;
+        params.top_k          = s % 2 == 0 ? 40 : 0;
+        params.penalty_repeat = s % 3 == 0 ? 1.5f : 1.0f;
+
+        smpls_seq  .push_back(common_sampler_init(model, params));
+        smpls_batch.push_back(common_sampler_init(model, params));
+    }
+
+    common_sampler_pool * pool = n_threads > 0 ? common_sampler_pool_init(n_threads) : nullptr;
+
+    std::mt19937 rng(42);
+    std::normal_distribution<float> dist(0.0f, 2.0f);
+
+    std::vector<std::vector<float>> logits(n_seq, std::vector<float>(n_vocab));
+
+    for (int it = 0; it < n_steps; ++it) {
+        std::vector<const float *> rows(n_seq);
+        for (int s = 0; s < n_seq; ++s) {
+            for (auto & l : logits[s]) {
+                l = dist(rng);
+            }
+            // a few high logits, so that the penalties change the sampled tokens
+            for (int j = 0; j < 4; ++j) {
+                logits[s][(s + j*97) % n_vocab] += 10.0f;
+            }
+            rows[s] = logits[s].data();
+        }
+
+        const auto ids = common_sampler_sample_and_accept_batch(pool, smpls_batch, ctx, rows);
+        GGML_ASSERT((int) ids.size() == n_seq);
+
+        for (int s = 0; s < n_seq; ++s) {
+            const llama_token id = common_sampler_sample_logits(smpls_seq[s], ctx, rows[s]);
+            common_sampler_accept(smpls_seq[s], id, true);
+
+            GGML_ASSERT(ids[s] == id);
+        }
+    }
+
+    common_sampler_pool_free(pool);
+
+    for (int s = 0; s < n_seq; ++s) {
+        common_sampler_free(smpls_seq[s]);
+        common_sampler_free(smpls_batch[s]);
+    }
+
+    llama_free(ctx);
+    llama_model_free(model);
+
+    printf("Batched sampling OK with n_threads=%d\n", n_threads);
+}
+
 static void bench(llama_sampler * cnstr, const char * cnstr_name, const std::vector<llama_token_data> & data, int n_iter) {
     std::vector<llama_token_data> cur(data.size());
     std::copy(data.begin(), data.end(), cur.begin());
@@ -282,7 +415,7 @@ static void bench(llama_sampler * cnstr, const char * cnstr_name, const std::vec
     }
     const int64_t t_end = ggml_time_us();
     llama_sampler_free(cnstr);
-    printf("%-43s: %8.3f us/iter\n", cnstr_name, (t_end - t_start) / (float)n_iter);
+    printf("%-58s: %8.3f us/iter, %8.0f tokens/s\n", cnstr_name, (t_end - t_start) / (float)n_iter, 1e6*n_iter / (t_end - t_start));
 }
 
 #define BENCH(__cnstr, __data, __n_iter) bench((__cnstr), #__cnstr, (__data), (__n_iter))
@@ -303,9 +436,30 @@ static void test_perf() {
     BENCH(llama_sampler_init_min_p  (0.2f, 1),                data, 32);
     BENCH(llama_sampler_init_typical(0.5f, 1),                data, 32);
     BENCH(llama_sampler_init_xtc    (1.0f, 0.1f, 1, 1),       data, 32);
+
+    // full top-k -> top-p -> min-p -> temp -> dist chain vs the fused sampler
+    // flat logits (uniform, as above) and peaked logits (normal) closer to the output of a model
+    std::vector<llama_token_data> data_peaked;
+
+    std::mt19937 rng(42);
+    std::normal_distribution<float> dist(0.0f, 3.0f);
+
+    data_peaked.reserve(n_vocab);
+    for (int i = 0; i < n_vocab; i++) {
+        data_peaked.emplace_back(llama_token_data{i, dist(rng), 0.0f});
+    }
+
+    BENCH(init_chain              (40, 0.95f, 0.05f, 1, 0.8f, 1), data,        32);
+    BENCH(llama_sampler_init_fused(40, 0.95f, 0.05f, 1, 0.8f, 1), data,        32);
+    BENCH(init_chain              (40, 0.95f, 0.05f, 1, 0.8f, 1), data_peaked, 32);
+    BENCH(llama_sampler_init_fused(40, 0.95f, 0.05f, 1, 0.8f, 1), data_peaked, 32);
+    BENCH(init_chain              ( 0, 0.95f, 0.05f, 1, 0.8f, 1), data_peaked, 32);
+    BENCH(llama_sampler_init_fused( 0, 0.95f, 0.05f, 1, 0.8f, 1), data_peaked, 32);
+    BENCH(init_chain              ( 0, 0.90f, 0.00f, 1, 0.8f, 1), data_peaked, 32);
+    BENCH(llama_sampler_init_fused( 0, 0.90f, 0.00f, 1, 0.8f, 1), data_peaked, 32);
 }
 
-int main(void) {
+int main(int argc, char ** argv) {
     ggml_time_init();
 
     test_temp({0.1f, 0.2f, 0.3f, 0.4f}, {0.4f, 0.3f, 0.2f, 0.1f}, 1.0f);
@@ -392,6 +546,28 @@ int main(void) {
     test_sampler_queue(10000, "mkp", 100, 0.8f, 0.1f);
     test_sampler_queue(10000, "mpk", 100, 0.8f, 0.1f);
 
+    test_fused(  1000, 40, 0.95f, 0.05f, 1, 0.8f, 3.0f);
+    test_fused(  1000,  0, 0.95f, 0.05f, 1, 0.8f, 3.0f);
+    test_fused(  1000,  0, 0.90f, 0.00f, 1, 1.0f, 1.0f);
+    test_fused(  1000,  0, 1.00f, 0.10f, 1, 1.5f, 3.0f);
+    test_fused(  1000, 10, 1.00f, 0.00f, 1, 0.0f, 3.0f);
+    test_fused(  1000,  0, 1.00f, 0.00f, 1, 1.0f, 3.0f);
+    test_fused(  1000,  0, 0.50f, 0.90f, 8, 0.7f, 1.0f);
+    test_fused(150000, 40, 0.95f, 0.05f, 1, 0.8f, 3.0f);
+    test_fused(150000,  0, 0.95f, 0.05f, 1, 0.8f, 2.0f);
+    test_fused(150000,  0, 0.99f, 0.00f, 1, 0.8f, 0.5f, false);
+
+    // the batched sampling needs a vocab
+    if (argc > 1) {
+        llama_backend_init();
+
+        for (int n_threads : { 0, 1, 4 }) {
+            test_sample_batch(argv[1], n_threads);
+        }
+
+        llama_backend_free();
+    }
+
     printf("OK\n");
 
     test_perf();
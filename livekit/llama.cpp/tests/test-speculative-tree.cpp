@@ -0,0 +1,320 @@
+// tests for the draft trees of speculative decoding (common_speculative_gen_draft_tree and the verification helpers)
+//
+// usage: test-speculative-tree <model.gguf>
+//
+// the same model is used as the draft and the target model, so that the results do not depend on the weights
+
+#include "common.h"
+#include "sampling.h"
+#include "speculative.h"
+#include "get-model.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+
+#undef NDEBUG
+#include <cassert>
+
+static const int n_branch = 4;
+static const int n_draft  = 12;
+
+// first sequence of the target context used by the branches, sequence 0 holds the prompt
+static const llama_seq_id seq_id_base = 1;
+
+static llama_token argmax(llama_context * ctx, int i) {
+    const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(llama_get_model(ctx)));
+
+    const float * logits = llama_get_logits_ith(ctx, i);
+
+    llama_token res = 0;
+    for (llama_token id = 1; id < n_vocab; ++id) {
+        if (logits[id] > logits[res]) {
+            res = id;
+        }
+    }
+
+    return res;
+}
+
+// the greedy continuation of the prompt, decoded one token at a time in sequence 0
+static llama_tokens greedy(llama_context * ctx, const llama_tokens & prompt, int n) {
+    llama_memory_clear(llama_get_memory(ctx), true);
+
+    llama_batch batch = llama_batch_init(prompt.size(), 0, 1);
+    for (size_t i = 0; i < prompt.size(); ++i) {
+        common_batch_add(batch, prompt[i], i, { 0 }, i == prompt.size() - 1);
+    }
+
+    llama_tokens res;
+    for (int i = 0; i < n; ++i) {
+        assert(llama_decode(ctx, batch) == 0);
+
+        res.push_back(argmax(ctx, batch.n_tokens - 1));
+
+        common_batch_clear(batch);
+        common_batch_add(batch, res.back(), prompt.size() + i, { 0 }, true);
+    }
+
+    llama_batch_free(batch);
+
+    return res;
+}
+
+// decode the prompt in sequence 0 and copy it to the sequences of the branches, then decode the tree on top of it
+static void decode_tree(llama_context * ctx, const llama_tokens & prompt, const common_speculative_tree & tree, llama_token id_last) {
+    auto * mem = llama_get_memory(ctx);
+
+    llama_memory_clear(mem, true);
+
+    llama_batch batch = llama_batch_init(std::max(prompt.size(), (size_t) n_draft + 1), 0, n_branch);
+
+    for (size_t i = 0; i < prompt.size(); ++i) {
+        common_batch_add(batch, prompt[i], i, { 0 }, false);
+    }
+    assert(llama_decode(ctx, batch) == 0);
+
+    for (int b = 0; b < tree.n_branch; ++b) {
+        llama_memory_seq_cp(mem, 0, seq_id_base + b, -1, -1);
+    }
+
+    common_batch_clear(batch);
+    common_speculative_tree_add_to_batch(tree, batch, id_last, prompt.size(), seq_id_base);
+    assert(llama_decode(ctx, batch) == 0);
+
+    llama_batch_free(batch);
+}
+
+// check the structure of a drafted tree: each branch is a path from the root and the siblings are different tokens
+static void check_tree(const common_speculative_tree & tree) {
+    assert(tree.size() > 0 && tree.size() <= n_draft);
+    assert(tree.n_branch >= 1 && tree.n_branch <= n_branch);
+    assert((int) tree.parent.size() == tree.size() && (int) tree.seqs.size() == tree.size());
+
+    const uint64_t all = tree.n_branch == 64 ? ~0ull : (1ull << tree.n_branch) - 1;
+
+    for (int k = 0; k < tree.size(); ++k) {
+        const int p = tree.parent[k];
+
+        // the parents come before their children
+        assert(p >= -1 && p < k);
+
+        // every node is on at least one branch, and the branches through a node also go through its parent
+        assert(tree.seqs[k] != 0 && (tree.seqs[k] & ~all) == 0);
+        if (p >= 0) {
+            assert((tree.seqs[k] & ~tree.seqs[p]) == 0);
+        }
+
+        for (int j = 0; j < k; ++j) {
+            if (tree.parent[j] == p) {
+                assert(tree.tokens[j] != tree.tokens[k]);
+                // the siblings are on different branches
+                assert((tree.seqs[j] & tree.seqs[k]) == 0);
+            }
+        }
+    }
+
+    // each branch has exactly one node at each depth, from 0 to the depth of its leaf
+    for (int b = 0; b < tree.n_branch; ++b) {
+        int n = 0;
+        int d_max = -1;
+        for (int k = 0; k < tree.size(); ++k) {
+            if (tree.seqs[k] & (1ull << b)) {
+                n++;
+                d_max = std::max(d_max, tree.depth(k));
+            }
+        }
+        assert(n > 0 && n == d_max + 1);
+    }
+}
+
+// check the batch built by common_speculative_tree_add_to_batch
+static void check_batch(const common_speculative_tree & tree, const llama_batch & batch, llama_token id_last, llama_pos n_past) {
+    assert(batch.n_tokens == tree.size() + 1);
+
+    // the root is shared by all branches
+    assert(batch.token[0] == id_last && batch.pos[0] == n_past && batch.logits[0]);
+    assert(batch.n_seq_id[0] == tree.n_branch);
+    for (int b = 0; b < tree.n_branch; ++b) {
+        assert(batch.seq_id[0][b] == seq_id_base + b);
+    }
+
+    for (int k = 0; k < tree.size(); ++k) {
+        const int i = k + 1;
+
+        assert(batch.token[i] == tree.tokens[k]);
+        assert(batch.pos[i] == n_past + 1 + tree.depth(k));
+        assert(batch.logits[i]);
+
+        uint64_t seqs = 0;
+        for (int s = 0; s < batch.n_seq_id[i]; ++s) {
+            const llama_seq_id seq_id = batch.seq_id[i][s];
+            assert(seq_id >= seq_id_base && seq_id < seq_id_base + tree.n_branch);
+            seqs |= 1ull << (seq_id - seq_id_base);
+        }
+        assert(seqs == tree.seqs[k]);
+    }
+}
+
+// the sampled tokens follow the tree until the first node whose children do not match, that token is appended
+static void check_accept(llama_context * ctx, common_sampler * smpl, const common_speculative_tree & tree,
+        const llama_tokens & expected, int node_expected) {
+    common_sampler_reset(smpl);
+
+    int node_last = -2;
+    const llama_tokens result = common_speculative_tree_sample_and_accept(smpl, ctx, tree, 0, node_last);
+
+    assert(result == expected);
+    assert(node_last == node_expected);
+}
+
+int main(int argc, char ** argv) {
+    auto * model_path = get_model_or_exit(argc, argv);
+
+    llama_backend_init();
+
+    auto mparams = llama_model_default_params();
+    mparams.n_gpu_layers = 0;
+
+    llama_model * model = llama_model_load_from_file(model_path, mparams);
+    assert(model != nullptr);
+
+    const llama_vocab * vocab = llama_model_get_vocab(model);
+
+    auto cparams = llama_context_default_params();
+    cparams.n_ctx     = 256;
+    cparams.n_batch   = 64;
+    cparams.n_seq_max = n_branch;
+    cparams.n_threads = 4;
+
+    llama_context * ctx_dft = llama_init_from_model(model, cparams);
+    assert(ctx_dft != nullptr);
+
+    cparams.n_seq_max = seq_id_base + n_branch;
+
+    llama_context * ctx_tgt = llama_init_from_model(model, cparams);
+    assert(ctx_tgt != nullptr);
+
+    common_params_sampling sparams;
+    sparams.top_k    = 1;
+    sparams.samplers = { COMMON_SAMPLER_TYPE_TOP_K };
+
+    common_sampler * smpl = common_sampler_init(model, sparams);
+
+    const int n_vocab = llama_vocab_n_tokens(vocab);
+
+    llama_tokens prompt;
+    for (int i = 0; i < 16; ++i) {
+        prompt.push_back(1 + (37*i) % (n_vocab - 1));
+    }
+
+    const llama_token id_last = prompt.back();
+    prompt.pop_back();
+
+    const llama_pos n_past = prompt.size();
+
+    llama_tokens prompt_all = prompt;
+    prompt_all.push_back(id_last);
+
+    // the greedy continuation of the target model
+    const llama_tokens ref = greedy(ctx_tgt, prompt_all, n_draft + 1);
+
+    // a drafted tree: with the same model and p_min = 0, the first branch is the greedy continuation, and the
+    // candidates split the other branches early
+    {
+        common_speculative * spec = common_speculative_init(ctx_dft);
+
+        common_speculative_params params;
+        params.n_draft  = n_draft;
+        params.n_branch = n_branch;
+        params.p_min    = 0.0f;
+        params.p_split  = 0.0f;
+
+        const auto tree = common_speculative_gen_draft_tree(spec, params, prompt, id_last);
+
+        check_tree(tree);
+        assert(tree.n_branch == n_branch);
+
+        // the nodes of the first branch, from the root
+        llama_tokens branch0;
+        for (int k = 0; k < tree.size(); ++k) {
+            if (tree.seqs[k] & 1) {
+                branch0.push_back(tree.tokens[k]);
+            }
+        }
+        assert(!branch0.empty() && branch0.size() < ref.size());
+        assert(std::equal(branch0.begin(), branch0.end(), ref.begin()));
+
+        llama_batch batch = llama_batch_init(n_draft + 1, 0, n_branch);
+        common_speculative_tree_add_to_batch(tree, batch, id_last, n_past, seq_id_base);
+        check_batch(tree, batch, id_last, n_past);
+        llama_batch_free(batch);
+
+        // the target model accepts the whole first branch and samples one more token
+        decode_tree(ctx_tgt, prompt, tree, id_last);
+
+        int leaf0 = -1;
+        for (int k = 0; k < tree.size(); ++k) {
+            if (tree.seqs[k] & 1) {
+                leaf0 = k;
+            }
+        }
+
+        check_accept(ctx_tgt, smpl, tree, llama_tokens(ref.begin(), ref.begin() + branch0.size() + 1), leaf0);
+
+        common_speculative_free(spec);
+    }
+
+    // a tree where the greedy continuation is on the second branch: the first two tokens are accepted and the third
+    // one does not match, so the sampled token is appended
+    {
+        const llama_token wrong0 = (ref[0] + 1) % n_vocab;
+        const llama_token wrong2 = (ref[2] + 1) % n_vocab;
+
+        common_speculative_tree tree;
+        tree.n_branch = 2;
+
+        const int k0 = tree.add(wrong0, -1);
+        const int k1 = tree.add(ref[0], -1);
+        const int k2 = tree.add(ref[1], k1);
+        const int k3 = tree.add(wrong2, k2);
+
+        tree.seqs[k0] = 1;
+        tree.seqs[k1] = tree.seqs[k2] = tree.seqs[k3] = 2;
+
+        check_tree(tree);
+
+        decode_tree(ctx_tgt, prompt, tree, id_last);
+
+        // the outputs of the branch are the same as those of the greedy decoding, so the masks keep the branches apart
+        assert(argmax(ctx_tgt, 1 + k1) == ref[1]);
+        assert(argmax(ctx_tgt, 1 + k2) == ref[2]);
+
+        check_accept(ctx_tgt, smpl, tree, { ref[0], ref[1], ref[2] }, k2);
+    }
+
+    // no child of the root matches: only the sampled token is accepted
+    {
+        common_speculative_tree tree;
+        tree.n_branch = 1;
+
+        tree.add((ref[0] + 1) % n_vocab, -1);
+        tree.seqs[0] = 1;
+
+        decode_tree(ctx_tgt, prompt, tree, id_last);
+
+        check_accept(ctx_tgt, smpl, tree, { ref[0] }, -1);
+    }
+
+    common_sampler_free(smpl);
+
+    llama_free(ctx_tgt);
+    llama_free(ctx_dft);
+    llama_model_free(model);
+
+    llama_backend_free();
+
+    printf("OK\n");
+
+    return 0;
+}
@@ -0,0 +1,161 @@
+// tests and microbenchmark for the lookup of the reusable draft context (common_speculative_find_prefix)
+//
+// usage: test-speculative [n_ctx]
+
+#include "speculative.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#undef NDEBUG
+#include <cassert>
+
+static int64_t time_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// the quadratic search that was used by common_speculative_gen_draft: the longest prefix of tgt in prompt, first occurrence
+static int32_t find_prefix_ref(const llama_tokens & prompt, const llama_tokens & tgt, int32_t & pos) {
+    int32_t best = 0;
+
+    pos = 0;
+
+    for (int32_t i = 0; i < (int32_t) prompt.size(); ++i) {
+        int32_t cur = 0;
+        while (cur < (int32_t) tgt.size() && i + cur < (int32_t) prompt.size() && tgt[cur] == prompt[i + cur]) {
+            cur++;
+        }
+
+        if (cur > best) {
+            best = cur;
+            pos  = i;
+        }
+    }
+
+    return best;
+}
+
+static llama_tokens random_tokens(std::mt19937 & rng, int n, int n_vocab) {
+    llama_tokens res(n);
+    for (auto & t : res) {
+        t = rng() % n_vocab;
+    }
+    return res;
+}
+
+// compare against the reference on random sequences over small vocabs, which have many repeated substrings
+static void test_find_prefix() {
+    std::mt19937 rng(42);
+
+    for (int it = 0; it < 20000; ++it) {
+        const int n_vocab = 1 + rng() % 6;
+
+        const llama_tokens prompt = random_tokens(rng, rng() % 200, n_vocab);
+
+        llama_tokens tgt;
+        switch (rng() % 3) {
+            case 0: // a continuation of the prompt with a cut at the front, as with a sliding context
+                {
+                    const int i0 = prompt.empty() ? 0 : rng() % prompt.size();
+                    tgt.assign(prompt.begin() + i0, prompt.end());
+                    for (auto t : random_tokens(rng, rng() % 16, n_vocab)) {
+                        tgt.push_back(t);
+                    }
+                } break;
+            case 1: // a different prompt
+                tgt = random_tokens(rng, rng() % 200, n_vocab + 1);
+                break;
+            default: // an edit in the middle of the prompt
+                {
+                    tgt = prompt;
+                    if (!tgt.empty()) {
+                        tgt[rng() % tgt.size()] = n_vocab;
+                    }
+                } break;
+        }
+
+        int32_t pos_ref = 0;
+        int32_t pos     = 0;
+
+        const int32_t n_ref = find_prefix_ref(prompt, tgt, pos_ref);
+        const int32_t n     = common_speculative_find_prefix(prompt, tgt.data(), tgt.size(), pos);
+
+        if (n != n_ref || pos != pos_ref) {
+            fprintf(stderr, "%s: mismatch at it = %d: n = %d (ref %d), pos = %d (ref %d)\n", __func__, it, n, n_ref, pos, pos_ref);
+            assert(false);
+        }
+
+        assert(n == 0 || std::equal(tgt.begin(), tgt.begin() + n, prompt.begin() + pos));
+    }
+}
+
+// time a single lookup of the reusable context with the quadratic search and with common_speculative_find_prefix
+static void bench_find_prefix(const char * name, const llama_tokens & prompt, const llama_tokens & tgt) {
+    int32_t pos_ref = 0;
+    int32_t pos     = 0;
+
+    const int64_t t_start_us = time_us();
+
+    const int32_t n_ref = find_prefix_ref(prompt, tgt, pos_ref);
+
+    const int64_t t_ref_us = time_us();
+
+    const int32_t n = common_speculative_find_prefix(prompt, tgt.data(), tgt.size(), pos);
+
+    const int64_t t_end_us = time_us();
+
+    assert(n == n_ref && pos == pos_ref);
+
+    printf("%s: %-10s n_ctx = %6d, reuse = %6d at %4d: quadratic %10.3f ms, linear %8.3f ms\n", __func__,
+            name, (int) prompt.size(), n, pos, 1e-3*(t_ref_us - t_start_us), 1e-3*(t_end_us - t_ref_us));
+}
+
+int main(int argc, char ** argv) {
+    int n_ctx = 16*1024;
+
+    if (argc > 1) {
+        n_ctx = std::atoi(argv[1]);
+    }
+
+    if (n_ctx < 64) {
+        fprintf(stderr, "%s: invalid arguments\n", argv[0]);
+        return 1;
+    }
+
+    test_find_prefix();
+
+    std::mt19937 rng(1234);
+
+    // text: the target window moved by a few tokens
+    {
+        const llama_tokens text = random_tokens(rng, n_ctx + 32, 32000);
+
+        const llama_tokens prompt(text.begin(),      text.begin() + n_ctx);
+        const llama_tokens tgt   (text.begin() + 32, text.end());
+
+        bench_find_prefix("text", prompt, tgt);
+    }
+
+    // repetitive content (e.g. padding or repeated lines) followed by an edit - the worst case of the quadratic search
+    {
+        llama_tokens text(n_ctx, 0);
+        for (int i = 0; i < n_ctx; ++i) {
+            text[i] = i % 4;
+        }
+
+        const llama_tokens prompt = text;
+
+        llama_tokens tgt(text.begin(), text.end() - 32);
+        tgt.push_back(4);
+
+        bench_find_prefix("repetitive", prompt, tgt);
+    }
+
+    printf("OK\n");
+
+    return 0;
+}
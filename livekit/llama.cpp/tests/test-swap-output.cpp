@@ -0,0 +1,163 @@
+// tests for the double-buffered outputs of llama_context (llama_context_params.swap_output): after a llama_decode(), the
+// outputs of the previous call must remain readable with llama_get_logits_prev_ith() / llama_get_embeddings_prev_ith()
+// and be equal to the outputs of that call
+//
+// usage: test-swap-output <model.gguf>
+
+#include "common.h"
+#include "get-model.h"
+
+#include <cstdio>
+#include <vector>
+
+#undef NDEBUG
+#include <cassert>
+
+static const int n_seq = 2;
+
+// the outputs of one llama_decode() call, by batch index (empty rows for the tokens without output)
+struct decode_outputs {
+    std::vector<std::vector<float>> logits;
+    std::vector<std::vector<float>> embd;
+};
+
+// n_tokens tokens for each of the sequences, starting at position pos - with output for the last token of each
+// sequence, and for every third token
+static llama_batch make_batch(int n_vocab, llama_pos pos, int n_tokens) {
+    llama_batch batch = llama_batch_init(n_seq*n_tokens, 0, 1);
+
+    for (int s = 0; s < n_seq; ++s) {
+        for (int i = 0; i < n_tokens; ++i) {
+            const llama_token id = 1 + (37*(pos + i) + 11*s) % (n_vocab - 1);
+            common_batch_add(batch, id, pos + i, { s }, i == n_tokens - 1 || i % 3 == 0);
+        }
+    }
+
+    return batch;
+}
+
+// reads the outputs of the last decode, or of the decode before it with prev == true
+static decode_outputs get_outputs(llama_context * ctx, const llama_batch & batch, bool embd, bool prev) {
+    const llama_model * model = llama_get_model(ctx);
+
+    const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(model));
+    const int n_embd  = llama_model_n_embd(model);
+
+    decode_outputs res;
+    res.logits.resize(batch.n_tokens);
+    res.embd  .resize(batch.n_tokens);
+
+    for (int i = 0; i < batch.n_tokens; ++i) {
+        // with embeddings, all the tokens are output
+        if (!batch.logits[i] && !embd) {
+            continue;
+        }
+
+        const float * logits = prev ? llama_get_logits_prev_ith(ctx, i) : llama_get_logits_ith(ctx, i);
+        assert(logits != nullptr);
+        res.logits[i].assign(logits, logits + n_vocab);
+
+        if (embd) {
+            const float * e = prev ? llama_get_embeddings_prev_ith(ctx, i) : llama_get_embeddings_ith(ctx, i);
+            assert(e != nullptr);
+            res.embd[i].assign(e, e + n_embd);
+        }
+    }
+
+    return res;
+}
+
+static void check_equal(const decode_outputs & a, const decode_outputs & b) {
+    assert(a.logits == b.logits);
+    assert(a.embd   == b.embd);
+}
+
+static void test_swap_output(llama_model * model, bool embd) {
+    const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(model));
+
+    auto cparams = llama_context_default_params();
+    cparams.n_ctx      = 256;
+    cparams.n_batch    = 64;
+    cparams.n_ubatch   = 64;
+    cparams.n_seq_max  = n_seq;
+    cparams.n_threads  = 4;
+    cparams.embeddings = embd;
+
+    llama_context * ctx_ref = llama_init_from_model(model, cparams);
+    assert(ctx_ref != nullptr);
+
+    cparams.swap_output = true;
+
+    llama_context * ctx = llama_init_from_model(model, cparams);
+    assert(ctx != nullptr);
+
+    // without double-buffering, there are no previous outputs
+    assert(llama_get_logits_prev_ith(ctx_ref, 0) == nullptr);
+
+    // a prompt followed by two steps of different sizes, so that the second buffer has to grow
+    const std::vector<int> n_tokens = { 10, 1, 4 };
+
+    std::vector<llama_batch>    batches;
+    std::vector<decode_outputs> ref;
+
+    llama_pos pos = 0;
+    for (int n : n_tokens) {
+        batches.push_back(make_batch(n_vocab, pos, n));
+        pos += n;
+
+        assert(llama_decode(ctx_ref, batches.back()) == 0);
+        ref.push_back(get_outputs(ctx_ref, batches.back(), embd, false));
+    }
+
+    for (size_t k = 0; k < batches.size(); ++k) {
+        assert(llama_decode(ctx, batches[k]) == 0);
+
+        // the outputs of the last decode are the same as without double-buffering
+        check_equal(get_outputs(ctx, batches[k], embd, false), ref[k]);
+
+        if (k == 0) {
+            // no decode before the first one
+            assert(llama_get_logits_prev_ith(ctx, 0) == nullptr);
+        } else {
+            // the outputs of the decode before the last one, with the indices of its batch
+            check_equal(get_outputs(ctx, batches[k - 1], embd, true), ref[k - 1]);
+
+            // the tokens of that batch without output
+            for (int i = 0; i < batches[k - 1].n_tokens && !embd; ++i) {
+                if (!batches[k - 1].logits[i]) {
+                    assert(llama_get_logits_prev_ith(ctx, i) == nullptr);
+                }
+            }
+        }
+    }
+
+    for (auto & batch : batches) {
+        llama_batch_free(batch);
+    }
+
+    llama_free(ctx);
+    llama_free(ctx_ref);
+
+    printf("%s: OK with embeddings = %d\n", __func__, embd);
+}
+
+int main(int argc, char ** argv) {
+    auto * model_path = get_model_or_exit(argc, argv);
+
+    llama_backend_init();
+
+    auto mparams = llama_model_default_params();
+    mparams.n_gpu_layers = 0;
+
+    llama_model * model = llama_model_load_from_file(model_path, mparams);
+    assert(model != nullptr);
+
+    test_swap_output(model, false);
+    test_swap_output(model, true);
+
+    llama_model_free(model);
+
+    llama_backend_free();
+
+    return 0;
+}
@@ -2,6 +2,7 @@
 #include "common.h"
 #include "console.h"
 
+#include <algorithm>
 #include <cstdio>
 #include <string>
 #include <map>
@@ -125,7 +126,7 @@ static llama_tests read_tests(const std::string & fname_inp, const std::string &
 
 int main(int argc, char **argv) {
     if (argc < 2) {
-        fprintf(stderr, "Usage: %s vocab-file [text-file]\n", argv[0]);
+        fprintf(stderr, "Usage: %s vocab-file [text-file | --bench]\n", argv[0]);
         return 1;
     }
 
@@ -135,8 +136,13 @@ int main(int argc, char **argv) {
     const std::string fname_out = fname + ".out";
 
     std::string fname_text;
+    bool bench = false;
     if (argc > 2) {
-        fname_text = argv[2];
+        if (std::string(argv[2]) == "--bench") {
+            bench = true;
+        } else {
+            fname_text = argv[2];
+        }
     }
 
     fprintf(stderr, "%s : reading vocab from: '%s'\n", __func__, fname.c_str());
@@ -300,6 +306,32 @@ int main(int argc, char **argv) {
         fprintf(stderr, "%s : tokens written to '%s'\n", __func__, (fname_text + ".tokcpp").c_str());
     }
 
+    // throughput over the test inputs, repeated to form a long text such as a large prompt
+    if (bench) {
+        std::string text;
+        while (text.size() < 4*1024*1024) {
+            for (const auto & test_kv : k_tests) {
+                text += test_kv.first;
+                text += "\n";
+            }
+        }
+
+        size_t n_tokens = 0;
+        double t_best   = 1e9;
+
+        for (int i = 0; i < 3; ++i) {
+            const auto t_start = ggml_time_us();
+
+            n_tokens = common_tokenize(ctx, text, add_special, false).size();
+
+            t_best = std::min(t_best, (ggml_time_us() - t_start) / 1e6);
+        }
+
+        printf("\n");
+        printf("%s : bench: %zu bytes, %zu tokens in %.3f ms, %.2f MB/s\n", __func__,
+                text.size(), n_tokens, t_best * 1000.0, text.size() / t_best / 1e6);
+    }
+
     llama_model_free(model);
     llama_free(ctx);
 
@@ -629,7 +629,9 @@ struct mtmd_tokenizer {
 
             // consider each mel_spec as a separate audio chunk
             // TODO: maybe support batching, but this may come with memory cost
-            for (auto & mel_spec : mel_spec_chunks) {
+            for (size_t i = 0; i < mel_spec_chunks.size(); ++i) {
+                auto & mel_spec = mel_spec_chunks[i];
+
                 clip_image_f32_ptr mel_f32(clip_image_f32_init());
                 mel_f32->nx  = mel_spec.n_len;
                 mel_f32->ny  = mel_spec.n_mel;
@@ -643,7 +645,7 @@ struct mtmd_tokenizer {
                 mtmd_audio_tokens_ptr audio_tokens(new mtmd_audio_tokens);
                 audio_tokens->n_tokens = n_tokens;
                 audio_tokens->batch_f32 = std::move(batch_f32);
-                audio_tokens->id = bitmap->id; // optional
+                audio_tokens->id = chunk_id(bitmap->id, i, mel_spec_chunks.size()); // optional
 
                 LOG_DBG("audio_tokens->n_tokens = %d\n", audio_tokens->n_tokens);
 
@@ -664,15 +666,28 @@ struct mtmd_tokenizer {
         return 0;
     }
 
+    // the chunks of a bitmap that is split into several chunks (image slices, audio segments) get distinct IDs,
+    // so that a chunk can be identified by its ID alone, also when the same bitmap appears several times in a prompt
+    static std::string chunk_id(const std::string & id, size_t idx, size_t n_chunks) {
+        if (id.empty() || n_chunks <= 1) {
+            return id;
+        }
+        return id + "/" + std::to_string(idx);
+    }
+
     std::vector<mtmd_input_chunk> split_batch_to_chunk(clip_image_f32_batch && batch_f32, const std::string & id) {
         std::vector<mtmd_input_chunk> chunks;
 
-        for (auto & entry : batch_f32.entries) {
+        const size_t n_entries = batch_f32.entries.size();
+
+        for (size_t i = 0; i < n_entries; ++i) {
+            auto & entry = batch_f32.entries[i];
+
             mtmd_image_tokens_ptr image_tokens(new mtmd_image_tokens);
             image_tokens->nx = clip_n_output_tokens(ctx->ctx_v, entry.get());
             image_tokens->ny = 1;
             image_tokens->batch_f32.entries.push_back(std::move(entry));
-            image_tokens->id = id;
+            image_tokens->id = chunk_id(id, i, n_entries);
 
             mtmd_input_chunk chunk{
                 MTMD_INPUT_CHUNK_TYPE_IMAGE,
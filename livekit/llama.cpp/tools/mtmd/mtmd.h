@@ -152,6 +152,8 @@ MTMD_API const llama_token *        mtmd_input_chunk_get_tokens_text (const mtmd
 MTMD_API const mtmd_image_tokens *  mtmd_input_chunk_get_tokens_image(const mtmd_input_chunk * chunk);
 MTMD_API size_t                     mtmd_input_chunk_get_n_tokens    (const mtmd_input_chunk * chunk);
 // returns nullptr for ID on text chunk
+// if the bitmap is split into several chunks (image slices, audio segments), the ID of each chunk is the ID of the
+// bitmap followed by "/" and the index of the chunk in the bitmap
 MTMD_API const char *               mtmd_input_chunk_get_id          (const mtmd_input_chunk * chunk);
 // number of temporal positions (always 1 for M-RoPE, n_tokens otherwise)
 MTMD_API llama_pos                  mtmd_input_chunk_get_n_pos       (const mtmd_input_chunk * chunk);
@@ -0,0 +1,120 @@
+#!/usr/bin/env python3
+# Load test for the llama-server task/result queues.
+#
+# Runs many concurrent streaming completion requests with a short generation against a running server and reports:
+#   - client side: time to first token and inter-token latency percentiles
+#   - server side: task queue wait percentiles from /metrics (requires --metrics)
+#
+# Example:
+#   llama-server -m model.gguf --parallel 16 --metrics
+#   python load.py --clients 64 --requests 1000 --n-predict 16
+from __future__ import annotations
+
+import argparse
+import json
+import re
+import threading
+import time
+
+import requests
+
+
+def percentile(values: list[float], p: float) -> float:
+    if not values:
+        return 0.0
+    values = sorted(values)
+    return values[min(len(values) - 1, int(p * len(values)))]
+
+
+def run_client(url: str, n_requests: int, n_predict: int, prompt: str, out: dict, lock: threading.Lock) -> None:
+    session = requests.Session()
+    ttft: list[float] = []
+    itl: list[float] = []
+    n_errors = 0
+
+    for _ in range(n_requests):
+        t_start = time.perf_counter()
+        t_last = None
+        try:
+            with session.post(f"{url}/completion", json={
+                "prompt": prompt,
+                "n_predict": n_predict,
+                "stream": True,
+                "cache_prompt": True,
+            }, stream=True, timeout=600) as res:
+                res.raise_for_status()
+                for line in res.iter_lines():
+                    if not line.startswith(b"data: "):
+                        continue
+                    t_now = time.perf_counter()
+                    if t_last is None:
+                        ttft.append(t_now - t_start)
+                    else:
+                        itl.append(t_now - t_last)
+                    t_last = t_now
+                    if json.loads(line[6:]).get("stop"):
+                        break
+        except requests.RequestException:
+            n_errors += 1
+
+    with lock:
+        out["ttft"] += ttft
+        out["itl"] += itl
+        out["errors"] += n_errors
+
+
+def scrape_metrics(url: str) -> dict[str, float]:
+    try:
+        res = requests.get(f"{url}/metrics", timeout=10)
+        res.raise_for_status()
+    except requests.RequestException:
+        return {}
+    metrics = {}
+    for line in res.text.splitlines():
+        m = re.match(r"^llamacpp:(\w+) ([-+.\deE]+|nan|inf)$", line)
+        if m:
+            metrics[m.group(1)] = float(m.group(2))
+    return metrics
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser(description="Load test of the llama-server task queue")
+    parser.add_argument("--url", type=str, help="Server URL", default="http://localhost:8080")
+    parser.add_argument("--clients", type=int, help="Number of concurrent clients", default=32)
+    parser.add_argument("--requests", type=int, help="Total number of requests", default=512)
+    parser.add_argument("--n-predict", type=int, help="Number of tokens to generate per request", default=16)
+    parser.add_argument("--prompt", type=str, help="Prompt of the requests", default="Write a haiku about the sea.")
+    args = parser.parse_args()
+
+    out = {"ttft": [], "itl": [], "errors": 0}
+    lock = threading.Lock()
+
+    n_per_client = max(1, args.requests // args.clients)
+
+    t_start = time.perf_counter()
+    threads = [threading.Thread(target=run_client, args=(args.url, n_per_client, args.n_predict, args.prompt, out, lock))
+               for _ in range(args.clients)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    t_total = time.perf_counter() - t_start
+
+    n_total = n_per_client * args.clients
+
+    print(f"requests: {n_total} ({out['errors']} errors) in {t_total:.2f} s, {n_total / t_total:.2f} req/s, {len(out['itl']) + len(out['ttft'])} tokens streamed")
+    for name, values in (("time to first token", out["ttft"]), ("inter-token latency", out["itl"])):
+        print(f"{name:>20}: p50 = {1e3 * percentile(values, 0.50):8.2f} ms, "
+              f"p90 = {1e3 * percentile(values, 0.90):8.2f} ms, p99 = {1e3 * percentile(values, 0.99):8.2f} ms")
+
+    metrics = scrape_metrics(args.url)
+    if "queue_wait_p50_ms" in metrics:
+        print(f"{'server queue wait':>20}: p50 = {metrics['queue_wait_p50_ms']:8.2f} ms, "
+              f"p90 = {metrics['queue_wait_p90_ms']:8.2f} ms, p99 = {metrics['queue_wait_p99_ms']:8.2f} ms "
+              f"(last 1024 of {int(metrics.get('queue_tasks_total', 0))} tasks)")
+    else:
+        print("server queue wait: not available, start the server with --metrics")
+
+
+if __name__ == "__main__":
+    main()
@@ -6,6 +6,7 @@
 #include "json-schema-to-grammar.h"
 #include "llama.h"
 #include "log.h"
+#include "ngram-cache.h"
 #include "sampling.h"
 #include "speculative.h"
 #include "mtmd.h"
@@ -18,12 +19,14 @@
 #include "index.html.gz.hpp"
 #include "loading.html.hpp"
 
+#include <array>
 #include <atomic>
 #include <chrono>
 #include <condition_variable>
 #include <cstddef>
 #include <cinttypes>
 #include <deque>
+#include <fstream>
 #include <memory>
 #include <mutex>
 #include <signal.h>
@@ -88,6 +91,34 @@ enum error_type {
     ERROR_TYPE_NOT_SUPPORTED, // custom error
 };
 
+// priority class of a request
+// deferred requests are admitted and prompts are processed in the order of their class, then in order of arrival
+enum server_priority {
+    SERVER_PRIORITY_HIGH,
+    SERVER_PRIORITY_NORMAL,
+    SERVER_PRIORITY_LOW,
+
+    SERVER_PRIORITY_COUNT,
+};
+
+static const char * server_priority_name(server_priority priority) {
+    switch (priority) {
+        case SERVER_PRIORITY_HIGH:   return "high";
+        case SERVER_PRIORITY_NORMAL: return "normal";
+        case SERVER_PRIORITY_LOW:    return "low";
+        default:                     return "unknown";
+    }
+}
+
+static server_priority server_priority_from_name(const std::string & name) {
+    for (int i = 0; i < SERVER_PRIORITY_COUNT; ++i) {
+        if (name == server_priority_name((server_priority) i)) {
+            return (server_priority) i;
+        }
+    }
+    throw std::runtime_error("Invalid priority: \"" + name + "\", must be one of: high, normal, low");
+}
+
 static bool server_task_type_need_embd(server_task_type task_type) {
     switch (task_type) {
         case SERVER_TASK_TYPE_EMBEDDING:
@@ -121,6 +152,8 @@ struct slot_params {
     int64_t t_max_prompt_ms  = -1; // TODO: implement
     int64_t t_max_predict_ms = -1; // if positive, limit the generation phase to this time limit
 
+    server_priority priority = SERVER_PRIORITY_NORMAL;
+
     std::vector<common_adapter_lora_info> lora;
 
     std::vector<std::string> antiprompt;
@@ -186,6 +219,7 @@ struct slot_params {
             {"max_tokens",                n_predict}, // User configured n_predict
             {"n_keep",                    n_keep},
             {"n_discard",                 n_discard},
+            {"priority",                  server_priority_name(priority)},
             {"ignore_eos",                sampling.ignore_eos},
             {"stream",                    stream},
             {"logit_bias",                format_logit_bias(sampling.logit_bias)},
@@ -203,6 +237,9 @@ struct slot_params {
             {"speculative.n_max",         speculative.n_max},
             {"speculative.n_min",         speculative.n_min},
             {"speculative.p_min",         speculative.p_min},
+            {"speculative.n_branch",      speculative.n_branch},
+            {"speculative.p_split",       speculative.p_split},
+            {"speculative.lookup",        speculative.lookup},
             {"timings_per_token",         timings_per_token},
             {"post_sampling_probs",       post_sampling_probs},
             {"lora",                      lora},
@@ -224,6 +261,9 @@ struct server_task {
     server_tokens prompt_tokens;
     int id_selected_slot = -1;
 
+    // time the task was created, used for the queue wait and time-to-first-token metrics
+    int64_t t_created = ggml_time_us();
+
     // used by SERVER_TASK_TYPE_SLOT_SAVE, SERVER_TASK_TYPE_SLOT_RESTORE, SERVER_TASK_TYPE_SLOT_ERASE
     struct slot_action {
         int slot_id;
@@ -269,6 +309,7 @@ struct server_task {
       //params.t_max_prompt_ms  = json_value(data, "t_max_prompt_ms",    defaults.t_max_prompt_ms); // TODO: implement
         params.t_max_predict_ms = json_value(data, "t_max_predict_ms",   defaults.t_max_predict_ms);
         params.response_fields  = json_value(data, "response_fields",   std::vector<std::string>());
+        params.priority         = server_priority_from_name(json_value(data, "priority", std::string(server_priority_name(defaults.priority))));
 
         params.sampling.top_k              = json_value(data, "top_k",              defaults.sampling.top_k);
         params.sampling.top_p              = json_value(data, "top_p",              defaults.sampling.top_p);
@@ -300,10 +341,19 @@ struct server_task {
         params.speculative.n_max = json_value(data, "speculative.n_max", defaults.speculative.n_max);
         params.speculative.p_min = json_value(data, "speculative.p_min", defaults.speculative.p_min);
 
+        params.speculative.n_branch = json_value(data, "speculative.n_branch", defaults.speculative.n_branch);
+        params.speculative.p_split  = json_value(data, "speculative.p_split",  defaults.speculative.p_split);
+
+        params.speculative.lookup = json_value(data, "speculative.lookup", defaults.speculative.lookup);
+
         params.speculative.n_min = std::min(params.speculative.n_max, params.speculative.n_min);
         params.speculative.n_min = std::max(params.speculative.n_min, 0);
         params.speculative.n_max = std::max(params.speculative.n_max, 0);
 
+        // the sequences for the draft branches are reserved when the server starts
+        params.speculative.n_branch = std::min(params.speculative.n_branch, defaults.speculative.n_branch);
+        params.speculative.n_branch = std::max(params.speculative.n_branch, 1);
+
         // Use OpenAI API logprobs only if n_probs wasn't provided
         if (data.contains("logprobs") && params.sampling.n_probs == defaults.sampling.n_probs){
             params.sampling.n_probs = json_value(data, "logprobs", defaults.sampling.n_probs);
@@ -530,6 +580,7 @@ struct result_timings {
     // Optional speculative metrics - only included when > 0
     int32_t draft_n = 0;
     int32_t draft_n_accepted = 0;
+    int32_t draft_n_steps = 0;
 
     json to_json() const {
         json base = {
@@ -547,6 +598,8 @@ struct result_timings {
         if (draft_n > 0) {
             base["draft_n"] = draft_n;
             base["draft_n_accepted"] = draft_n_accepted;
+            base["draft_n_steps"] = draft_n_steps;
+            base["draft_accept_len"] = (double) draft_n_accepted / draft_n_steps;
         }
 
         return base;
@@ -1159,6 +1212,30 @@ struct server_task_result_metrics : server_task_result {
     uint64_t n_decode_total     = 0;
     uint64_t n_busy_slots_total = 0;
 
+    uint64_t n_prompt_cache_hit        = 0;
+    uint64_t n_prompt_cache_miss       = 0;
+    uint64_t n_prompt_cache_tokens_hit = 0;
+    uint64_t n_prompt_cache_evicted    = 0;
+    int32_t  n_prompt_cache_cells      = 0;
+    int32_t  n_prompt_cache_entries    = 0;
+
+    uint64_t n_mtmd_cache_hit     = 0;
+    uint64_t n_mtmd_cache_miss    = 0;
+    uint64_t n_mtmd_cache_evicted = 0;
+    uint64_t n_mtmd_cache_bytes   = 0;
+
+    // time the recent client tasks waited before they started on a slot
+    uint64_t n_queue_wait_total = 0;
+    double   t_queue_wait_p50   = 0.0;
+    double   t_queue_wait_p90   = 0.0;
+    double   t_queue_wait_p99   = 0.0;
+
+    // per priority class, see server_metrics
+    std::array<uint64_t, SERVER_PRIORITY_COUNT> n_started_class     = {};
+    std::array<uint64_t, SERVER_PRIORITY_COUNT> t_queue_wait_class  = {};
+    std::array<uint64_t, SERVER_PRIORITY_COUNT> n_first_token_class = {};
+    std::array<uint64_t, SERVER_PRIORITY_COUNT> t_first_token_class = {};
+
     // while we can also use std::vector<server_slot> this requires copying the slot object which can be quite messy
     // therefore, we use json to temporarily store the slot.to_json() result
     json slots_data = json::array();
@@ -1183,6 +1260,28 @@ struct server_task_result_metrics : server_task_result {
             { "n_decode_total",                  n_decode_total },
             { "n_busy_slots_total",              n_busy_slots_total },
 
+            { "n_prompt_cache_hit",              n_prompt_cache_hit },
+            { "n_prompt_cache_miss",             n_prompt_cache_miss },
+            { "n_prompt_cache_tokens_hit",       n_prompt_cache_tokens_hit },
+            { "n_prompt_cache_evicted",          n_prompt_cache_evicted },
+            { "n_prompt_cache_cells",            n_prompt_cache_cells },
+            { "n_prompt_cache_entries",          n_prompt_cache_entries },
+
+            { "n_mtmd_cache_hit",                n_mtmd_cache_hit },
+            { "n_mtmd_cache_miss",               n_mtmd_cache_miss },
+            { "n_mtmd_cache_evicted",            n_mtmd_cache_evicted },
+            { "n_mtmd_cache_bytes",              n_mtmd_cache_bytes },
+
+            { "n_queue_wait_total",              n_queue_wait_total },
+            { "t_queue_wait_p50",                t_queue_wait_p50 },
+            { "t_queue_wait_p90",                t_queue_wait_p90 },
+            { "t_queue_wait_p99",                t_queue_wait_p99 },
+
+            { "n_started_class",                 n_started_class },
+            { "t_queue_wait_class",              t_queue_wait_class },
+            { "n_first_token_class",             n_first_token_class },
+            { "t_first_token_class",             t_first_token_class },
+
             { "slots",                           slots_data },
         };
     }
@@ -1255,6 +1354,13 @@ struct server_slot {
 
     common_speculative * spec = nullptr;
 
+    // first of the speculative.n_branch sequences used to verify draft trees
+    llama_seq_id seq_id_spec = -1;
+
+    // prompt lookup decoding: n-grams of the tokens in lookup_tokens
+    common_ngram_cache ngram_cache_lookup;
+    llama_tokens       lookup_tokens;
+
     std::vector<common_adapter_lora_info> lora;
 
     // the index relative to completion multi-task request
@@ -1312,6 +1418,7 @@ struct server_slot {
     // stats
     size_t n_sent_text        = 0; // number of sent text character
 
+    int64_t t_task_created = 0; // creation time of the current task
     int64_t t_start_process_prompt;
     int64_t t_start_generation;
 
@@ -1323,6 +1430,7 @@ struct server_slot {
     // Speculative decoding stats
     int32_t n_draft_total = 0;      // Total draft tokens generated
     int32_t n_draft_accepted = 0;   // Draft tokens actually accepted
+    int32_t n_draft_steps = 0;      // Number of drafts verified by the target model
 
     void reset() {
         SLT_DBG(*this, "%s", "\n");
@@ -1348,6 +1456,7 @@ struct server_slot {
         // clear speculative decoding stats
         n_draft_total = 0;
         n_draft_accepted = 0;
+        n_draft_steps = 0;
     }
 
     bool need_embd() const {
@@ -1391,7 +1500,36 @@ struct server_slot {
     }
 
     bool can_speculate() const {
-        return ctx_dft && params.speculative.n_max > 0 && params.cache_prompt;
+        return (ctx_dft || (params.speculative.lookup && !mctx)) && params.speculative.n_max > 0 && params.cache_prompt;
+    }
+
+    // draft from the n-grams of the slot context, validated with the static n-gram cache
+    llama_tokens gen_draft_lookup(llama_token id, int n_draft, common_ngram_cache & nc_static) {
+        const llama_tokens & tokens = cache_tokens.get_text_tokens();
+
+        // the n-gram cache can only be appended to - rebuild it if the context of the slot has changed
+        if (lookup_tokens.size() > tokens.size() || !std::equal(lookup_tokens.begin(), lookup_tokens.end(), tokens.begin())) {
+            ngram_cache_lookup.clear();
+            lookup_tokens.clear();
+        }
+
+        const size_t n_old = lookup_tokens.size();
+
+        // id is the last sampled token - it will be the next token of the context
+        lookup_tokens.insert(lookup_tokens.end(), tokens.begin() + n_old, tokens.end());
+        lookup_tokens.push_back(id);
+
+        common_ngram_cache_update(ngram_cache_lookup, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, lookup_tokens, lookup_tokens.size() - n_old, false);
+
+        llama_tokens draft = { id };
+
+        // there is no dynamic cache of the previous generations
+        common_ngram_cache nc_dynamic;
+        common_ngram_cache_draft(lookup_tokens, draft, n_draft, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, ngram_cache_lookup, nc_dynamic, nc_static);
+
+        draft.erase(draft.begin());
+
+        return draft;
     }
 
     void add_token(const completion_token_output & token) {
@@ -1429,6 +1567,7 @@ struct server_slot {
         if (n_draft_total > 0) {
             timings.draft_n = n_draft_total;
             timings.draft_n_accepted = n_draft_accepted;
+            timings.draft_n_steps = n_draft_steps;
         }
 
         return timings;
@@ -1496,10 +1635,13 @@ struct server_slot {
 
         if (n_draft_total > 0) {
             const float draft_ratio = (float) n_draft_accepted / n_draft_total;
+            const float draft_len   = (float) n_draft_accepted / n_draft_steps;
             SLT_INF(*this,
                     "\n"
-                    "draft acceptance rate = %0.5f (%5d accepted / %5d generated)\n",
-                    draft_ratio, n_draft_accepted, n_draft_total
+                    "draft acceptance rate = %0.5f (%5d accepted / %5d generated)\n"
+                    "draft acceptance len  = %7.3f (%5d accepted / %5d steps)\n",
+                    draft_ratio, n_draft_accepted, n_draft_total,
+                    draft_len,   n_draft_accepted, n_draft_steps
             );
         }
     }
@@ -1543,6 +1685,13 @@ struct server_metrics {
     uint64_t n_decode_total     = 0;
     uint64_t n_busy_slots_total = 0;
 
+    // per priority class: number of started requests and their total queue wait, number of first tokens and the
+    // total time to first token (both measured from the creation of the task, in microseconds)
+    uint64_t n_started_class    [SERVER_PRIORITY_COUNT] = {};
+    uint64_t t_queue_wait_class [SERVER_PRIORITY_COUNT] = {};
+    uint64_t n_first_token_class[SERVER_PRIORITY_COUNT] = {};
+    uint64_t t_first_token_class[SERVER_PRIORITY_COUNT] = {};
+
     void init() {
         t_start = ggml_time_us();
     }
@@ -1561,6 +1710,16 @@ struct server_metrics {
         t_tokens_generation_total  += slot.t_token_generation;
     }
 
+    void on_started(const server_slot & slot) {
+        n_started_class   [slot.params.priority]++;
+        t_queue_wait_class[slot.params.priority] += ggml_time_us() - slot.t_task_created;
+    }
+
+    void on_first_token(const server_slot & slot) {
+        n_first_token_class[slot.params.priority]++;
+        t_first_token_class[slot.params.priority] += slot.t_start_generation - slot.t_task_created;
+    }
+
     void on_decoded(const std::vector<server_slot> & slots) {
         n_decode_total++;
         for (const auto & slot : slots) {
@@ -1578,14 +1737,348 @@ struct server_metrics {
     }
 };
 
+// prompt cache shared by all slots
+// each cached prompt is kept in the KV cache under its own sequence id (one of the extra sequences after the slots)
+// a radix tree over the cached token sequences is used to find the longest cached prefix of a new prompt, which is
+// then copied into the slot sequence with llama_memory_seq_cp (the cells are shared, no data is copied)
+// the cells computed with other LoRA adapters cannot be reused, so there is one tree per set of adapters
+struct server_prompt_cache {
+    struct entry {
+        llama_seq_id seq_id;
+        llama_tokens tokens;
+
+        std::vector<common_adapter_lora_info> lora;
+
+        int64_t t_last_used = -1;
+    };
+
+    struct node {
+        llama_tokens edge; // tokens on the edge from the parent to this node
+
+        int32_t i_entry = -1; // index of an entry that contains the full path up to this node
+
+        std::unordered_map<llama_token, std::unique_ptr<node>> children;
+    };
+
+    struct tree {
+        std::vector<common_adapter_lora_info> lora;
+
+        node root;
+    };
+
+    llama_memory_t mem = nullptr;
+
+    int32_t n_cells_max = 0;
+    int32_t n_cells     = 0; // sum of the tokens of all entries
+
+    std::vector<entry> entries; // entries with empty tokens are free
+
+    std::vector<tree> trees;
+
+    // stats
+    uint64_t n_hit          = 0;
+    uint64_t n_miss         = 0;
+    uint64_t n_tokens_hit   = 0;
+    uint64_t n_evicted      = 0;
+
+    void init(llama_memory_t mem, llama_seq_id seq_id_start, int32_t n_seqs, int32_t n_cells_max) {
+        this->mem         = mem;
+        this->n_cells_max = n_cells_max;
+
+        entries.resize(n_seqs);
+        for (int32_t i = 0; i < n_seqs; ++i) {
+            entries[i].seq_id = seq_id_start + i;
+        }
+    }
+
+    bool enabled() const {
+        return mem != nullptr && n_cells_max > 0;
+    }
+
+    int32_t n_entries() const {
+        int32_t res = 0;
+        for (const auto & e : entries) {
+            res += !e.tokens.empty();
+        }
+        return res;
+    }
+
+    // find the longest cached prefix of tokens
+    // returns the length of the prefix and the sequence that holds it in the KV cache
+    int32_t find(const llama_tokens & tokens, const std::vector<common_adapter_lora_info> & lora, llama_seq_id & seq_id) {
+        const node * root = tree_root(lora);
+        if (root == nullptr) {
+            return 0;
+        }
+
+        int32_t i_entry = -1;
+
+        const int32_t n_match = walk(*root, tokens, i_entry);
+
+        if (i_entry < 0 || n_match == 0) {
+            return 0;
+        }
+
+        entries[i_entry].t_last_used = ggml_time_us();
+
+        seq_id = entries[i_entry].seq_id;
+
+        return n_match;
+    }
+
+    // store the first n_tokens of the sequence seq_src
+    void insert(llama_seq_id seq_src, const llama_tokens & tokens, const std::vector<common_adapter_lora_info> & lora) {
+        const int32_t n_tokens = tokens.size();
+
+        if (n_tokens == 0 || n_tokens > n_cells_max) {
+            return;
+        }
+
+        const node * root = tree_root(lora);
+
+        int32_t i_entry = -1;
+
+        const int32_t n_match = root ? walk(*root, tokens, i_entry) : 0;
+
+        if (i_entry >= 0 && n_match == n_tokens) {
+            // already cached
+            entries[i_entry].t_last_used = ggml_time_us();
+            return;
+        }
+
+        if (i_entry >= 0 && n_match == (int32_t) entries[i_entry].tokens.size()) {
+            // the cached entry is a prefix of the new tokens - extend it with the cells of the source sequence
+            if (!reserve(n_tokens - n_match, i_entry)) {
+                return;
+            }
+
+            auto & e = entries[i_entry];
+
+            llama_memory_seq_cp(mem, seq_src, e.seq_id, n_match, n_tokens);
+
+            n_cells += n_tokens - n_match;
+
+            e.tokens      = tokens;
+            e.t_last_used = ggml_time_us();
+
+            tree_insert(e.tokens, e.lora, i_entry);
+
+            return;
+        }
+
+        if (!reserve(n_tokens, -1)) {
+            return;
+        }
+
+        i_entry = -1;
+        for (int32_t i = 0; i < (int32_t) entries.size(); ++i) {
+            if (entries[i].tokens.empty()) {
+                i_entry = i;
+                break;
+            }
+        }
+        GGML_ASSERT(i_entry >= 0);
+
+        auto & e = entries[i_entry];
+
+        llama_memory_seq_rm(mem, e.seq_id, -1, -1);
+        llama_memory_seq_cp(mem, seq_src, e.seq_id, 0, n_tokens);
+
+        n_cells += n_tokens;
+
+        e.tokens      = tokens;
+        e.lora        = lora;
+        e.t_last_used = ggml_time_us();
+
+        tree_insert(e.tokens, e.lora, i_entry);
+    }
+
+    // drop all entries, used when the KV cache is cleared or when we run out of space in it
+    void clear() {
+        for (auto & e : entries) {
+            if (!e.tokens.empty()) {
+                llama_memory_seq_rm(mem, e.seq_id, -1, -1);
+                e.tokens.clear();
+                e.lora.clear();
+            }
+        }
+
+        n_cells = 0;
+
+        trees.clear();
+    }
+
+private:
+    // make room for n_tokens more cells and a free entry (unless i_keep >= 0) by evicting the least recently used entries
+    bool reserve(int32_t n_tokens, int32_t i_keep) {
+        bool evicted = false;
+
+        while (true) {
+            const bool has_free = i_keep >= 0 || n_entries() < (int32_t) entries.size();
+
+            if (has_free && n_cells + n_tokens <= n_cells_max) {
+                break;
+            }
+
+            int32_t i_lru = -1;
+            for (int32_t i = 0; i < (int32_t) entries.size(); ++i) {
+                if (i == i_keep || entries[i].tokens.empty()) {
+                    continue;
+                }
+                if (i_lru < 0 || entries[i].t_last_used < entries[i_lru].t_last_used) {
+                    i_lru = i;
+                }
+            }
+
+            if (i_lru < 0) {
+                return false;
+            }
+
+            auto & e = entries[i_lru];
+
+            SRV_DBG("prompt cache: evicting seq_id = %d, n_tokens = %d\n", e.seq_id, (int) e.tokens.size());
+
+            llama_memory_seq_rm(mem, e.seq_id, -1, -1);
+
+            n_cells -= e.tokens.size();
+
+            e.tokens.clear();
+            e.lora.clear();
+
+            n_evicted++;
+            evicted = true;
+        }
+
+        if (evicted) {
+            tree_rebuild();
+        }
+
+        return true;
+    }
+
+    // the root of the tree of the entries with the given LoRA adapters, nullptr if there is none
+    node * tree_root(const std::vector<common_adapter_lora_info> & lora) {
+        for (auto & t : trees) {
+            if (are_lora_equal(t.lora, lora)) {
+                return &t.root;
+            }
+        }
+        return nullptr;
+    }
+
+    // walk the tree along tokens, return the number of matched tokens and the entry that contains them
+    int32_t walk(const node & root, const llama_tokens & tokens, int32_t & i_entry) const {
+        const node * cur = &root;
+
+        int32_t n_match = 0;
+
+        i_entry = -1;
+
+        while (n_match < (int32_t) tokens.size()) {
+            const auto it = cur->children.find(tokens[n_match]);
+            if (it == cur->children.end()) {
+                break;
+            }
+
+            const node * child = it->second.get();
+
+            // any entry that reaches the child contains the full edge, so a partial match is also usable
+            i_entry = child->i_entry;
+
+            size_t i = 0;
+            while (i < child->edge.size() && n_match < (int32_t) tokens.size() && child->edge[i] == tokens[n_match]) {
+                i++;
+                n_match++;
+            }
+
+            if (i < child->edge.size()) {
+                break;
+            }
+
+            cur = child;
+        }
+
+        return n_match;
+    }
+
+    void tree_insert(const llama_tokens & tokens, const std::vector<common_adapter_lora_info> & lora, int32_t i_entry) {
+        node * cur = tree_root(lora);
+        if (cur == nullptr) {
+            trees.push_back({ lora, {} });
+            cur = &trees.back().root;
+        }
+
+        size_t pos = 0;
+
+        while (pos < tokens.size()) {
+            auto it = cur->children.find(tokens[pos]);
+            if (it == cur->children.end()) {
+                auto child = std::make_unique<node>();
+                child->edge.assign(tokens.begin() + pos, tokens.end());
+                child->i_entry = i_entry;
+
+                cur->children.emplace(tokens[pos], std::move(child));
+                return;
+            }
+
+            node * child = it->second.get();
+
+            size_t i = 0;
+            while (i < child->edge.size() && pos + i < tokens.size() && child->edge[i] == tokens[pos + i]) {
+                i++;
+            }
+
+            if (i < child->edge.size()) {
+                // split the edge at i
+                auto mid = std::make_unique<node>();
+                mid->edge.assign(child->edge.begin(), child->edge.begin() + i);
+                mid->i_entry = i_entry;
+
+                std::unique_ptr<node> old = std::move(it->second);
+                old->edge.erase(old->edge.begin(), old->edge.begin() + i);
+
+                const llama_token key = old->edge[0];
+                mid->children.emplace(key, std::move(old));
+
+                it->second = std::move(mid);
+                child = it->second.get();
+            } else {
+                child->i_entry = i_entry;
+            }
+
+            pos += i;
+            cur  = child;
+        }
+    }
+
+    void tree_rebuild() {
+        trees.clear();
+
+        for (int32_t i = 0; i < (int32_t) entries.size(); ++i) {
+            if (!entries[i].tokens.empty()) {
+                tree_insert(entries[i].tokens, entries[i].lora, i);
+            }
+        }
+    }
+};
+
 struct server_queue {
-    int id = 0;
-    bool running;
+    std::atomic<int>  id      = 0;
+    std::atomic<bool> running = false;
 
     // queues
+    // note: these are owned by the main loop and must only be accessed from the thread running start_loop()
     std::deque<server_task> queue_tasks;
     std::deque<server_task> queue_tasks_deferred;
 
+    // time that the recent client tasks waited from their creation until they started on a slot,
+    // including the time spent in queue_tasks_deferred (ring buffer, main loop only)
+    static constexpr size_t n_wait_samples = 1024;
+
+    std::vector<int64_t> t_wait_us;
+    uint64_t             n_wait_total = 0;
+
+    // used only to put the main loop to sleep when there is nothing to do
     std::mutex mutex_tasks;
     std::condition_variable condition_tasks;
 
@@ -1593,60 +2086,59 @@ struct server_queue {
     std::function<void(server_task &&)> callback_new_task;
     std::function<void(void)>           callback_update_slots;
 
+    ~server_queue() {
+        task_node * node = incoming.exchange(nullptr);
+        while (node) {
+            task_node * next = node->next;
+            delete node;
+            node = next;
+        }
+    }
+
     // Add a new task to the end of the queue
+    // thread-safe and lock-free, the task is moved into the main queue on the next iteration of the main loop
     int post(server_task && task, bool front = false) {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
         GGML_ASSERT(task.id != -1);
-        // if this is cancel task make sure to clean up pending tasks
-        if (task.type == SERVER_TASK_TYPE_CANCEL) {
-            cleanup_pending_task(task.id_target);
-        }
         const int task_id = task.id;
         QUE_DBG("new task, id = %d, front = %d\n", task_id, front);
-        if (front) {
-            queue_tasks.push_front(std::move(task));
-        } else {
-            queue_tasks.push_back(std::move(task));
-        }
-        condition_tasks.notify_one();
+        task_node * node = new task_node { std::move(task), front, nullptr };
+        push(node, node);
         return task_id;
     }
 
     // multi-task version of post()
+    // the tasks are published together, so they are never interleaved with tasks from other threads
     int post(std::vector<server_task> && tasks, bool front = false) {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
+        if (tasks.empty()) {
+            return 0;
+        }
+        // the list is LIFO, so link the tasks in reverse order
+        task_node * first = nullptr;
+        task_node * last  = nullptr;
         for (auto & task : tasks) {
             if (task.id == -1) {
                 task.id = id++;
             }
-            // if this is cancel task make sure to clean up pending tasks
-            if (task.type == SERVER_TASK_TYPE_CANCEL) {
-                cleanup_pending_task(task.id_target);
-            }
             QUE_DBG("new task, id = %d/%d, front = %d\n", task.id, (int) tasks.size(), front);
-            if (front) {
-                queue_tasks.push_front(std::move(task));
-            } else {
-                queue_tasks.push_back(std::move(task));
+            first = new task_node { std::move(task), front, first };
+            if (last == nullptr) {
+                last = first;
             }
         }
-        condition_tasks.notify_one();
+        push(first, last);
         return 0;
     }
 
     // Add a new task, but defer until one slot is available
+    // note: call only from the main loop
     void defer(server_task && task) {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
         QUE_DBG("defer task, id = %d\n", task.id);
         queue_tasks_deferred.push_back(std::move(task));
-        condition_tasks.notify_one();
     }
 
     // Get the next id for creating a new task
     int get_new_id() {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        int new_id = id++;
-        return new_id;
+        return id++;
     }
 
     // Register function to process a new task
@@ -1660,22 +2152,71 @@ struct server_queue {
     }
 
     // Call when the state of one slot is changed, it will move one task from deferred to main queue
+    // the task with the highest priority is moved first, tasks of the same priority are moved in order of arrival
+    // note: call only from the main loop
     void pop_deferred_task() {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        if (!queue_tasks_deferred.empty()) {
-            queue_tasks.emplace_back(std::move(queue_tasks_deferred.front()));
-            queue_tasks_deferred.pop_front();
+        if (queue_tasks_deferred.empty()) {
+            return;
+        }
+        auto best = queue_tasks_deferred.begin();
+        for (auto it = best + 1; it != queue_tasks_deferred.end(); ++it) {
+            if (it->params.priority < best->params.priority) {
+                best = it;
+            }
+        }
+        queue_tasks.emplace_back(std::move(*best));
+        queue_tasks_deferred.erase(best);
+    }
+
+    // remove the deferred tasks that were created more than t_max_us ago and pass them to the callback
+    // note: call only from the main loop
+    void expire_deferred_tasks(int64_t t_max_us, const std::function<void(const server_task &)> & callback) {
+        const int64_t t_now_us = ggml_time_us();
+        for (auto it = queue_tasks_deferred.begin(); it != queue_tasks_deferred.end(); ) {
+            if (t_now_us - it->t_created > t_max_us) {
+                QUE_DBG("deferred task expired, id = %d\n", it->id);
+                callback(*it);
+                it = queue_tasks_deferred.erase(it);
+            } else {
+                ++it;
+            }
         }
-        condition_tasks.notify_one();
     }
 
     // end the start_loop routine
     void terminate() {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
         running = false;
+
+        std::unique_lock<std::mutex> lock(mutex_tasks);
         condition_tasks.notify_all();
     }
 
+    // record the wait time of a task that has just started on a slot
+    // note: call only from the main loop
+    void add_wait_sample(int64_t t_wait) {
+        if (t_wait_us.size() < n_wait_samples) {
+            t_wait_us.push_back(t_wait);
+        } else {
+            t_wait_us[n_wait_total % n_wait_samples] = t_wait;
+        }
+        n_wait_total++;
+    }
+
+    // the p-th percentile of the recent queue wait times, in milliseconds
+    // note: call only from the main loop
+    double get_wait_ms(double p) const {
+        if (t_wait_us.empty()) {
+            return 0.0;
+        }
+
+        std::vector<int64_t> tmp = t_wait_us;
+
+        const size_t k = std::min(tmp.size() - 1, (size_t) (p*tmp.size()));
+        std::nth_element(tmp.begin(), tmp.begin() + k, tmp.end());
+
+        return 1e-3*tmp[k];
+    }
+
     /**
      * Main loop consists of these steps:
      * - Wait until a new task arrives
@@ -1690,18 +2231,16 @@ struct server_queue {
             QUE_DBG("%s", "processing new tasks\n");
 
             while (true) {
-                std::unique_lock<std::mutex> lock(mutex_tasks);
                 if (!running) {
                     QUE_DBG("%s", "terminate\n");
                     return;
                 }
+                drain();
                 if (queue_tasks.empty()) {
-                    lock.unlock();
                     break;
                 }
                 server_task task = std::move(queue_tasks.front());
                 queue_tasks.pop_front();
-                lock.unlock();
 
                 QUE_DBG("processing task, id = %d\n", task.id);
                 callback_new_task(std::move(task));
@@ -1714,23 +2253,80 @@ struct server_queue {
 
             QUE_DBG("%s", "waiting for new tasks\n");
             {
-                std::unique_lock<std::mutex> lock(mutex_tasks);
                 if (!running) {
                     QUE_DBG("%s", "terminate\n");
                     return;
                 }
                 if (queue_tasks.empty()) {
+                    std::unique_lock<std::mutex> lock(mutex_tasks);
+                    sleeping = true;
                     condition_tasks.wait(lock, [&]{
-                        return (!queue_tasks.empty() || !running);
+                        return (incoming.load() != nullptr || !running);
                     });
+                    sleeping = false;
                 }
             }
         }
     }
 
 private:
+    // tasks posted by the HTTP threads, not yet seen by the main loop
+    // this is a lock-free LIFO list (Treiber stack) that the main loop takes as a whole and reverses
+    struct task_node {
+        server_task task;
+        bool        front;
+        task_node * next;
+    };
+
+    std::atomic<task_node *> incoming = nullptr;
+
+    // true while the main loop waits on condition_tasks
+    std::atomic<bool> sleeping = false;
+
+    // publish the chain of nodes [first, last]
+    void push(task_node * first, task_node * last) {
+        last->next = incoming.load();
+        while (!incoming.compare_exchange_weak(last->next, first)) {
+            // last->next is updated with the current head
+        }
+
+        // the main loop sets "sleeping" before checking "incoming", so either it sees the new tasks or we see it sleeping
+        if (sleeping) {
+            std::unique_lock<std::mutex> lock(mutex_tasks);
+            condition_tasks.notify_one();
+        }
+    }
+
+    // move the posted tasks into the main queue, in the order they were posted
+    void drain() {
+        task_node * node = incoming.exchange(nullptr);
+
+        task_node * fifo = nullptr;
+        while (node) {
+            task_node * next = node->next;
+            node->next = fifo;
+            fifo = node;
+            node = next;
+        }
+
+        while (fifo) {
+            std::unique_ptr<task_node> cur(fifo);
+            fifo = fifo->next;
+
+            // if this is cancel task make sure to clean up pending tasks
+            if (cur->task.type == SERVER_TASK_TYPE_CANCEL) {
+                cleanup_pending_task(cur->task.id_target);
+            }
+            if (cur->front) {
+                queue_tasks.push_front(std::move(cur->task));
+            } else {
+                queue_tasks.push_back(std::move(cur->task));
+            }
+        }
+    }
+
     void cleanup_pending_task(int id_target) {
-        // no need lock because this is called exclusively by post()
+        // no need lock because this is called exclusively by the main loop
         auto rm_func = [id_target](const server_task & task) {
             return task.id_target == id_target;
         };
@@ -1744,106 +2340,137 @@ private:
 };
 
 struct server_response {
-    bool running = true;
+    std::atomic<bool> running = true;
 
-    // for keeping track of all tasks waiting for the result
-    std::unordered_set<int> waiting_task_ids;
+    // the results of the tasks of one request
+    // each HTTP thread waits only on the channel of its own request, so it wakes up only for its own results
+    struct channel {
+        std::mutex mutex;
+        std::condition_variable condition;
 
-    // the main result queue (using ptr for polymorphism)
-    std::vector<server_task_result_ptr> queue_results;
+        std::deque<server_task_result_ptr> results;
+    };
+
+    using channel_ptr = std::shared_ptr<channel>;
+
+    // for keeping track of all tasks waiting for the result
+    // tasks added together with add_waiting_tasks() share the same channel
+    std::unordered_map<int, channel_ptr> waiting_tasks;
 
     std::mutex mutex_results;
-    std::condition_variable condition_results;
+    std::condition_variable condition_waiting; // notified when tasks are added to waiting_tasks
 
     // add the id_task to the list of tasks waiting for response
     void add_waiting_task_id(int id_task) {
-        SRV_DBG("add task %d to waiting list. current waiting = %d (before add)\n", id_task, (int) waiting_task_ids.size());
+        SRV_DBG("add task %d to waiting list. current waiting = %d (before add)\n", id_task, (int) waiting_tasks.size());
 
-        std::unique_lock<std::mutex> lock(mutex_results);
-        waiting_task_ids.insert(id_task);
+        {
+            std::unique_lock<std::mutex> lock(mutex_results);
+            waiting_tasks[id_task] = std::make_shared<channel>();
+        }
+        condition_waiting.notify_all();
     }
 
     void add_waiting_tasks(const std::vector<server_task> & tasks) {
-        std::unique_lock<std::mutex> lock(mutex_results);
+        auto ch = std::make_shared<channel>();
 
-        for (const auto & task : tasks) {
-            SRV_DBG("add task %d to waiting list. current waiting = %d (before add)\n", task.id, (int) waiting_task_ids.size());
-            waiting_task_ids.insert(task.id);
+        {
+            std::unique_lock<std::mutex> lock(mutex_results);
+
+            for (const auto & task : tasks) {
+                SRV_DBG("add task %d to waiting list. current waiting = %d (before add)\n", task.id, (int) waiting_tasks.size());
+                waiting_tasks[task.id] = ch;
+            }
         }
+        condition_waiting.notify_all();
     }
 
     // when the request is finished, we can remove task associated with it
     void remove_waiting_task_id(int id_task) {
-        SRV_DBG("remove task %d from waiting list. current waiting = %d (before remove)\n", id_task, (int) waiting_task_ids.size());
+        SRV_DBG("remove task %d from waiting list. current waiting = %d (before remove)\n", id_task, (int) waiting_tasks.size());
+
+        channel_ptr ch;
+        {
+            std::unique_lock<std::mutex> lock(mutex_results);
+            auto it = waiting_tasks.find(id_task);
+            if (it == waiting_tasks.end()) {
+                return;
+            }
+            ch = std::move(it->second);
+            waiting_tasks.erase(it);
+        }
 
-        std::unique_lock<std::mutex> lock(mutex_results);
-        waiting_task_ids.erase(id_task);
         // make sure to clean up all pending results
-        queue_results.erase(
-            std::remove_if(queue_results.begin(), queue_results.end(), [id_task](const server_task_result_ptr & res) {
+        std::unique_lock<std::mutex> lock(ch->mutex);
+        ch->results.erase(
+            std::remove_if(ch->results.begin(), ch->results.end(), [id_task](const server_task_result_ptr & res) {
                 return res->id == id_task;
             }),
-            queue_results.end());
+            ch->results.end());
     }
 
     void remove_waiting_task_ids(const std::unordered_set<int> & id_tasks) {
-        std::unique_lock<std::mutex> lock(mutex_results);
-
         for (const auto & id_task : id_tasks) {
-            SRV_DBG("remove task %d from waiting list. current waiting = %d (before remove)\n", id_task, (int) waiting_task_ids.size());
-            waiting_task_ids.erase(id_task);
+            remove_waiting_task_id(id_task);
         }
     }
 
     // This function blocks the thread until there is a response for one of the id_tasks
+    // note: the id_tasks must have been added together (i.e. they share the same channel)
     server_task_result_ptr recv(const std::unordered_set<int> & id_tasks) {
-        while (true) {
-            std::unique_lock<std::mutex> lock(mutex_results);
-            condition_results.wait(lock, [&]{
-                if (!running) {
-                    SRV_DBG("%s : queue result stop\n", __func__);
-                    std::terminate(); // we cannot return here since the caller is HTTP code
-                }
-                return !queue_results.empty();
-            });
+        channel_ptr ch = get_channel(id_tasks);
+        GGML_ASSERT(ch != nullptr && "recv() called for tasks that are not waiting for results");
 
-            for (size_t i = 0; i < queue_results.size(); i++) {
-                if (id_tasks.find(queue_results[i]->id) != id_tasks.end()) {
-                    server_task_result_ptr res = std::move(queue_results[i]);
-                    queue_results.erase(queue_results.begin() + i);
-                    return res;
-                }
+        server_task_result_ptr res;
+
+        std::unique_lock<std::mutex> lock(ch->mutex);
+        ch->condition.wait(lock, [&]{
+            if (!running) {
+                SRV_DBG("%s : queue result stop\n", __func__);
+                std::terminate(); // we cannot return here since the caller is HTTP code
             }
-        }
+            res = pop_result(*ch, id_tasks);
+            return res != nullptr;
+        });
 
-        // should never reach here
+        return res;
     }
 
     // same as recv(), but have timeout in seconds
     // if timeout is reached, nullptr is returned
     server_task_result_ptr recv_with_timeout(const std::unordered_set<int> & id_tasks, int timeout) {
-        while (true) {
-            std::unique_lock<std::mutex> lock(mutex_results);
+        const auto t_end = std::chrono::steady_clock::now() + std::chrono::seconds(timeout);
 
-            for (int i = 0; i < (int) queue_results.size(); i++) {
-                if (id_tasks.find(queue_results[i]->id) != id_tasks.end()) {
-                    server_task_result_ptr res = std::move(queue_results[i]);
-                    queue_results.erase(queue_results.begin() + i);
-                    return res;
+        channel_ptr ch;
+        {
+            // no result can arrive before the tasks are added, wait for them instead of for a result
+            std::unique_lock<std::mutex> lock(mutex_results);
+            condition_waiting.wait_until(lock, t_end, [&]{
+                if (!running) {
+                    SRV_DBG("%s : queue result stop\n", __func__);
+                    std::terminate(); // we cannot return here since the caller is HTTP code
                 }
-            }
+                ch = find_channel(id_tasks);
+                return ch != nullptr;
+            });
+        }
+        if (ch == nullptr) {
+            return nullptr;
+        }
+
+        server_task_result_ptr res;
 
-            std::cv_status cr_res = condition_results.wait_for(lock, std::chrono::seconds(timeout));
+        std::unique_lock<std::mutex> lock(ch->mutex);
+        ch->condition.wait_until(lock, t_end, [&]{
             if (!running) {
                 SRV_DBG("%s : queue result stop\n", __func__);
                 std::terminate(); // we cannot return here since the caller is HTTP code
             }
-            if (cr_res == std::cv_status::timeout) {
-                return nullptr;
-            }
-        }
+            res = pop_result(*ch, id_tasks);
+            return res != nullptr;
+        });
 
-        // should never reach here
+        return res;
     }
 
     // single-task version of recv()
@@ -1856,22 +2483,67 @@ struct server_response {
     void send(server_task_result_ptr && result) {
         SRV_DBG("sending result for task id = %d\n", result->id);
 
-        std::unique_lock<std::mutex> lock(mutex_results);
-        for (const auto & id_task : waiting_task_ids) {
-            if (result->id == id_task) {
-                SRV_DBG("task id = %d pushed to result queue\n", result->id);
-
-                queue_results.emplace_back(std::move(result));
-                condition_results.notify_all();
+        channel_ptr ch;
+        {
+            std::unique_lock<std::mutex> lock(mutex_results);
+            auto it = waiting_tasks.find(result->id);
+            if (it == waiting_tasks.end()) {
                 return;
             }
+            ch = it->second;
+        }
+
+        SRV_DBG("task id = %d pushed to result queue\n", result->id);
+        {
+            std::unique_lock<std::mutex> lock(ch->mutex);
+            ch->results.emplace_back(std::move(result));
         }
+        ch->condition.notify_one();
     }
 
     // terminate the waiting loop
     void terminate() {
         running = false;
-        condition_results.notify_all();
+
+        std::unique_lock<std::mutex> lock(mutex_results);
+        for (auto & it : waiting_tasks) {
+            std::unique_lock<std::mutex> lock_ch(it.second->mutex);
+            it.second->condition.notify_all();
+        }
+        condition_waiting.notify_all();
+    }
+
+private:
+    channel_ptr get_channel(const std::unordered_set<int> & id_tasks) {
+        std::unique_lock<std::mutex> lock(mutex_results);
+        return find_channel(id_tasks);
+    }
+
+    // note: mutex_results must be locked
+    channel_ptr find_channel(const std::unordered_set<int> & id_tasks) const {
+        channel_ptr res;
+        for (const auto & id_task : id_tasks) {
+            auto it = waiting_tasks.find(id_task);
+            if (it == waiting_tasks.end()) {
+                continue;
+            }
+            GGML_ASSERT((res == nullptr || res == it->second) && "tasks received together must be added together");
+            res = it->second;
+        }
+
+        return res;
+    }
+
+    // note: the channel must be locked
+    static server_task_result_ptr pop_result(channel & ch, const std::unordered_set<int> & id_tasks) {
+        for (auto it = ch.results.begin(); it != ch.results.end(); ++it) {
+            if (id_tasks.find((*it)->id) != id_tasks.end()) {
+                server_task_result_ptr res = std::move(*it);
+                ch.results.erase(it);
+                return res;
+            }
+        }
+        return nullptr;
     }
 };
 
@@ -1894,6 +2566,9 @@ struct server_context {
 
     llama_context_params cparams_dft;
 
+    // n-grams of a large text corpus, used to validate the drafts of prompt lookup decoding
+    common_ngram_cache ngram_cache_static;
+
     llama_batch batch {};
 
     bool clean_kv_cache = true;
@@ -1911,6 +2586,14 @@ struct server_context {
 
     server_metrics metrics;
 
+    server_prompt_cache prompt_cache;
+
+    // image and audio embeddings shared by all slots
+    server_mtmd_cache mtmd_cache;
+
+    // threads sampling the slots of a decoded batch in parallel
+    common_sampler_pool * sampler_pool = nullptr;
+
     // Necessary similarity of prompt for slot selection
     float slot_prompt_similarity = 0.0f;
 
@@ -1935,6 +2618,8 @@ struct server_context {
         }
 
         llama_batch_free(batch);
+
+        common_sampler_pool_free(sampler_pool);
     }
 
     bool load_model(const common_params & params) {
@@ -1942,6 +2627,19 @@ struct server_context {
 
         params_base = params;
 
+        // the slots, the shared prompt cache and the draft trees of the slots use separate sequences
+        {
+            const uint32_t n_seq_max = common_context_params_to_llama(params_base).n_seq_max;
+
+            if (n_seq_max > llama_max_parallel_sequences()) {
+                SRV_ERR("too many sequences: %u are needed (%d slots, %d for the shared prompt cache, %d branches per slot for the draft trees), "
+                        "the maximum is %zu - reduce --parallel, --cache-radix-seqs or --draft-branches\n",
+                        n_seq_max, params_base.n_parallel, params_base.n_cache_radix > 0 ? params_base.n_cache_radix_seqs : 0,
+                        params_base.speculative.n_branch, llama_max_parallel_sequences());
+                return false;
+            }
+        }
+
         llama_init = common_init_from_params(params_base);
 
         model = llama_init.model.get();
@@ -1996,6 +2694,17 @@ struct server_context {
             llama_init_dft.context.reset();
         }
 
+        if (!params_base.lookup_cache_static.empty()) {
+            try {
+                ngram_cache_static = common_ngram_cache_load(params_base.lookup_cache_static);
+            } catch (std::ifstream::failure const &) {
+                SRV_ERR("failed to open static lookup cache, '%s'\n", params_base.lookup_cache_static.c_str());
+                return false;
+            }
+
+            SRV_INF("loaded static lookup cache, '%s', %zu n-grams\n", params_base.lookup_cache_static.c_str(), ngram_cache_static.size());
+        }
+
         chat_templates = common_chat_templates_init(model, params_base.chat_template);
         try {
             common_chat_format_example(chat_templates.get(), params.use_jinja);
@@ -2019,6 +2728,8 @@ struct server_context {
             }
             SRV_INF("loaded multimodal model, '%s'\n", mmproj_path.c_str());
 
+            mtmd_cache.n_bytes_max = (size_t) std::max(params_base.n_cache_mtmd, 0) * 1024 * 1024;
+
             if (params_base.ctx_shift) {
                 params_base.ctx_shift = false;
                 SRV_WRN("%s\n", "ctx_shift is not supported by multimodal, it will be disabled");
@@ -2035,6 +2746,37 @@ struct server_context {
             }
         }
 
+        if (params_base.n_cache_radix > 0) {
+            const char * reason = nullptr;
+
+            if (mctx) {
+                reason = "multimodal";
+            } else if (llama_model_is_recurrent(model) || !llama_memory_can_shift(llama_get_memory(ctx))) {
+                reason = "this context";
+            } else if (llama_model_n_swa(model) > 0) {
+                reason = "SWA models";
+            } else if (params_base.n_cache_radix >= n_ctx) {
+                reason = "a cache size larger than the context";
+            }
+
+            if (reason) {
+                params_base.n_cache_radix = 0;
+                SRV_WRN("the shared prompt cache is not supported by %s, it will be disabled\n", reason);
+            } else {
+                // shifting the KV cells of a slot would also shift the cells it shares with the prompt cache
+                // and with the other slots that restored the same prefix
+                if (params_base.n_cache_reuse) {
+                    params_base.n_cache_reuse = 0;
+                    SRV_WRN("%s\n", "cache_reuse is not supported together with the shared prompt cache, it will be disabled");
+                }
+
+                if (params_base.ctx_shift) {
+                    params_base.ctx_shift = false;
+                    SRV_WRN("%s\n", "ctx_shift is not supported together with the shared prompt cache, it will be disabled");
+                }
+            }
+        }
+
         if (!llama_memory_can_shift(llama_get_memory(ctx))) {
             if (params_base.ctx_shift) {
                 params_base.ctx_shift = false;
@@ -2051,7 +2793,7 @@ struct server_context {
     }
 
     void init() {
-        const int32_t n_ctx_slot = n_ctx / params_base.n_parallel;
+        const int32_t n_ctx_slot = (n_ctx - params_base.n_cache_radix) / params_base.n_parallel;
 
         SRV_INF("initializing slots, n_slots = %d\n", params_base.n_parallel);
 
@@ -2065,8 +2807,13 @@ struct server_context {
             slot.mctx = mctx;
             slot.cache_tokens.has_mtmd = mctx != nullptr;
 
+            if (model_dft || params_base.speculative.lookup) {
+                slot.batch_spec = llama_batch_init(params_base.speculative.n_max + 1, 0, params_base.speculative.n_branch);
+            }
+
             if (model_dft) {
-                slot.batch_spec = llama_batch_init(params_base.speculative.n_max + 1, 0, 1);
+                // the sequences for the draft trees come after the slots and the shared prompt cache
+                slot.seq_id_spec = params_base.n_parallel + (params_base.n_cache_radix > 0 ? params_base.n_cache_radix_seqs : 0) + i*params_base.speculative.n_branch;
 
                 slot.ctx_dft = llama_init_from_model(model_dft, cparams_dft);
                 if (slot.ctx_dft == nullptr) {
@@ -2106,6 +2853,22 @@ struct server_context {
 
         metrics.init();
 
+        {
+            const int32_t n_threads = params_base.n_threads_sampling < 0 ? params_base.cpuparams.n_threads : params_base.n_threads_sampling;
+
+            if (n_threads > 1 && params_base.n_parallel > 1) {
+                SRV_INF("sampling the slots with %d threads\n", std::min(n_threads, params_base.n_parallel));
+
+                sampler_pool = common_sampler_pool_init(std::min(n_threads, params_base.n_parallel));
+            }
+        }
+
+        if (params_base.n_cache_radix > 0) {
+            SRV_INF("initializing shared prompt cache, n_cells = %d, n_seqs = %d\n", params_base.n_cache_radix, params_base.n_cache_radix_seqs);
+
+            prompt_cache.init(llama_get_memory(ctx), params_base.n_parallel, params_base.n_cache_radix_seqs, params_base.n_cache_radix);
+        }
+
         oai_parser_opt = {
             /* use_jinja             */ params_base.use_jinja,
             /* prefill_assistant     */ params_base.prefill_assistant,
@@ -2192,9 +2955,10 @@ struct server_context {
 
     bool launch_slot_with_task(server_slot & slot, server_task && task) {
         slot.reset();
-        slot.id_task       = task.id;
-        slot.index         = task.index;
-        slot.task_type     = task.type;
+        slot.id_task        = task.id;
+        slot.index          = task.index;
+        slot.task_type      = task.type;
+        slot.t_task_created = task.t_created;
         slot.params        = std::move(task.params);
         slot.prompt_tokens = std::move(task.prompt_tokens);
 
@@ -2233,15 +2997,18 @@ struct server_context {
             }
         }
 
-        if (slot.ctx_dft) {
+        if (slot.can_speculate()) {
             llama_batch_free(slot.batch_spec);
 
-            slot.batch_spec = llama_batch_init(slot.params.speculative.n_max + 1, 0, 1);
+            slot.batch_spec = llama_batch_init(slot.params.speculative.n_max + 1, 0, slot.params.speculative.n_branch);
         }
 
         slot.state = SLOT_STATE_STARTED;
 
-        SLT_INF(slot, "%s", "processing task\n");
+        metrics.on_started(slot);
+        queue_tasks.add_wait_sample(ggml_time_us() - slot.t_task_created);
+
+        SLT_INF(slot, "processing task, priority = %s\n", server_priority_name(slot.params.priority));
 
         return true;
     }
@@ -2252,6 +3019,25 @@ struct server_context {
         // clear the entire KV cache
         llama_memory_clear(llama_get_memory(ctx), true);
         clean_kv_cache = false;
+
+        if (prompt_cache.enabled()) {
+            prompt_cache.clear();
+        }
+    }
+
+    // store the processed tokens of the slot in the shared prompt cache
+    void prompt_cache_update(const server_slot & slot) {
+        if (!prompt_cache.enabled() || !slot.params.cache_prompt || !slot.need_logits()) {
+            return;
+        }
+
+        // only the positions that have actually been decoded can be shared
+        const llama_pos pos_max = llama_memory_seq_pos_max(llama_get_memory(ctx), slot.id);
+
+        const llama_tokens & tokens = slot.cache_tokens.get_text_tokens();
+        const size_t n_tokens = std::min(tokens.size(), (size_t) (pos_max + 1));
+
+        prompt_cache.insert(slot.id, llama_tokens(tokens.begin(), tokens.begin() + n_tokens), slot.lora);
     }
 
     bool process_token(completion_token_output & result, server_slot & slot) {
@@ -2406,7 +3192,7 @@ struct server_context {
         return slot.has_next_token; // continue
     }
 
-    void populate_token_probs(const server_slot & slot, completion_token_output & result, bool post_sampling, bool special, int idx) {
+    void populate_token_probs(const server_slot & slot, completion_token_output & result, bool post_sampling, bool special, const float * logits) {
         size_t n_probs = slot.params.sampling.n_probs;
         size_t n_vocab = llama_vocab_n_tokens(vocab);
         if (post_sampling) {
@@ -2431,25 +3217,15 @@ struct server_context {
                 });
             }
         } else {
-            // TODO: optimize this with min-p optimization
-            std::vector<llama_token_data> cur = get_token_probabilities(ctx, idx);
-
-            // set probability for sampled token
-            for (size_t i = 0; i < n_vocab; i++) {
-                // set probability for sampled token
-                if (cur[i].id == result.tok) {
-                    result.prob = cur[i].p;
-                    break;
-                }
-            }
+            // set probability for sampled token and for top n_probs tokens
+            const std::vector<llama_token_data> cur = get_token_probabilities(logits, n_vocab, std::min(n_vocab, n_probs), result.tok, result.prob);
 
-            // set probability for top n_probs tokens
-            result.probs.reserve(n_probs);
-            for (size_t i = 0; i < std::min(n_vocab, n_probs); i++) {
+            result.probs.reserve(cur.size());
+            for (const auto & td : cur) {
                 result.probs.push_back({
-                    cur[i].id,
-                    common_token_to_piece(ctx, cur[i].id, special),
-                    cur[i].p
+                    td.id,
+                    common_token_to_piece(ctx, td.id, special),
+                    td.p
                 });
             }
         }
@@ -2826,6 +3602,30 @@ struct server_context {
                     res->n_decode_total          = metrics.n_decode_total;
                     res->n_busy_slots_total      = metrics.n_busy_slots_total;
 
+                    res->n_prompt_cache_hit        = prompt_cache.n_hit;
+                    res->n_prompt_cache_miss       = prompt_cache.n_miss;
+                    res->n_prompt_cache_tokens_hit = prompt_cache.n_tokens_hit;
+                    res->n_prompt_cache_evicted    = prompt_cache.n_evicted;
+                    res->n_prompt_cache_cells      = prompt_cache.n_cells;
+                    res->n_prompt_cache_entries    = prompt_cache.n_entries();
+
+                    res->n_mtmd_cache_hit     = mtmd_cache.n_hit;
+                    res->n_mtmd_cache_miss    = mtmd_cache.n_miss;
+                    res->n_mtmd_cache_evicted = mtmd_cache.n_evicted;
+                    res->n_mtmd_cache_bytes   = mtmd_cache.n_bytes;
+
+                    res->n_queue_wait_total = queue_tasks.n_wait_total;
+                    res->t_queue_wait_p50   = queue_tasks.get_wait_ms(0.50);
+                    res->t_queue_wait_p90   = queue_tasks.get_wait_ms(0.90);
+                    res->t_queue_wait_p99   = queue_tasks.get_wait_ms(0.99);
+
+                    for (int i = 0; i < SERVER_PRIORITY_COUNT; ++i) {
+                        res->n_started_class    [i] = metrics.n_started_class    [i];
+                        res->t_queue_wait_class [i] = metrics.t_queue_wait_class [i];
+                        res->n_first_token_class[i] = metrics.n_first_token_class[i];
+                        res->t_first_token_class[i] = metrics.t_first_token_class[i];
+                    }
+
                     if (task.metrics_reset_bucket) {
                         metrics.reset_bucket();
                     }
@@ -2957,7 +3757,107 @@ struct server_context {
         }
     }
 
+    bool accept_special_token(const server_slot & slot, llama_token token) const {
+        return params_base.special || slot.params.sampling.preserved_tokens.find(token) != slot.params.sampling.preserved_tokens.end();
+    }
+
+    // sample the next token of the slots with an output in the batch view [i, i + n_tokens), in parallel with sampler_pool
+    // if prev is true, the view was decoded by the llama_decode() call preceding the last one (double-buffered outputs)
+    void process_batch_outputs(int32_t i, int32_t n_tokens, const llama_batch & batch_view, bool prev) {
+        std::vector<server_slot *>    gen_slots;
+        std::vector<common_sampler *> gen_smpls;
+        std::vector<const float *>    gen_logits;
+
+        for (auto & slot : slots) {
+            if (slot.i_batch < (int) i || slot.i_batch >= (int) (i + n_tokens)) {
+                continue; // continue loop of slots
+            }
+
+            if (slot.state == SLOT_STATE_DONE_PROMPT) {
+                if (slot.task_type == SERVER_TASK_TYPE_EMBEDDING) {
+                    // prompt evaluated for embedding
+                    send_embedding(slot, batch_view);
+                    slot.release();
+                    slot.i_batch = -1;
+                    continue; // continue loop of slots
+                }
+
+                if (slot.task_type == SERVER_TASK_TYPE_RERANK) {
+                    send_rerank(slot, batch_view);
+                    slot.release();
+                    slot.i_batch = -1;
+                    continue; // continue loop of slots
+                }
+
+                // prompt evaluated for next-token prediction
+                slot.state = SLOT_STATE_GENERATING;
+
+                prompt_cache_update(slot);
+            } else if (slot.state != SLOT_STATE_GENERATING) {
+                continue; // continue loop of slots
+            }
+
+            const int tok_idx = slot.i_batch - i;
+
+            slot.i_batch = -1;
+
+            gen_slots .push_back(&slot);
+            gen_smpls .push_back(slot.smpl);
+            gen_logits.push_back(prev ? llama_get_logits_prev_ith(ctx, tok_idx) : llama_get_logits_ith(ctx, tok_idx));
+        }
+
+        // sample the generating slots in parallel
+        const std::vector<llama_token> ids = common_sampler_sample_and_accept_batch(sampler_pool, gen_smpls, ctx, gen_logits);
+
+        for (size_t k = 0; k < gen_slots.size(); ++k) {
+            server_slot & slot = *gen_slots[k];
+
+            const llama_token id = ids[k];
+
+            const float * logits = gen_logits[k];
+
+            slot.n_decoded += 1;
+
+            const int64_t t_current = ggml_time_us();
+
+            if (slot.n_decoded == 1) {
+                slot.t_start_generation = t_current;
+                slot.t_prompt_processing = (slot.t_start_generation - slot.t_start_process_prompt) / 1e3;
+                metrics.on_prompt_eval(slot);
+                metrics.on_first_token(slot);
+            }
+
+            slot.t_token_generation = (t_current - slot.t_start_generation) / 1e3;
+
+            completion_token_output result;
+            result.tok          = id;
+            result.text_to_send = common_token_to_piece(ctx, result.tok, accept_special_token(slot, result.tok));
+            result.prob         = 1.0f; // TODO: set it here instead of doing inside populate_token_probs
+
+            if (slot.params.sampling.n_probs > 0) {
+                populate_token_probs(slot, result, slot.params.post_sampling_probs, params_base.special, logits);
+            }
+
+            if (!process_token(result, slot)) {
+                // release slot because of stop condition
+                prompt_cache_update(slot);
+                slot.release();
+                slot.print_timings();
+                send_final_response(slot);
+                metrics.on_prediction(slot);
+                continue;
+            }
+        }
+    }
+
     void update_slots() {
+        // reject the requests that waited too long for a free slot
+        if (params_base.t_queue_max_ms > 0) {
+            queue_tasks.expire_deferred_tasks(1000ll*params_base.t_queue_max_ms, [this](const server_task & task) {
+                send_error(task, "the request waited too long for a free slot", ERROR_TYPE_UNAVAILABLE);
+            });
+        }
+
         // check if all slots are idle
         {
             bool all_idle = true;
@@ -3039,10 +3939,6 @@ struct server_context {
         // track if given slot can be batched with slots already in the batch
         server_slot * slot_batched = nullptr;
 
-        auto accept_special_token = [&](server_slot & slot, llama_token token) {
-            return params_base.special || slot.params.sampling.preserved_tokens.find(token) != slot.params.sampling.preserved_tokens.end();
-        };
-
         // frist, add sampled tokens from any ongoing sequences
         for (auto & slot : slots) {
             if (slot.state != SLOT_STATE_GENERATING) {
@@ -3071,9 +3967,27 @@ struct server_context {
         int32_t n_batch  = llama_n_batch(ctx);
         int32_t n_ubatch = llama_n_ubatch(ctx);
 
+        // the prompt tokens are added on top of the tokens of the generating slots, up to the prefill budget
+        const int32_t n_batch_prompt = params_base.n_prefill_budget > 0 ? std::min(n_batch, batch.n_tokens + params_base.n_prefill_budget) : n_batch;
+
         // next, batch any pending prompts without exceeding n_batch
         if (params_base.cont_batching || batch.n_tokens == 0) {
+            // process the prompts in order of priority, then in order of arrival
+            std::vector<server_slot *> slots_prompt;
+            slots_prompt.reserve(slots.size());
             for (auto & slot : slots) {
+                slots_prompt.push_back(&slot);
+            }
+            std::stable_sort(slots_prompt.begin(), slots_prompt.end(), [](const server_slot * a, const server_slot * b) {
+                if (a->params.priority != b->params.priority) {
+                    return a->params.priority < b->params.priority;
+                }
+                return a->t_task_created < b->t_task_created;
+            });
+
+            for (server_slot * slot_ptr : slots_prompt) {
+                auto & slot = *slot_ptr;
+
                 // check if we can batch this slot with the previous one
                 if (slot.is_processing()) {
                     if (!slot_batched) {
@@ -3192,6 +4106,32 @@ struct server_context {
                                 // reuse any previously computed tokens that are common with the new prompt
                                 slot.n_past = slot.cache_tokens.get_common_prefix(prompt_tokens);
 
+                                // reuse a longer prefix from the shared prompt cache, if there is one
+                                if (prompt_cache.enabled()) {
+                                    const llama_tokens & tokens = prompt_tokens.get_text_tokens();
+
+                                    llama_seq_id seq_id_cache = -1;
+
+                                    const int32_t n_cache = prompt_cache.find(tokens, slot.lora, seq_id_cache);
+
+                                    if (n_cache > slot.n_past) {
+                                        SLT_INF(slot, "reusing %d tokens from the prompt cache (seq_id = %d), n_past = %d\n", n_cache, seq_id_cache, slot.n_past);
+
+                                        llama_memory_seq_rm(llama_get_memory(ctx), slot.id, -1, -1);
+                                        llama_memory_seq_cp(llama_get_memory(ctx), seq_id_cache, slot.id, 0, n_cache);
+
+                                        slot.cache_tokens.clear();
+                                        slot.cache_tokens.insert(llama_tokens(tokens.begin(), tokens.begin() + n_cache));
+
+                                        slot.n_past = n_cache;
+
+                                        prompt_cache.n_hit++;
+                                        prompt_cache.n_tokens_hit += n_cache;
+                                    } else {
+                                        prompt_cache.n_miss++;
+                                    }
+                                }
+
                                 // reuse chunks from the cached prompt by shifting their KV cache in the new position
                                 if (params_base.n_cache_reuse > 0) {
                                     size_t head_c = slot.n_past; // cache
@@ -3296,7 +4236,7 @@ struct server_context {
                     if (slot.n_past < slot.n_prompt_tokens && slot.prompt_tokens[slot.n_past] == LLAMA_TOKEN_NULL) {
                         // process the image
                         int32_t new_n_past;
-                        int32_t res = slot.prompt_tokens.process_chunk(ctx, mctx, slot.n_past, slot.id, new_n_past);
+                        int32_t res = slot.prompt_tokens.process_chunk(ctx, mctx, slot.n_past, slot.id, new_n_past, mtmd_cache);
                         int32_t n_pos = new_n_past - slot.n_past;
 
                         if (res != 0) {
@@ -3316,8 +4256,11 @@ struct server_context {
                         slot.n_prompt_tokens_processed += n_pos;
                     }
 
+                    // limit the number of prompt tokens of this slot in the current batch
+                    const int32_t n_past_max = params_base.n_prefill_chunk > 0 ? slot.n_past + params_base.n_prefill_chunk : slot.n_prompt_tokens;
+
                     // add prompt tokens for processing in the current batch
-                    while (slot.n_past < slot.n_prompt_tokens && batch.n_tokens < n_batch) {
+                    while (slot.n_past < slot.n_prompt_tokens && slot.n_past < n_past_max && batch.n_tokens < n_batch_prompt) {
                         // get next token to process
                         llama_token cur_tok = slot.prompt_tokens[slot.n_past];
                         if (cur_tok == LLAMA_TOKEN_NULL) {
@@ -3365,7 +4308,7 @@ struct server_context {
                     }
                 }
 
-                if (batch.n_tokens >= n_batch) {
+                if (batch.n_tokens >= n_batch_prompt) {
                     break;
                 }
             }
@@ -3385,11 +4328,21 @@ struct server_context {
             llama_set_embeddings(ctx, slot_batched->need_embd());
         }
 
+        // with double-buffered outputs, the batch is decoded one ubatch at a time and the outputs of each ubatch are
+        // sampled while the next one is computed
+        // not used for embeddings and speculative decoding, which need the outputs of the last decode
+        const bool pipeline = params_base.swap_output && !params_base.embedding &&
+            std::none_of(slots.begin(), slots.end(), [](const server_slot & slot) { return slot.can_speculate(); });
+
         int32_t i_next = 0;
 
+        // the last decoded view, not sampled yet (pipeline)
+        int32_t i_pending = 0;
+        int32_t n_pending = 0;
+
         // process the created batch of tokens
         for (int32_t i = 0; i < batch.n_tokens; i = i_next) {
-            const int32_t n_tokens = std::min(n_batch, batch.n_tokens - i);
+            const int32_t n_tokens = std::min(pipeline ? std::min<int32_t>(n_batch, llama_n_ubatch(ctx)) : n_batch, batch.n_tokens - i);
 
             llama_batch batch_view = {
                 n_tokens,
@@ -3405,6 +4358,15 @@ struct server_context {
 
             metrics.on_decoded(slots);
 
+            if (ret == 1 && prompt_cache.n_cells > 0) {
+                // free the cells held only by the prompt cache before reducing the batch size
+                SRV_WRN("failed to find free space in the KV cache, clearing the prompt cache, i = %d, n_batch = %d\n", i, n_batch);
+
+                prompt_cache.clear();
+
+                continue; // continue loop of n_batch
+            }
+
             if (ret != 0) {
                 {
                     std::string err;
@@ -3427,6 +4389,7 @@ struct server_context {
                             slot.release();
                             send_error(slot, err);
                         }
+                        n_pending = 0;
                         break;
                     }
                 }
@@ -3445,72 +4408,20 @@ struct server_context {
             // on successful decode, restore the original batch size
             n_batch = llama_n_batch(ctx);
 
-            for (auto & slot : slots) {
-                if (slot.i_batch < (int) i || slot.i_batch >= (int) (i + n_tokens)) {
-                    continue; // continue loop of slots
-                }
-
-                if (slot.state == SLOT_STATE_DONE_PROMPT) {
-                    if (slot.task_type == SERVER_TASK_TYPE_EMBEDDING) {
-                        // prompt evaluated for embedding
-                        send_embedding(slot, batch_view);
-                        slot.release();
-                        slot.i_batch = -1;
-                        continue; // continue loop of slots
-                    }
-
-                    if (slot.task_type == SERVER_TASK_TYPE_RERANK) {
-                        send_rerank(slot, batch_view);
-                        slot.release();
-                        slot.i_batch = -1;
-                        continue; // continue loop of slots
-                    }
-
-                    // prompt evaluated for next-token prediction
-                    slot.state = SLOT_STATE_GENERATING;
-                } else if (slot.state != SLOT_STATE_GENERATING) {
-                    continue; // continue loop of slots
-                }
-
-                const int tok_idx = slot.i_batch - i;
-
-                llama_token id = common_sampler_sample(slot.smpl, ctx, tok_idx);
-
-                slot.i_batch = -1;
-
-                common_sampler_accept(slot.smpl, id, true);
-
-                slot.n_decoded += 1;
-
-                const int64_t t_current = ggml_time_us();
-
-                if (slot.n_decoded == 1) {
-                    slot.t_start_generation = t_current;
-                    slot.t_prompt_processing = (slot.t_start_generation - slot.t_start_process_prompt) / 1e3;
-                    metrics.on_prompt_eval(slot);
+            if (pipeline) {
+                // sample the previous view while this one is computed
+                if (n_pending > 0) {
+                    process_batch_outputs(i_pending, n_pending, batch, true);
                 }
 
-                slot.t_token_generation = (t_current - slot.t_start_generation) / 1e3;
+                i_pending = i;
+                n_pending = n_tokens;
 
-                completion_token_output result;
-                result.tok          = id;
-                result.text_to_send = common_token_to_piece(ctx, result.tok, accept_special_token(slot, result.tok));
-                result.prob         = 1.0f; // TODO: set it here instead of doing inside populate_token_probs
-
-                if (slot.params.sampling.n_probs > 0) {
-                    populate_token_probs(slot, result, slot.params.post_sampling_probs, params_base.special, tok_idx);
-                }
-
-                if (!process_token(result, slot)) {
-                    // release slot because of stop condition
-                    slot.release();
-                    slot.print_timings();
-                    send_final_response(slot);
-                    metrics.on_prediction(slot);
-                    continue;
-                }
+                continue;
             }
 
+            process_batch_outputs(i, n_tokens, batch_view, false);
+
             // do speculative decoding
             for (auto & slot : slots) {
                 if (!slot.is_processing() || !slot.can_speculate()) {
@@ -3549,36 +4460,100 @@ struct server_context {
 
                 struct common_speculative_params params_spec;
                 params_spec.n_draft   = n_draft_max;
-                params_spec.n_reuse   = llama_n_ctx(slot.ctx_dft) - slot.params.speculative.n_max;
                 params_spec.p_min     = slot.params.speculative.p_min;
 
+                // prompt lookup decoding does not need a draft model
+                const bool use_lookup = slot.params.speculative.lookup || !slot.ctx_dft;
+
+                if (!use_lookup) {
+                    params_spec.n_reuse = llama_n_ctx(slot.ctx_dft) - slot.params.speculative.n_max;
+                }
+
                 const llama_tokens & cached_text_tokens = slot.cache_tokens.get_text_tokens();
-                llama_tokens draft = common_speculative_gen_draft(slot.spec, params_spec, cached_text_tokens, id);
 
-                // ignore small drafts
-                if (slot.params.speculative.n_min > (int) draft.size()) {
-                    SLT_DBG(slot, "ignoring small draft: %d < %d\n", (int) draft.size(), slot.params.speculative.n_min);
+                // the accepted tokens from the speculation
+                llama_tokens ids;
+
+                int n_draft = 0;
 
-                    continue;
-                }
+                if (!use_lookup && slot.params.speculative.n_branch > 1) {
+                    params_spec.n_branch = slot.params.speculative.n_branch;
+                    params_spec.p_split  = slot.params.speculative.p_split;
 
-                // keep track of total number of drafted tokens tested
-                slot.n_draft_total += draft.size();
+                    const common_speculative_tree tree = common_speculative_gen_draft_tree(slot.spec, params_spec, cached_text_tokens, id);
 
-                // construct the speculation batch
-                common_batch_clear(slot.batch_spec);
-                common_batch_add  (slot.batch_spec, id, slot.n_past, { slot.id }, true);
+                    // ignore small drafts
+                    if (slot.params.speculative.n_min > tree.size() || tree.size() == 0) {
+                        SLT_DBG(slot, "ignoring small draft: %d < %d\n", tree.size(), slot.params.speculative.n_min);
 
-                for (size_t i = 0; i < draft.size(); ++i) {
-                    common_batch_add(slot.batch_spec, draft[i], slot.n_past + 1 + i, { slot.id }, true);
-                }
+                        continue;
+                    }
 
-                SLT_DBG(slot, "decoding speculative batch, size = %d\n", slot.batch_spec.n_tokens);
+                    n_draft = tree.size();
 
-                llama_decode(ctx, slot.batch_spec);
+                    auto * mem = llama_get_memory(ctx);
 
-                // the accepted tokens from the speculation
-                const auto ids = common_sampler_sample_and_accept_n(slot.smpl, ctx, draft);
+                    // each branch of the tree is verified in its own sequence, on top of the cached prompt of the slot
+                    for (int b = 0; b < tree.n_branch; ++b) {
+                        llama_memory_seq_rm(mem,          slot.seq_id_spec + b, -1, -1);
+                        llama_memory_seq_cp(mem, slot.id, slot.seq_id_spec + b, -1, -1);
+                    }
+
+                    common_batch_clear(slot.batch_spec);
+                    common_speculative_tree_add_to_batch(tree, slot.batch_spec, id, slot.n_past, slot.seq_id_spec);
+
+                    SLT_DBG(slot, "decoding speculative tree, size = %d, branches = %d\n", slot.batch_spec.n_tokens, tree.n_branch);
+
+                    llama_decode(ctx, slot.batch_spec);
+
+                    int node_last = -1;
+                    ids = common_speculative_tree_sample_and_accept(slot.smpl, ctx, tree, 0, node_last);
+
+                    // keep the accepted path in the sequence of the slot and drop the rest of the tree
+                    int b_keep = 0;
+                    if (node_last >= 0) {
+                        while (!(tree.seqs[node_last] & (1ull << b_keep))) {
+                            b_keep++;
+                        }
+                    }
+
+                    llama_memory_seq_cp(mem, slot.seq_id_spec + b_keep, slot.id, slot.n_past, slot.n_past + ids.size());
+
+                    for (int b = 0; b < tree.n_branch; ++b) {
+                        llama_memory_seq_rm(mem, slot.seq_id_spec + b, -1, -1);
+                    }
+                } else {
+                    llama_tokens draft = use_lookup
+                        ? slot.gen_draft_lookup(id, n_draft_max, ngram_cache_static)
+                        : common_speculative_gen_draft(slot.spec, params_spec, cached_text_tokens, id);
+
+                    // ignore small drafts
+                    if (slot.params.speculative.n_min > (int) draft.size()) {
+                        SLT_DBG(slot, "ignoring small draft: %d < %d\n", (int) draft.size(), slot.params.speculative.n_min);
+
+                        continue;
+                    }
+
+                    n_draft = draft.size();
+
+                    // construct the speculation batch
+                    common_batch_clear(slot.batch_spec);
+                    common_batch_add  (slot.batch_spec, id, slot.n_past, { slot.id }, true);
+
+                    for (size_t i = 0; i < draft.size(); ++i) {
+                        common_batch_add(slot.batch_spec, draft[i], slot.n_past + 1 + i, { slot.id }, true);
+                    }
+
+                    SLT_DBG(slot, "decoding speculative batch, size = %d\n", slot.batch_spec.n_tokens);
+
+                    llama_decode(ctx, slot.batch_spec);
+
+                    ids = common_sampler_sample_and_accept_n(slot.smpl, ctx, draft);
+                }
+
+                // keep track of total number of drafted tokens tested
+                slot.n_draft_total += n_draft;
+                slot.n_draft_steps += 1;
 
                 slot.n_past    += ids.size();
                 slot.n_decoded += ids.size();
@@ -3602,6 +4577,7 @@ struct server_context {
 
                     if (!process_token(result, slot)) {
                         // release slot because of stop condition
+                        prompt_cache_update(slot);
                         slot.release();
                         slot.print_timings();
                         send_final_response(slot);
@@ -3610,10 +4586,14 @@ struct server_context {
                     }
                 }
 
-                SLT_DBG(slot, "accepted %d/%d draft tokens, new n_past = %d\n", (int) ids.size() - 1, (int) draft.size(), slot.n_past);
+                SLT_DBG(slot, "accepted %d/%d draft tokens, new n_past = %d\n", (int) ids.size() - 1, n_draft, slot.n_past);
             }
         }
 
+        if (n_pending > 0) {
+            process_batch_outputs(i_pending, n_pending, batch, false);
+        }
+
         SRV_DBG("%s", "run slots completed\n");
     }
 
@@ -3940,6 +4920,38 @@ int main(int argc, char ** argv) {
                     {"name",  "n_busy_slots_per_decode"},
                     {"help",  "Average number of busy slots per llama_decode() call"},
                     {"value",  (float) res_metrics->n_busy_slots_total / std::max((float) res_metrics->n_decode_total, 1.f)}
+            }, {
+                    {"name",  "prompt_cache_hits_total"},
+                    {"help",  "Number of prompts that reused a prefix from the shared prompt cache."},
+                    {"value",  res_metrics->n_prompt_cache_hit}
+            }, {
+                    {"name",  "prompt_cache_misses_total"},
+                    {"help",  "Number of prompts that found no usable prefix in the shared prompt cache."},
+                    {"value",  res_metrics->n_prompt_cache_miss}
+            }, {
+                    {"name",  "prompt_cache_tokens_total"},
+                    {"help",  "Number of prompt tokens reused from the shared prompt cache."},
+                    {"value",  res_metrics->n_prompt_cache_tokens_hit}
+            }, {
+                    {"name",  "prompt_cache_evictions_total"},
+                    {"help",  "Number of prompts evicted from the shared prompt cache."},
+                    {"value",  res_metrics->n_prompt_cache_evicted}
+            }, {
+                    {"name",  "mtmd_cache_hits_total"},
+                    {"help",  "Number of image and audio chunks whose embeddings were found in the cache."},
+                    {"value",  res_metrics->n_mtmd_cache_hit}
+            }, {
+                    {"name",  "mtmd_cache_misses_total"},
+                    {"help",  "Number of image and audio chunks that went through the encoder."},
+                    {"value",  res_metrics->n_mtmd_cache_miss}
+            }, {
+                    {"name",  "mtmd_cache_evictions_total"},
+                    {"help",  "Number of image and audio embeddings evicted from the cache."},
+                    {"value",  res_metrics->n_mtmd_cache_evicted}
+            }, {
+                    {"name",  "queue_tasks_total"},
+                    {"help",  "Number of client tasks (completion, embedding, rerank) that started on a slot."},
+                    {"value",  res_metrics->n_queue_wait_total}
             }}},
             {"gauge", {{
                     {"name",  "prompt_tokens_seconds"},
@@ -3957,9 +4969,54 @@ int main(int argc, char ** argv) {
                     {"name",  "requests_deferred"},
                     {"help",  "Number of requests deferred."},
                     {"value",  (uint64_t) res_metrics->n_tasks_deferred}
+            },{
+                    {"name",  "prompt_cache_cells"},
+                    {"help",  "Number of KV cells held by the shared prompt cache."},
+                    {"value",  res_metrics->n_prompt_cache_cells}
+            },{
+                    {"name",  "prompt_cache_prompts"},
+                    {"help",  "Number of prompts held by the shared prompt cache."},
+                    {"value",  res_metrics->n_prompt_cache_entries}
+            },{
+                    {"name",  "mtmd_cache_bytes"},
+                    {"help",  "Size of the image and audio embeddings held by the cache."},
+                    {"value",  res_metrics->n_mtmd_cache_bytes}
+            },{
+                    {"name",  "queue_wait_p50_ms"},
+                    {"help",  "Median time the recent client tasks waited before they started on a slot."},
+                    {"value",  res_metrics->t_queue_wait_p50}
+            },{
+                    {"name",  "queue_wait_p90_ms"},
+                    {"help",  "90th percentile of the time the recent client tasks waited before they started on a slot."},
+                    {"value",  res_metrics->t_queue_wait_p90}
+            },{
+                    {"name",  "queue_wait_p99_ms"},
+                    {"help",  "99th percentile of the time the recent client tasks waited before they started on a slot."},
+                    {"value",  res_metrics->t_queue_wait_p99}
             }}}
         };
 
+        // per priority class
+        for (int i = 0; i < SERVER_PRIORITY_COUNT; ++i) {
+            const std::string name = server_priority_name((server_priority) i);
+
+            all_metrics_def["counter"].push_back({
+                    {"name",  "requests_" + name + "_total"},
+                    {"help",  "Number of requests with " + name + " priority that started processing."},
+                    {"value",  res_metrics->n_started_class[i]}
+            });
+            all_metrics_def["gauge"].push_back({
+                    {"name",  "queue_wait_" + name + "_ms"},
+                    {"help",  "Average time requests with " + name + " priority waited for a slot."},
+                    {"value",  res_metrics->n_started_class[i] ? 1e-3 * res_metrics->t_queue_wait_class[i] / res_metrics->n_started_class[i] : 0.}
+            });
+            all_metrics_def["gauge"].push_back({
+                    {"name",  "time_to_first_token_" + name + "_ms"},
+                    {"help",  "Average time from the arrival of requests with " + name + " priority to their first generated token."},
+                    {"value",  res_metrics->n_first_token_class[i] ? 1e-3 * res_metrics->t_first_token_class[i] / res_metrics->n_first_token_class[i] : 0.}
+            });
+        }
+
         std::stringstream prometheus;
 
         for (const auto & el : all_metrics_def.items()) {
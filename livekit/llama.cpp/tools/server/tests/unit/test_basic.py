@@ -64,6 +64,30 @@ def test_server_slots():
     assert res.body[0]["params"]["seed"] == server.seed
 
 
+def test_server_queue_wait_metrics():
+    global server
+    server.server_metrics = True
+    server.n_slots = 1
+    server.start()
+
+    # with a single slot, the second request waits in the deferred queue until the first one is done
+    results = parallel_function_calls([
+        (server.make_request, ("POST", "/completion", {"prompt": "Hello", "n_predict": 32})),
+        (server.make_request, ("POST", "/completion", {"prompt": "World", "n_predict": 32})),
+    ])
+    assert all(res.status_code == 200 for res in results)
+
+    metrics = {}
+    for line in requests.get(f"http://{server.server_host}:{server.server_port}/metrics").text.split("\n"):
+        if line.startswith("llamacpp:"):
+            name, value = line.split(" ")
+            metrics[name] = float(value)
+
+    # only the client tasks are counted, not the tasks the server posts to itself
+    assert metrics["llamacpp:queue_tasks_total"] == 2
+    assert metrics["llamacpp:queue_wait_p99_ms"] >= metrics["llamacpp:queue_wait_p50_ms"] > 0
+
+
 def test_load_split_model():
     global server
     server.model_hf_repo = "ggml-org/models"
@@ -201,6 +201,40 @@ def test_consistent_result_different_batch_size(n_batch: int, temperature: float
         last_res = res
 
 
+@pytest.mark.parametrize("n_slots", [1, 4])
+def test_consistent_result_swap_output(n_slots: int):
+    # with --swap-output the batch is decoded one ubatch at a time and the outputs of each ubatch are sampled while the
+    # next one is computed, the results must be the same as when the whole batch is decoded at once
+    global server
+    server.n_slots = n_slots
+    server.n_ubatch = 4
+    prompts = [
+        "I believe the meaning of life is",
+        "Write a very long book.",
+        "What is LLM?",
+        "The sky is blue and I love it.",
+    ][:n_slots]
+    results = {}
+    for swap_output in [False, True]:
+        server.swap_output = swap_output
+        server.start()
+        tasks = [(server.make_request, ("POST", "/completion", {
+            "prompt": prompt,
+            "n_predict": 32,
+            "temperature": 0.0,
+            "n_probs": 4,
+        })) for prompt in prompts]
+        results[swap_output] = [res.body for res in parallel_function_calls(tasks)]
+        server.stop()
+    for res, res_ref in zip(results[True], results[False]):
+        assert res["content"] == res_ref["content"]
+        # the probabilities are read from the logits of the previous ubatch, the slots may be batched in a different
+        # order in the two runs
+        for prob, prob_ref in zip(res["completion_probabilities"], res_ref["completion_probabilities"]):
+            assert [p["id"] for p in prob["top_logprobs"]] == [p["id"] for p in prob_ref["top_logprobs"]]
+            assert prob["logprob"] == pytest.approx(prob_ref["logprob"], abs=1e-3)
+
+
 @pytest.mark.skip(reason="This test fails on linux, need to be fixed")
 def test_cache_vs_nocache_prompt():
     global server
@@ -0,0 +1,71 @@
+import pytest
+from utils import *
+
+# prompt lookup decoding: the drafts come from the n-grams of the context, no draft model is used
+
+server = ServerPreset.stories15m_moe()
+
+# a repetitive prompt, so that the n-grams of the context give drafts that are accepted
+PROMPT = "Once upon a time, there was a little dog. " * 8
+
+
+def create_server():
+    global server
+    server = ServerPreset.stories15m_moe()
+    server.draft_min = 1
+    server.draft_max = 8
+
+
+@pytest.fixture(autouse=True)
+def fixture_create_server():
+    return create_server()
+
+
+def make_completion(lookup: bool | None):
+    data = {
+        "prompt": PROMPT,
+        "temperature": 0.0,
+        "top_k": 1,
+        "n_predict": 32,
+    }
+    if lookup is not None:
+        data["speculative.lookup"] = lookup
+    res = server.make_request("POST", "/completion", data=data)
+    assert res.status_code == 200
+    return res.body
+
+
+def test_lookup_without_draft_model():
+    global server
+    server.draft_lookup = True
+    server.start()
+    body = make_completion(None)
+    assert body["tokens_predicted"] == 32
+    timings = body["timings"]
+    assert timings["draft_n"] > 0
+    assert timings["draft_n_steps"] > 0
+    assert 0 <= timings["draft_n_accepted"] <= timings["draft_n"]
+    assert timings["draft_accept_len"] == pytest.approx(timings["draft_n_accepted"] / timings["draft_n_steps"])
+
+
+def test_lookup_per_request():
+    global server
+    server.start()
+    # disabled by default on the server, enabled by the request
+    body = make_completion(None)
+    assert "draft_n" not in body["timings"]
+    body = make_completion(True)
+    assert body["timings"]["draft_n"] > 0
+    body = make_completion(False)
+    assert "draft_n" not in body["timings"]
+
+
+def test_lookup_same_greedy_output():
+    global server
+    server.start()
+    body_off = make_completion(False)
+    body_on  = make_completion(True)
+    assert body_on["timings"]["draft_n"] > 0
+    assert body_on["timings"]["draft_n_accepted"] > 0
+    assert body_on["content"] == body_off["content"]
+    assert body_on["tokens_predicted"] == body_off["tokens_predicted"]
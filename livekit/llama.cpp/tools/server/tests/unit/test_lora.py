@@ -1,4 +1,5 @@
 import pytest
+import requests
 from utils import *
 
 server = ServerPreset.stories15m_moe()
@@ -66,6 +67,52 @@ def test_lora_per_request():
         assert match_regex(re_test, res.body["content"])
 
 
+def test_lora_prompt_cache():
+    # the shared prompt cache only reuses the cells computed with the same adapters, also when a prompt with the same
+    # prefix and other adapters was cached after them
+    global server
+    server.n_slots = 3
+    server.n_ctx = 1024
+    server.n_cache_radix = 256
+    server.server_metrics = True
+    server.start()
+
+    prefix = "Look in thy glass and tell the face thou viewest, now is the time that face should form another"
+
+    # returns the number of prompt tokens that were not taken from a cache
+    def run(id_slot: int, scale: float, suffix: str) -> int:
+        res = server.make_request("POST", "/completion", data={
+            "prompt": prefix + suffix,
+            "id_slot": id_slot,
+            "lora": [{"id": 0, "scale": scale}],
+            "n_predict": 4,
+            "temperature": 0.0,
+            "cache_prompt": True,
+        })
+        assert res.status_code == 200
+        return res.body["tokens_evaluated"] - res.body["timings"]["prompt_n"]
+
+    assert run(0, 1.0, " whose fresh repair") == 0
+
+    # the same prefix with other adapters is computed again
+    assert run(1, 0.0, " if now thou not renewest") == 0
+
+    # the prefix computed with the same adapters is reused
+    n_hit = get_metric("prompt_cache_hits_total")
+    assert run(2, 1.0, " thou dost beguile the world") > 0
+    assert get_metric("prompt_cache_hits_total") == n_hit + 1
+
+
+def get_metric(name: str) -> float:
+    # the metrics endpoint returns plain text, so it cannot go through make_request
+    res = requests.get(f"http://{server.server_host}:{server.server_port}/metrics")
+    assert res.status_code == 200
+    for line in res.text.split("\n"):
+        if line.startswith(f"llamacpp:{name} "):
+            return float(line.split(" ")[1])
+    raise AssertionError(f"metric {name} not found")
+
+
 @pytest.mark.skipif(not is_slow_test_allowed(), reason="skipping slow test")
 def test_with_big_model():
     server = ServerProcess()
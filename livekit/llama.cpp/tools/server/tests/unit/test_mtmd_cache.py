@@ -0,0 +1,102 @@
+import pytest
+import base64
+import requests
+import struct
+import zlib
+from utils import *
+
+server: ServerProcess
+
+
+def make_png(width: int, height: int) -> str:
+    # a small RGB gradient, so that the test does not need to download an image
+    raw = b"".join(
+        b"\x00" + bytes(v for x in range(width) for v in ((x * 255) // width, (y * 255) // height, 128))
+        for y in range(height)
+    )
+    def chunk(tag: bytes, data: bytes) -> bytes:
+        return struct.pack(">I", len(data)) + tag + data + struct.pack(">I", zlib.crc32(tag + data))
+    png = b"\x89PNG\r\n\x1a\n"
+    png += chunk(b"IHDR", struct.pack(">IIBBBBB", width, height, 8, 2, 0, 0, 0))
+    png += chunk(b"IDAT", zlib.compress(raw))
+    png += chunk(b"IEND", b"")
+    return "data:image/png;base64," + base64.b64encode(png).decode("utf-8")
+
+
+IMG_BASE64 = make_png(64, 48)
+
+
+@pytest.fixture(autouse=True)
+def create_server():
+    global server
+    server = ServerPreset.tinygemma3()
+    server.server_metrics = True
+
+
+def get_metric(name: str) -> float:
+    # the metrics endpoint returns plain text, so it cannot go through make_request
+    res = requests.get(f"http://{server.server_host}:{server.server_port}/metrics")
+    assert res.status_code == 200
+    for line in res.text.split("\n"):
+        if line.startswith(f"llamacpp:{name} "):
+            return float(line.split(" ")[1])
+    raise AssertionError(f"metric {name} not found")
+
+
+def run_requests(n_cache_mtmd: int, contents: list[list[str]]) -> tuple[list[str], float, float]:
+    # sends a chat request for each list of parts ("image" is replaced by the image) and returns the answers,
+    # the number of cache hits and the number of cache misses
+    global server
+    server.n_cache_mtmd = n_cache_mtmd
+    server.start(timeout_seconds=60)
+    answers = []
+    for parts in contents:
+        res = server.make_request("POST", "/chat/completions", data={
+            "temperature": 0.0,
+            "top_k": 1,
+            # the image must go through process_chunk, not be reused from the KV cache of the slot
+            "cache_prompt": False,
+            "messages": [
+                {"role": "user", "content": [
+                    {"type": "image_url", "image_url": {"url": IMG_BASE64}} if part == "image" else {"type": "text", "text": part}
+                    for part in parts
+                ]},
+            ],
+        })
+        assert res.status_code == 200
+        answers.append(res.body["choices"][0]["message"]["content"])
+    n_hit  = get_metric("mtmd_cache_hits_total")
+    n_miss = get_metric("mtmd_cache_misses_total")
+    server.stop()
+    return answers, n_hit, n_miss
+
+
+def test_mtmd_cache_same_image_in_two_requests():
+    contents = [
+        ["What is this:\n", "image"],
+        ["Describe this image:\n", "image"],
+    ]
+
+    answers, n_hit, n_miss = run_requests(256, contents)
+    assert n_miss == 1
+    assert n_hit == 1
+
+    # the embeddings taken from the cache give the same greedy output as the encoder
+    answers_ref, n_hit, n_miss = run_requests(0, contents)
+    assert n_miss == 0
+    assert n_hit == 0
+    assert answers == answers_ref
+
+
+def test_mtmd_cache_same_image_twice_in_one_prompt():
+    contents = [
+        ["Compare this:\n", "image", "\nwith this:\n", "image"],
+    ]
+
+    # the second occurrence of the image is taken from the cache
+    answers, n_hit, n_miss = run_requests(256, contents)
+    assert n_miss == 1
+    assert n_hit == 1
+
+    answers_ref, _, _ = run_requests(0, contents)
+    assert answers == answers_ref
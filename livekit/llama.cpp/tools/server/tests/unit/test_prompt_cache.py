@@ -0,0 +1,90 @@
+import pytest
+import requests
+from utils import *
+
+server = ServerPreset.tinyllama2()
+
+SYSTEM_PROMPT = "Once upon a time, there was a little girl named Lily. She loved to play outside in the park with her friends."
+
+@pytest.fixture(scope="module", autouse=True)
+def create_server():
+    global server
+    server = ServerPreset.tinyllama2()
+    server.n_ctx = 512
+    server.n_slots = 2
+    server.n_cache_radix = 128
+    server.server_metrics = True
+    server.temperature = 0.0
+
+
+def get_metric(name: str) -> float:
+    # the metrics endpoint returns plain text, so it cannot go through make_request
+    res = requests.get(f"http://{server.server_host}:{server.server_port}/metrics")
+    assert res.status_code == 200
+    for line in res.text.split("\n"):
+        if line.startswith(f"llamacpp:{name} "):
+            return float(line.split(" ")[1])
+    raise AssertionError(f"metric {name} not found")
+
+
+def test_prompt_cache_shared_across_slots():
+    global server
+    server.start()
+
+    # first request in slot 0 processes the full prompt and stores it in the prompt cache
+    res = server.make_request("POST", "/completion", data={
+        "prompt": SYSTEM_PROMPT + " What did Lily find?",
+        "id_slot": 0,
+        "n_predict": 8,
+        "cache_prompt": True,
+    })
+    assert res.status_code == 200
+    n_prompt_full = res.body["timings"]["prompt_n"]
+
+    # a request with the same prefix in the other slot reuses the cached prefix
+    res = server.make_request("POST", "/completion", data={
+        "prompt": SYSTEM_PROMPT + " Where did Lily go?",
+        "id_slot": 1,
+        "n_predict": 8,
+        "cache_prompt": True,
+    })
+    assert res.status_code == 200
+    assert res.body["timings"]["prompt_n"] < n_prompt_full
+
+    assert get_metric("prompt_cache_hits_total") >= 1
+    assert get_metric("prompt_cache_tokens_total") > 0
+    assert get_metric("prompt_cache_prompts") >= 1
+    assert get_metric("prompt_cache_cells") <= 128
+
+
+def test_prompt_cache_miss():
+    global server
+    server.start()
+
+    res = server.make_request("POST", "/completion", data={
+        "prompt": "The quick brown fox",
+        "id_slot": 0,
+        "n_predict": 4,
+        "cache_prompt": True,
+    })
+    assert res.status_code == 200
+    assert get_metric("prompt_cache_misses_total") >= 1
+
+
+def test_prompt_cache_disables_ctx_shift():
+    # the slots share KV cells with the prompt cache, so shifting them is not allowed
+    # the slot context is (512 - 128)/2 = 192 tokens
+    global server
+    server.n_predict = -1
+    server.start()
+
+    res = server.make_request("POST", "/completion", data={
+        "prompt": "Hi how are you",
+        "n_predict": 256,
+        "ignore_eos": True,
+        "cache_prompt": True,
+    })
+    assert res.status_code == 200
+    # the generation stops when the slot context is full instead of shifting it
+    assert res.body["timings"]["predicted_n"] < 256
+    assert res.body["timings"]["prompt_n"] + res.body["timings"]["predicted_n"] <= 192
@@ -0,0 +1,181 @@
+import pytest
+import math
+import requests
+import threading
+import time
+from utils import *
+
+server: ServerProcess
+
+# long enough to keep a slot busy while the other requests are queued
+N_PREDICT_LONG = 2000
+
+LONG_PROMPT = "Once upon a time there was a cat. " * 20
+
+
+@pytest.fixture(autouse=True)
+def create_server():
+    global server
+    server = ServerPreset.tinyllama2()
+    server.server_metrics = True
+    server.n_predict = -1
+    # the queued requests hold their HTTP thread, /metrics must still be served
+    server.n_threads_http = 8
+
+
+def get_metric(name: str) -> float:
+    # the metrics endpoint returns plain text, so it cannot go through make_request
+    res = requests.get(f"http://{server.server_host}:{server.server_port}/metrics")
+    assert res.status_code == 200
+    for line in res.text.split("\n"):
+        if line.startswith(f"llamacpp:{name} "):
+            return float(line.split(" ")[1])
+    raise AssertionError(f"metric {name} not found")
+
+
+def wait_for_metric(name: str, value: float, timeout: float = 10):
+    t_start = time.time()
+    while get_metric(name) != value:
+        if time.time() - t_start > timeout:
+            raise TimeoutError(f"metric {name} did not reach {value}")
+        time.sleep(0.01)
+
+
+def start_long_request() -> threading.Thread:
+    # occupies a slot, returns once the request is being processed
+    def run():
+        res = server.make_request("POST", "/completion", data={
+            "prompt": "Once upon a time",
+            "n_predict": N_PREDICT_LONG,
+            "ignore_eos": True,
+        }, timeout=60)
+        assert res.status_code == 200
+    thread = threading.Thread(target=run)
+    thread.start()
+    wait_for_metric("requests_processing", 1)
+    return thread
+
+
+def test_priority_order():
+    global server
+    server.n_slots = 1
+    server.start()
+
+    thread_long = start_long_request()
+
+    # the low-priority request arrives first, both wait for the slot
+    finished = []
+    def run(priority: str):
+        res = server.make_request("POST", "/completion", data={
+            "prompt": "I believe the meaning of life is",
+            "n_predict": 32,
+            "priority": priority,
+        }, timeout=60)
+        assert res.status_code == 200
+        finished.append(priority)
+
+    thread_low = threading.Thread(target=run, args=("low",))
+    thread_low.start()
+    wait_for_metric("requests_deferred", 1)
+
+    thread_high = threading.Thread(target=run, args=("high",))
+    thread_high.start()
+    wait_for_metric("requests_deferred", 2)
+
+    # the long request must still hold the slot, otherwise the order of arrival decided
+    assert get_metric("requests_processing") == 1
+
+    thread_long.join()
+    thread_low.join()
+    thread_high.join()
+
+    assert finished == ["high", "low"]
+    assert get_metric("requests_high_total") == 1
+    assert get_metric("requests_low_total") == 1
+
+
+@pytest.mark.parametrize("prefill_budget,prefill_chunk,n_max", [
+    (16,   None, 16),
+    (None, 8,    8),
+    (16,   8,    8),
+])
+def test_prefill_limit(prefill_budget: int | None, prefill_chunk: int | None, n_max: int):
+    global server
+    server.n_batch = 256
+    server.prefill_budget = prefill_budget
+    server.prefill_chunk = prefill_chunk
+    server.start()
+
+    n_prompt = len(server.make_request("POST", "/tokenize", data={"content": LONG_PROMPT, "add_special": True}).body["tokens"])
+    n_batches = math.ceil(n_prompt / n_max)
+    assert n_prompt > n_max
+
+    # alone, the prompt is split in batches of at most n_max tokens
+    n_decode = get_metric("n_decode_total")
+    res = server.make_request("POST", "/completion", data={
+        "prompt": LONG_PROMPT,
+        "n_predict": 1,
+        "cache_prompt": False,
+    })
+    assert res.status_code == 200
+    assert res.body["timings"]["prompt_n"] == n_prompt
+    assert get_metric("n_decode_total") - n_decode >= n_batches
+
+    # the generation of another slot continues while the prompt is processed: each of the batches of the prompt also
+    # carries the next token of the generating slot
+    n_received = 0
+    def run_stream():
+        nonlocal n_received
+        for data in server.make_stream_request("POST", "/completion", data={
+            "prompt": "Once upon a time",
+            "n_predict": N_PREDICT_LONG,
+            "ignore_eos": True,
+            "stream": True,
+        }):
+            if data["content"]:
+                n_received += 1
+    thread = threading.Thread(target=run_stream)
+    thread.start()
+    while n_received == 0:
+        time.sleep(0.01)
+
+    n_decode = get_metric("n_decode_total")
+    n_received_start = n_received
+    res = server.make_request("POST", "/completion", data={
+        "prompt": LONG_PROMPT,
+        "n_predict": 1,
+        "cache_prompt": False,
+    })
+    n_received_end = n_received
+    assert res.status_code == 200
+    assert get_metric("n_decode_total") - n_decode >= n_batches
+
+    # some tokens may still be on their way to the client, so only half of them are expected
+    assert n_received_end - n_received_start >= n_batches // 2
+
+    thread.join()
+    assert n_received > n_received_end
+
+
+def test_max_queue_time():
+    global server
+    server.n_slots = 1
+    server.max_queue_time = 200
+    server.start()
+
+    thread_long = start_long_request()
+
+    t_start = time.time()
+    res = server.make_request("POST", "/completion", data={
+        "prompt": "I believe the meaning of life is",
+        "n_predict": 8,
+    }, timeout=60)
+    t_wait = time.time() - t_start
+
+    assert res.status_code == 503
+    assert res.body["error"]["type"] == "unavailable_error"
+    assert t_wait >= 0.2
+
+    # the request holding the slot is not affected
+    assert get_metric("requests_processing") == 1
+    thread_long.join()
@@ -55,6 +55,7 @@ class ServerProcess:
     model_file: str | None = None
     model_draft: str | None = None
     n_threads: int | None = None
+    n_threads_http: int | None = None
     n_gpu_layer: int | None = None
     n_batch: int | None = None
     n_ubatch: int | None = None
@@ -67,6 +68,11 @@ class ServerProcess:
     id_slot: int | None = None
     cache_prompt: bool | None = None
     n_slots: int | None = None
+    n_cache_radix: int | None = None
+    n_cache_mtmd: int | None = None
+    prefill_budget: int | None = None
+    prefill_chunk: int | None = None
+    max_queue_time: int | None = None
     ctk: str | None = None
     ctv: str | None = None
     fa: bool | None = None
@@ -82,6 +88,8 @@ class ServerProcess:
     disable_ctx_shift: int | None = False
     draft_min: int | None = None
     draft_max: int | None = None
+    draft_lookup: bool | None = None
+    swap_output: bool | None = None
     no_webui: bool | None = None
     jinja: bool | None = None
     reasoning_format: Literal['deepseek', 'none', 'nothink'] | None = None
@@ -137,6 +145,8 @@ class ServerProcess:
             server_args.extend(["--ubatch-size", self.n_ubatch])
         if self.n_threads:
             server_args.extend(["--threads", self.n_threads])
+        if self.n_threads_http:
+            server_args.extend(["--threads-http", self.n_threads_http])
         if self.n_gpu_layer:
             server_args.extend(["--n-gpu-layers", self.n_gpu_layer])
         if self.draft is not None:
@@ -169,6 +179,16 @@ class ServerProcess:
             server_args.extend(["--n-predict", self.n_predict])
         if self.slot_save_path:
             server_args.extend(["--slot-save-path", self.slot_save_path])
+        if self.n_cache_radix:
+            server_args.extend(["--cache-radix", self.n_cache_radix])
+        if self.n_cache_mtmd is not None:
+            server_args.extend(["--cache-mtmd", self.n_cache_mtmd])
+        if self.prefill_budget:
+            server_args.extend(["--prefill-budget", self.prefill_budget])
+        if self.prefill_chunk:
+            server_args.extend(["--prefill-chunk", self.prefill_chunk])
+        if self.max_queue_time:
+            server_args.extend(["--max-queue-time", self.max_queue_time])
         if self.n_ga:
             server_args.extend(["--grp-attn-n", self.n_ga])
         if self.n_ga_w:
@@ -186,6 +206,10 @@ class ServerProcess:
             server_args.extend(["--draft-max", self.draft_max])
         if self.draft_min:
             server_args.extend(["--draft-min", self.draft_min])
+        if self.draft_lookup:
+            server_args.append("--draft-lookup")
+        if self.swap_output:
+            server_args.append("--swap-output")
         if self.no_webui:
             server_args.append("--no-webui")
         if self.jinja:
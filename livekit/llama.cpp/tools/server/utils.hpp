@@ -24,6 +24,8 @@
 #include <vector>
 #include <memory>
 #include <cinttypes>
+#include <list>
+#include <unordered_map>
 
 #define DEFAULT_OAICOMPAT_MODEL "gpt-3.5-turbo"
 
@@ -980,38 +982,48 @@ static std::string safe_json_to_str(const json & data) {
     return data.dump(-1, ' ', false, json::error_handler_t::replace);
 }
 
-static std::vector<llama_token_data> get_token_probabilities(llama_context * ctx, int idx) {
-    std::vector<llama_token_data> cur;
-    const auto * logits = llama_get_logits_ith(ctx, idx);
-
-    const llama_model * model = llama_get_model(ctx);
-    const llama_vocab * vocab = llama_model_get_vocab(model);
+// probabilities of the n_top most likely tokens, sorted by decreasing probability
+// the logits are read in place, without building and sorting a candidate array over the full vocabulary
+// the probability of the token `tok` is returned in p_tok
+static std::vector<llama_token_data> get_token_probabilities(const float * logits, int n_vocab, size_t n_top, llama_token tok, float & p_tok) {
+    // min-heap on the logits, the front is the least likely of the current top tokens
+    const auto cmp = [](const llama_token_data & a, const llama_token_data & b) {
+        return a.logit > b.logit;
+    };
 
-    const int n_vocab = llama_vocab_n_tokens(vocab);
+    std::vector<llama_token_data> top;
+    top.reserve(n_top);
 
-    cur.resize(n_vocab);
+    float max_l = -INFINITY;
     for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
-        cur[token_id] = llama_token_data{token_id, logits[token_id], 0.0f};
+        max_l = std::max(max_l, logits[token_id]);
     }
 
-    // sort tokens by logits
-    std::sort(cur.begin(), cur.end(), [](const llama_token_data & a, const llama_token_data & b) {
-        return a.logit > b.logit;
-    });
-
-    // apply softmax
-    float max_l = cur[0].logit;
     float cum_sum = 0.0f;
-    for (size_t i = 0; i < cur.size(); ++i) {
-        float p = expf(cur[i].logit - max_l);
-        cur[i].p = p;
-        cum_sum += p;
+    for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
+        const float logit = logits[token_id];
+
+        cum_sum += expf(logit - max_l);
+
+        if (top.size() < n_top) {
+            top.push_back({token_id, logit, 0.0f});
+            std::push_heap(top.begin(), top.end(), cmp);
+        } else if (n_top > 0 && logit > top.front().logit) {
+            std::pop_heap(top.begin(), top.end(), cmp);
+            top.back() = {token_id, logit, 0.0f};
+            std::push_heap(top.begin(), top.end(), cmp);
+        }
     }
-    for (size_t i = 0; i < cur.size(); ++i) {
-        cur[i].p /= cum_sum;
+
+    std::sort_heap(top.begin(), top.end(), cmp);
+
+    for (auto & cur : top) {
+        cur.p = expf(cur.logit - max_l) / cum_sum;
     }
 
-    return cur;
+    p_tok = expf(logits[tok] - max_l) / cum_sum;
+
+    return top;
 }
 
 static bool are_lora_equal(
@@ -1060,6 +1072,89 @@ static std::vector<common_adapter_lora_info> parse_lora_request(
 // (may need to refactor in near future)
 //
 
+/**
+ * cache of the encoder outputs of image and audio chunks, shared by all slots
+ * a repeated image or audio file skips the encoder, even if its KV cells were not kept in the slot that processes it
+ * the entries are evicted in least recently used order when the total size would exceed n_bytes_max
+ */
+struct server_mtmd_cache {
+    struct entry {
+        std::vector<float> embd;
+
+        std::list<std::string>::iterator it_lru;
+    };
+
+    size_t n_bytes_max = 0;
+    size_t n_bytes     = 0;
+
+    std::unordered_map<std::string, entry> entries;
+
+    std::list<std::string> lru; // the most recently used key first
+
+    // stats
+    uint64_t n_hit     = 0;
+    uint64_t n_miss    = 0;
+    uint64_t n_evicted = 0;
+
+    bool enabled() const {
+        return n_bytes_max > 0;
+    }
+
+    // returns nullptr if the key is not in the cache, or if its entry does not have n_embd values
+    std::vector<float> * get(const std::string & key, size_t n_embd) {
+        auto it = entries.find(key);
+        if (it == entries.end() || it->second.embd.size() != n_embd) {
+            n_miss++;
+            return nullptr;
+        }
+
+        n_hit++;
+        lru.splice(lru.begin(), lru, it->second.it_lru);
+
+        return &it->second.embd;
+    }
+
+    // replaces the entry of the key, if any
+    void put(const std::string & key, const float * embd, size_t n_embd) {
+        const size_t n_bytes_new = n_embd*sizeof(float);
+
+        auto it = entries.find(key);
+        if (it != entries.end()) {
+            erase(it);
+        }
+
+        if (n_bytes_new > n_bytes_max) {
+            return;
+        }
+
+        while (n_bytes + n_bytes_new > n_bytes_max) {
+            erase(entries.find(lru.back()));
+            n_evicted++;
+        }
+
+        lru.push_front(key);
+
+        entries[key] = { std::vector<float>(embd, embd + n_embd), lru.begin() };
+
+        n_bytes += n_bytes_new;
+    }
+
+    void clear() {
+        entries.clear();
+        lru.clear();
+
+        n_bytes = 0;
+    }
+
+private:
+    void erase(std::unordered_map<std::string, entry>::iterator it) {
+        n_bytes -= it->second.embd.size()*sizeof(float);
+
+        lru.erase(it->second.it_lru);
+        entries.erase(it);
+    }
+};
+
 /**
  * server_tokens is a helper to manage the input tokens and image for the server.
  * it is made this way to simplify the logic of KV cache management.
@@ -1293,12 +1388,14 @@ public:
     }
 
     // encode and decode the image chunk
+    // the encoder output is taken from or stored in the cache, if it is enabled
     int32_t process_chunk(
                 llama_context * ctx,
                 mtmd_context * mctx,
                 llama_pos n_past,
                 int32_t seq_id,
-                llama_pos & n_pos_out) {
+                llama_pos & n_pos_out,
+                server_mtmd_cache & cache) {
         auto & chunk = find_chunk(n_past);
         const char * name = mtmd_input_chunk_get_type(chunk.get()) == MTMD_INPUT_CHUNK_TYPE_IMAGE
                             ? "image" : "audio";
@@ -1306,13 +1403,45 @@ public:
         int32_t n_batch = llama_n_batch(ctx);
         int64_t t0 = ggml_time_ms();
         llama_pos new_n_past = n_past;
-        int32_t result = mtmd_helper_eval_chunk_single(mctx, ctx,
-            chunk.get(),
-            n_past,
-            seq_id,
-            n_batch,
-            true, // logits last
-            &new_n_past);
+        int32_t result = 0;
+        if (cache.enabled() && *mtmd_input_chunk_get_id(chunk.get()) != '\0') {
+            // the slices of an image and the segments of an audio file have distinct ids, so the id is the key
+            const std::string key = mtmd_input_chunk_get_id(chunk.get());
+            const size_t n_embd = mtmd_input_chunk_get_n_tokens(chunk.get()) * llama_model_n_embd(llama_get_model(ctx));
+
+            float * embd = nullptr;
+
+            std::vector<float> * cached = cache.get(key, n_embd);
+            if (cached) {
+                SRV_DBG("%s found in the cache, key = %s\n", name, key.c_str());
+                embd = cached->data();
+            } else {
+                result = mtmd_encode_chunk(mctx, chunk.get());
+                if (result != 0) {
+                    LOG_ERR("failed to encode %s, status %d", name, result);
+                    n_pos_out = n_past;
+                    return result;
+                }
+                embd = mtmd_get_output_embd(mctx);
+                cache.put(key, embd, n_embd);
+            }
+
+            result = mtmd_helper_decode_image_chunk(mctx, ctx,
+                chunk.get(),
+                embd,
+                n_past,
+                seq_id,
+                n_batch,
+                &new_n_past);
+        } else {
+            result = mtmd_helper_eval_chunk_single(mctx, ctx,
+                chunk.get(),
+                n_past,
+                seq_id,
+                n_batch,
+                true, // logits last
+                &new_n_past);
+        }
         SRV_INF("%s processed in %" PRId64 " ms\n", name, ggml_time_ms() - t0);
         if (result != 0) {
             LOG_ERR("mtmd_helper_eval failed with status %d", result);
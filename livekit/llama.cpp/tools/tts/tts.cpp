@@ -11,12 +11,12 @@
 
 #include <algorithm>
 #include <cmath>
+#include <complex>
 #include <cstdio>
 #include <fstream>
 #include <map>
 #include <regex>
 #include <string>
-#include <thread>
 #include <vector>
 
 using json = nlohmann::ordered_json;
@@ -89,29 +89,49 @@ struct wav_header {
     uint32_t data_size;
 };
 
-static bool save_wav16(const std::string & fname, const std::vector<float> & data, int sample_rate) {
-    std::ofstream file(fname, std::ios::binary);
-    if (!file) {
-        LOG_ERR("%s: Failed to open file '%s' for writing.\n", __func__, fname.c_str());
-        return false;
-    }
+// writes 16-bit PCM incrementally - the sizes in the header are patched when the file is closed
+struct wav_writer {
+    std::ofstream file;
+    wav_header    header;
 
-    wav_header header;
-    header.sample_rate = sample_rate;
-    header.byte_rate = header.sample_rate * header.num_channels * (header.bits_per_sample / 8);
-    header.block_align = header.num_channels * (header.bits_per_sample / 8);
-    header.data_size = data.size() * (header.bits_per_sample / 8);
-    header.chunk_size = 36 + header.data_size;
+    bool open(const std::string & fname, int sample_rate) {
+        file.open(fname, std::ios::binary);
+        if (!file) {
+            LOG_ERR("%s: Failed to open file '%s' for writing.\n", __func__, fname.c_str());
+            return false;
+        }
 
-    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        header.sample_rate = sample_rate;
+        header.byte_rate = header.sample_rate * header.num_channels * (header.bits_per_sample / 8);
+        header.block_align = header.num_channels * (header.bits_per_sample / 8);
+        header.data_size = 0;
+        header.chunk_size = 36 + header.data_size;
 
-    for (const auto & sample : data) {
-        int16_t pcm_sample = static_cast<int16_t>(std::clamp(sample * 32767.0, -32768.0, 32767.0));
-        file.write(reinterpret_cast<const char*>(&pcm_sample), sizeof(pcm_sample));
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+        return file.good();
     }
 
-    return file.good();
-}
+    void write(const float * data, size_t n) {
+        std::vector<int16_t> pcm(n);
+        for (size_t i = 0; i < n; ++i) {
+            pcm[i] = static_cast<int16_t>(std::clamp(data[i] * 32767.0, -32768.0, 32767.0));
+        }
+        file.write(reinterpret_cast<const char*>(pcm.data()), n * sizeof(int16_t));
+
+        header.data_size += n * (header.bits_per_sample / 8);
+    }
+
+    bool close() {
+        header.chunk_size = 36 + header.data_size;
+
+        file.seekp(0);
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.close();
+
+        return !file.fail();
+    }
+};
 
 static void fill_hann_window(int length, bool periodic, float * output) {
     int offset = -1;
@@ -123,45 +143,134 @@ static void fill_hann_window(int length, bool periodic, float * output) {
     }
 }
 
-// very poor-man fft
-static void twiddle(float * real, float * imag, int k, int N) {
-    float angle = 2 * M_PI * k / N;
-    *real = cos(angle);
-    *imag = sin(angle);
-}
+//
+// inverse real FFT
+//
+// n_fft = 1280 = 2^8*5 is not a power of two, so we use a mixed-radix Cooley-Tukey complex FFT (generic radix
+// butterflies, decimation in time) of size n/2 and unpack the real signal from it - O(n log n) per frame
+//
+
+using cplx = std::complex<float>;
 
-static void irfft(int n, const float * inp_cplx, float * out_real) {
-    int N = n / 2 + 1;
+struct fft_plan {
+    int n = 0;
 
-    std::vector<float> real_input(N);
-    std::vector<float> imag_input(N);
-    for (int i = 0; i < N; ++i) {
-        real_input[i] = inp_cplx[2 * i];
-        imag_input[i] = inp_cplx[2 * i + 1];
+    std::vector<int>  factors; // pairs of (radix, remaining length)
+    std::vector<cplx> tw;      // exp(2*pi*i*k/n), k in [0, n)
+    std::vector<cplx> scratch;
+
+    explicit fft_plan(int n) : n(n), tw(n) {
+        for (int i = 0; i < n; ++i) {
+            const double phase = 2.0*M_PI*i/n;
+            tw[i] = cplx(cos(phase), sin(phase));
+        }
+
+        int m = n;
+        int p = 2;
+        while (m > 1) {
+            while (m % p != 0) {
+                p = p == 2 ? 3 : p + 2;
+            }
+            m /= p;
+            factors.push_back(p);
+            factors.push_back(m);
+            scratch.resize(std::max<size_t>(scratch.size(), p));
+        }
     }
 
-    std::vector<float> real_output(n);
-    std::vector<float> imag_output(n);
+    // out[k] = sum_j inp[j]*exp(2*pi*i*j*k/n) (unnormalized inverse transform)
+    void compute(const cplx * inp, cplx * out) {
+        if (n == 1) {
+            out[0] = inp[0];
+            return;
+        }
+        work(out, inp, 1, factors.data());
+    }
 
-    for (int k = 0; k < n; ++k) {
-        real_output[k] = 0.0f;
-        imag_output[k] = 0.0f;
-        for (int m = 0; m < N; ++m) {
-            float twiddle_real;
-            float twiddle_imag;
+private:
+    void work(cplx * out, const cplx * inp, int fstride, const int * f) {
+        const int p = f[0];
+        const int m = f[1];
 
-            twiddle(&twiddle_real, &twiddle_imag, k * m, n);
+        cplx * const out_beg = out;
+        cplx * const out_end = out + p*m;
+
+        if (m == 1) {
+            for (; out != out_end; ++out, inp += fstride) {
+                *out = *inp;
+            }
+        } else {
+            for (; out != out_end; out += m, inp += fstride) {
+                work(out, inp, fstride*p, f + 2);
+            }
+        }
+
+        // radix-p butterflies with the twiddles folded in
+        out = out_beg;
+        for (int u = 0; u < m; ++u) {
+            for (int q = 0, k = u; q < p; ++q, k += m) {
+                scratch[q] = out[k];
+            }
+            for (int q = 0, k = u; q < p; ++q, k += m) {
+                cplx acc = scratch[0];
+                int  idx = 0;
+                for (int r = 1; r < p; ++r) {
+                    idx += fstride*k;
+                    if (idx >= n) {
+                        idx -= n;
+                    }
+                    acc += scratch[r]*tw[idx];
+                }
+                out[k] = acc;
+            }
+        }
+    }
+};
 
-            real_output[k] += real_input[m] * twiddle_real - imag_input[m] * twiddle_imag;
-            imag_output[k] += real_input[m] * twiddle_imag + imag_input[m] * twiddle_real;
+// same as torch.fft.irfft(x, n, norm="backward"): n/2 + 1 complex bins in, n real samples out
+// the imaginary parts of the DC and Nyquist bins are ignored
+struct irfft_plan {
+    const int n;
+
+    fft_plan          fft;
+    std::vector<cplx> tw; // exp(2*pi*i*k/n), k in [0, n/2)
+    std::vector<cplx> buf_inp;
+    std::vector<cplx> buf_out;
+
+    explicit irfft_plan(int n) : n(n), fft(n/2), tw(n/2), buf_inp(n/2), buf_out(n/2) {
+        GGML_ASSERT(n % 2 == 0);
+        for (int k = 0; k < n/2; ++k) {
+            const double phase = 2.0*M_PI*k/n;
+            tw[k] = cplx(cos(phase), sin(phase));
         }
     }
 
-    for (int i = 0; i < n; ++i) {
-        out_real[i] = real_output[i] / N;
+    void compute(const cplx * inp, float * out) {
+        const int h = n/2;
+
+        // pack the even/odd samples into a half-size complex signal: z[j] = x[2j] + i*x[2j + 1]
+        for (int k = 0; k < h; ++k) {
+            cplx a = inp[k];
+            cplx b = std::conj(inp[h - k]);
+            if (k == 0) {
+                a = cplx(a.real(), 0.0f);
+                b = cplx(b.real(), 0.0f);
+            }
+            buf_inp[k] = (a + b) + cplx(0.0f, 1.0f)*tw[k]*(a - b);
+        }
+
+        fft.compute(buf_inp.data(), buf_out.data());
+
+        const float scale = 1.0f/n;
+        for (int j = 0; j < h; ++j) {
+            out[2*j + 0] = buf_out[j].real()*scale;
+            out[2*j + 1] = buf_out[j].imag()*scale;
+        }
     }
-}
+};
 
+//
+// streaming ISTFT - equivalent to the following, but the audio is emitted as soon as no later frame can touch it:
 //
 //  y = torch.nn.functional.fold(
 //       data, output_size=(1, output_size), kernel_size=(1, self.win_length), stride=(1, self.hop_length),
@@ -173,111 +282,163 @@ static void irfft(int n, const float * inp_cplx, float * out_real) {
 // hop_length =  320
 // pad =  480
 //
-static void fold(const std::vector<float> & data, int64_t n_out, int64_t n_win, int64_t n_hop, int64_t n_pad, std::vector<float> & output) {
-    int64_t output_height = n_out;
-    int64_t kernel_w = n_win;
-    int64_t stride_w = n_hop;
-    int64_t width    = n_out;
-
-    output.resize(width, 0.0f);
-
-    int64_t col_idx = 0;
-    for (int64_t w_col = 0; w_col < width; ++w_col) {
-        int64_t start = w_col * stride_w - n_pad;
-        int64_t end   = start + kernel_w;
-
-        for (int64_t w_im = start; w_im < end; ++w_im) {
-            if (w_im >= 0 && w_im < output_height && col_idx < (int64_t) data.size()) {
-                output[w_im] += data[col_idx];
-            }
-            col_idx++;
-        }
-    }
-
-    output.resize(n_out - 2 * n_pad);
-}
-
-// TODO: not optimized at all
-static std::vector<float> embd_to_audio(
-        const float * embd,
-        const int n_codes,
-        const int n_embd,
-        const int n_thread) {
-    const int n_fft = 1280;
-    const int n_hop = 320;
-    const int n_win = 1280;
-    const int n_pad = (n_win - n_hop)/2;
-    const int n_out = (n_codes - 1)*n_hop + n_win;
+// the overlap-add tail of the last frames (and of the window envelope) is carried between calls to push(), so the
+// spectrogram can be fed in chunks of any size and the concatenated output matches the single-shot result
+//
+struct istft_stream {
+    const int n_fft;
+    const int n_hop;
+    const int n_win;
+    const int n_pad;
 
-    std::vector<float> hann(n_fft);
+    irfft_plan irfft;
 
-    fill_hann_window(hann.size(), true, hann.data());
+    std::vector<float> hann;
+    std::vector<cplx>  spec;
+    std::vector<float> frame;
 
-    int n_spec = n_embd*n_codes;
+    // overlap-add accumulators for the samples [n_frames*n_hop, n_frames*n_hop + n_win)
+    std::vector<float> ola;
+    std::vector<float> env;
 
-    std::vector<float> E (n_spec);
-    std::vector<float> S (n_spec);
-    std::vector<float> ST(n_spec);
+    int64_t n_frames = 0;
 
-    for (int l = 0; l < n_codes; ++l) {
-        for (int k = 0; k < n_embd; ++k) {
-            E[k*n_codes + l] = embd[l*n_embd + k];
-        }
+    istft_stream(int n_fft, int n_hop, int n_win) :
+        n_fft(n_fft), n_hop(n_hop), n_win(n_win), n_pad((n_win - n_hop)/2),
+        irfft(n_fft), hann(n_win), spec(n_fft/2 + 1), frame(n_fft), ola(n_win, 0.0f), env(n_win, 0.0f) {
+        GGML_ASSERT(n_win == n_fft);
+        fill_hann_window(hann.size(), true, hann.data());
     }
 
-    for (int k = 0; k < n_embd/2; ++k) {
+    // embd: n_codes rows of [log-magnitude | phase], n_embd = n_fft + 2
+    // appends the samples that are final after these frames to out
+    void push(const float * embd, int n_codes, int n_embd, std::vector<float> & out) {
+        GGML_ASSERT(n_embd == n_fft + 2);
+
         for (int l = 0; l < n_codes; ++l) {
-            float mag = E[(k           )*n_codes + l];
-            float phi = E[(k + n_embd/2)*n_codes + l];
+            const float * e = embd + (size_t) l*n_embd;
+
+            for (int k = 0; k < n_embd/2; ++k) {
+                float mag = e[k];
+                float phi = e[k + n_embd/2];
+
+                mag = exp(mag);
+
+                if (mag > 1e2) {
+                    mag = 1e2;
+                }
+                spec[k] = cplx(mag*cosf(phi), mag*sinf(phi));
+            }
 
-            mag = exp(mag);
+            irfft.compute(spec.data(), frame.data());
 
-            if (mag > 1e2) {
-                mag = 1e2;
+            for (int j = 0; j < n_win; ++j) {
+                ola[j] += frame[j]*hann[j];
+                env[j] += hann[j]*hann[j];
             }
-            S[2*(k*n_codes + l) + 0] = mag*cosf(phi);
-            S[2*(k*n_codes + l) + 1] = mag*sinf(phi);
+
+            // the first n_hop samples of the accumulator are complete now
+            emit(n_frames*n_hop, n_hop, out);
+
+            std::copy(ola.begin() + n_hop, ola.end(), ola.begin());
+            std::copy(env.begin() + n_hop, env.end(), env.begin());
+            std::fill(ola.end() - n_hop, ola.end(), 0.0f);
+            std::fill(env.end() - n_hop, env.end(), 0.0f);
+
+            n_frames++;
         }
     }
 
-    for (int l = 0; l < n_codes; ++l) {
-        for (int k = 0; k < n_embd/2; ++k) {
-            ST[l*n_embd + 2*k + 0] = S[2*(k*n_codes + l) + 0];
-            ST[l*n_embd + 2*k + 1] = S[2*(k*n_codes + l) + 1];
+    // appends the tail of the last frame, minus the trailing padding, and resets the state
+    void flush(std::vector<float> & out) {
+        if (n_frames > 0) {
+            emit(n_frames*n_hop, n_win - n_hop - n_pad, out);
         }
-    }
 
-    std::vector<float> res  (n_codes*n_fft);
-    std::vector<float> hann2(n_codes*n_fft);
-
-    std::vector<std::thread> workers(n_thread);
-    for (int i = 0; i < n_thread; ++i) {
-        workers[i] = std::thread([&, i]() {
-            for (int l = i; l < n_codes; l += n_thread) {
-                irfft(n_fft, ST.data() + l*n_embd, res.data() + l*n_fft);
-                for (int j = 0; j < n_fft; ++j) {
-                    res  [l*n_fft + j] *= hann[j];
-                    hann2[l*n_fft + j]  = hann[j] * hann[j];
-                }
-            }
-        });
+        std::fill(ola.begin(), ola.end(), 0.0f);
+        std::fill(env.begin(), env.end(), 0.0f);
+
+        n_frames = 0;
     }
-    for (int i = 0; i < n_thread; ++i) {
-        workers[i].join();
+
+private:
+    // append the samples [pos, pos + n) from the head of the accumulators, dropping the leading padding
+    void emit(int64_t pos, int n, std::vector<float> & out) const {
+        for (int j = std::max<int64_t>(0, n_pad - pos); j < n; ++j) {
+            out.push_back(ola[j]/env[j]);
+        }
     }
+};
 
-    std::vector<float> audio;
-    std::vector<float> env;
+// codes around each streamed chunk that are passed to the vocoder as context - the vocoder is not causal, so
+// without them the chunk boundaries would be audible
+static const int k_chunk_ctx_left  = 32;
+static const int k_chunk_ctx_right = 8;
+
+// converts audio codes to PCM - either all at once, or chunk by chunk while the codes are still being generated
+struct vocoder_stream {
+    llama_context * ctx;
+
+    const int n_embd;
+
+    istft_stream istft;
+
+    int n_done = 0; // number of codes converted so far
+
+    int64_t t_voc_us  = 0;
+    int64_t t_spec_us = 0;
+
+    explicit vocoder_stream(llama_context * ctx) :
+        ctx(ctx), n_embd(llama_model_n_embd(llama_get_model(ctx))), istft(1280, 320, 1280) {}
 
-    fold(res,   n_out, n_win, n_hop, n_pad, audio);
-    fold(hann2, n_out, n_win, n_hop, n_pad, env); // TODO: can be done once
+    // convert the codes [n_done, n_end), with up to n_ctx_left/n_ctx_right neighbouring codes as context
+    bool process(const std::vector<llama_token> & codes, int n_end, int n_ctx_left, int n_ctx_right, std::vector<float> & out) {
+        if (n_end <= n_done) {
+            return true;
+        }
+
+        const int i0 = std::max(0, n_done - n_ctx_left);
+        const int i1 = std::min((int) codes.size(), n_end + n_ctx_right);
+
+        const auto t_voc_start = ggml_time_us();
+
+        llama_batch batch = llama_batch_init(i1 - i0, 0, 1);
+
+        for (int i = i0; i < i1; ++i) {
+            common_batch_add(batch, codes[i], i - i0, { 0 }, true); // TODO: all logits?
+        }
+        GGML_ASSERT(batch.n_tokens == i1 - i0);
+
+        const int ret = llama_encode(ctx, batch);
+
+        llama_batch_free(batch);
 
-    for (size_t i = 0; i < audio.size(); ++i) {
-        audio[i] /= env[i];
+        if (ret != 0) {
+            LOG_ERR("%s: llama_encode() failed\n", __func__);
+            return false;
+        }
+
+        llama_synchronize(ctx);
+
+        const auto t_spec_start = ggml_time_us();
+
+        // spectral operations
+        const float * embd = llama_get_embeddings(ctx);
+
+        istft.push(embd + (size_t) (n_done - i0)*n_embd, n_end - n_done, n_embd, out);
+
+        t_voc_us  += t_spec_start - t_voc_start;
+        t_spec_us += ggml_time_us() - t_spec_start;
+
+        n_done = n_end;
+
+        return true;
     }
 
-    return audio;
-}
+    void flush(std::vector<float> & out) {
+        istft.flush(out);
+    }
+};
 
 static const std::map<int, std::string> ones = {
     {0, "zero"}, {1, "one"}, {2, "two"}, {3, "three"}, {4, "four"},
@@ -612,6 +773,47 @@ int main(int argc, char ** argv) {
     std::vector<llama_token> codes;
     std::vector<llama_token> guide_tokens;
 
+    const int n_sr = 24000; // sampling rate
+
+    // chunked vocoding follows a single sequence
+    const int n_chunk = n_parallel == 1 ? params.vocoder.n_chunk : 0;
+    if (params.vocoder.n_chunk > 0 && n_chunk == 0) {
+        LOG_WRN("%s: --tts-chunk is not supported with n_parallel > 1, the audio will be vocoded after generation\n", __func__);
+    }
+
+    vocoder_stream vocoder(ctx_cts);
+
+    std::vector<llama_token> codes_audio; // audio codes generated so far, in vocoder token ids (chunked mode only)
+    std::vector<float>       audio;
+
+    wav_writer wav;
+    if (!wav.open(params.out_file, n_sr)) {
+        return ENOENT;
+    }
+
+    int64_t n_audio       = 0;  // samples written so far
+    int64_t t_first_audio = -1;
+
+    auto write_audio = [&](std::vector<float> & pcm) {
+        if (pcm.empty()) {
+            return;
+        }
+
+        if (t_first_audio < 0) {
+            t_first_audio = ggml_time_us();
+        }
+
+        // zero out first 0.25 seconds
+        for (int64_t i = 0; i < (int64_t) pcm.size() && n_audio + i < n_sr/4; ++i) {
+            pcm[i] = 0.0f;
+        }
+
+        wav.write(pcm.data(), pcm.size());
+
+        n_audio += pcm.size();
+        pcm.clear();
+    };
+
     // the default speaker profile is from: https://github.com/edwko/OuteTTS/blob/main/outetts/version/v1/default_speakers/en_male_1.json
     std::string audio_text = "<|text_start|>the<|text_sep|>overall<|text_sep|>package<|text_sep|>from<|text_sep|>just<|text_sep|>two<|text_sep|>people<|text_sep|>is<|text_sep|>pretty<|text_sep|>remarkable<|text_sep|>sure<|text_sep|>i<|text_sep|>have<|text_sep|>some<|text_sep|>critiques<|text_sep|>about<|text_sep|>some<|text_sep|>of<|text_sep|>the<|text_sep|>gameplay<|text_sep|>aspects<|text_sep|>but<|text_sep|>its<|text_sep|>still<|text_sep|>really<|text_sep|>enjoyable<|text_sep|>and<|text_sep|>it<|text_sep|>looks<|text_sep|>lovely<|text_sep|>";
     std::string audio_data = R"(<|audio_start|>
@@ -896,6 +1098,10 @@ lovely<|t_0.56|><|code_start|><|634|><|596|><|1766|><|1556|><|1306|><|1285|><|14
 
                 codes.push_back(new_token_id);
 
+                if (n_chunk > 0 && new_token_id >= 151672 && new_token_id <= 155772) {
+                    codes_audio.push_back(new_token_id - 151672);
+                }
+
                 const auto * cands = common_sampler_get_candidates(smpl[i]);
 
                 // is it an end of generation? -> mark the stream as finished
@@ -933,6 +1139,14 @@ lovely<|t_0.56|><|code_start|><|634|><|596|><|1766|><|1556|><|1306|><|1285|><|14
                 common_batch_add(batch, new_token_id, n_past, { i }, true);
             }
 
+            // vocode the next chunk as soon as its right context has been generated
+            while (n_chunk > 0 && (int) codes_audio.size() >= vocoder.n_done + n_chunk + k_chunk_ctx_right) {
+                if (!vocoder.process(codes_audio, vocoder.n_done + n_chunk, k_chunk_ctx_left, k_chunk_ctx_right, audio)) {
+                    return 1;
+                }
+                write_audio(audio);
+            }
+
             // all streams are finished
             if (batch.n_tokens == 0) {
                 break;
@@ -1013,38 +1227,14 @@ lovely<|t_0.56|><|code_start|><|634|><|596|><|1766|><|1556|><|1306|><|1285|><|14
         token -= 151672;
     }
 
-    const auto t_voc_start = ggml_time_us();
-
-    const int n_codes = codes.size();
-
-    llama_batch batch = llama_batch_init(n_codes, 0, 1);
-
-    for (size_t i = 0; i < codes.size(); ++i) {
-        common_batch_add(batch, codes[i], i, { 0 }, true); // TODO: all logits?
-    }
-    GGML_ASSERT(batch.n_tokens == n_codes);
-
-    if (llama_encode(ctx_cts, batch) != 0) {
-        LOG_ERR("%s: llama_encode() failed\n", __func__);
+    // vocode the codes that have not been streamed yet
+#if 1
+    if (!vocoder.process(codes, (int) codes.size(), k_chunk_ctx_left, 0, audio)) {
         return 1;
     }
-
-    llama_synchronize(ctx_cts);
-
-    LOG_INF("%s: time for vocoder:      %.3f ms\n", __func__, (ggml_time_us() - t_voc_start) / 1000.0f);
-
-    const auto t_spec_start = ggml_time_us();
-
-#if 1
-    // spectral operations
-    const int n_embd = llama_model_n_embd(model_cts);
-    const float * embd = llama_get_embeddings(ctx_cts);
-
-    auto audio = embd_to_audio(embd, n_codes, n_embd, params.cpuparams.n_threads);
-
+    vocoder.flush(audio);
 #else
     // read the spectrogram from a file for debugging purposes
-    std::vector<float> audio;
     {
         std::ifstream fin("out.bin", std::ios::binary);
         if (!fin) {
@@ -1066,25 +1256,33 @@ lovely<|t_0.56|><|code_start|><|634|><|596|><|1766|><|1556|><|1306|><|1285|><|14
 
         LOG_INF("%s: n_codes: %d, n_embd: %d\n", __func__, n_codes, n_embd);
 
-        audio = embd_to_audio(embd.data(), n_codes, n_embd, params.cpuparams.n_threads);
+        vocoder.istft.push(embd.data(), n_codes, n_embd, audio);
+        vocoder.istft.flush(audio);
     }
 #endif
 
-    const int n_sr = 24000; // sampling rate
+    write_audio(audio);
 
-    // zero out first 0.25 seconds
-    for (int i = 0; i < 24000/4; ++i) {
-        audio[i] = 0.0f;
-    }
+    const auto t_main_end = ggml_time_us();
+
+    LOG_INF("%s: time for vocoder:      %.3f ms\n", __func__, vocoder.t_voc_us  / 1000.0f);
+    LOG_INF("%s: time for spectral ops: %.3f ms\n", __func__, vocoder.t_spec_us / 1000.0f);
+    LOG_INF("%s: total time:            %.3f ms\n", __func__, (t_main_end - t_main_start) / 1000.0f);
 
-    LOG_INF("%s: time for spectral ops: %.3f ms\n", __func__, (ggml_time_us() - t_spec_start) / 1000.0f);
-    LOG_INF("%s: total time:            %.3f ms\n", __func__, (ggml_time_us() - t_main_start) / 1000.0f);
+    if (n_audio > 0) {
+        const float t_audio = (float) n_audio / n_sr;
+
+        LOG_INF("%s: time to first audio:   %.3f ms (%s)\n", __func__, (t_first_audio - t_main_start) / 1000.0f,
+                n_chunk > 0 ? string_format("chunks of %d codes", n_chunk).c_str() : "not chunked");
+        LOG_INF("%s: real-time factor:      %.3f (%.3f s of audio)\n", __func__, (t_main_end - t_main_start) / 1e6f / t_audio, t_audio);
+    }
 
     int retval = 0;
 
-    if (save_wav16(params.out_file, audio, n_sr)) {
+    if (wav.close()) {
         LOG_INF("%s: audio written to file '%s'\n", __func__, params.out_file.c_str());
     } else {
+        LOG_ERR("%s: failed to write file '%s'\n", __func__, params.out_file.c_str());
         retval = ENOENT;
     }
 